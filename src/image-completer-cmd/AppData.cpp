@@ -134,6 +134,34 @@ void AppData::ApplyCommandLineOptionsToSettings(const CommandLineOptions& option
 	{
 		m_settings.numIterations = options.GetNumIterations();
 	}
+	if (options.HasConvergenceEnergyThreshold())
+	{
+		m_settings.convergenceEnergyThreshold = options.GetConvergenceEnergyThreshold();
+	}
+	if (options.HasFreezeStableIterations())
+	{
+		m_settings.freezeStableIterations = options.GetFreezeStableIterations();
+	}
+	if (options.HasCandidateLabelsPerNode())
+	{
+		m_settings.candidateLabelsPerNode = options.GetCandidateLabelsPerNode();
+	}
+	if (options.HasCheckpointIterations())
+	{
+		m_settings.checkpointIterations = options.GetCheckpointIterations();
+	}
+	if (options.HasNumThreads())
+	{
+		m_settings.numThreads = options.GetNumThreads();
+	}
+	if (options.HasLabelEnergyCacheMegabytesMax())
+	{
+		m_settings.labelEnergyCacheMegabytesMax = options.GetLabelEnergyCacheMegabytesMax();
+	}
+	if (options.HasPriorityBpSchedule())
+	{
+		m_settings.priorityBpSchedule = options.GetPriorityBpSchedule();
+	}
 	if (options.HasPostPruneLabelsMin())
 	{
 		m_settings.postPruneLabelsMin = options.GetPostPruneLabelsMin();
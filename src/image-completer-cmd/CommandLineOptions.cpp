@@ -22,6 +22,7 @@
 #include "Pch.h"
 #include "CommandLineOptions.h"
 
+#include <stdio.h>
 #include <vector>
 
 #include <wx/cmdline.h>
@@ -159,17 +160,44 @@ void CommandLineOptions::TypedOption<LfnIc::CompositorPatchBlender>::Find(const
 	}
 }
 
+template<>
+void CommandLineOptions::TypedOption<LfnIc::PriorityBpSchedule>::Find(const wxCmdLineParser& parser)
+{
+	wxString stringValue;
+	if (parser.Found(this->shortName, &stringValue))
+	{
+		for (int e = LfnIc::PriorityBpScheduleInvalid + 1; e < LfnIc::PriorityBpScheduleNum; ++e)
+		{
+			const LfnIc::PriorityBpSchedule priorityBpSchedule = LfnIc::PriorityBpSchedule(e);
+			const wxString desc(SettingsText::GetEnumDescription(priorityBpSchedule));
+			if (stringValue.CmpNoCase(desc) == 0)
+			{
+				this->wasFound = true;
+				this->value = priorityBpSchedule;
+				break;
+			}
+		}
+	}
+}
+
 //
 // CommandLineOptions
 //
 CommandLineOptions::CommandLineOptions(int argc, char** argv)
-	: m_optImageInput("", Option::COMPLETER_OPTION_TYPE, "ii", "image-input", "The input image file path.", -1, wxCMD_LINE_VAL_STRING, wxCMD_LINE_OPTION_MANDATORY)
+	: m_optImageInput("", Option::COMPLETER_OPTION_TYPE, "ii", "image-input", "The input image file path.", -1, wxCMD_LINE_VAL_STRING)
 	, m_optImageMask("", Option::COMPLETER_OPTION_TYPE, "im", "image-mask", "The mask image file path.", -1, wxCMD_LINE_VAL_STRING)
 	, m_optImageOutput("", Option::COMPLETER_OPTION_TYPE, "io", "image-output", "The mask image file path.", -1, wxCMD_LINE_VAL_STRING)
 	, m_optSettingsShow(false, Option::COMPLETER_OPTION_TYPE, "ss", "settings-show", "Show the settings and exit.", -1, wxCMD_LINE_VAL_NONE)
 	, m_optDebugLowResolutionPasses(false, Option::COMPLETER_OPTION_TYPE, "sd", "settings-debug-low-res-passes", "Output separate images for each low resolution pass.", -1, wxCMD_LINE_VAL_NONE)
 	, m_optLowResolutionPassesMax(0, Option::COMPLETER_OPTION_TYPE, "sp", "settings-low-res-passes", std::string("Max low resolution passes to perform.\n") + Option::Indent() + "(" + SettingsText::GetLowResolutionPassesAutoDescription() + ", or any integer value greater than 0)", offsetof(LfnIc::Settings, lowResolutionPassesMax), wxCMD_LINE_VAL_STRING)
 	, m_optNumIterations(LfnIc::Settings::NUM_ITERATIONS_DEFAULT, Option::COMPLETER_OPTION_TYPE, "si", "settings-num-iterations", "Number of Priority-BP iterations per pass.", offsetof(LfnIc::Settings, numIterations), wxCMD_LINE_VAL_NUMBER)
+	, m_optConvergenceEnergyThreshold(0, Option::COMPLETER_OPTION_TYPE, "sce", "settings-convergence-energy", std::string("Stop iterating once no message changes by more than this.\n") + Option::Indent() + "(-1 to always run every iteration)", offsetof(LfnIc::Settings, convergenceEnergyThreshold), wxCMD_LINE_VAL_NUMBER)
+	, m_optFreezeStableIterations(LfnIc::Settings::FREEZE_STABLE_ITERATIONS_DISABLED, Option::COMPLETER_OPTION_TYPE, "sfi", "settings-freeze-iterations", std::string("Freeze nodes whose best label is stable for this many iterations.\n") + Option::Indent() + "(0 to never freeze nodes)", offsetof(LfnIc::Settings, freezeStableIterations), wxCMD_LINE_VAL_NUMBER)
+	, m_optCandidateLabelsPerNode(LfnIc::Settings::CANDIDATE_LABELS_PER_NODE_DISABLED, Option::COMPLETER_OPTION_TYPE, "scl", "settings-candidate-labels", std::string("Number of candidate labels to search for per node.\n") + Option::Indent() + "(0 to consider every label)", offsetof(LfnIc::Settings, candidateLabelsPerNode), wxCMD_LINE_VAL_NUMBER)
+	, m_optCheckpointIterations(LfnIc::Settings::CHECKPOINT_ITERATIONS_DISABLED, Option::COMPLETER_OPTION_TYPE, "sci", "settings-checkpoint-iterations", std::string("Also save a checkpoint every this many iterations.\n") + Option::Indent() + "(0 to only save one after each low resolution pass)", offsetof(LfnIc::Settings, checkpointIterations), wxCMD_LINE_VAL_NUMBER)
+	, m_optNumThreads(LfnIc::Settings::NUM_THREADS_AUTO, Option::COMPLETER_OPTION_TYPE, "st", "settings-num-threads", std::string("Number of threads, including the main thread.\n") + Option::Indent() + "(0 for one thread per cpu)", offsetof(LfnIc::Settings, numThreads), wxCMD_LINE_VAL_NUMBER)
+	, m_optLabelEnergyCacheMegabytesMax(LfnIc::Settings::LABEL_ENERGY_CACHE_MEGABYTES_DEFAULT, Option::COMPLETER_OPTION_TYPE, "sec", "settings-energy-cache-mb", std::string("Max megabytes of cached label energies.\n") + Option::Indent() + "(0 to disable the cache)", offsetof(LfnIc::Settings, labelEnergyCacheMegabytesMax), wxCMD_LINE_VAL_NUMBER)
+	, m_optPriorityBpSchedule(LfnIc::PriorityBpScheduleDefault, Option::COMPLETER_OPTION_TYPE, "sbs", "settings-bp-schedule", std::string("Priority-BP node schedule.\n") + Option::Indent() + "(" + SettingsText::JoinEnumDescriptions<LfnIc::PriorityBpSchedule>() + ")", offsetof(LfnIc::Settings, priorityBpSchedule), wxCMD_LINE_VAL_STRING)
 	, m_optLatticeWidth(0, Option::COMPLETER_OPTION_TYPE, "sw", "settings-lattice-width", "Width of each gap in the lattice.", offsetof(LfnIc::Settings, latticeGapX), wxCMD_LINE_VAL_NUMBER)
 	, m_optLatticeHeight(0, Option::COMPLETER_OPTION_TYPE, "sh", "settings-lattice-height", "Height of each gap in the lattice.", offsetof(LfnIc::Settings, latticeGapY), wxCMD_LINE_VAL_NUMBER)
 	, m_optPatchesMin(0, Option::COMPLETER_OPTION_TYPE, "smn", "settings-patches-min", "Min patches after pruning.", offsetof(LfnIc::Settings, postPruneLabelsMin), wxCMD_LINE_VAL_NUMBER) // These should be called Labels instead of Patches to match SettingsText.cpp
@@ -180,6 +208,11 @@ CommandLineOptions::CommandLineOptions(int argc, char** argv)
 	, m_optPatchesInput("", Option::COMPLETER_OPTION_TYPE, "pi", "patches-input", "The input patches file path.", -1, wxCMD_LINE_VAL_STRING)
 	, m_optPatchesOutput("", Option::COMPLETER_OPTION_TYPE, "po", "patches-output", "The output patches file path.", -1, wxCMD_LINE_VAL_STRING)
 #endif
+	, m_optFftWisdom("", Option::COMPLETER_OPTION_TYPE, "fw", "fft-wisdom", "The fft wisdom file path. Measured fft plans are loaded from\n" + std::string(Option::Indent()) + "and saved to this file, to speed up later runs.", -1, wxCMD_LINE_VAL_STRING)
+	, m_optFftPrePlan("", Option::COMPLETER_OPTION_TYPE, "fp", "fft-pre-plan", std::string("Measure the fft plans for a list of image and patch sizes,\n") + Option::Indent() + "save them to the fft wisdom file, and exit.\n" + Option::Indent() + "(WxH:PWxPH[,WxH:PWxPH...], e.g., 1024x768:32x32)", -1, wxCMD_LINE_VAL_STRING)
+	, m_optEnergyCalculatorTable("", Option::COMPLETER_OPTION_TYPE, "et", "energy-calculator-table", std::string("The energy calculator crossover table file path. Decides\n") + Option::Indent() + "which energy calculator to use for each batch size.", -1, wxCMD_LINE_VAL_STRING)
+	, m_optEnergyCalculatorCalibrate(false, Option::COMPLETER_OPTION_TYPE, "ec", "energy-calculator-calibrate", std::string("Benchmark the energy calculators on the input and mask images,\n") + Option::Indent() + "save the energy calculator table, and exit.", -1, wxCMD_LINE_VAL_NONE)
+	, m_optCheckpoint("", Option::COMPLETER_OPTION_TYPE, "ck", "checkpoint", std::string("The Priority-BP checkpoint file path. An interrupted completion\n") + Option::Indent() + "saves its progress to this file, and resumes from it when rerun.", -1, wxCMD_LINE_VAL_STRING)
 	, m_shouldRunImageCompletion(false)
 	, m_isValid(false)
 {
@@ -190,6 +223,13 @@ CommandLineOptions::CommandLineOptions(int argc, char** argv)
 	m_options.push_back(&m_optDebugLowResolutionPasses);
 	m_options.push_back(&m_optLowResolutionPassesMax);
 	m_options.push_back(&m_optNumIterations);
+	m_options.push_back(&m_optConvergenceEnergyThreshold);
+	m_options.push_back(&m_optFreezeStableIterations);
+	m_options.push_back(&m_optCandidateLabelsPerNode);
+	m_options.push_back(&m_optCheckpointIterations);
+	m_options.push_back(&m_optNumThreads);
+	m_options.push_back(&m_optLabelEnergyCacheMegabytesMax);
+	m_options.push_back(&m_optPriorityBpSchedule);
 	m_options.push_back(&m_optLatticeWidth);
 	m_options.push_back(&m_optLatticeHeight);
 	m_options.push_back(&m_optPatchesMin);
@@ -200,6 +240,11 @@ CommandLineOptions::CommandLineOptions(int argc, char** argv)
 #endif
 	m_options.push_back(&m_optCompositorPatchType);
 	m_options.push_back(&m_optCompositorPatchBlender);
+	m_options.push_back(&m_optFftWisdom);
+	m_options.push_back(&m_optFftPrePlan);
+	m_options.push_back(&m_optEnergyCalculatorTable);
+	m_options.push_back(&m_optEnergyCalculatorCalibrate);
+	m_options.push_back(&m_optCheckpoint);
 
 	// Completer options which depend on the input image
 	// http://arnout.engelen.eu/~wxwindows/xmldocs/applications/docbook/output/html/x13114.html
@@ -232,11 +277,18 @@ CommandLineOptions::CommandLineOptions(int argc, char** argv)
 		m_optPatchesOutput.Find(parser);
 #endif // ENABLE_PATCHES_INPUT_OUTPUT
 
+		m_optFftWisdom.Find(parser);
+		m_optFftPrePlan.Find(parser);
+		m_optEnergyCalculatorTable.Find(parser);
+		m_optEnergyCalculatorCalibrate.Find(parser);
+		m_optCheckpoint.Find(parser);
+
 		m_optSettingsShow.Find(parser);
 
 		// As of now, don't run image completion if the user wanted the
-		// settings displayed. Maybe change this later.
-		m_shouldRunImageCompletion = !m_optSettingsShow.value;
+		// settings displayed, the ffts pre-planned, or the energy calculators
+		// calibrated. Maybe change this later.
+		m_shouldRunImageCompletion = !m_optSettingsShow.value && !m_optFftPrePlan.wasFound && !m_optEnergyCalculatorCalibrate.value;
 
 		m_isValid = true;
 
@@ -244,16 +296,49 @@ CommandLineOptions::CommandLineOptions(int argc, char** argv)
 		{
 			wxString errorMessage;
 
-			// wxparser::Parse() should've failed if the input image
-			// wasn't present, since it's set to wxCMD_LINE_OPTION_MANDATORY.
-			wxASSERT(HasInputImagePath());
+			if (m_optFftPrePlan.wasFound)
+			{
+				// Pre-planning needs no images, only somewhere to save the
+				// plans.
+				if (!ParseFftPrePlanDimensions())
+				{
+					errorMessage = wxString::Format("\nInvalid fft pre-plan sizes. Please specify:\n\n\t-%s WxH:PWxPH[,WxH:PWxPH...]\n", m_optFftPrePlan.shortName);
+					m_isValid = false;
+				}
+				else if (!HasFftWisdomPath())
+				{
+					errorMessage = wxString::Format("\nMissing fft wisdom path. Please specify:\n\n\t-%s path/to/wisdomfile\n", m_optFftWisdom.shortName);
+					m_isValid = false;
+				}
+			}
+			else if (!HasInputImagePath())
+			{
+				errorMessage = wxString::Format("\nMissing input image path. Please specify:\n\n\t-%s path/to/inputimage.ext\n", m_optImageInput.shortName);
+				m_isValid = false;
+			}
 
 			if (m_optSettingsShow.value)
 			{
 				// Nothing besides the input image is needed to display the settings.
 			}
 
-			if (m_shouldRunImageCompletion)
+			if (m_isValid && m_optEnergyCalculatorCalibrate.value)
+			{
+				// Calibrating requires the mask image, and somewhere to save
+				// the table.
+				if (!HasMaskImagePath())
+				{
+					errorMessage = wxString::Format("\nMissing mask image path. Please specify:\n\n\t-%s path/to/maskimage.ext\n", m_optImageMask.shortName);
+					m_isValid = false;
+				}
+				else if (!HasEnergyCalculatorTablePath())
+				{
+					errorMessage = wxString::Format("\nMissing energy calculator table path. Please specify:\n\n\t-%s path/to/tablefile\n", m_optEnergyCalculatorTable.shortName);
+					m_isValid = false;
+				}
+			}
+
+			if (m_isValid && m_shouldRunImageCompletion)
 			{
 				// Running image completion requires mask and output images.
 				if (!HasMaskImagePath() && !HasOutputImagePath())
@@ -285,6 +370,13 @@ CommandLineOptions::CommandLineOptions(int argc, char** argv)
 				m_optDebugLowResolutionPasses.Find(parser);
 				m_optLowResolutionPassesMax.Find(parser);
 				m_optNumIterations.Find(parser);
+				m_optConvergenceEnergyThreshold.Find(parser);
+				m_optFreezeStableIterations.Find(parser);
+				m_optCandidateLabelsPerNode.Find(parser);
+				m_optCheckpointIterations.Find(parser);
+				m_optNumThreads.Find(parser);
+				m_optLabelEnergyCacheMegabytesMax.Find(parser);
+				m_optPriorityBpSchedule.Find(parser);
 				m_optLatticeWidth.Find(parser);
 				m_optLatticeHeight.Find(parser);
 				m_optPatchesMin.Find(parser);
@@ -296,6 +388,34 @@ CommandLineOptions::CommandLineOptions(int argc, char** argv)
 	}
 }
 
+bool CommandLineOptions::ParseFftPrePlanDimensions()
+{
+	m_fftPrePlanDimensions.clear();
+
+	const std::string& value = m_optFftPrePlan.value;
+	for (size_t entryBegin = 0; entryBegin <= value.length(); )
+	{
+		const size_t entryEnd = std::min(value.find(',', entryBegin), value.length());
+		const std::string entry(value, entryBegin, entryEnd - entryBegin);
+		entryBegin = entryEnd + 1;
+
+		FftPrePlanDimensions dimensions;
+		int numCharsRead = 0;
+		if (sscanf(entry.c_str(), "%dx%d:%dx%d%n", &dimensions.imageWidth, &dimensions.imageHeight, &dimensions.patchWidth, &dimensions.patchHeight, &numCharsRead) != 4 ||
+			numCharsRead != int(entry.length()) ||
+			dimensions.imageWidth <= 0 || dimensions.imageHeight <= 0 ||
+			dimensions.patchWidth <= 0 || dimensions.patchHeight <= 0)
+		{
+			m_fftPrePlanDimensions.clear();
+			return false;
+		}
+
+		m_fftPrePlanDimensions.push_back(dimensions);
+	}
+
+	return !m_fftPrePlanDimensions.empty();
+}
+
 const CommandLineOptions::Option* CommandLineOptions::FindOptionById(size_t id) const
 {
 	for (int i = 0, n = m_options.size(); i < n; ++i)
@@ -368,6 +488,13 @@ void CommandLineOptions::PrintSettingsThatHaveCommandLineOptions(const LfnIc::Se
 	OptionStrValueMap optionStrValues;
 	optionStrValues[&m_optLowResolutionPassesMax] = VAL_S(lowResolutionPassesMaxString.c_str());
 	optionStrValues[&m_optNumIterations] = VAL_I(settings.numIterations);
+	optionStrValues[&m_optConvergenceEnergyThreshold] = VAL_X("I64d", settings.convergenceEnergyThreshold);
+	optionStrValues[&m_optFreezeStableIterations] = VAL_I(settings.freezeStableIterations);
+	optionStrValues[&m_optCandidateLabelsPerNode] = VAL_I(settings.candidateLabelsPerNode);
+	optionStrValues[&m_optCheckpointIterations] = VAL_I(settings.checkpointIterations);
+	optionStrValues[&m_optNumThreads] = VAL_I(settings.numThreads);
+	optionStrValues[&m_optLabelEnergyCacheMegabytesMax] = VAL_I(settings.labelEnergyCacheMegabytesMax);
+	optionStrValues[&m_optPriorityBpSchedule] = VAL_S(SettingsText::GetEnumDescription(settings.priorityBpSchedule).c_str());
 	optionStrValues[&m_optLatticeWidth] = VAL_I(settings.latticeGapX);
 	optionStrValues[&m_optLatticeHeight] = VAL_I(settings.latticeGapY);
 	optionStrValues[&m_optPatchesMin] = VAL_I(settings.postPruneLabelsMin);
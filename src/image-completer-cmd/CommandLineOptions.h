@@ -101,6 +101,15 @@ public:
 		void Find(const wxCmdLineParser& parser);
 	};
 
+	// An input image and patch size to pre-plan the ffts for.
+	struct FftPrePlanDimensions
+	{
+		int imageWidth;
+		int imageHeight;
+		int patchWidth;
+		int patchHeight;
+	};
+
 	inline bool IsValid() const { return m_isValid; }
 
 	inline bool HasInputImagePath() const { return !m_optImageInput.value.empty(); }
@@ -119,6 +128,20 @@ public:
 	inline const std::string& GetOutputPatchesPath() const { return m_optPatchesOutput.value; }
 #endif // ENABLE_PATCHES_INPUT_OUTPUT
 
+	inline bool HasFftWisdomPath() const { return !m_optFftWisdom.value.empty(); }
+	inline const std::string& GetFftWisdomPath() const { return m_optFftWisdom.value; }
+
+	inline bool ShouldPrePlanFfts() const { return !m_fftPrePlanDimensions.empty(); }
+	inline const std::vector<FftPrePlanDimensions>& GetFftPrePlanDimensions() const { return m_fftPrePlanDimensions; }
+
+	inline bool HasEnergyCalculatorTablePath() const { return !m_optEnergyCalculatorTable.value.empty(); }
+	inline const std::string& GetEnergyCalculatorTablePath() const { return m_optEnergyCalculatorTable.value; }
+
+	inline bool ShouldCalibrateEnergyCalculators() const { return m_optEnergyCalculatorCalibrate.value; }
+
+	inline bool HasCheckpointPath() const { return !m_optCheckpoint.value.empty(); }
+	inline const std::string& GetCheckpointPath() const { return m_optCheckpoint.value; }
+
 	inline bool ShouldShowSettings() const { return m_optSettingsShow.value; }
 	inline bool ShouldRunImageCompletion() const { return m_shouldRunImageCompletion; }
 
@@ -130,6 +153,27 @@ public:
 	inline bool HasNumIterations() const { return m_optNumIterations.wasFound; }
 	inline int GetNumIterations() const { return m_optNumIterations.value; }
 
+	inline bool HasConvergenceEnergyThreshold() const { return m_optConvergenceEnergyThreshold.wasFound; }
+	inline LfnIc::Energy GetConvergenceEnergyThreshold() const { return m_optConvergenceEnergyThreshold.value; }
+
+	inline bool HasFreezeStableIterations() const { return m_optFreezeStableIterations.wasFound; }
+	inline int GetFreezeStableIterations() const { return m_optFreezeStableIterations.value; }
+
+	inline bool HasCandidateLabelsPerNode() const { return m_optCandidateLabelsPerNode.wasFound; }
+	inline int GetCandidateLabelsPerNode() const { return m_optCandidateLabelsPerNode.value; }
+
+	inline bool HasCheckpointIterations() const { return m_optCheckpointIterations.wasFound; }
+	inline int GetCheckpointIterations() const { return m_optCheckpointIterations.value; }
+
+	inline bool HasNumThreads() const { return m_optNumThreads.wasFound; }
+	inline int GetNumThreads() const { return m_optNumThreads.value; }
+
+	inline bool HasLabelEnergyCacheMegabytesMax() const { return m_optLabelEnergyCacheMegabytesMax.wasFound; }
+	inline int GetLabelEnergyCacheMegabytesMax() const { return m_optLabelEnergyCacheMegabytesMax.value; }
+
+	inline bool HasPriorityBpSchedule() const { return m_optPriorityBpSchedule.wasFound; }
+	inline LfnIc::PriorityBpSchedule GetPriorityBpSchedule() const { return m_optPriorityBpSchedule.value; }
+
 	inline bool HasLatticeGapX() const { return m_optLatticeWidth.wasFound; }
 	inline int GetLatticeGapX() const { return m_optLatticeWidth.value; }
 
@@ -159,6 +203,10 @@ public:
 	void PrintSettingsThatHaveCommandLineOptions(const LfnIc::Settings& settings) const;
 
 private:
+	// Parses m_optFftPrePlan's "WxH:PWxPH[,WxH:PWxPH...]" value into
+	// m_fftPrePlanDimensions. Returns false if it's malformed.
+	bool ParseFftPrePlanDimensions();
+
 	TypedOption<std::string> m_optImageInput;
 	TypedOption<std::string> m_optImageMask;
 	TypedOption<std::string> m_optImageOutput;
@@ -166,6 +214,13 @@ private:
 	TypedOption<bool> m_optDebugLowResolutionPasses;
 	TypedOption<int> m_optLowResolutionPassesMax;
 	TypedOption<long> m_optNumIterations;
+	TypedOption<long> m_optConvergenceEnergyThreshold;
+	TypedOption<long> m_optFreezeStableIterations;
+	TypedOption<long> m_optCandidateLabelsPerNode;
+	TypedOption<long> m_optCheckpointIterations;
+	TypedOption<long> m_optNumThreads;
+	TypedOption<long> m_optLabelEnergyCacheMegabytesMax;
+	TypedOption<LfnIc::PriorityBpSchedule> m_optPriorityBpSchedule;
 	TypedOption<long> m_optLatticeWidth; // Should these be X/Y or Width/Height?
 	TypedOption<long> m_optLatticeHeight;
 	TypedOption<long> m_optPatchesMin; // These should be called Labels instead of Patches to match SettingsText.cpp
@@ -178,6 +233,14 @@ private:
 	TypedOption<std::string> m_optPatchesOutput;
 #endif // ENABLE_PATCHES_INPUT_OUTPUT
 
+	TypedOption<std::string> m_optFftWisdom;
+	TypedOption<std::string> m_optFftPrePlan;
+	TypedOption<std::string> m_optEnergyCalculatorTable;
+	TypedOption<bool> m_optEnergyCalculatorCalibrate;
+	TypedOption<std::string> m_optCheckpoint;
+
+	std::vector<FftPrePlanDimensions> m_fftPrePlanDimensions;
+
 	bool m_shouldRunImageCompletion;
 	bool m_isValid;
 
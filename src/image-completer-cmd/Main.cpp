@@ -26,6 +26,7 @@
 #include "AppData.h"
 #include "CommandLineOptions.h"
 #include "LfnIc.h"
+#include "LfnIcSettings.h"
 #include "SettingsText.h"
 
 #ifdef USE_ITK
@@ -46,6 +47,46 @@ typedef AppWxMask AppMaskType;
 
 #include "tech/DbgMem.h"
 
+// Measures and saves the fft plans for each of the command line's image and
+// patch sizes. Returns true if they were all saved.
+static bool PrePlanFfts(const CommandLineOptions& options)
+{
+	bool result = true;
+
+	const std::vector<CommandLineOptions::FftPrePlanDimensions>& prePlanDimensions = options.GetFftPrePlanDimensions();
+	for (int i = 0, n = prePlanDimensions.size(); i < n; ++i)
+	{
+		const CommandLineOptions::FftPrePlanDimensions& dimensions = prePlanDimensions[i];
+
+		// Only the patch size, low resolution passes and threads affect
+		// which ffts are planned.
+		LfnIc::Settings settings;
+		LfnIc::SettingsConstruct(
+			settings,
+			int(dimensions.patchWidth / LfnIc::Settings::PATCH_TO_LATTICE_RATIO),
+			int(dimensions.patchHeight / LfnIc::Settings::PATCH_TO_LATTICE_RATIO));
+		settings.patchWidth = dimensions.patchWidth;
+		settings.patchHeight = dimensions.patchHeight;
+		if (options.HasLowResolutionPassesMax())
+		{
+			settings.lowResolutionPassesMax = options.GetLowResolutionPassesMax();
+		}
+		if (options.HasNumThreads())
+		{
+			settings.numThreads = options.GetNumThreads();
+		}
+
+		const bool prePlanned = LfnIc::PrePlanFfts(settings, dimensions.imageWidth, dimensions.imageHeight);
+		wxMessageOutput::Get()->Printf("%s fft plans for %dx%d images with %dx%d patches.\n",
+			prePlanned ? "Saved" : "Could not save",
+			dimensions.imageWidth, dimensions.imageHeight, dimensions.patchWidth, dimensions.patchHeight);
+
+		result &= prePlanned;
+	}
+
+	return result;
+}
+
 int main(int argc, char** argv)
 {
 	LfnIc::CompletionResult completionResult = LfnIc::CompletionFailedForUnknownReasons;
@@ -69,7 +110,28 @@ int main(int argc, char** argv)
 		wxInitAllImageHandlers();
 
 		const CommandLineOptions options(argc, argv);
-		if (options.IsValid())
+		if (options.IsValid() && options.HasFftWisdomPath())
+		{
+			LfnIc::SetFftWisdomFilePath(options.GetFftWisdomPath().c_str());
+		}
+
+		if (options.IsValid() && options.HasEnergyCalculatorTablePath())
+		{
+			LfnIc::SetEnergyCalculatorTableFilePath(options.GetEnergyCalculatorTablePath().c_str());
+		}
+
+		if (options.IsValid() && options.HasCheckpointPath())
+		{
+			LfnIc::SetCheckpointFilePath(options.GetCheckpointPath().c_str());
+		}
+
+		if (options.IsValid() && options.ShouldPrePlanFfts())
+		{
+			completionResult = PrePlanFfts(options)
+				? LfnIc::CompletionSucceeded
+				: LfnIc::CompletionFailedForUnknownReasons;
+		}
+		else if (options.IsValid())
 		{
 			AppImageType inputImage;
 			inputImage.LoadAndValidate(options.GetInputImagePath());
@@ -87,6 +149,18 @@ int main(int argc, char** argv)
 					options.PrintSettingsThatHaveCommandLineOptions(appData.GetSettings());
 				}
 
+				if (options.ShouldCalibrateEnergyCalculators())
+				{
+					const bool calibrated = LfnIc::CalibrateEnergyCalculators(appData.GetSettings(), appData.GetInputImage(), appData.GetMask());
+					wxMessageOutput::Get()->Printf("%s the energy calculator table %s.\n",
+						calibrated ? "Saved" : "Could not save",
+						options.GetEnergyCalculatorTablePath().c_str());
+
+					completionResult = calibrated
+						? LfnIc::CompletionSucceeded
+						: LfnIc::CompletionFailedForUnknownReasons;
+				}
+
 				if (options.ShouldRunImageCompletion())
 				{
 					completionResult = LfnIc::Complete(
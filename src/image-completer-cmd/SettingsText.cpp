@@ -61,6 +61,19 @@ std::string SettingsText::GetEnumDescription(LfnIc::CompositorPatchBlender e)
 	return desc;
 }
 
+std::string SettingsText::GetEnumDescription(LfnIc::PriorityBpSchedule e)
+{
+	std::string desc;
+	switch (e)
+	{
+	case LfnIc::PriorityBpScheduleSerial:   desc = "serial"; break;
+	case LfnIc::PriorityBpScheduleParallel: desc = "parallel"; break;
+	default:                                desc = "unknown"; break;
+	}
+
+	return desc;
+}
+
 //
 // SettingsText::PrintInvalidMembers
 //
@@ -35,6 +35,7 @@ public:
 	// Returns a description string for an enum value.
 	static std::string GetEnumDescription(LfnIc::CompositorPatchType e);
 	static std::string GetEnumDescription(LfnIc::CompositorPatchBlender e);
+	static std::string GetEnumDescription(LfnIc::PriorityBpSchedule e);
 
 	template<typename T>
 	static std::string JoinEnumDescriptions()
@@ -69,6 +69,56 @@ namespace LfnIc
 		std::istream* patchesIstream = NULL,
 		std::ostream* patchesOstream = NULL);
 
+	///
+	/// Sets the file that Complete() saves its Priority-BP checkpoints to,
+	/// after each low resolution pass, and every settings.checkpointIterations
+	/// iterations. If the file already has a checkpoint from a completion of
+	/// the same input, mask and settings, e.g., one that was interrupted,
+	/// Complete() resumes from it, and skips the resolutions that were
+	/// already solved. NULL or an empty path, the default, disables
+	/// checkpoints.
+	///
+	extern EXPORT void SetCheckpointFilePath(const char* filePath);
+
+	///
+	/// Sets the file that the fft energy calculator's plans (fftw wisdom) are
+	/// loaded from and saved to. The file is loaded before the next FFT is
+	/// planned, and saved whenever new FFT sizes had to be measured, so that
+	/// later runs skip the measuring. NULL or an empty path, the default,
+	/// disables the file.
+	///
+	extern EXPORT void SetFftWisdomFilePath(const char* filePath);
+
+	///
+	/// Measures the FFT plans that Complete() would use for an input image
+	/// of the given dimensions, at each resolution that the settings allow,
+	/// and saves them to the wisdom file. Plans depend on the number of
+	/// threads, so settings.numThreads should match the later completions.
+	/// Returns false if the settings or dimensions are invalid, or if the
+	/// plans couldn't be saved.
+	///
+	extern EXPORT bool PrePlanFfts(const Settings& settings, int imageWidth, int imageHeight);
+
+	///
+	/// Sets the file that the energy calculator crossover table is loaded
+	/// from at the start of each completion, and saved to by
+	/// CalibrateEnergyCalculators(). The table decides which energy
+	/// calculator is faster for each batch size. Without one (NULL or an
+	/// empty path, the default, or a missing file), the energy calculators
+	/// are timed against each other during the completion instead.
+	///
+	extern EXPORT void SetEnergyCalculatorTableFilePath(const char* filePath);
+
+	///
+	/// Benchmarks the energy calculators on the input image and mask, over a
+	/// range of batch sizes at each resolution that the settings allow, and
+	/// saves their crossovers to the table file. Settings and images used for
+	/// calibration should be representative of the later completions.
+	/// Returns false if the input is invalid, there's no table file, or it
+	/// couldn't be saved.
+	///
+	extern EXPORT bool CalibrateEnergyCalculators(const Settings& settings, const Image& inputImage, const Mask& mask);
+
 }
 
 #endif
@@ -42,6 +42,20 @@ namespace LfnIc
 		static const int LOW_RESOLUTION_PASSES_AUTO = -1;
 		static const int NUM_ITERATIONS_DEFAULT = 6;
 
+		static const int NUM_THREADS_AUTO = 0;
+		static const int NUM_THREADS_MAX = 256;
+
+		static const int LABEL_ENERGY_CACHE_MEGABYTES_DEFAULT = 256;
+		static const int LABEL_ENERGY_CACHE_MEGABYTES_MAX = 65536;
+
+		static const Energy CONVERGENCE_ENERGY_THRESHOLD_DISABLED;
+		static const int FREEZE_STABLE_ITERATIONS_DISABLED = 0;
+
+		static const int CANDIDATE_LABELS_PER_NODE_DISABLED = 0;
+		static const int CANDIDATE_LABELS_PER_NODE_MAX = 65536;
+
+		static const int CHECKPOINT_ITERATIONS_DISABLED = 0;
+
 		static const int IMAGE_DIMENSION_MAX = 32767;
 		static const int IMAGE_WIDTH_MAX = IMAGE_DIMENSION_MAX;
 		static const int IMAGE_HEIGHT_MAX = IMAGE_DIMENSION_MAX;
@@ -77,9 +91,59 @@ namespace LfnIc
 		/// will be at the expense of solution accuracy.
 		int lowResolutionPassesMax;
 
-		/// The number of priority-bp iterations to run.
+		/// The max number of priority-bp iterations to run.
 		int numIterations;
 
+		/// Iterations stop early once an iteration prunes no labels, changes
+		/// no node's best label, and changes no message by more than this
+		/// energy. At 0, they only stop once an iteration leaves every
+		/// message unchanged, after which further iterations would only
+		/// repeat it.
+		/// CONVERGENCE_ENERGY_THRESHOLD_DISABLED always runs numIterations.
+		Energy convergenceEnergyThreshold;
+
+		/// Once a node's best label has been the same, and the only label
+		/// within confidenceBeliefThreshold of the best belief, for this many
+		/// consecutive iterations, the node is frozen: it neither sends nor
+		/// receives messages for the rest of the resolution's iterations.
+		/// FREEZE_STABLE_ITERATIONS_DISABLED never freezes nodes.
+		int freezeStableIterations;
+
+		/// If enabled, before the first Priority-BP pass, a randomized
+		/// PatchMatch-style search finds this many candidate labels for each
+		/// node, and the node only considers those rather than every label
+		/// in the image. At least postPruneLabelsMax candidates are kept.
+		/// Much faster for large images, at the risk of missing the best
+		/// labels. CANDIDATE_LABELS_PER_NODE_DISABLED searches exhaustively.
+		int candidateLabelsPerNode;
+
+		/// If a checkpoint file is set (see SetCheckpointFilePath()), the
+		/// Priority-BP state is saved to it after each low resolution pass,
+		/// and also every this many iterations within a pass.
+		/// CHECKPOINT_ITERATIONS_DISABLED only saves it between passes.
+		int checkpointIterations;
+
+		/// The number of threads used for energy calculations, including the
+		/// calling thread, or NUM_THREADS_AUTO to use one thread per cpu.
+		/// This is the budget for the whole completion; the FFT library is
+		/// limited to the same number of threads.
+		int numThreads;
+
+		/// The memory cap, in megabytes, for caching the energies of each
+		/// node's labels against the node's own patch, and against its
+		/// neighbors' labels where their patches overlap. These don't change
+		/// during a resolution's iterations, so once cached, only the
+		/// messages need to be summed to update a node's priority or send
+		/// its messages. 0 disables the caches.
+		int labelEnergyCacheMegabytesMax;
+
+		/// How the Priority-BP passes schedule their nodes. See the enum for
+		/// more info. The parallel schedule's solution doesn't depend on
+		/// numThreads, but does on its fixed wave size, so it can differ
+		/// from the serial schedule's, and between builds with different
+		/// wave sizes.
+		PriorityBpSchedule priorityBpSchedule;
+
 		/// The gap between nodes in the Markov Random Field lattice. Both
 		/// values must be >= LATTICE_GAP_MIN.
 		int latticeGapX;
@@ -91,6 +91,30 @@ namespace LfnIc
 		CompositorPatchBlenderNum,
 		CompositorPatchBlenderDefault = CompositorPatchBlenderPriority
 	};
+
+	/// Determines how the Priority-BP passes schedule their nodes.
+	enum PriorityBpSchedule
+	{
+		PriorityBpScheduleInvalid = -1,
+
+		/// Each pass visits one node at a time, in priority order. This is
+		/// the algorithm as described by the white paper.
+		PriorityBpScheduleSerial,
+
+		/// The forward pass visits waves of the highest priority uncommitted
+		/// nodes, which are far enough apart in the lattice that they share
+		/// no neighbors, and prunes them and sends their messages
+		/// concurrently. The backward pass replays the waves in reverse.
+		/// The waves' maximum size is fixed rather than the number of
+		/// threads, so the output is the same for any number of threads,
+		/// but may differ from the serial schedule's. Energy calculators can't
+		/// be timed concurrently, so a calibrated crossover table is
+		/// recommended.
+		PriorityBpScheduleParallel,
+
+		PriorityBpScheduleNum,
+		PriorityBpScheduleDefault = PriorityBpScheduleSerial
+	};
 }
 
 /// Full TypeInfo specialization for LfnIc::CompositorPatchType.
@@ -107,4 +131,11 @@ template<> struct TypeInfo<LfnIc::CompositorPatchBlender>
 	static const int Last = LfnIc::CompositorPatchBlenderNum - 1;
 };
 
+/// Full TypeInfo specialization for LfnIc::PriorityBpSchedule.
+template<> struct TypeInfo<LfnIc::PriorityBpSchedule>
+{
+	static const int First = LfnIc::PriorityBpScheduleInvalid + 1;
+	static const int Last = LfnIc::PriorityBpScheduleNum - 1;
+};
+
 #endif
@@ -0,0 +1,55 @@
+//
+// Copyright 2010, Darren Lafreniere
+// <http://www.lafarren.com/image-completer/>
+//
+// This file is part of lafarren.com's Image Completer.
+//
+// Image Completer is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Image Completer is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Image Completer, named License.txt. If not, see
+// <http://www.gnu.org/licenses/>.
+//
+
+#include "Pch.h"
+#include "CacheBudget.h"
+
+#include "tech/DbgMem.h"
+
+//
+// CacheBudget implementation
+//
+LfnIc::CacheBudget::CacheBudget(int64 bytesFree) :
+m_bytesFree(bytesFree)
+{
+}
+
+bool LfnIc::CacheBudget::Reserve(int64 bytes)
+{
+	wxASSERT(bytes >= 0);
+
+	wxMutexLocker lock(m_mutex);
+	if (bytes > m_bytesFree)
+	{
+		return false;
+	}
+
+	m_bytesFree -= bytes;
+	return true;
+}
+
+void LfnIc::CacheBudget::Release(int64 bytes)
+{
+	wxASSERT(bytes >= 0);
+
+	wxMutexLocker lock(m_mutex);
+	m_bytesFree += bytes;
+}
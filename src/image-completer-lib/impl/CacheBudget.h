@@ -0,0 +1,54 @@
+//
+// Copyright 2010, Darren Lafreniere
+// <http://www.lafarren.com/image-completer/>
+//
+// This file is part of lafarren.com's Image Completer.
+//
+// Image Completer is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Image Completer is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Image Completer, named License.txt. If not, see
+// <http://www.gnu.org/licenses/>.
+//
+
+#ifndef CACHE_BUDGET_H
+#define CACHE_BUDGET_H
+
+#include <wx/thread.h>
+
+#include "LfnIcTypes.h"
+
+namespace LfnIc
+{
+	///
+	/// The number of bytes that a group of caches may still allocate. Caches
+	/// reserve bytes before they grow and release them when they shrink.
+	/// Thread safe, so that caches can be filled from concurrent jobs.
+	///
+	class CacheBudget
+	{
+	public:
+		CacheBudget(int64 bytesFree);
+
+		/// Reserves bytes and returns true if that many are free. Otherwise,
+		/// nothing is reserved and false is returned.
+		bool Reserve(int64 bytes);
+
+		/// Returns previously reserved bytes to the budget.
+		void Release(int64 bytes);
+
+	private:
+		wxMutex m_mutex;
+		int64 m_bytesFree;
+	};
+}
+
+#endif
@@ -52,13 +52,25 @@ const LfnIc::Label& LfnIc::ConstNodeLabels::GetLabel(int index) const
 		: m_node.m_labelInfoSet[index].label;
 }
 
-const LfnIc::Energy* LfnIc::ConstNodeLabels::GetMessages(int index) const
+void LfnIc::ConstNodeLabels::GetMessages(int index, Energy outMessages[NumNeighborEdges]) const
 {
 	wxASSERT(index >= 0);
 	wxASSERT(index < size());
-	static const Energy globalMessageSet[NumNeighborEdges] = {Energy(0)};
 
-	return m_globalLabelSet
-		? globalMessageSet
-		: m_node.m_labelInfoSet[index].messages;
+	if (m_globalLabelSet)
+	{
+		for (int i = 0; i < NumNeighborEdges; ++i)
+		{
+			const std::vector<Node::StoredMessage>& edgeMessages = m_node.m_globalLabelMessages[i];
+			outMessages[i] = edgeMessages.empty() ? Energy(0) : Node::LoadMessage(edgeMessages[index]);
+		}
+	}
+	else
+	{
+		const Node::StoredMessage* messages = m_node.m_labelInfoSet[index].messages;
+		for (int i = 0; i < NumNeighborEdges; ++i)
+		{
+			outMessages[i] = Node::LoadMessage(messages[i]);
+		}
+	}
 }
@@ -23,6 +23,7 @@
 #define CONST_NODE_LABELS_H
 
 #include "LfnIcTypes.h"
+#include "NeighborEdge.h"
 
 namespace LfnIc
 {
@@ -44,8 +45,9 @@ namespace LfnIc
 		/// Label accessor.
 		const Label& GetLabel(int index) const;
 
-		/// Returns a Energy buffer of NumNeighborEdges length.
-		const Energy* GetMessages(int index) const;
+		/// Stores the label's messages, in the node's neighbor edge order, into
+		/// outMessages.
+		void GetMessages(int index, Energy outMessages[NumNeighborEdges]) const;
 
 	private:
 		const Node& m_node;
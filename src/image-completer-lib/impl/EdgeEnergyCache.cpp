@@ -0,0 +1,210 @@
+//
+// Copyright 2010, Darren Lafreniere
+// <http://www.lafarren.com/image-completer/>
+//
+// This file is part of lafarren.com's Image Completer.
+//
+// Image Completer is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Image Completer is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Image Completer, named License.txt. If not, see
+// <http://www.gnu.org/licenses/>.
+//
+
+#include "Pch.h"
+#include "EdgeEnergyCache.h"
+
+#include "CacheBudget.h"
+#include "ConstNodeLabels.h"
+#include "Label.h"
+
+#include "tech/DbgMem.h"
+
+namespace LfnIc
+{
+	// For each of the sorted keys in to, outIndices receives the index of
+	// the same key in the sorted keys from, or -1 if it's not there.
+	void MapSortedKeys(const std::vector<int>& from, const std::vector<int>& to, std::vector<int>& outIndices)
+	{
+		outIndices.resize(to.size());
+		for (int toIndex = 0, fromIndex = 0, toNum = to.size(), fromNum = from.size(); toIndex < toNum; ++toIndex)
+		{
+			while (fromIndex < fromNum && from[fromIndex] < to[toIndex])
+			{
+				++fromIndex;
+			}
+
+			outIndices[toIndex] = (fromIndex < fromNum && from[fromIndex] == to[toIndex]) ? fromIndex : -1;
+		}
+	}
+}
+
+//
+// EdgeEnergyCache implementation
+//
+const LfnIc::Energy LfnIc::EdgeEnergyCache::ENERGY_UNKNOWN = ~ENERGY_MIN;
+
+LfnIc::EdgeEnergyCache::EdgeEnergyCache()
+{
+}
+
+bool LfnIc::EdgeEnergyCache::Rekey(const ConstNodeLabels& a, const ConstNodeLabels& b, CacheBudget& budget, Scratch& scratch)
+{
+	Keys& keysA = scratch.keysA;
+	Keys& keysB = scratch.keysB;
+	GetSortedKeys(a, keysA);
+	GetSortedKeys(b, keysB);
+
+	if (keysA != m_keysA || keysB != m_keysB)
+	{
+		const int64 bytesOld = GetNumBytes();
+		const int64 bytesNew = int64(keysA.size()) * int64(keysB.size()) * int64(sizeof(Energy));
+		if (bytesNew > bytesOld && !budget.Reserve(bytesNew - bytesOld))
+		{
+			Clear(budget);
+			return false;
+		}
+
+		// Keep the energies of the label pairs that are in both the old and
+		// new keys.
+		std::vector<int>& oldRows = scratch.oldRows;
+		std::vector<int>& oldCols = scratch.oldCols;
+		MapSortedKeys(m_keysA, keysA, oldRows);
+		MapSortedKeys(m_keysB, keysB, oldCols);
+
+		const int rowNum = keysA.size();
+		const int colNum = keysB.size();
+		const int oldColNum = m_keysB.size();
+		std::vector<Energy>& energies = scratch.energies;
+		energies.assign(rowNum * colNum, ENERGY_UNKNOWN);
+		for (int row = 0; row < rowNum; ++row)
+		{
+			const int oldRow = oldRows[row];
+			if (oldRow >= 0)
+			{
+				for (int col = 0; col < colNum; ++col)
+				{
+					const int oldCol = oldCols[col];
+					if (oldCol >= 0)
+					{
+						energies[(row * colNum) + col] = m_energies[(oldRow * oldColNum) + oldCol];
+					}
+				}
+			}
+		}
+
+		// Assign rather than swap, so that the cache keeps its own capacity
+		// and the scratch buffers keep theirs. Labels are only pruned away
+		// during a resolution, so the cache usually shrinks in place.
+		m_keysA = keysA;
+		m_keysB = keysB;
+		m_energies = energies;
+		if (bytesNew < bytesOld)
+		{
+			budget.Release(bytesOld - bytesNew);
+		}
+	}
+
+	GetKeyIndices(a, m_keysA, m_keyIndicesA);
+	GetKeyIndices(b, m_keysB, m_keyIndicesB);
+	return true;
+}
+
+void LfnIc::EdgeEnergyCache::Clear(CacheBudget& budget)
+{
+	budget.Release(GetNumBytes());
+
+	// Swap to actually release the memory.
+	Keys().swap(m_keysA);
+	Keys().swap(m_keysB);
+	std::vector<int>().swap(m_keyIndicesA);
+	std::vector<int>().swap(m_keyIndicesB);
+	std::vector<Energy>().swap(m_energies);
+}
+
+bool LfnIc::EdgeEnergyCache::Lookup(int aIndex, int bIndex, Energy bound, Energy& outEnergy) const
+{
+	const Energy energy = GetEnergy(aIndex, bIndex);
+	if (energy >= ENERGY_MIN)
+	{
+		outEnergy = energy;
+		return true;
+	}
+
+	// A lower bound that already reaches the bound is as good an answer as
+	// the bounded calculation would give.
+	const Energy lowerBound = ~energy;
+	if (lowerBound >= bound)
+	{
+		outEnergy = lowerBound;
+		return true;
+	}
+
+	return false;
+}
+
+void LfnIc::EdgeEnergyCache::Store(int aIndex, int bIndex, Energy bound, Energy energy)
+{
+	wxASSERT(energy >= ENERGY_MIN);
+	Energy& cachedEnergy = GetEnergy(aIndex, bIndex);
+	if (energy < bound)
+	{
+		cachedEnergy = energy;
+	}
+	else if (cachedEnergy < ENERGY_MIN && ~cachedEnergy < energy)
+	{
+		cachedEnergy = ~energy;
+	}
+}
+
+int LfnIc::EdgeEnergyCache::GetKey(const Label& label)
+{
+	return (int(label.top) << 16) | int(static_cast<unsigned short>(label.left));
+}
+
+void LfnIc::EdgeEnergyCache::GetSortedKeys(const ConstNodeLabels& labels, Keys& outKeys)
+{
+	const int labelNum = labels.size();
+	outKeys.resize(labelNum);
+	for (int i = 0; i < labelNum; ++i)
+	{
+		outKeys[i] = GetKey(labels.GetLabel(i));
+	}
+
+	std::sort(outKeys.begin(), outKeys.end());
+}
+
+void LfnIc::EdgeEnergyCache::GetKeyIndices(const ConstNodeLabels& labels, const Keys& keys, std::vector<int>& outKeyIndices)
+{
+	const int labelNum = labels.size();
+	outKeyIndices.resize(labelNum);
+	for (int i = 0; i < labelNum; ++i)
+	{
+		const Keys::const_iterator it = std::lower_bound(keys.begin(), keys.end(), GetKey(labels.GetLabel(i)));
+		wxASSERT(it != keys.end() && *it == GetKey(labels.GetLabel(i)));
+		outKeyIndices[i] = it - keys.begin();
+	}
+}
+
+inline LfnIc::Energy& LfnIc::EdgeEnergyCache::GetEnergy(int aIndex, int bIndex)
+{
+	return m_energies[(m_keyIndicesA[aIndex] * m_keysB.size()) + m_keyIndicesB[bIndex]];
+}
+
+inline const LfnIc::Energy& LfnIc::EdgeEnergyCache::GetEnergy(int aIndex, int bIndex) const
+{
+	return m_energies[(m_keyIndicesA[aIndex] * m_keysB.size()) + m_keyIndicesB[bIndex]];
+}
+
+int64 LfnIc::EdgeEnergyCache::GetNumBytes() const
+{
+	return int64(m_energies.size()) * int64(sizeof(Energy));
+}
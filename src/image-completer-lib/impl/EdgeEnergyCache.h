@@ -0,0 +1,110 @@
+//
+// Copyright 2010, Darren Lafreniere
+// <http://www.lafarren.com/image-completer/>
+//
+// This file is part of lafarren.com's Image Completer.
+//
+// Image Completer is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Image Completer is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Image Completer, named License.txt. If not, see
+// <http://www.gnu.org/licenses/>.
+//
+
+#ifndef EDGE_ENERGY_CACHE_H
+#define EDGE_ENERGY_CACHE_H
+
+#include "LfnIcTypes.h"
+
+namespace LfnIc
+{
+	// Forward declarations
+	class CacheBudget;
+	class ConstNodeLabels;
+	struct Label;
+
+	///
+	/// Caches the energies between the labels of two neighboring nodes, over
+	/// the region where their patches overlap, keyed by label pair. These
+	/// energies don't change during a resolution's iterations, so once both
+	/// nodes are pruned, repeated message sends only need the min-sum
+	/// arithmetic.
+	///
+	/// Each energy is either exact, or a lower bound left by a bounded
+	/// calculation that stopped early.
+	///
+	class EdgeEnergyCache
+	{
+	public:
+		/// Rekey()'s temporary buffers, which keep their capacity between
+		/// calls, so that rekeying doesn't allocate once they've grown. Each
+		/// thread must use its own.
+		struct Scratch
+		{
+			std::vector<int> keysA;
+			std::vector<int> keysB;
+			std::vector<int> oldRows;
+			std::vector<int> oldCols;
+			std::vector<Energy> energies;
+		};
+
+		EdgeEnergyCache();
+
+		/// Keys the cache by the current labels of node a and node b. The
+		/// energies of label pairs that were already keyed are kept, and
+		/// the others are unknown. Afterwards, labels are addressed by their
+		/// ConstNodeLabels indices. The change in size is reserved from, or
+		/// released to, budget; if the cache doesn't fit, it's cleared and
+		/// false is returned.
+		bool Rekey(const ConstNodeLabels& a, const ConstNodeLabels& b, CacheBudget& budget, Scratch& scratch);
+
+		/// Empties the cache and releases its bytes to budget.
+		void Clear(CacheBudget& budget);
+
+		/// Returns true if the cached energy between a's label aIndex and b's
+		/// label bIndex answers a calculation bounded by bound (see
+		/// EnergyCalculator::BatchQueued::QueueCalculationBounded).
+		bool Lookup(int aIndex, int bIndex, Energy bound, Energy& outEnergy) const;
+
+		/// Stores the result of a calculation bounded by bound.
+		void Store(int aIndex, int bIndex, Energy bound, Energy energy);
+
+	private:
+		// Lower bound of ENERGY_MIN, stored as a lower bound (see
+		// m_energies).
+		static const Energy ENERGY_UNKNOWN;
+
+		// Labels are keyed in ascending order of their packed coordinates.
+		typedef std::vector<int> Keys;
+
+		static int GetKey(const Label& label);
+		static void GetSortedKeys(const ConstNodeLabels& labels, Keys& outKeys);
+
+		// Maps each ConstNodeLabels index to its sorted key's index.
+		static void GetKeyIndices(const ConstNodeLabels& labels, const Keys& keys, std::vector<int>& outKeyIndices);
+
+		inline Energy& GetEnergy(int aIndex, int bIndex);
+		inline const Energy& GetEnergy(int aIndex, int bIndex) const;
+
+		int64 GetNumBytes() const;
+
+		Keys m_keysA;
+		Keys m_keysB;
+		std::vector<int> m_keyIndicesA;
+		std::vector<int> m_keyIndicesB;
+
+		// m_keysA.size() rows of m_keysB.size() energies. Lower bounds are
+		// stored as their bitwise complement, which is always negative.
+		std::vector<Energy> m_energies;
+	};
+}
+
+#endif
@@ -87,6 +87,15 @@ namespace LfnIc
 			/// Asserts that a batch is open.
 			inline Energy Calculate(int bLeft, int bTop) const;
 
+			/// Same as Calculate(), for callers that only need the energy
+			/// when it's less than bound. If it is, it's returned exactly.
+			/// Otherwise, some energy >= bound is returned, and the energy
+			/// calculator may stop calculating as soon as the bound is
+			/// exceeded.
+			///
+			/// Asserts that a batch is open.
+			inline Energy CalculateBounded(int bLeft, int bTop, Energy bound) const;
+
 		private:
 			EnergyCalculator& m_energyCalculator;
 		};
@@ -147,6 +156,13 @@ namespace LfnIc
 			/// Asserts that a batch is open.
 			inline Handle QueueCalculation(int bLeft, int bTop);
 
+			/// Same as QueueCalculation(), except that the result is only
+			/// exact if it's less than bound. See
+			/// BatchImmediate::CalculateBounded().
+			///
+			/// Asserts that a batch is open.
+			inline Handle QueueCalculationBounded(int bLeft, int bTop, Energy bound);
+
 			/// Completes the processing of the queued calculations using all
 			/// available threads (workers & main). QueueCalculation() will
 			/// assert if called after a this method, and GetResult will assert
@@ -175,6 +191,11 @@ namespace LfnIc
 		virtual void ProcessCalculations() = 0;
 		virtual Energy GetResult(BatchQueued::Handle handle) const = 0;
 
+		// Bounded calculations. By default, the bound is ignored and the
+		// energy is calculated in full, which satisfies the contract.
+		virtual Energy CalculateBounded(int bLeft, int bTop, Energy bound) const;
+		virtual BatchQueued::Handle QueueCalculationBounded(int bLeft, int bTop, Energy bound);
+
 		// Let the internal EnergyCalculatorMeasurer class (in
 		// EnergyCalculatorContainer.cpp) delegate to these protected methods.
 		friend class EnergyCalculatorMeasurer;
@@ -50,6 +50,11 @@ namespace LfnIc
 		return m_energyCalculator.Calculate(bLeft, bTop);
 	}
 
+	inline Energy EnergyCalculator::BatchImmediate::CalculateBounded(int bLeft, int bTop, Energy bound) const
+	{
+		return m_energyCalculator.CalculateBounded(bLeft, bTop, bound);
+	}
+
 	inline EnergyCalculator::BatchQueued::BatchQueued(EnergyCalculator& energyCalculator, const BatchParams& params)
 		: m_energyCalculator(energyCalculator)
 	{
@@ -66,6 +71,11 @@ namespace LfnIc
 		return m_energyCalculator.QueueCalculation(bLeft, bTop);
 	}
 
+	inline EnergyCalculator::BatchQueued::Handle EnergyCalculator::BatchQueued::QueueCalculationBounded(int bLeft, int bTop, Energy bound)
+	{
+		return m_energyCalculator.QueueCalculationBounded(bLeft, bTop, bound);
+	}
+
 	inline void EnergyCalculator::BatchQueued::ProcessCalculations()
 	{
 		return m_energyCalculator.ProcessCalculations();
@@ -75,6 +85,16 @@ namespace LfnIc
 	{
 		return m_energyCalculator.GetResult(handle);
 	}
+
+	inline Energy EnergyCalculator::CalculateBounded(int bLeft, int bTop, Energy bound) const
+	{
+		return Calculate(bLeft, bTop);
+	}
+
+	inline EnergyCalculator::BatchQueued::Handle EnergyCalculator::QueueCalculationBounded(int bLeft, int bTop, Energy bound)
+	{
+		return QueueCalculation(bLeft, bTop);
+	}
 }
 
 #endif
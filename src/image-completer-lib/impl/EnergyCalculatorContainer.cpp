@@ -22,13 +22,72 @@
 #include "Pch.h"
 #include "EnergyCalculatorContainer.h"
 
+#include "tech/ThreadPool.h"
 #include "tech/Time.h"
 
+#include "ImageConst.h"
+#include "LfnIcSettings.h"
+
 #include "tech/DbgMem.h"
 
 namespace LfnIc
 {
 #if ENABLE_ENERGY_CALCULATOR_FFT
+	// The crossover table file that containers load at construction.
+	static std::string g_crossoverTableFilePath;
+
+	// Each calibration timing is the fastest of this many samples, so that a
+	// single noisy sample can't skew a crossover.
+	const int CALIBRATION_SAMPLES_NUM = 3;
+
+	// Calibrated calculations per batch are powers of two up to this limit,
+	// or up to the number of distinct block B positions.
+	const int CALIBRATION_CALCULATIONS_MAX = 1 << 16;
+
+	// Returns the fastest time, in seconds, of running a queued batch of
+	// params.maxCalculations calculations. Block B positions are spread
+	// deterministically over the image, so each sample does the same work.
+	static double MeasureQueuedBatch(EnergyCalculator& energyCalculator, const EnergyCalculator::BatchParams& params, int imageWidth, int imageHeight)
+	{
+		const int bLeftNum = imageWidth - params.width + 1;
+		const int bTopNum = imageHeight - params.height + 1;
+		wxASSERT(bLeftNum > 0 && bTopNum > 0);
+
+		double fastestTime = 0.0;
+		for (int sample = 0; sample < CALIBRATION_SAMPLES_NUM; ++sample)
+		{
+			const double startTime = LfnTech::CurrentTime();
+			{
+				EnergyCalculator::BatchQueued energyBatch(energyCalculator, params);
+				for (int i = 0; i < params.maxCalculations; ++i)
+				{
+					// Computed in 64 bits, since i * 104729 overflows an int
+					// well within CALIBRATION_CALCULATIONS_MAX.
+					const int bLeft = int((int64(i) * 7919) % bLeftNum);
+					const int bTop = int((int64(i) * 104729) % bTopNum);
+					wxASSERT(bLeft >= 0 && bLeft < bLeftNum);
+					wxASSERT(bTop >= 0 && bTop < bTopNum);
+					energyBatch.QueueCalculation(bLeft, bTop);
+				}
+
+				energyBatch.ProcessCalculations();
+
+				for (int i = 0; i < params.maxCalculations; ++i)
+				{
+					energyBatch.GetResult(EnergyCalculator::BatchQueued::Handle(i));
+				}
+			}
+
+			const double time = LfnTech::CurrentTime() - startTime;
+			if (sample == 0 || time < fastestTime)
+			{
+				fastestTime = time;
+			}
+		}
+
+		return fastestTime;
+	}
+
 	class ScopedTimeAccumulator
 	{
 	public:
@@ -224,6 +283,22 @@ namespace LfnIc
 			return m_measureCurrent->energyCalculator.QueueCalculation(bLeft, bTop);
 		}
 
+		virtual Energy CalculateBounded(int bLeft, int bTop, Energy bound) const
+		{
+			wxASSERT(m_measureCurrent);
+
+			ScopedTimeAccumulator scopedTimeAccumulator(m_measureCurrent->totalTime);
+			return m_measureCurrent->energyCalculator.CalculateBounded(bLeft, bTop, bound);
+		}
+
+		virtual BatchQueued::Handle QueueCalculationBounded(int bLeft, int bTop, Energy bound)
+		{
+			wxASSERT(m_measureCurrent);
+
+			ScopedTimeAccumulator scopedTimeAccumulator(m_measureCurrent->totalTime);
+			return m_measureCurrent->energyCalculator.QueueCalculationBounded(bLeft, bTop, bound);
+		}
+
 		virtual void ProcessCalculations()
 		{
 			wxASSERT(m_measureCurrent);
@@ -261,21 +336,40 @@ namespace LfnIc
 //
 // EnergyCalculatorContainer implementation
 //
-LfnIc::EnergyCalculatorContainer::EnergyCalculatorContainer(const Settings& settings, const ImageConst& inputImage, const MaskLod& mask)
+LfnIc::EnergyCalculatorContainer::EnergyCalculatorContainer(const Settings& settings, LfnTech::ThreadPool& threadPool, const ImageConst& inputImage, const MaskLod& mask)
 	: m_settings(settings)
+	, m_threadPool(threadPool)
 	, m_inputImage(inputImage)
 	, m_mask(mask)
-	, m_energyCalculatorPerPixel(inputImage, mask)
+	, m_energyCalculatorPerPixel(inputImage, mask, threadPool)
+	, m_threadCalculators(threadPool.GetNumThreads(), NULL)
 	, m_depth(0)
 {
 #if ENABLE_ENERGY_CALCULATOR_FFT
 	// Create the original resolution label set.
 	m_resolutions.push_back(new Resolution(*this));
+
+	if (!g_crossoverTableFilePath.empty())
+	{
+		if (m_crossoverTable.Load(g_crossoverTableFilePath))
+		{
+			std::cout << "Using the energy calculator crossover table " << g_crossoverTableFilePath << "." << std::endl;
+		}
+		else
+		{
+			std::cout << "Couldn't load the energy calculator crossover table " << g_crossoverTableFilePath << ", measuring the energy calculators instead." << std::endl;
+		}
+	}
 #endif
 }
 
 LfnIc::EnergyCalculatorContainer::~EnergyCalculatorContainer()
 {
+	for (int i = 0, n = m_threadCalculators.size(); i < n; ++i)
+	{
+		delete m_threadCalculators[i];
+	}
+
 #if ENABLE_ENERGY_CALCULATOR_FFT
 	ClearMeasurers();
 
@@ -291,6 +385,8 @@ void LfnIc::EnergyCalculatorContainer::ScaleUp()
 	wxASSERT(m_depth > 0);
 
 #if ENABLE_ENERGY_CALCULATOR_FFT
+	ClearThreadCalculatorsFft();
+
 	// We don't expect to scale back down to this resolution, so free up some
 	// memory. This is checked by the assert at the bottom of
 	// EnergyCalculatorContainer::ScaleDown().
@@ -306,6 +402,8 @@ void LfnIc::EnergyCalculatorContainer::ScaleDown()
 	wxASSERT(m_depth >= 0);
 
 #if ENABLE_ENERGY_CALCULATOR_FFT
+	ClearThreadCalculatorsFft();
+
 	// If there's no resolution for the next lower depth, create one.
 	if (static_cast<unsigned int>(m_depth) == m_resolutions.size() - 1)
 	{
@@ -332,10 +430,31 @@ int LfnIc::EnergyCalculatorContainer::GetScaleDepth() const
 LfnIc::EnergyCalculator& LfnIc::EnergyCalculatorContainer::Get(const EnergyCalculator::BatchParams& batchParams, int numBatchCalculations)
 {
 	wxASSERT(numBatchCalculations > 0);
+	if (m_threadPool.IsRunning())
+	{
+		return GetConcurrent(batchParams, numBatchCalculations);
+	}
+
 #if !ENABLE_ENERGY_CALCULATOR_FFT
 	return m_energyCalculatorPerPixel;
 #else
+	wxASSERT(CanUseFft(batchParams));
+
 	const EnergyBatchSize batchSize(batchParams, numBatchCalculations);
+
+	if (!m_crossoverTable.IsEmpty())
+	{
+		const int imagePixels = m_inputImage.GetWidth() * m_inputImage.GetHeight();
+		if (m_crossoverTable.ShouldUseFft(imagePixels, batchParams.aMasked, batchSize.numBatchPixels, numBatchCalculations))
+		{
+			return GetCurrentResolution().GetEnergyCalculatorFft();
+		}
+		else
+		{
+			return m_energyCalculatorPerPixel;
+		}
+	}
+
 	EnergyCalculatorMeasurer* measurerToUse = NULL;
 
 	// Iterate through measurers, looking for measurers that have determined
@@ -385,7 +504,174 @@ LfnIc::EnergyCalculator& LfnIc::EnergyCalculatorContainer::Get(const EnergyCalcu
 #endif
 }
 
+LfnIc::EnergyCalculator& LfnIc::EnergyCalculatorContainer::GetConcurrent(const EnergyCalculator::BatchParams& batchParams, int numBatchCalculations)
+{
+	const int threadIndex = m_threadPool.GetCurrentThreadIndex();
+	wxASSERT(threadIndex >= 0 && threadIndex < int(m_threadCalculators.size()));
+	if (!m_threadCalculators[threadIndex])
+	{
+		m_threadCalculators[threadIndex] = new ThreadCalculators(*this);
+	}
+
+	ThreadCalculators& threadCalculators = *m_threadCalculators[threadIndex];
+#if !ENABLE_ENERGY_CALCULATOR_FFT
+	return threadCalculators.GetEnergyCalculatorPerPixel();
+#else
+	wxASSERT(CanUseFft(batchParams));
+
+	// Same choice as Get(), except that measuring isn't thread safe, so if
+	// the choice isn't known yet, the per-pixel calculator is used.
+	bool useFft = false;
+	GetChosen(batchParams, numBatchCalculations, useFft);
+
+	return useFft
+		? static_cast<EnergyCalculator&>(threadCalculators.GetEnergyCalculatorFft())
+		: static_cast<EnergyCalculator&>(threadCalculators.GetEnergyCalculatorPerPixel());
+#endif
+}
+
+bool LfnIc::EnergyCalculatorContainer::HasChosen(const EnergyCalculator::BatchParams& batchParams, int numBatchCalculations) const
+{
+#if !ENABLE_ENERGY_CALCULATOR_FFT
+	return true;
+#else
+	bool useFft = false;
+	return GetChosen(batchParams, numBatchCalculations, useFft);
+#endif
+}
+
 #if ENABLE_ENERGY_CALCULATOR_FFT
+bool LfnIc::EnergyCalculatorContainer::GetChosen(const EnergyCalculator::BatchParams& batchParams, int numBatchCalculations, bool& outUseFft) const
+{
+	const EnergyBatchSize batchSize(batchParams, numBatchCalculations);
+
+	bool result = false;
+	if (!m_crossoverTable.IsEmpty())
+	{
+		const int imagePixels = m_inputImage.GetWidth() * m_inputImage.GetHeight();
+		outUseFft = m_crossoverTable.ShouldUseFft(imagePixels, batchParams.aMasked, batchSize.numBatchPixels, numBatchCalculations);
+		result = true;
+	}
+	else
+	{
+		// Only the measurers that have finished are consulted; see Get().
+		for (int i = 0, n = m_measurers.size(); i < n && !result; ++i)
+		{
+			wxASSERT(m_measurers[i]);
+			const EnergyCalculatorMeasurer& measurer = *m_measurers[i];
+			if (!measurer.FoundFasterEnergyCalculator())
+			{
+				continue;
+			}
+
+			if (measurer.GetFasterEnergyCalculator() == &m_energyCalculatorPerPixel)
+			{
+				if (batchSize <= measurer.GetBatchSize())
+				{
+					outUseFft = false;
+					result = true;
+				}
+			}
+			else if (measurer.GetBatchSize() <= batchSize)
+			{
+				outUseFft = true;
+				result = true;
+			}
+		}
+	}
+
+	return result;
+}
+
+bool LfnIc::EnergyCalculatorContainer::CanUseFft(const EnergyCalculator::BatchParams& batchParams) const
+{
+	return batchParams.width % m_settings.latticeGapX == 0 && batchParams.height % m_settings.latticeGapY == 0;
+}
+
+void LfnIc::EnergyCalculatorContainer::SetCrossoverTableFilePath(const std::string& filePath)
+{
+	g_crossoverTableFilePath = filePath;
+}
+
+const std::string& LfnIc::EnergyCalculatorContainer::GetCrossoverTableFilePath()
+{
+	return g_crossoverTableFilePath;
+}
+
+void LfnIc::EnergyCalculatorContainer::Calibrate(EnergyCalculatorCrossoverTable& outTable)
+{
+	const int imageWidth = m_inputImage.GetWidth();
+	const int imageHeight = m_inputImage.GetHeight();
+	EnergyCalculatorFft& energyCalculatorFft = GetCurrentResolution().GetEnergyCalculatorFft();
+
+	// Block A is centered, so that a masked block A is likely to overlap
+	// both known and unknown pixels.
+	const int aCenterX = imageWidth / 2;
+	const int aCenterY = imageHeight / 2;
+
+	// Node batches are lattice gap multiples: the whole patch for node
+	// energies, a gap by a patch for the neighbor overlaps, and the known
+	// region crops in between (see Node::GetKnownRegion()). Each of these
+	// shapes is calibrated, from the whole patch down, except those whose
+	// area already was, since the table is keyed by batch pixels.
+	const int latticeGapX = m_settings.latticeGapX;
+	const int latticeGapY = m_settings.latticeGapY;
+	const int patchGapsX = m_settings.patchWidth / latticeGapX;
+	const int patchGapsY = m_settings.patchHeight / latticeGapY;
+	std::vector<int> batchPixelsCalibrated;
+	for (int shape = 0, shapeNum = patchGapsX * patchGapsY; shape < shapeNum; ++shape)
+	{
+		const int batchWidth = (patchGapsX - shape % patchGapsX) * latticeGapX;
+		const int batchHeight = (patchGapsY - shape / patchGapsX) * latticeGapY;
+		const int batchPixels = batchWidth * batchHeight;
+		if (batchWidth > imageWidth || batchHeight > imageHeight ||
+			std::find(batchPixelsCalibrated.begin(), batchPixelsCalibrated.end(), batchPixels) != batchPixelsCalibrated.end())
+		{
+			continue;
+		}
+
+		batchPixelsCalibrated.push_back(batchPixels);
+
+		const int bPositionsNum = (imageWidth - batchWidth + 1) * (imageHeight - batchHeight + 1);
+		const int calculationsMax = std::min(bPositionsNum, CALIBRATION_CALCULATIONS_MAX);
+
+		for (int aMaskedIndex = 0; aMaskedIndex < 2; ++aMaskedIndex)
+		{
+			const bool aMasked = (aMaskedIndex == 1);
+
+			EnergyCalculatorCrossoverTable::Entry entry;
+			entry.imagePixels = imageWidth * imageHeight;
+			entry.aMasked = aMasked;
+			entry.batchPixels = batchPixels;
+			entry.crossoverCalculations = EnergyCalculatorCrossoverTable::CROSSOVER_NEVER;
+
+			// The fft calculator's cost is mostly per batch, and the
+			// per-pixel calculator's is per calculation, so the first
+			// number of calculations at which the fft is faster is the
+			// crossover.
+			for (int calculations = 1; ; calculations = std::min(calculations * 2, calculationsMax))
+			{
+				const EnergyCalculator::BatchParams batchParams(calculations, batchWidth, batchHeight, aCenterX - batchWidth / 2, aCenterY - batchHeight / 2, aMasked);
+				wxASSERT(CanUseFft(batchParams));
+				const double perPixelTime = MeasureQueuedBatch(m_energyCalculatorPerPixel, batchParams, imageWidth, imageHeight);
+				const double fftTime = MeasureQueuedBatch(energyCalculatorFft, batchParams, imageWidth, imageHeight);
+				if (fftTime < perPixelTime)
+				{
+					entry.crossoverCalculations = calculations;
+					break;
+				}
+
+				if (calculations == calculationsMax)
+				{
+					break;
+				}
+			}
+
+			outTable.Add(entry);
+		}
+	}
+}
+
 void LfnIc::EnergyCalculatorContainer::OnFoundFasterEnergyCalculator(const EnergyCalculatorMeasurer& measurer)
 {
 	wxASSERT(measurer.FoundFasterEnergyCalculator());
@@ -443,6 +729,17 @@ void LfnIc::EnergyCalculatorContainer::ClearMeasurers()
 	}
 }
 
+void LfnIc::EnergyCalculatorContainer::ClearThreadCalculatorsFft()
+{
+	for (int i = 0, n = m_threadCalculators.size(); i < n; ++i)
+	{
+		if (m_threadCalculators[i])
+		{
+			m_threadCalculators[i]->ClearEnergyCalculatorFft();
+		}
+	}
+}
+
 LfnIc::EnergyCalculatorContainer::Resolution::Resolution(const EnergyCalculatorContainer& energyCalculatorContainer)
 	: m_energyCalculatorContainer(energyCalculatorContainer)
 	, m_energyCalculatorFft(NULL)
@@ -466,6 +763,7 @@ LfnIc::EnergyCalculatorFft& LfnIc::EnergyCalculatorContainer::Resolution::GetEne
 	{
 		m_energyCalculatorFft = new EnergyCalculatorFft(
 			m_energyCalculatorContainer.m_settings,
+			m_energyCalculatorContainer.m_threadPool.GetNumThreads(),
 			m_energyCalculatorContainer.m_inputImage,
 			m_energyCalculatorContainer.m_mask
 #if FFT_VALIDATION_ENABLED
@@ -477,3 +775,51 @@ LfnIc::EnergyCalculatorFft& LfnIc::EnergyCalculatorContainer::Resolution::GetEne
 	return *m_energyCalculatorFft;
 }
 #endif
+
+//
+// EnergyCalculatorContainer::ThreadCalculators implementation
+//
+LfnIc::EnergyCalculatorContainer::ThreadCalculators::ThreadCalculators(const EnergyCalculatorContainer& energyCalculatorContainer)
+	: m_energyCalculatorContainer(energyCalculatorContainer)
+	, m_energyCalculatorPerPixel(energyCalculatorContainer.m_inputImage, energyCalculatorContainer.m_mask, energyCalculatorContainer.m_threadPool)
+#if ENABLE_ENERGY_CALCULATOR_FFT
+	, m_energyCalculatorFft(NULL)
+#endif
+{
+}
+
+LfnIc::EnergyCalculatorContainer::ThreadCalculators::~ThreadCalculators()
+{
+#if ENABLE_ENERGY_CALCULATOR_FFT
+	ClearEnergyCalculatorFft();
+#endif
+}
+
+LfnIc::EnergyCalculatorPerPixel& LfnIc::EnergyCalculatorContainer::ThreadCalculators::GetEnergyCalculatorPerPixel()
+{
+	return m_energyCalculatorPerPixel;
+}
+
+#if ENABLE_ENERGY_CALCULATOR_FFT
+LfnIc::EnergyCalculatorFft& LfnIc::EnergyCalculatorContainer::ThreadCalculators::GetEnergyCalculatorFft()
+{
+	if (!m_energyCalculatorFft)
+	{
+		// The resolution's calculator is lazily created, and fftw's planner
+		// isn't thread safe, so it's created by whichever thread needs it
+		// first. Each thread then has a batch context that shares its
+		// precomputation, and executes single threaded plans, since the
+		// other threads are busy with their own batches.
+		wxMutexLocker lock(m_energyCalculatorContainer.m_fftPlannerMutex);
+		m_energyCalculatorFft = m_energyCalculatorContainer.GetCurrentResolution().GetEnergyCalculatorFft().CreateBatchContext();
+	}
+
+	return *m_energyCalculatorFft;
+}
+
+void LfnIc::EnergyCalculatorContainer::ThreadCalculators::ClearEnergyCalculatorFft()
+{
+	delete m_energyCalculatorFft;
+	m_energyCalculatorFft = NULL;
+}
+#endif
@@ -22,13 +22,21 @@
 #ifndef ENERGY_CALCULATOR_CONTAINER_H
 #define ENERGY_CALCULATOR_CONTAINER_H
 
+#include <wx/thread.h>
+
 #include "energy-calculators/EnergyCalculatorFftConfig.h"
 #if ENABLE_ENERGY_CALCULATOR_FFT
 #include "energy-calculators/EnergyCalculatorFft.h"
+#include "EnergyCalculatorCrossoverTable.h"
 #endif
 #include "energy-calculators/EnergyCalculatorPerPixel.h"
 #include "Scalable.h"
 
+namespace LfnTech
+{
+	class ThreadPool;
+}
+
 namespace LfnIc
 {
 	class EnergyCalculatorMeasurer;
@@ -38,10 +46,13 @@ namespace LfnIc
 
 	/// This class contains implementors of the EnergyCalculator interface,
 	/// and provides access to the faster implementor for a given batch size.
+	/// The faster implementor is looked up in the calibrated crossover table
+	/// if one was loaded, and is otherwise found by timing each implementor
+	/// as the batches run.
 	class EnergyCalculatorContainer : public Scalable
 	{
 	public:
-		EnergyCalculatorContainer(const Settings& settings, const ImageConst& inputImage, const MaskLod& mask);
+		EnergyCalculatorContainer(const Settings& settings, LfnTech::ThreadPool& threadPool, const ImageConst& inputImage, const MaskLod& mask);
 		~EnergyCalculatorContainer();
 
 		virtual void ScaleUp();
@@ -50,19 +61,94 @@ namespace LfnIc
 
 		/// Returns a reference to an energy calculator that's suitable for
 		/// the batch parameters and the number of calculations in the
-		/// batch.
+		/// batch. While the thread pool is running a job, each of its
+		/// threads gets its own calculators, so that they can all have a
+		/// batch open at once.
 		EnergyCalculator& Get(const EnergyCalculator::BatchParams& batchParams, int numBatchCalculations);
 
+		/// Returns true if the faster calculator for the batch is already
+		/// known, from the crossover table or a measurer that has finished.
+		/// Otherwise, Get() would measure the batch, which its thread pool
+		/// threads can't do, so they fall back to the per-pixel calculator.
+		/// Callers that fan batches out to the pool can first run the
+		/// batches that this returns false for serially.
+		bool HasChosen(const EnergyCalculator::BatchParams& batchParams, int numBatchCalculations) const;
+
+#if ENABLE_ENERGY_CALCULATOR_FFT
+		/// Sets the crossover table file that's loaded by each subsequently
+		/// constructed container. An empty path, the default, or a missing
+		/// file falls back to timing the implementors.
+		static void SetCrossoverTableFilePath(const std::string& filePath);
+		static const std::string& GetCrossoverTableFilePath();
+
+		/// Benchmarks the implementors at the current resolution, over a
+		/// range of batch sizes, and adds their crossovers to outTable.
+		void Calibrate(EnergyCalculatorCrossoverTable& outTable);
+#endif
+
 	private:
 		const Settings& m_settings;
+		LfnTech::ThreadPool& m_threadPool;
 		const ImageConst& m_inputImage;
 		const MaskLod& m_mask;
 
 		EnergyCalculatorPerPixel m_energyCalculatorPerPixel;
+
+		// The calculators of one of the thread pool's threads, which are used
+		// by Get() while the pool is running a job. Each is only created and
+		// accessed by its own thread.
+		class ThreadCalculators
+		{
+		public:
+			ThreadCalculators(const EnergyCalculatorContainer& energyCalculatorContainer);
+			~ThreadCalculators();
+
+			EnergyCalculatorPerPixel& GetEnergyCalculatorPerPixel();
+#if ENABLE_ENERGY_CALCULATOR_FFT
+			EnergyCalculatorFft& GetEnergyCalculatorFft();
+
+			// Deletes the fft batch context, which shares the current
+			// resolution's calculator, so must be deleted first.
+			void ClearEnergyCalculatorFft();
+#endif
+		private:
+			const EnergyCalculatorContainer& m_energyCalculatorContainer;
+			EnergyCalculatorPerPixel m_energyCalculatorPerPixel;
 #if ENABLE_ENERGY_CALCULATOR_FFT
+			EnergyCalculatorFft* m_energyCalculatorFft;
+#endif
+		};
+
+		friend class ThreadCalculators;
+
+		// Get() while the thread pool is running a job. The measurers are only
+		// read, so the faster calculator is chosen by the crossover table, or
+		// by the measurers that have finished.
+		EnergyCalculator& GetConcurrent(const EnergyCalculator::BatchParams& batchParams, int numBatchCalculations);
+
+		// Indexed by LfnTech::ThreadPool::GetCurrentThreadIndex(). Lazily
+		// created.
+		std::vector<ThreadCalculators*> m_threadCalculators;
+
+#if ENABLE_ENERGY_CALCULATOR_FFT
+		// fftw's planner isn't thread safe, so the resolution's fft calculator
+		// and the threads' batch contexts are created one at a time.
+		mutable wxMutex m_fftPlannerMutex;
+
 		friend class EnergyCalculatorMeasurer;
 		void OnFoundFasterEnergyCalculator(const EnergyCalculatorMeasurer& measurer);
 		void ClearMeasurers();
+		void ClearThreadCalculatorsFft();
+
+		// The fft calculator's windowed sum squared tables only handle
+		// batches whose dimensions are multiples of the lattice gap. Node
+		// batches are, including those cropped to their known region; this
+		// is asserted before the fft calculator is chosen.
+		bool CanUseFft(const EnergyCalculator::BatchParams& batchParams) const;
+
+		// If the faster calculator for the batch is already known, stores
+		// whether it's the fft calculator into outUseFft and returns true.
+		bool GetChosen(const EnergyCalculator::BatchParams& batchParams, int numBatchCalculations, bool& outUseFft) const;
 
 		// EnergyCalculatorFft instances are non-scalable. Therefore, they're
 		// dynamically allocated and initialized for each resolution.
@@ -83,6 +169,10 @@ namespace LfnIc
 		std::vector<Resolution*> m_resolutions;
 
 		std::vector<EnergyCalculatorMeasurer*> m_measurers;
+
+		// Loaded at construction. Get() uses the measurers only when this is
+		// empty.
+		EnergyCalculatorCrossoverTable m_crossoverTable;
 #endif // ENABLE_ENERGY_CALCULATOR_FFT
 		int m_depth;
 	};
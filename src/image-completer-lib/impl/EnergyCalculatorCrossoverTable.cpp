@@ -0,0 +1,151 @@
+//
+// Copyright 2010, Darren Lafreniere
+// <http://www.lafarren.com/image-completer/>
+//
+// This file is part of lafarren.com's Image Completer.
+//
+// Image Completer is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Image Completer is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Image Completer, named License.txt. If not, see
+// <http://www.gnu.org/licenses/>.
+//
+
+#include "Pch.h"
+#include "EnergyCalculatorCrossoverTable.h"
+
+#if ENABLE_ENERGY_CALCULATOR_FFT
+
+#include "tech/DbgMem.h"
+
+namespace LfnIc
+{
+	// Identifies the file format. Bump the version whenever the format, or
+	// the meaning of the measurements, changes.
+	static const char* const g_crossoverTableFileTag = "lfn-ic-energy-calculator-crossover-table";
+	static const int g_crossoverTableFileVersion = 1;
+
+	// Distance between two sizes, by ratio rather than difference, since
+	// the calibrated sizes are spaced geometrically.
+	static double GetSizeDistance(int a, int b)
+	{
+		return fabs(log(double(std::max(a, 1)) / double(std::max(b, 1))));
+	}
+}
+
+void LfnIc::EnergyCalculatorCrossoverTable::Add(const Entry& entry)
+{
+	wxASSERT(entry.imagePixels > 0);
+	wxASSERT(entry.batchPixels > 0);
+	wxASSERT(entry.crossoverCalculations > 0 || entry.crossoverCalculations == CROSSOVER_NEVER);
+	m_entries.push_back(entry);
+}
+
+bool LfnIc::EnergyCalculatorCrossoverTable::ShouldUseFft(int imagePixels, bool aMasked, int batchPixels, int numBatchCalculations) const
+{
+	wxASSERT(!IsEmpty());
+
+	const Entry* nearest = NULL;
+	double nearestImageDistance = 0.0;
+	double nearestBatchDistance = 0.0;
+	for (int i = 0, n = m_entries.size(); i < n; ++i)
+	{
+		const Entry& entry = m_entries[i];
+		const double imageDistance = GetSizeDistance(entry.imagePixels, imagePixels);
+		const double batchDistance = GetSizeDistance(entry.batchPixels, batchPixels);
+
+		bool isNearer;
+		if (!nearest)
+		{
+			isNearer = true;
+		}
+		else if (entry.aMasked != nearest->aMasked)
+		{
+			isNearer = (entry.aMasked == aMasked);
+		}
+		else if (imageDistance != nearestImageDistance)
+		{
+			isNearer = (imageDistance < nearestImageDistance);
+		}
+		else
+		{
+			isNearer = (batchDistance < nearestBatchDistance);
+		}
+
+		if (isNearer)
+		{
+			nearest = &entry;
+			nearestImageDistance = imageDistance;
+			nearestBatchDistance = batchDistance;
+		}
+	}
+
+	wxASSERT(nearest);
+	return nearest->crossoverCalculations != CROSSOVER_NEVER && numBatchCalculations >= nearest->crossoverCalculations;
+}
+
+bool LfnIc::EnergyCalculatorCrossoverTable::Load(const std::string& filePath)
+{
+	m_entries.clear();
+
+	std::ifstream file(filePath.c_str());
+	std::string tag;
+	int version = 0;
+	int numEntries = 0;
+	bool result =
+		(file >> tag >> version >> numEntries) &&
+		tag == g_crossoverTableFileTag &&
+		version == g_crossoverTableFileVersion &&
+		numEntries >= 0;
+
+	for (int i = 0; result && i < numEntries; ++i)
+	{
+		Entry entry;
+		int aMasked = 0;
+		result =
+			(file >> entry.imagePixels >> aMasked >> entry.batchPixels >> entry.crossoverCalculations) &&
+			entry.imagePixels > 0 &&
+			entry.batchPixels > 0 &&
+			(entry.crossoverCalculations > 0 || entry.crossoverCalculations == CROSSOVER_NEVER);
+
+		if (result)
+		{
+			entry.aMasked = (aMasked != 0);
+			m_entries.push_back(entry);
+		}
+	}
+
+	if (!result)
+	{
+		m_entries.clear();
+	}
+
+	return result;
+}
+
+bool LfnIc::EnergyCalculatorCrossoverTable::Save(const std::string& filePath) const
+{
+	std::ofstream file(filePath.c_str());
+	file << g_crossoverTableFileTag << " " << g_crossoverTableFileVersion << "\n";
+	file << m_entries.size() << "\n";
+
+	// imagePixels aMasked batchPixels crossoverCalculations
+	for (int i = 0, n = m_entries.size(); i < n; ++i)
+	{
+		const Entry& entry = m_entries[i];
+		file << entry.imagePixels << " " << (entry.aMasked ? 1 : 0) << " " << entry.batchPixels << " " << entry.crossoverCalculations << "\n";
+	}
+
+	file.close();
+	return !file.fail();
+}
+
+#endif // ENABLE_ENERGY_CALCULATOR_FFT
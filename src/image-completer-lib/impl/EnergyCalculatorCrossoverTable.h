@@ -0,0 +1,76 @@
+//
+// Copyright 2010, Darren Lafreniere
+// <http://www.lafarren.com/image-completer/>
+//
+// This file is part of lafarren.com's Image Completer.
+//
+// Image Completer is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Image Completer is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Image Completer, named License.txt. If not, see
+// <http://www.gnu.org/licenses/>.
+//
+
+#ifndef ENERGY_CALCULATOR_CROSSOVER_TABLE_H
+#define ENERGY_CALCULATOR_CROSSOVER_TABLE_H
+
+#include "energy-calculators/EnergyCalculatorFftConfig.h"
+#if ENABLE_ENERGY_CALCULATOR_FFT
+
+namespace LfnIc
+{
+	///
+	/// Calibrated crossover points between the per-pixel and fft energy
+	/// calculators. Each entry stores, for an input image size, block A
+	/// masking and number of pixels per batch, the smallest number of
+	/// calculations per batch at which the fft calculator was measured to be
+	/// faster. Entries are measured by EnergyCalculatorContainer::Calibrate(),
+	/// and looked up by EnergyCalculatorContainer::Get().
+	///
+	class EnergyCalculatorCrossoverTable
+	{
+	public:
+		/// crossoverCalculations value of entries for which the fft
+		/// calculator was never measured to be faster.
+		static const int CROSSOVER_NEVER = -1;
+
+		struct Entry
+		{
+			int imagePixels;
+			bool aMasked;
+			int batchPixels;
+			int crossoverCalculations;
+		};
+
+		inline bool IsEmpty() const { return m_entries.empty(); }
+		void Add(const Entry& entry);
+
+		/// Finds the entry nearest to the image size, and then to the batch
+		/// pixels, preferring entries with the same aMasked. Returns true if
+		/// numBatchCalculations has reached its crossover, i.e., if the fft
+		/// calculator should be used. Asserts that the table isn't empty.
+		bool ShouldUseFft(int imagePixels, bool aMasked, int batchPixels, int numBatchCalculations) const;
+
+		/// Replaces the entries with the file's. Returns false, leaving the
+		/// table empty, if the file is missing, malformed or from another
+		/// version.
+		bool Load(const std::string& filePath);
+
+		/// Returns false if the file couldn't be written.
+		bool Save(const std::string& filePath) const;
+
+	private:
+		std::vector<Entry> m_entries;
+	};
+}
+
+#endif // ENABLE_ENERGY_CALCULATOR_FFT
+#endif // ENERGY_CALCULATOR_CROSSOVER_TABLE_H
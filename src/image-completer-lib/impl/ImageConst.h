@@ -26,6 +26,9 @@
 
 namespace LfnIc
 {
+	// Forward declarations
+	class ImageWorkingCopy;
+
 	///
 	/// Partially implements Image under the assumption that the image is
 	/// const. Used internally to access read-only image data, including scaled
@@ -50,6 +53,10 @@ namespace LfnIc
 		virtual int GetWidth() const = 0;
 		virtual int GetHeight() const = 0;
 
+		/// Returns the internal working copy of the image's pixels, which
+		/// the energy calculators read from.
+		virtual const ImageWorkingCopy& GetWorkingCopy() const = 0;
+
 	protected:
 		// Instances cannot be destroyed through a base Image pointer.
 		virtual ~ImageConst() {}
@@ -23,12 +23,14 @@
 #include "ImageScalable.h"
 
 #include "tech/ImageUtils.h"
+#include "ImageWorkingCopy.h"
 #include "MaskScalable.h"
 
 #include "tech/DbgMem.h"
 
 //
-// Internal Image extension. Exists to give ImageScalable destruction permission.
+// Internal Image extension. Exists to give ImageScalable destruction permission,
+// and owns the resolution's working copy.
 //
 namespace LfnIc
 {
@@ -36,6 +38,14 @@ namespace LfnIc
 	{
 	public:
 		virtual ~ImageConstInternal() {}
+
+		// Must be called once the derived class has its pixel data.
+		inline void InitWorkingCopy() { m_workingCopy.Init(*this); }
+
+		virtual const ImageWorkingCopy& GetWorkingCopy() const { return m_workingCopy; }
+
+	private:
+		ImageWorkingCopy m_workingCopy;
 	};
 }
 
@@ -243,6 +253,7 @@ LfnIc::ImageScalable::ImageScalable(const Image& image, const MaskScalable& mask
 {
 	// Delegate to original resolution Image at depth 0.
 	m_resolutions.push_back(new ImageConstDelegateToImage(image));
+	m_resolutions.back()->InitWorkingCopy();
 }
 
 LfnIc::ImageScalable::~ImageScalable()
@@ -268,6 +279,11 @@ int LfnIc::ImageScalable::GetHeight() const
 	return GetCurrentResolution().GetHeight();
 }
 
+const LfnIc::ImageWorkingCopy& LfnIc::ImageScalable::GetWorkingCopy() const
+{
+	return GetCurrentResolution().GetWorkingCopy();
+}
+
 void LfnIc::ImageScalable::ScaleUp()
 {
 	wxASSERT(m_depth > 0);
@@ -296,6 +312,7 @@ void LfnIc::ImageScalable::ScaleDown()
 
 		const ImageConst& imageToScaleDown = GetCurrentResolution();
 		m_resolutions.push_back(new ImageScaledDown(imageToScaleDown, m_maskScalable));
+		m_resolutions.back()->InitWorkingCopy();
 	}
 
 	++m_depth;
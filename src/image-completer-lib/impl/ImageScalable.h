@@ -44,6 +44,7 @@ namespace LfnIc
 		virtual const Pixel* GetData() const;
 		virtual int GetWidth() const;
 		virtual int GetHeight() const;
+		virtual const ImageWorkingCopy& GetWorkingCopy() const;
 
 		virtual void ScaleUp();
 		virtual void ScaleDown();
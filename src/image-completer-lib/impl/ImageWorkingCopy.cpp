@@ -0,0 +1,95 @@
+//
+// Copyright 2010, Darren Lafreniere
+// <http://www.lafarren.com/image-completer/>
+//
+// This file is part of lafarren.com's Image Completer.
+//
+// Image Completer is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Image Completer is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Image Completer, named License.txt. If not, see
+// <http://www.gnu.org/licenses/>.
+//
+
+
+#include "Pch.h"
+#include "ImageWorkingCopy.h"
+
+#include "tech/DbgMem.h"
+
+namespace LfnIc
+{
+	// Rounds numBytes up to the next multiple of the row alignment.
+	static inline int AlignRowBytes(int numBytes)
+	{
+		return (numBytes + ImageWorkingCopy::ROW_ALIGNMENT - 1) & ~(ImageWorkingCopy::ROW_ALIGNMENT - 1);
+	}
+}
+
+LfnIc::ImageWorkingCopy::ImageWorkingCopy()
+	: m_width(0)
+	, m_height(0)
+	, m_paddedRowBytes(0)
+	, m_planarRowBytes(0)
+	, m_buffer(NULL)
+	, m_padded(NULL)
+{
+	for (int c = 0; c < Image::Pixel::NUM_CHANNELS; ++c)
+	{
+		m_planes[c] = NULL;
+	}
+}
+
+LfnIc::ImageWorkingCopy::~ImageWorkingCopy()
+{
+	delete [] m_buffer;
+}
+
+void LfnIc::ImageWorkingCopy::Init(const Image& image)
+{
+	wxCOMPILE_TIME_ASSERT((ROW_ALIGNMENT & (ROW_ALIGNMENT - 1)) == 0, RowAlignmentIsNotAPowerOfTwo);
+
+	delete [] m_buffer;
+
+	m_width = image.GetWidth();
+	m_height = image.GetHeight();
+	m_paddedRowBytes = AlignRowBytes(m_width * sizeof(PaddedPixel));
+	m_planarRowBytes = AlignRowBytes(m_width * sizeof(ChannelType));
+
+	const int paddedBytes = m_paddedRowBytes * m_height;
+	const int planeBytes = m_planarRowBytes * m_height;
+
+	// Over-allocate so that the start can be aligned. Zero everything up
+	// front, which takes care of the pad channels and row padding.
+	const int bufferBytes = paddedBytes + (planeBytes * Image::Pixel::NUM_CHANNELS) + ROW_ALIGNMENT;
+	m_buffer = new byte[bufferBytes];
+	memset(m_buffer, 0, bufferBytes);
+
+	m_padded = m_buffer + (ROW_ALIGNMENT - (reinterpret_cast<size_t>(m_buffer) & (ROW_ALIGNMENT - 1))) % ROW_ALIGNMENT;
+	for (int c = 0; c < Image::Pixel::NUM_CHANNELS; ++c)
+	{
+		m_planes[c] = m_padded + paddedBytes + (planeBytes * c);
+	}
+
+	const Image::Pixel* imagePixel = image.GetData();
+	for (int y = 0; y < m_height; ++y)
+	{
+		PaddedPixel* paddedRow = reinterpret_cast<PaddedPixel*>(m_padded + (y * m_paddedRowBytes));
+		for (int x = 0; x < m_width; ++x, ++imagePixel)
+		{
+			for (int c = 0; c < Image::Pixel::NUM_CHANNELS; ++c)
+			{
+				paddedRow[x].channel[c] = imagePixel->channel[c];
+				reinterpret_cast<ChannelType*>(m_planes[c] + (y * m_planarRowBytes))[x] = imagePixel->channel[c];
+			}
+		}
+	}
+}
@@ -0,0 +1,101 @@
+//
+// Copyright 2010, Darren Lafreniere
+// <http://www.lafarren.com/image-completer/>
+//
+// This file is part of lafarren.com's Image Completer.
+//
+// Image Completer is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Image Completer is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Image Completer, named License.txt. If not, see
+// <http://www.gnu.org/licenses/>.
+//
+
+
+#ifndef IMAGE_WORKING_COPY_H
+#define IMAGE_WORKING_COPY_H
+
+#include "tech/Core.h"
+#include "LfnIcImage.h"
+
+namespace LfnIc
+{
+	///
+	/// Internal copy of an image's pixels, laid out for the energy
+	/// calculators. The pixels are stored in two forms:
+	///
+	/// - Padded: each pixel is padded to NUM_PADDED_CHANNELS channels (RGBX
+	///   for 24 bit rgb images), so that whole pixels map onto vector lanes.
+	///
+	/// - Planar: one plane per channel, so that a single channel can be
+	///   read with unit stride.
+	///
+	/// Every row of both forms starts on a ROW_ALIGNMENT byte boundary. Pad
+	/// channels and the space between the end of a row and the start of the
+	/// next are zero.
+	///
+	class ImageWorkingCopy
+	{
+	public:
+		typedef Image::Pixel::ChannelType ChannelType;
+
+		/// A cache line, and the width of the widest vector load.
+		static const int ROW_ALIGNMENT = 64;
+
+		/// The channel count rounded up to a multiple of four.
+		static const int NUM_PADDED_CHANNELS = (Image::Pixel::NUM_CHANNELS + 3) & ~3;
+
+		struct PaddedPixel
+		{
+			ChannelType channel[NUM_PADDED_CHANNELS];
+		};
+
+		ImageWorkingCopy();
+		~ImageWorkingCopy();
+
+		/// Copies the image's pixels into both forms, replacing any previous
+		/// contents.
+		void Init(const Image& image);
+
+		inline int GetWidth() const { return m_width; }
+		inline int GetHeight() const { return m_height; }
+
+		/// Returns the first pixel of padded row y.
+		inline const PaddedPixel* GetPaddedRow(int y) const
+		{
+			return reinterpret_cast<const PaddedPixel*>(m_padded + (y * m_paddedRowBytes));
+		}
+
+		/// Returns the first value of row y in the channel's plane.
+		inline const ChannelType* GetPlanarRow(int channel, int y) const
+		{
+			return reinterpret_cast<const ChannelType*>(m_planes[channel] + (y * m_planarRowBytes));
+		}
+
+	private:
+		// Hide copy constructor and assignment.
+		ImageWorkingCopy(const ImageWorkingCopy&);
+		ImageWorkingCopy& operator=(const ImageWorkingCopy&);
+
+		int m_width;
+		int m_height;
+		int m_paddedRowBytes;
+		int m_planarRowBytes;
+
+		// Single allocation holding the padded image followed by the planes.
+		// m_padded and m_planes point at aligned addresses within it.
+		byte* m_buffer;
+		byte* m_padded;
+		byte* m_planes[Image::Pixel::NUM_CHANNELS];
+	};
+}
+
+#endif
@@ -70,6 +70,15 @@ int LfnIc::LabelSet::size() const
 	return GetCurrentResolution().labels.size();
 }
 
+bool LfnIc::LabelSet::Contains(int left, int top) const
+{
+	const LabelBitArray& labelBitArray = GetCurrentResolution().labelBitArray;
+	return
+		left >= 0 && top >= 0 &&
+		left < labelBitArray.GetWidth() && top < labelBitArray.GetHeight() &&
+		labelBitArray.IsSet(left, top);
+}
+
 void LfnIc::LabelSet::ScaleUp()
 {
 	wxASSERT(m_depth > 0);
@@ -61,6 +61,10 @@ namespace LfnIc
 		const Label& operator[](int i) const;
 		int size() const;
 
+		/// Returns true if the current resolution's set has the label at
+		/// left, top. Coordinates outside of the image return false.
+		bool Contains(int left, int top) const;
+
 		/// Scalable interface
 		virtual void ScaleUp();
 		virtual void ScaleDown();
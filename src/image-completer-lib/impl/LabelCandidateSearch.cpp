@@ -0,0 +1,249 @@
+//
+// Copyright 2010, Darren Lafreniere
+// <http://www.lafarren.com/image-completer/>
+//
+// This file is part of lafarren.com's Image Completer.
+//
+// Image Completer is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Image Completer is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Image Completer, named License.txt. If not, see
+// <http://www.gnu.org/licenses/>.
+//
+
+#include "Pch.h"
+#include "LabelCandidateSearch.h"
+
+#include "tech/Profile.h"
+
+#include "LfnIcSettings.h"
+#include "NodeSet.h"
+
+#include "tech/DbgMem.h"
+
+namespace LfnIc
+{
+	// The number of propagation and random search iterations after seeding.
+	const int LABEL_CANDIDATE_SEARCH_ITERATIONS = 4;
+}
+
+//
+// LabelCandidateSearch implementation
+//
+LfnIc::LabelCandidateSearch::LabelCandidateSearch(const Settings& settings, const LabelSet& labelSet, NodeSet& nodeSet) :
+m_settings(settings),
+m_labelSet(labelSet),
+m_nodeSet(nodeSet),
+m_candidatesPerNode(std::max(settings.candidateLabelsPerNode, settings.postPruneLabelsMax)),
+m_labelLeftMax(0),
+m_labelTopMax(0),
+m_randomState(0x9e3779b9),
+m_calculationNum(0)
+{
+}
+
+void LfnIc::LabelCandidateSearch::Run()
+{
+	TECH_TIME_PROFILE("LfnIc::LabelCandidateSearch::Run");
+
+	const int nodeNum = m_nodeSet.size();
+	const int labelNum = m_labelSet.size();
+	if (nodeNum == 0 || labelNum <= m_candidatesPerNode || m_nodeSet[0].HasOwnLabelSet())
+	{
+		return;
+	}
+
+	for (int i = 0; i < labelNum; ++i)
+	{
+		const Label& label = m_labelSet[i];
+		m_labelLeftMax = std::max(m_labelLeftMax, int(label.left));
+		m_labelTopMax = std::max(m_labelTopMax, int(label.top));
+	}
+
+	m_candidates.resize(nodeNum * m_candidatesPerNode);
+	m_candidateNums.assign(nodeNum, 0);
+	m_calculationNum = 0;
+
+	for (int i = 0; i < nodeNum; ++i)
+	{
+		wxASSERT(!m_nodeSet[i].HasOwnLabelSet());
+		Seed(i);
+	}
+
+	// The node set is in Hilbert curve order, so visiting it in index
+	// order propagates good candidates along the curve, and the reverse
+	// order carries them back.
+	for (int iteration = 0; iteration < LABEL_CANDIDATE_SEARCH_ITERATIONS; ++iteration)
+	{
+		if ((iteration & 1) == 0)
+		{
+			for (int i = 0; i < nodeNum; ++i)
+			{
+				Visit(i);
+			}
+		}
+		else
+		{
+			for (int i = nodeNum; --i >= 0; )
+			{
+				Visit(i);
+			}
+		}
+	}
+
+	std::vector<Label> labels;
+	labels.reserve(m_candidatesPerNode);
+	for (int i = 0; i < nodeNum; ++i)
+	{
+		const Candidate* candidates = GetCandidates(i);
+		labels.clear();
+		for (int j = 0, n = m_candidateNums[i]; j < n; ++j)
+		{
+			labels.push_back(candidates[j].label);
+		}
+
+		m_nodeSet[i].SetCandidateLabels(labels);
+	}
+
+	std::cout << "Searched for " << m_candidatesPerNode << " candidate labels per node with " << m_calculationNum << " energy calculations, rather than " << (int64(nodeNum) * int64(labelNum)) << " for every label." << std::endl;
+}
+
+void LfnIc::LabelCandidateSearch::Seed(int nodeIndex)
+{
+	const Label* neighborLabels[NumNeighborEdges] = { NULL };
+	for (int i = 0; i < m_candidatesPerNode; ++i)
+	{
+		TryLabel(nodeIndex, m_labelSet[GetRandom(m_labelSet.size())], neighborLabels);
+	}
+}
+
+void LfnIc::LabelCandidateSearch::Visit(int nodeIndex)
+{
+	const Node& node = m_nodeSet[nodeIndex];
+	const Label* neighborLabels[NumNeighborEdges];
+	GetNeighborLabels(nodeIndex, neighborLabels);
+
+	// The neighbors' best candidates may have changed since the energies
+	// were calculated.
+	Candidate* candidates = GetCandidates(nodeIndex);
+	const int candidateNum = m_candidateNums[nodeIndex];
+	for (int i = 0; i < candidateNum; ++i)
+	{
+		candidates[i].energy = node.CalculateCandidateEnergy(candidates[i].label, neighborLabels, ENERGY_MAX);
+		++m_calculationNum;
+	}
+
+	for (int i = 1; i < candidateNum; ++i)
+	{
+		const Candidate candidate = candidates[i];
+		int j = i;
+		for (; j > 0 && candidates[j - 1].energy > candidate.energy; --j)
+		{
+			candidates[j] = candidates[j - 1];
+		}
+
+		candidates[j] = candidate;
+	}
+
+	// Propagation: a neighbor's candidate, shifted by the offset between the
+	// nodes, continues the same source region across the edge.
+	for (int edge = 0; edge < NumNeighborEdges; ++edge)
+	{
+		const Node* neighbor = node.GetNeighbor(NeighborEdge(edge));
+		if (neighbor)
+		{
+			const int offsetX = node.GetLeft() - neighbor->GetLeft();
+			const int offsetY = node.GetTop() - neighbor->GetTop();
+			const int neighborIndex = neighbor->GetIndex();
+			const Candidate* neighborCandidates = GetCandidates(neighborIndex);
+			for (int i = 0, n = m_candidateNums[neighborIndex]; i < n; ++i)
+			{
+				const int left = neighborCandidates[i].label.left + offsetX;
+				const int top = neighborCandidates[i].label.top + offsetY;
+				if (m_labelSet.Contains(left, top))
+				{
+					TryLabel(nodeIndex, Label(left, top), neighborLabels);
+				}
+			}
+		}
+	}
+
+	// Random search: the widest window is the whole label set, so it's
+	// sampled directly. The narrower windows are centered on the best
+	// candidate, and halve in size each time.
+	TryLabel(nodeIndex, m_labelSet[GetRandom(m_labelSet.size())], neighborLabels);
+	for (int radius = std::max(m_labelLeftMax, m_labelTopMax) / 2; radius >= 1; radius /= 2)
+	{
+		const Label& best = candidates[0].label;
+		const int left = std::min(std::max(best.left + GetRandom((radius * 2) + 1) - radius, 0), m_labelLeftMax);
+		const int top = std::min(std::max(best.top + GetRandom((radius * 2) + 1) - radius, 0), m_labelTopMax);
+		if (m_labelSet.Contains(left, top))
+		{
+			TryLabel(nodeIndex, Label(left, top), neighborLabels);
+		}
+	}
+}
+
+void LfnIc::LabelCandidateSearch::GetNeighborLabels(int nodeIndex, const Label* outNeighborLabels[NumNeighborEdges]) const
+{
+	const Node& node = m_nodeSet[nodeIndex];
+	for (int edge = 0; edge < NumNeighborEdges; ++edge)
+	{
+		const Node* neighbor = node.GetNeighbor(NeighborEdge(edge));
+		const int neighborIndex = neighbor ? neighbor->GetIndex() : -1;
+		outNeighborLabels[edge] = (neighbor && m_candidateNums[neighborIndex] > 0)
+			? &GetCandidates(neighborIndex)[0].label
+			: NULL;
+	}
+}
+
+void LfnIc::LabelCandidateSearch::TryLabel(int nodeIndex, const Label& label, const Label* const neighborLabels[NumNeighborEdges])
+{
+	Candidate* candidates = GetCandidates(nodeIndex);
+	int& candidateNum = m_candidateNums[nodeIndex];
+	for (int i = 0; i < candidateNum; ++i)
+	{
+		if (candidates[i].label == label)
+		{
+			return;
+		}
+	}
+
+	const bool isFull = (candidateNum == m_candidatesPerNode);
+	const Energy bound = isFull ? candidates[candidateNum - 1].energy : ENERGY_MAX;
+	const Energy energy = m_nodeSet[nodeIndex].CalculateCandidateEnergy(label, neighborLabels, bound);
+	++m_calculationNum;
+	if (energy >= bound)
+	{
+		return;
+	}
+
+	// Insert in order, dropping the worst candidate if the set is full.
+	int i = isFull ? (candidateNum - 1) : candidateNum++;
+	for (; i > 0 && candidates[i - 1].energy > energy; --i)
+	{
+		candidates[i] = candidates[i - 1];
+	}
+
+	candidates[i].label = label;
+	candidates[i].energy = energy;
+}
+
+int LfnIc::LabelCandidateSearch::GetRandom(int n)
+{
+	wxASSERT(n > 0);
+
+	// xorshift32
+	m_randomState ^= m_randomState << 13;
+	m_randomState ^= m_randomState >> 17;
+	m_randomState ^= m_randomState << 5;
+	return int(m_randomState % uint32(n));
+}
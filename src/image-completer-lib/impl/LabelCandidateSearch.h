@@ -0,0 +1,118 @@
+//
+// Copyright 2010, Darren Lafreniere
+// <http://www.lafarren.com/image-completer/>
+//
+// This file is part of lafarren.com's Image Completer.
+//
+// Image Completer is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Image Completer is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Image Completer, named License.txt. If not, see
+// <http://www.gnu.org/licenses/>.
+//
+
+#ifndef LABEL_CANDIDATE_SEARCH_H
+#define LABEL_CANDIDATE_SEARCH_H
+
+#include "Label.h"
+#include "LfnIcTypes.h"
+#include "NeighborEdge.h"
+
+namespace LfnIc
+{
+	// Forward declarations
+	class NodeSet;
+	struct Settings;
+
+	///
+	/// Before the first Priority-BP run, replaces the global label set of
+	/// each node with a small set of candidate labels, found with a
+	/// randomized, PatchMatch-style search:
+	/// http://gfx.cs.princeton.edu/pubs/Barnes_2009_PAR/
+	///
+	/// Each node keeps its candidates with the lowest energy: the energy
+	/// against the node's own masked patch, plus the overlap energy against
+	/// each neighbor's best candidate. After random seeding, each iteration
+	/// visits the nodes, alternating direction, and tries the neighbors'
+	/// candidates shifted by the lattice offset (propagation), then labels at
+	/// exponentially decreasing distances from the node's best candidate
+	/// (random search).
+	///
+	class LabelCandidateSearch
+	{
+	public:
+		LabelCandidateSearch(const Settings& settings, const LabelSet& labelSet, NodeSet& nodeSet);
+
+		/// Searches for settings.candidateLabelsPerNode candidates, or at
+		/// least settings.postPruneLabelsMax, and sets them as each node's
+		/// labels. Does nothing if the nodes already have their own label
+		/// sets, or if the global label set isn't any larger.
+		void Run();
+
+	private:
+		//
+		// Internal definitions
+		//
+		struct Candidate
+		{
+			Label label;
+			Energy energy;
+		};
+
+		//
+		// Internal methods
+		//
+
+		// Tries random labels, without any neighbor energies.
+		void Seed(int nodeIndex);
+
+		// Rescores the node's candidates against its neighbors' current best
+		// candidates, then propagates and searches for better ones.
+		void Visit(int nodeIndex);
+
+		// Stores the best candidate label of each of the node's neighbors
+		// into outNeighborLabels, or NULL for neighbors without any.
+		void GetNeighborLabels(int nodeIndex, const Label* outNeighborLabels[NumNeighborEdges]) const;
+
+		// Adds the label to the node's candidates if it isn't one yet, and
+		// it has a lower energy than the worst of a full set.
+		void TryLabel(int nodeIndex, const Label& label, const Label* const neighborLabels[NumNeighborEdges]);
+
+		// Returns a pseudo-random number in [0, n). Deterministic, so that
+		// the search is repeatable.
+		int GetRandom(int n);
+
+		inline Candidate* GetCandidates(int nodeIndex) { return &m_candidates[nodeIndex * m_candidatesPerNode]; }
+		inline const Candidate* GetCandidates(int nodeIndex) const { return &m_candidates[nodeIndex * m_candidatesPerNode]; }
+
+		//
+		// Data
+		//
+		const Settings& m_settings;
+		const LabelSet& m_labelSet;
+		NodeSet& m_nodeSet;
+		const int m_candidatesPerNode;
+
+		// m_candidatesPerNode per node, of which the first m_candidateNums
+		// are valid, sorted in ascending order of energy.
+		std::vector<Candidate> m_candidates;
+		std::vector<int> m_candidateNums;
+
+		// The largest label coordinates, which bound the random search.
+		int m_labelLeftMax;
+		int m_labelTopMax;
+
+		uint32 m_randomState;
+		int64 m_calculationNum;
+	};
+}
+
+#endif
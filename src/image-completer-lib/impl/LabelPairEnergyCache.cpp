@@ -0,0 +1,189 @@
+//
+// Copyright 2010, Darren Lafreniere
+// <http://www.lafarren.com/image-completer/>
+//
+// This file is part of lafarren.com's Image Completer.
+//
+// Image Completer is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Image Completer is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Image Completer, named License.txt. If not, see
+// <http://www.gnu.org/licenses/>.
+//
+
+#include "Pch.h"
+#include "LabelPairEnergyCache.h"
+
+#include "CacheBudget.h"
+#include "Label.h"
+
+#include "tech/DbgMem.h"
+
+//
+// LabelPairEnergyCache implementation
+//
+LfnIc::LabelPairEnergyCache::Shard::Shard() :
+isOverBudget(false),
+useClock(0),
+lookupNum(0),
+hitNum(0)
+{
+}
+
+LfnIc::LabelPairEnergyCache::LabelPairEnergyCache()
+{
+	wxCOMPILE_TIME_ASSERT(SET_NUM % SHARD_NUM == 0, SetsMustDivideIntoShards);
+}
+
+bool LfnIc::LabelPairEnergyCache::Lookup(const Label& a, const Label& b, Energy& outEnergy)
+{
+	const uint64 key = GetKey(a, b);
+	int setEntryIndex;
+	Shard& shard = GetShard(key, setEntryIndex);
+
+	wxMutexLocker lock(shard.mutex);
+	++shard.lookupNum;
+
+	bool result = false;
+	if (!shard.entries.empty())
+	{
+		Entry* set = &shard.entries[setEntryIndex];
+		for (int i = 0; i < WAY_NUM; ++i)
+		{
+			Entry& entry = set[i];
+			if (entry.key == key)
+			{
+				entry.lastUse = ++shard.useClock;
+				outEnergy = entry.energy;
+				++shard.hitNum;
+				result = true;
+				break;
+			}
+		}
+	}
+
+	return result;
+}
+
+void LfnIc::LabelPairEnergyCache::Store(const Label& a, const Label& b, Energy energy, CacheBudget& budget)
+{
+	const uint64 key = GetKey(a, b);
+	int setEntryIndex;
+	Shard& shard = GetShard(key, setEntryIndex);
+
+	wxMutexLocker lock(shard.mutex);
+	if (shard.entries.empty() && !shard.isOverBudget)
+	{
+		if (budget.Reserve(GetShardNumBytes()))
+		{
+			Entry entryEmpty;
+			entryEmpty.key = KEY_EMPTY;
+			entryEmpty.energy = ENERGY_MIN;
+			entryEmpty.lastUse = 0;
+			shard.entries.assign(SHARD_SET_NUM * WAY_NUM, entryEmpty);
+		}
+		else
+		{
+			shard.isOverBudget = true;
+		}
+	}
+
+	if (!shard.entries.empty())
+	{
+		// Replace the pair's entry if it's already cached, and otherwise the
+		// least recently used one. Empty entries were never used.
+		Entry* set = &shard.entries[setEntryIndex];
+		Entry* replaced = &set[0];
+		for (int i = 0; i < WAY_NUM; ++i)
+		{
+			Entry& entry = set[i];
+			if (entry.key == key)
+			{
+				replaced = &entry;
+				break;
+			}
+
+			if (entry.lastUse < replaced->lastUse)
+			{
+				replaced = &entry;
+			}
+		}
+
+		replaced->key = key;
+		replaced->energy = energy;
+		replaced->lastUse = ++shard.useClock;
+	}
+}
+
+void LfnIc::LabelPairEnergyCache::Clear(CacheBudget& budget)
+{
+	for (int i = 0; i < SHARD_NUM; ++i)
+	{
+		Shard& shard = m_shards[i];
+		wxMutexLocker lock(shard.mutex);
+		if (!shard.entries.empty())
+		{
+			budget.Release(GetShardNumBytes());
+
+			// Swap to actually release the memory.
+			std::vector<Entry>().swap(shard.entries);
+		}
+
+		shard.isOverBudget = false;
+		shard.useClock = 0;
+		shard.lookupNum = 0;
+		shard.hitNum = 0;
+	}
+}
+
+int64 LfnIc::LabelPairEnergyCache::GetLookupNum() const
+{
+	int64 lookupNum = 0;
+	for (int i = 0; i < SHARD_NUM; ++i)
+	{
+		lookupNum += m_shards[i].lookupNum;
+	}
+
+	return lookupNum;
+}
+
+int64 LfnIc::LabelPairEnergyCache::GetHitNum() const
+{
+	int64 hitNum = 0;
+	for (int i = 0; i < SHARD_NUM; ++i)
+	{
+		hitNum += m_shards[i].hitNum;
+	}
+
+	return hitNum;
+}
+
+uint64 LfnIc::LabelPairEnergyCache::GetKey(const Label& a, const Label& b)
+{
+	const uint32 packedA = (uint32(uint16(a.left)) << 16) | uint32(uint16(a.top));
+	const uint32 packedB = (uint32(uint16(b.left)) << 16) | uint32(uint16(b.top));
+	return (packedA < packedB)
+		? ((uint64(packedA) << 32) | packedB)
+		: ((uint64(packedB) << 32) | packedA);
+}
+
+LfnIc::LabelPairEnergyCache::Shard& LfnIc::LabelPairEnergyCache::GetShard(uint64 key, int& outSetEntryIndex)
+{
+	// Fibonacci hashing, so that nearby labels spread over the sets.
+	const int set = int((key * 11400714819323198485ULL) >> (64 - SET_NUM_LOG2));
+	outSetEntryIndex = (set / SHARD_NUM) * WAY_NUM;
+	return m_shards[set % SHARD_NUM];
+}
+
+int64 LfnIc::LabelPairEnergyCache::GetShardNumBytes() const
+{
+	return int64(SHARD_SET_NUM) * int64(WAY_NUM) * int64(sizeof(Entry));
+}
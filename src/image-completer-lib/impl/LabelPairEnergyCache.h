@@ -0,0 +1,130 @@
+//
+// Copyright 2010, Darren Lafreniere
+// <http://www.lafarren.com/image-completer/>
+//
+// This file is part of lafarren.com's Image Completer.
+//
+// Image Completer is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Image Completer is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Image Completer, named License.txt. If not, see
+// <http://www.gnu.org/licenses/>.
+//
+
+#ifndef LABEL_PAIR_ENERGY_CACHE_H
+#define LABEL_PAIR_ENERGY_CACHE_H
+
+#include <wx/thread.h>
+
+#include "LfnIcTypes.h"
+
+namespace LfnIc
+{
+	// Forward declarations
+	class CacheBudget;
+	struct Label;
+
+	///
+	/// Caches the energies between the whole patches of two labels, keyed by
+	/// the unordered label pair, so that the label similarity filter of a
+	/// node's first pruning doesn't recalculate the pairs that other nodes
+	/// already compared. Neighboring nodes tend to keep the same popular
+	/// labels, so many of the pairs are repeated across the lattice.
+	///
+	/// The cache is a fixed size, set associative cache, and evicts the least
+	/// recently used energy of a full set. Its sets are split into shards,
+	/// each with its own lock, so that it can be shared by concurrently
+	/// pruned nodes.
+	///
+	/// The energies are stored as calculated, so the cache must only be
+	/// shared by calculations with the same bound, and must be cleared when
+	/// the labels change resolution.
+	///
+	class LabelPairEnergyCache
+	{
+	public:
+		LabelPairEnergyCache();
+
+		/// Returns true and the cached energy if the pair's energy is cached.
+		bool Lookup(const Label& a, const Label& b, Energy& outEnergy);
+
+		/// Caches the pair's energy. A shard's memory is reserved from budget
+		/// when it's first stored into; if it doesn't fit, nothing is cached
+		/// by the shard.
+		void Store(const Label& a, const Label& b, Energy energy, CacheBudget& budget);
+
+		/// Empties the cache, releases its bytes to budget, and resets the
+		/// statistics.
+		void Clear(CacheBudget& budget);
+
+		/// Statistics since the last Clear(). Must not be called while the
+		/// cache is in use by other threads.
+		int64 GetLookupNum() const;
+		int64 GetHitNum() const;
+
+	private:
+		//
+		// Internal definitions
+		//
+		static const int SET_NUM_LOG2 = 14;
+		static const int SET_NUM = 1 << SET_NUM_LOG2;
+		static const int WAY_NUM = 4;
+		static const int SHARD_NUM = 64;
+		static const int SHARD_SET_NUM = SET_NUM / SHARD_NUM;
+
+		static const uint64 KEY_EMPTY = ~uint64(0);
+
+		struct Entry
+		{
+			uint64 key;
+			Energy energy;
+
+			// The shard's use clock as of the entry's last lookup or store.
+			uint32 lastUse;
+		};
+
+		struct Shard
+		{
+			Shard();
+
+			wxMutex mutex;
+
+			// SHARD_SET_NUM sets of WAY_NUM entries, or empty if the shard
+			// hasn't been stored into, or didn't fit in the budget.
+			std::vector<Entry> entries;
+			bool isOverBudget;
+
+			uint32 useClock;
+			int64 lookupNum;
+			int64 hitNum;
+		};
+
+		//
+		// Internal methods
+		//
+
+		// Returns the unordered pair's key.
+		static uint64 GetKey(const Label& a, const Label& b);
+
+		// Returns the key's shard, and the index of the first entry of its
+		// set within the shard.
+		Shard& GetShard(uint64 key, int& outSetEntryIndex);
+
+		int64 GetShardNumBytes() const;
+
+		//
+		// Data
+		//
+		Shard m_shards[SHARD_NUM];
+	};
+}
+
+#endif
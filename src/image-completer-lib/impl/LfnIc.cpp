@@ -23,6 +23,7 @@
 #include "LfnIc.h"
 
 #include "tech/Profile.h"
+#include "tech/ThreadPool.h"
 
 #include "Compositor.h"
 #include "EnergyCalculatorContainer.h"
@@ -32,6 +33,7 @@
 #include "NodeSet.h"
 #include "Patch.h"
 #include "LfnIcImage.h"
+#include "PriorityBpCheckpoint.h"
 #include "PriorityBpRunner.h"
 #include "ScalableDebugging.h"
 #include "SettingsScalable.h"
@@ -84,16 +86,9 @@ namespace LfnIc
 		return result;
 	}
 
-	void RecurivelyRunFromLowestToNextHighestResolution(
-		SettingsScalable& settingsScalable,
-		ImageScalable& imageScalable,
-		MaskScalable& maskScalable,
-		EnergyCalculatorContainer& energyCalculatorContainer,
-		LabelSet& labelSet,
-		NodeSet& nodeSet,
-		PriorityBpRunner& priorityBpRunner,
-		const std::string& highResOutputFilePath,
-		int pass)
+	// Returns true if the resolution below the current one (i.e., the one
+	// that would be the pass'th low resolution pass) should be evaluated.
+	static bool ShouldEvaluateLowerResolution(const Settings& settings, int currentImageWidth, int currentImageHeight, int pass)
 	{
 		// Patch and image side dimensions are reduced by half at each lower
 		// resolution. Patch cannot reduce lower than LOW_RES_PATCH_SIDE_MIN,
@@ -101,28 +96,80 @@ namespace LfnIc
 		const int LOW_RES_PATCH_SIDE_MIN = Settings::PATCH_SIDE_MIN / 2;
 		const int IMAGE_SIDE_REDUCTION_MIN = 50;
 
-		bool shouldEvaluateThisResolution = false;
+		bool shouldEvaluate = false;
+
+		// If lowResolutionPassesMax is LOW_RESOLUTION_PASSES_AUTO, then
+		// only stop once we've hit a too-low resolution. If
+		// lowResolutionPassesMax is valid, stop if this pass has exceeded
+		// that max.
+		if (settings.lowResolutionPassesMax == Settings::LOW_RESOLUTION_PASSES_AUTO || pass <= settings.lowResolutionPassesMax)
+		{
+			// Calculate the patch and image
+			const int patchWidth = settings.patchWidth / 2;
+			const int patchHeight = settings.patchHeight / 2;
+			const int imageWidth = currentImageWidth / 2;
+			const int imageHeight = currentImageHeight / 2;
+
+			shouldEvaluate =
+				patchWidth >= LOW_RES_PATCH_SIDE_MIN &&
+				patchHeight >= LOW_RES_PATCH_SIDE_MIN &&
+				imageWidth >= IMAGE_SIDE_REDUCTION_MIN &&
+				imageHeight >= IMAGE_SIDE_REDUCTION_MIN;
+		}
+
+		return shouldEvaluate;
+	}
+
+	// Restores the checkpoint if it's at the node set's resolution. Returns
+	// false if Priority-BP doesn't need to run at this resolution, because
+	// the checkpoint is from a higher one, or the checkpoint's run was
+	// complete.
+	static bool ResumeFromCheckpoint(PriorityBpCheckpoint* checkpoint, NodeSet& nodeSet, PriorityBpRunner& priorityBpRunner)
+	{
+		bool shouldRun = true;
+
+		if (checkpoint && checkpoint->CanResume())
 		{
-			// If lowResolutionPassesMax is LOW_RESOLUTION_PASSES_AUTO, then
-			// only stop once we've hit a too-low resolution. If
-			// lowResolutionPassesMax is valid, stop if this pass has exceeded
-			// that max.
-			if (settingsScalable.lowResolutionPassesMax == Settings::LOW_RESOLUTION_PASSES_AUTO || pass <= settingsScalable.lowResolutionPassesMax)
+			const int depth = nodeSet.GetScaleDepth();
+			if (depth > checkpoint->GetResumeDepth())
+			{
+				shouldRun = false;
+			}
+			else if (depth == checkpoint->GetResumeDepth())
 			{
-				// Calculate the patch and image
-				const int patchWidth = settingsScalable.patchWidth / 2;
-				const int patchHeight = settingsScalable.patchHeight / 2;
-				const int imageWidth = imageScalable.GetWidth() / 2;
-				const int imageHeight = imageScalable.GetHeight() / 2;
-
-				shouldEvaluateThisResolution =
-					patchWidth >= LOW_RES_PATCH_SIDE_MIN &&
-					patchHeight >= LOW_RES_PATCH_SIDE_MIN &&
-					imageWidth >= IMAGE_SIDE_REDUCTION_MIN &&
-					imageHeight >= IMAGE_SIDE_REDUCTION_MIN;
+				if (checkpoint->Resume(nodeSet))
+				{
+					std::cout << "Resumed from the Priority-BP checkpoint at depth " << depth << ", after " << checkpoint->GetResumeIterationsRun() << " iterations." << std::endl;
+					shouldRun = !checkpoint->IsResumeDepthComplete();
+					if (shouldRun)
+					{
+						priorityBpRunner.ResumeNextRun(checkpoint->GetResumeIterationsRun());
+					}
+				}
+				else
+				{
+					std::cout << "Couldn't read the Priority-BP checkpoint from " << PriorityBpCheckpoint::GetFilePath() << "; running depth " << depth << " from scratch." << std::endl;
+				}
 			}
 		}
 
+		return shouldRun;
+	}
+
+	void RecurivelyRunFromLowestToNextHighestResolution(
+		SettingsScalable& settingsScalable,
+		ImageScalable& imageScalable,
+		MaskScalable& maskScalable,
+		EnergyCalculatorContainer& energyCalculatorContainer,
+		LabelSet& labelSet,
+		NodeSet& nodeSet,
+		PriorityBpRunner& priorityBpRunner,
+		PriorityBpCheckpoint* checkpoint,
+		const std::string& highResOutputFilePath,
+		int pass)
+	{
+		const bool shouldEvaluateThisResolution = ShouldEvaluateLowerResolution(settingsScalable, imageScalable.GetWidth(), imageScalable.GetHeight(), pass);
+
 		if (shouldEvaluateThisResolution)
 		{
 			// maskScalable MUST be scaled down after imageScalable, because
@@ -146,17 +193,27 @@ namespace LfnIc
 				labelSet,
 				nodeSet,
 				priorityBpRunner,
+				checkpoint,
 				highResOutputFilePath,
 				pass + 1);
 
-			// Run priority-bp at this resolution.
-			if (!settingsScalable.debugLowResolutionPasses)
+			// Run priority-bp at this resolution, unless a checkpoint already
+			// solved it.
+			if (ResumeFromCheckpoint(checkpoint, nodeSet, priorityBpRunner))
 			{
-				priorityBpRunner.Run();
-			}
-			else
-			{
-				ScalableDebugging::RunPriorityBp(priorityBpRunner, settingsScalable, imageScalable, maskScalable, highResOutputFilePath, pass);
+				if (!settingsScalable.debugLowResolutionPasses)
+				{
+					priorityBpRunner.Run();
+				}
+				else
+				{
+					ScalableDebugging::RunPriorityBp(priorityBpRunner, settingsScalable, imageScalable, maskScalable, highResOutputFilePath, pass);
+				}
+
+				if (checkpoint && !checkpoint->Save(nodeSet, priorityBpRunner.GetIterationsRun(), true))
+				{
+					std::cout << "Couldn't save the Priority-BP checkpoint to " << PriorityBpCheckpoint::GetFilePath() << "." << std::endl;
+				}
 			}
 		}
 	}
@@ -233,11 +290,27 @@ namespace LfnIc
 				{
 					TECH_TIME_PROFILE("ImageCompleter::Complete - Priority-BP");
 
+					// The thread pool is the completion's whole thread budget.
+					// Without USE_THREADS, everything runs on this thread.
+					wxCOMPILE_TIME_ASSERT(int(Settings::NUM_THREADS_AUTO) == int(LfnTech::ThreadPool::NUM_THREADS_AUTO), NumThreadsAutoMismatch);
+#ifdef USE_THREADS
+					LfnTech::ThreadPool threadPool(LfnTech::ThreadPool::ResolveNumThreads(settingsScalable.numThreads));
+#else
+					LfnTech::ThreadPool threadPool(1);
+#endif
+
 					// Construct priority-bp related data, passing in the required dependencies.
-					EnergyCalculatorContainer energyCalculatorContainer(settingsScalable, imageScalable, maskScalable);
+					EnergyCalculatorContainer energyCalculatorContainer(settingsScalable, threadPool, imageScalable, maskScalable);
 					LabelSet labelSet(settingsScalable, imageScalable, maskScalable);
-					NodeSet nodeSet(settingsScalable, imageScalable, maskScalable, labelSet, energyCalculatorContainer);
-					PriorityBpRunner priorityBpRunner(settingsScalable, nodeSet);
+					NodeSet nodeSet(settingsScalable, imageScalable, maskScalable, labelSet, energyCalculatorContainer, threadPool);
+					PriorityBpRunner priorityBpRunner(settingsScalable, labelSet, nodeSet, threadPool);
+
+					std::auto_ptr<PriorityBpCheckpoint> checkpoint;
+					if (!PriorityBpCheckpoint::GetFilePath().empty())
+					{
+						checkpoint.reset(new PriorityBpCheckpoint(settings, inputImage, mask));
+						priorityBpRunner.SetCheckpoint(checkpoint.get());
+					}
 
 					std::cout << "There are " << labelSet.size() << " labels." << std::endl;
 
@@ -252,10 +325,13 @@ namespace LfnIc
 						labelSet,
 						nodeSet,
 						priorityBpRunner,
+						checkpoint.get(),
 						outputImage.GetFilePath(),
 						1);
 
-					// Original resolution pass
+					// Original resolution pass. Its checkpoints are only
+					// saved within the pass; the solution is the patches.
+					ResumeFromCheckpoint(checkpoint.get(), nodeSet, priorityBpRunner);
 					priorityBpRunner.RunAndGetPatches(compositorInput.patches);
 					arePatchesValid = true;
 				}
@@ -293,4 +369,122 @@ namespace LfnIc
 
 		return result;
 	}
+
+	void SetCheckpointFilePath(const char* filePath)
+	{
+		PriorityBpCheckpoint::SetFilePath(filePath ? filePath : "");
+	}
+
+	void SetFftWisdomFilePath(const char* filePath)
+	{
+#if ENABLE_ENERGY_CALCULATOR_FFT
+		EnergyCalculatorFft::SetWisdomFilePath(filePath ? filePath : "");
+#endif
+	}
+
+	bool PrePlanFfts(const Settings& settings, int imageWidth, int imageHeight)
+	{
+		bool result = false;
+
+#if ENABLE_ENERGY_CALCULATOR_FFT
+		if (AreSettingsValid(settings) &&
+			imageWidth > 0 && imageWidth <= Settings::IMAGE_WIDTH_MAX &&
+			imageHeight > 0 && imageHeight <= Settings::IMAGE_HEIGHT_MAX)
+		{
+#ifdef USE_THREADS
+			const int numThreads = LfnTech::ThreadPool::ResolveNumThreads(settings.numThreads);
+#else
+			const int numThreads = 1;
+#endif
+
+			// Walk the resolutions the same way Complete() does, scaling
+			// the settings and image dimensions down in place.
+			SettingsScalable settingsScalable(settings);
+			result = true;
+			for (int pass = 1; ; ++pass)
+			{
+				result &= EnergyCalculatorFft::PrePlan(numThreads, imageWidth, imageHeight, settingsScalable.patchWidth, settingsScalable.patchHeight);
+				if (!ShouldEvaluateLowerResolution(settingsScalable, imageWidth, imageHeight, pass))
+				{
+					break;
+				}
+
+				settingsScalable.ScaleDown();
+				imageWidth /= 2;
+				imageHeight /= 2;
+			}
+		}
+#endif
+
+		return result;
+	}
+
+	void SetEnergyCalculatorTableFilePath(const char* filePath)
+	{
+#if ENABLE_ENERGY_CALCULATOR_FFT
+		EnergyCalculatorContainer::SetCrossoverTableFilePath(filePath ? filePath : "");
+#endif
+	}
+
+	bool CalibrateEnergyCalculators(const Settings& settings, const Image& inputImage, const Mask& mask)
+	{
+		bool result = false;
+
+#if ENABLE_ENERGY_CALCULATOR_FFT
+		const std::string tableFilePath = EnergyCalculatorContainer::GetCrossoverTableFilePath();
+		if (!tableFilePath.empty() &&
+			AreSettingsValid(settings) &&
+			ValidateImage(inputImage) &&
+			HasAnyKnownPixels(inputImage.GetWidth(), inputImage.GetHeight(), mask))
+		{
+			// See the comment in Complete().
+			wxInitializer initializer;
+			{
+				SettingsScalable settingsScalable(settings);
+				MaskScalable maskScalable(inputImage.GetWidth(), inputImage.GetHeight(), mask);
+				ImageScalable imageScalable(inputImage, maskScalable);
+
+#ifdef USE_THREADS
+				LfnTech::ThreadPool threadPool(LfnTech::ThreadPool::ResolveNumThreads(settingsScalable.numThreads));
+#else
+				LfnTech::ThreadPool threadPool(1);
+#endif
+
+				// Calibrate with an empty table, and replace the file's when
+				// done.
+				EnergyCalculatorContainer::SetCrossoverTableFilePath("");
+				EnergyCalculatorCrossoverTable table;
+				{
+					EnergyCalculatorContainer energyCalculatorContainer(settingsScalable, threadPool, imageScalable, maskScalable);
+
+					// Walk the resolutions the same way Complete() does. They're
+					// never scaled back up, so the scaled down resolutions are
+					// freed along with the scalables.
+					for (int pass = 1; ; ++pass)
+					{
+						std::cout << "Calibrating the energy calculators for " << imageScalable.GetWidth() << "x" << imageScalable.GetHeight() << "." << std::endl;
+						energyCalculatorContainer.Calibrate(table);
+
+						if (!ShouldEvaluateLowerResolution(settingsScalable, imageScalable.GetWidth(), imageScalable.GetHeight(), pass))
+						{
+							break;
+						}
+
+						// maskScalable MUST be scaled down after imageScalable.
+						// See RecurivelyRunFromLowestToNextHighestResolution().
+						settingsScalable.ScaleDown();
+						imageScalable.ScaleDown();
+						maskScalable.ScaleDown();
+						energyCalculatorContainer.ScaleDown();
+					}
+				}
+
+				EnergyCalculatorContainer::SetCrossoverTableFilePath(tableFilePath);
+				result = table.Save(tableFilePath);
+			}
+		}
+#endif
+
+		return result;
+	}
 }
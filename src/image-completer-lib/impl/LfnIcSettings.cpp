@@ -43,6 +43,8 @@ const LfnIc::Belief LfnIc::Settings::CONFIDENCE_BELIEF_THRESHOLD_MAX = BELIEF_MA
 const LfnIc::Belief LfnIc::Settings::PRUNE_BELIEF_THRESHOLD_MIN = BELIEF_MIN;
 const LfnIc::Belief LfnIc::Settings::PRUNE_BELIEF_THRESHOLD_MAX = BELIEF_MAX;
 
+const LfnIc::Energy LfnIc::Settings::CONVERGENCE_ENERGY_THRESHOLD_DISABLED = -1;
+
 const LfnIc::Energy LfnIc::Settings::PRUNE_ENERGY_SIMILAR_THRESHOLD_MIN = ENERGY_MIN;
 const LfnIc::Energy LfnIc::Settings::PRUNE_ENERGY_SIMILAR_THRESHOLD_MAX = ENERGY_MAX;
 
@@ -65,6 +67,13 @@ static void SettingsConstructHelper(LfnIc::Settings& out, int latticeGapX, int l
 	out.debugLowResolutionPasses = false;
 	out.lowResolutionPassesMax = 0;
 	out.numIterations = LfnIc::Settings::NUM_ITERATIONS_DEFAULT;
+	out.convergenceEnergyThreshold = 0;
+	out.freezeStableIterations = LfnIc::Settings::FREEZE_STABLE_ITERATIONS_DISABLED;
+	out.candidateLabelsPerNode = LfnIc::Settings::CANDIDATE_LABELS_PER_NODE_DISABLED;
+	out.checkpointIterations = LfnIc::Settings::CHECKPOINT_ITERATIONS_DISABLED;
+	out.numThreads = LfnIc::Settings::NUM_THREADS_AUTO;
+	out.labelEnergyCacheMegabytesMax = LfnIc::Settings::LABEL_ENERGY_CACHE_MEGABYTES_DEFAULT;
+	out.priorityBpSchedule = LfnIc::PriorityBpScheduleDefault;
 
 	out.latticeGapX = latticeGapX;
 	out.latticeGapY = latticeGapY;
@@ -166,6 +175,18 @@ bool LfnIc::AreSettingsValid(const Settings& settings, SettingsInvalidMemberHand
 	// Perform the validation:
 	VALIDATE_NOT_LESS_THAN(lowResolutionPassesMax, Settings::LOW_RESOLUTION_PASSES_AUTO);
 	VALIDATE_NOT_LESS_THAN(numIterations, 1);
+	VALIDATE_NOT_LESS_THAN(convergenceEnergyThreshold, Settings::CONVERGENCE_ENERGY_THRESHOLD_DISABLED);
+	VALIDATE_NOT_LESS_THAN(freezeStableIterations, Settings::FREEZE_STABLE_ITERATIONS_DISABLED);
+	VALIDATE_IN_RANGE(candidateLabelsPerNode, Settings::CANDIDATE_LABELS_PER_NODE_DISABLED, Settings::CANDIDATE_LABELS_PER_NODE_MAX);
+	VALIDATE_NOT_LESS_THAN(checkpointIterations, Settings::CHECKPOINT_ITERATIONS_DISABLED);
+	VALIDATE_IN_RANGE(numThreads, Settings::NUM_THREADS_AUTO, Settings::NUM_THREADS_MAX);
+	VALIDATE_IN_RANGE(labelEnergyCacheMegabytesMax, 0, Settings::LABEL_ENERGY_CACHE_MEGABYTES_MAX);
+
+	if (settings.priorityBpSchedule <= PriorityBpScheduleInvalid || settings.priorityBpSchedule >= PriorityBpScheduleNum)
+	{
+		valid = false;
+		handler.OnInvalidMemberDetected(settings, offsetof(Settings, priorityBpSchedule), "is invalid");
+	}
 
 	VALIDATE_NOT_LESS_THAN(latticeGapX, Settings::LATTICE_GAP_MIN);
 	VALIDATE_NOT_LESS_THAN(latticeGapY, Settings::LATTICE_GAP_MIN);
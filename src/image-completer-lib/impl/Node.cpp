@@ -25,6 +25,7 @@
 #define PROFILE_MEM 0
 
 #include "tech/MathUtils.h"
+#include "tech/ThreadPool.h"
 #if PROFILE_MEM
 #include "tech/Profile.h"
 #endif
@@ -34,6 +35,7 @@
 #include "Label.h"
 #include "LfnIcSettings.h"
 #include "MaskLod.h"
+#include "PriorityBpCheckpoint.h"
 #include "ScopedNodeEnergyBatch.h"
 
 #include "tech/DbgMem.h"
@@ -54,26 +56,120 @@
 // labels to use.
 #define NODE_SCALE_UP_PICK_RANDOM_MAPPED_LABEL 0
 
+namespace LfnIc
+{
+	// TODO: move belief into LabelInfo?
+	struct PruneInfo
+	{
+		int labelIndex;
+		Belief belief;
+	};
+
+	// For sorting:
+	bool operator <(const PruneInfo& a, const PruneInfo& b)
+	{
+		// Use > to sort in descending order. Equal beliefs are ordered by
+		// label, so that the order is total, and pruning rounds can resume
+		// after the previous round's last label.
+		return (a.belief > b.belief) || (a.belief == b.belief && a.labelIndex < b.labelIndex);
+	}
+
+	// Replaces to's elements with from's. to's memory is reused, unless
+	// it's more than twice what's needed, so that refilling a vector with
+	// about as many elements doesn't allocate, while a vector that shrinks
+	// a lot doesn't hold on to its memory.
+	template<typename T>
+	void AssignReusingCapacity(std::vector<T>& to, const std::vector<T>& from)
+	{
+		if (from.size() < to.capacity() / 2)
+		{
+			std::vector<T>(from).swap(to);
+		}
+		else
+		{
+			to = from;
+		}
+	}
+}
+
+//
+// Node::Scratch implementation
+//
+struct LfnIc::Node::Scratch
+{
+	std::vector<Energy> labelEnergies;
+
+	// SendMessages()
+	std::vector<Energy> messages;
+	std::vector<Energy> qEnergies;
+	std::vector<int> qIndicesCalculated;
+	EdgeEnergyCache::Scratch edgeEnergyCache;
+
+	// PruneLabels()
+	std::vector<PruneInfo> pruneInfos;
+	LabelInfoSet labelInfoSetKept;
+	std::vector<Energy> labelEnergiesKept;
+	std::vector<int> keptIndicesUncached;
+
+	// CalculatePriority() and PruneLabels()
+	std::vector<Belief> beliefs;
+};
+
 //
 // Node implementation
 //
-LfnIc::Node::Context::Context(const Settings& settings, const LabelSet& labelSet, EnergyCalculatorContainer& energyCalculatorContainer) :
+LfnIc::Node::Context::Context(const Settings& settings, const MaskLod& mask, const LabelSet& labelSet, EnergyCalculatorContainer& energyCalculatorContainer, const LfnTech::ThreadPool& threadPool, std::vector<Node>& nodes) :
 settings(settings),
+mask(mask),
 labelSet(labelSet),
-energyCalculatorContainer(energyCalculatorContainer)
+energyCalculatorContainer(energyCalculatorContainer),
+threadPool(threadPool),
+nodes(nodes),
+cacheBudget(int64(settings.labelEnergyCacheMegabytesMax) * 1024 * 1024),
+scratches(threadPool.GetNumThreads(), NULL)
 {
+	for (int i = 0, n = scratches.size(); i < n; ++i)
+	{
+		scratches[i] = new Scratch;
+	}
 }
 
-LfnIc::Node::Node(Context& context, const MaskLod& mask, int x, int y) :
+LfnIc::Node::Context::~Context()
+{
+	labelPairEnergyCache.Clear(cacheBudget);
+
+	for (int i = 0, n = scratches.size(); i < n; ++i)
+	{
+		delete scratches[i];
+	}
+}
+
+LfnIc::Node::Scratch& LfnIc::Node::Context::GetScratch() const
+{
+	const int threadIndex = threadPool.GetCurrentThreadIndex();
+	wxASSERT(threadIndex >= 0 && threadIndex < int(scratches.size()));
+	return *scratches[threadIndex];
+}
+
+LfnIc::Node::Node(Context& context, const MaskLod& mask, int index, int x, int y) :
 m_context(&context),
+m_index(index),
+m_originalResolution(x, y),
+m_currentResolution(x, y),
 m_depth(0),
 m_overlapsKnownRegion(false),
 m_hasPrunedOnce(false)
 {
-	// Add original resolution
-	m_resolutions.push_back(Resolution(x, y));
+#if NODE_COMPACT_MESSAGES
+	wxCOMPILE_TIME_ASSERT(sizeof(LabelInfo) <= 20, CompactLabelInfoExpectedToBe20Bytes);
+#endif
 
-	memset(m_neighbors, 0, sizeof(m_neighbors));
+	for (int i = 0; i < NumNeighborEdges; ++i)
+	{
+		m_neighbors[i] = NO_NEIGHBOR;
+	}
+
+	memset(m_edges, 0, sizeof(m_edges));
 
 	// Determine m_overlapsKnownRegion
 	{
@@ -108,16 +204,28 @@ m_hasPrunedOnce(false)
 			}
 		}
 	}
+
+	wxASSERT(&mask == &m_context->mask);
+	PrecomputeKnownRegion();
 }
 
 LfnIc::Node::Node(const Node& other) :
 m_context(other.m_context),
+m_index(other.m_index),
+m_originalResolution(other.m_originalResolution),
+m_currentResolution(other.m_currentResolution),
 m_depth(other.m_depth),
 m_overlapsKnownRegion(other.m_overlapsKnownRegion),
+m_knownRegion(other.m_knownRegion),
 m_hasPrunedOnce(other.m_hasPrunedOnce)
 {
-	m_resolutions = other.m_resolutions;
 	memcpy(m_neighbors, other.m_neighbors, sizeof(m_neighbors));
+	memcpy(m_edges, other.m_edges, sizeof(m_edges));
+}
+
+int LfnIc::Node::GetIndex() const
+{
+	return m_index;
 }
 
 int LfnIc::Node::GetX() const
@@ -133,7 +241,7 @@ int LfnIc::Node::GetY() const
 bool LfnIc::Node::AddNeighbor(Node& neighbor, NeighborEdge edge)
 {
 #ifdef _DEBUG
-	wxASSERT(!m_neighbors[edge]);
+	wxASSERT(m_neighbors[edge] == NO_NEIGHBOR);
 	wxASSERT(m_labelInfoSet.size() == 0);
 
 	int edgeDirectionX = 0;
@@ -145,10 +253,11 @@ bool LfnIc::Node::AddNeighbor(Node& neighbor, NeighborEdge edge)
 
 	for (int i = 0; i < NumNeighborEdges; ++i)
 	{
-		wxASSERT(m_neighbors[i] != &neighbor);
+		wxASSERT(m_neighbors[i] != neighbor.m_index);
 	}
 #endif
-	m_neighbors[edge] = &neighbor;
+	wxASSERT(&m_context->nodes[neighbor.m_index] == &neighbor);
+	m_neighbors[edge] = neighbor.m_index;
 	return true;
 }
 
@@ -156,14 +265,15 @@ LfnIc::Node* LfnIc::Node::GetNeighbor(NeighborEdge edge) const
 {
 	wxASSERT(edge >= FirstNeighborEdge);
 	wxASSERT(edge <= LastNeighborEdge);
-	return m_neighbors[edge];
+	const int neighborIndex = m_neighbors[edge];
+	return (neighborIndex != NO_NEIGHBOR) ? &m_context->nodes[neighborIndex] : NULL;
 }
 
 LfnIc::NeighborEdge LfnIc::Node::GetNeighborEdge(const Node& neighbor) const
 {
 	for (int i = 0; i < NumNeighborEdges; ++i)
 	{
-		if (m_neighbors[i] == &neighbor)
+		if (m_neighbors[i] == neighbor.m_index)
 		{
 			return NeighborEdge(i);
 		}
@@ -173,27 +283,8 @@ LfnIc::NeighborEdge LfnIc::Node::GetNeighborEdge(const Node& neighbor) const
 	return InvalidNeighborEdge;
 }
 
-void LfnIc::Node::SendMessages(Node& neighbor) const
+void LfnIc::Node::PrecomputeEdges()
 {
-	// At this point, this node must have its own label info set.
-	wxASSERT(m_labelInfoSet.size() > 0);
-
-	// And we expect that it has been pruned.
-	wxASSERT(int(m_labelInfoSet.size()) <= m_context->settings.postPruneLabelsMax);
-
-	// Make sure the neighbor has its own label info set to store this node's messages to it.
-	neighbor.PopulateLabelInfoSetIfNeeded();
-	wxASSERT(neighbor.m_labelInfoSet.size() > 0);
-
-	// p: this node
-	// q: neighbor node
-	// r: this node's neighbors except q
-	const NeighborEdge pEdgeInQ = neighbor.GetNeighborEdge(*this);
-	const NeighborEdge qEdgeInP = this->GetNeighborEdge(neighbor);
-	wxASSERT(pEdgeInQ != InvalidNeighborEdge);
-	wxASSERT(qEdgeInP != InvalidNeighborEdge);
-
-	// Figure out overlapping region (pre-compute the result of this per neighbor?)
 	const int patchWidth = m_context->settings.patchWidth;
 	const int patchHeight = m_context->settings.patchHeight;
 
@@ -202,46 +293,72 @@ void LfnIc::Node::SendMessages(Node& neighbor) const
 	const int pRight = pLeft + patchWidth - 1;
 	const int pBottom = pTop + patchHeight - 1;
 
-	const int qLeft = neighbor.GetLeft();
-	const int qTop = neighbor.GetTop();
-	const int qRight = qLeft + patchWidth - 1;
-	const int qBottom = qTop + patchHeight - 1;
+	for (int edge = 0; edge < NumNeighborEdges; ++edge)
+	{
+		EdgeInfo& edgeInfo = m_edges[edge];
+		const Node* neighbor = GetNeighbor(NeighborEdge(edge));
+		if (!neighbor)
+		{
+			memset(&edgeInfo, 0, sizeof(edgeInfo));
+			edgeInfo.edgeInNeighbor = InvalidNeighborEdge;
+			continue;
+		}
 
-	const int overlapLeft = std::max(pLeft, qLeft);
-	const int overlapTop = std::max(pTop, qTop);
-	const int overlapRight = std::min(pRight, qRight);
-	const int overlapBottom = std::min(pBottom, qBottom);
+		const int qLeft = neighbor->GetLeft();
+		const int qTop = neighbor->GetTop();
+		const int qRight = qLeft + patchWidth - 1;
+		const int qBottom = qTop + patchHeight - 1;
+
+		const int overlapLeft = std::max(pLeft, qLeft);
+		const int overlapTop = std::max(pTop, qTop);
+		const int overlapRight = std::min(pRight, qRight);
+		const int overlapBottom = std::min(pBottom, qBottom);
+
+		edgeInfo.edgeInNeighbor = neighbor->GetNeighborEdge(*this);
+		edgeInfo.overlapWidth = overlapRight - overlapLeft + 1;
+		edgeInfo.overlapHeight = overlapBottom - overlapTop + 1;
+		edgeInfo.overlapLeftOffset = overlapLeft - pLeft;
+		edgeInfo.overlapTopOffset = overlapTop - pTop;
+		edgeInfo.neighborOverlapLeftOffset = overlapLeft - qLeft;
+		edgeInfo.neighborOverlapTopOffset = overlapTop - qTop;
+		wxASSERT(edgeInfo.edgeInNeighbor != InvalidNeighborEdge);
+	}
+}
 
-	const int overlapWidth = overlapRight - overlapLeft + 1;
-	const int overlapHeight = overlapBottom - overlapTop + 1;
-	const int pOverlapLeftOffset = overlapLeft - pLeft;
-	const int pOverlapTopOffset = overlapTop - pTop;
-	const int qOverlapLeftOffset = overlapLeft - qLeft;
-	const int qOverlapTopOffset = overlapTop - qTop;
+LfnIc::Energy LfnIc::Node::SendMessages(NeighborEdge edge) const
+{
+	Node& neighbor = *GetNeighbor(edge);
 
-	// TODO: cache this?
-	const int pLabelNum = m_labelInfoSet.size();
-	std::vector<Energy> pLabelEnergies(pLabelNum);
-	{
-		const EnergyCalculator::BatchParams energyBatchParams(pLabelNum, m_context->settings.patchWidth, m_context->settings.patchHeight, GetLeft(), GetTop(), true);
-		ScopedNodeEnergyBatchQueued energyBatch(*this, m_context->energyCalculatorContainer.Get(energyBatchParams, pLabelNum), energyBatchParams);
+	// At this point, this node must have its own label info set.
+	wxASSERT(m_labelInfoSet.size() > 0);
 
-		// Queue energy calculations
-		for (int pIndex = 0; pIndex < pLabelNum; ++pIndex)
-		{
-			const Label& label = m_labelInfoSet[pIndex].label;
-			const EnergyCalculator::BatchQueued::Handle handle = energyBatch.QueueCalculation(label.left, label.top);
-			ASSERT_NODE_ENERGY_BATCH_QUEUED_HANDLE_IS_INDEX(handle, pIndex);
-		}
+	// And we expect that it has been pruned.
+	wxASSERT(int(m_labelInfoSet.size()) <= m_context->settings.postPruneLabelsMax);
 
-		energyBatch.ProcessCalculations();
+	// The neighbor may not have its own label info set yet, in which case
+	// its labels are the global label set's.
+	const ConstNodeLabels qLabels(neighbor);
 
-		// Get and use energy calculation results
-		for (int pIndex = 0; pIndex < pLabelNum; ++pIndex)
-		{
-			pLabelEnergies[pIndex] = energyBatch.GetResult(EnergyCalculator::BatchQueued::Handle(pIndex));
-		}
-	}
+	// p: this node
+	// q: neighbor node
+	// r: this node's neighbors except q
+	const EdgeInfo& edgeInfo = m_edges[edge];
+	const NeighborEdge pEdgeInQ = edgeInfo.edgeInNeighbor;
+	const NeighborEdge qEdgeInP = edge;
+	wxASSERT(pEdgeInQ == neighbor.GetNeighborEdge(*this));
+
+	// The overlapping region, precomputed per resolution.
+	const int overlapWidth = edgeInfo.overlapWidth;
+	const int overlapHeight = edgeInfo.overlapHeight;
+	const int pOverlapLeftOffset = edgeInfo.overlapLeftOffset;
+	const int pOverlapTopOffset = edgeInfo.overlapTopOffset;
+	const int qOverlapLeftOffset = edgeInfo.neighborOverlapLeftOffset;
+	const int qOverlapTopOffset = edgeInfo.neighborOverlapTopOffset;
+
+	Scratch& scratch = m_context->GetScratch();
+	const int pLabelNum = m_labelInfoSet.size();
+	std::vector<Energy>& pLabelEnergies = scratch.labelEnergies;
+	GetLabelEnergies(pLabelEnergies);
 
 	// Send messages for every label in the neighbor's set. Keep track of the
 	// minimum message sent from p to q, to normalizing all p->q messages by
@@ -254,9 +371,27 @@ void LfnIc::Node::SendMessages(Node& neighbor) const
 	// However, because p's labels have already been pruned, the more
 	// efficient way to batch the energy calculations is to swap the loop
 	// order.
-	const int qLabelNum = neighbor.m_labelInfoSet.size();
-	std::vector<Energy> messages(qLabelNum, ENERGY_MAX);
+	const int qLabelNum = qLabels.size();
+	std::vector<Energy>& messages = scratch.messages;
+	messages.assign(qLabelNum, ENERGY_MAX);
 	Energy messagesMin = ENERGY_MAX;
+
+	// The overlap energies of label pairs that were already calculated are
+	// taken from the edge's cache, which is keyed by the current labels of
+	// both nodes, so it follows any changes to their label sets.
+	const bool pOwnsEdgeEnergyCache = OwnsEdgeEnergyCache(qEdgeInP);
+	EdgeEnergyCache& edgeEnergyCache = pOwnsEdgeEnergyCache
+		? m_edgeEnergyCaches[qEdgeInP]
+		: neighbor.m_edgeEnergyCaches[pEdgeInQ];
+	const bool isEdgeEnergyCached = pOwnsEdgeEnergyCache
+		? edgeEnergyCache.Rekey(ConstNodeLabels(*this), qLabels, m_context->cacheBudget, scratch.edgeEnergyCache)
+		: edgeEnergyCache.Rekey(qLabels, ConstNodeLabels(*this), m_context->cacheBudget, scratch.edgeEnergyCache);
+
+	std::vector<Energy>& qEnergies = scratch.qEnergies;
+	qEnergies.resize(qLabelNum);
+	std::vector<int>& qIndicesCalculated = scratch.qIndicesCalculated;
+	qIndicesCalculated.reserve(qLabelNum);
+
 	// Iterate over this node's labels to determine which should supply
 	// the message for each q, which will be the one that produces the
 	// lowest energy.
@@ -266,35 +401,80 @@ void LfnIc::Node::SendMessages(Node& neighbor) const
 		const int pOverlapLeft = pLabelInfo.label.left + pOverlapLeftOffset;
 		const int pOverlapTop = pLabelInfo.label.top + pOverlapTopOffset;
 
-		const EnergyCalculator::BatchParams energyBatchParams(qLabelNum, overlapWidth, overlapHeight, pOverlapLeft, pOverlapTop, false);
-		EnergyCalculator::BatchQueued energyBatch(m_context->energyCalculatorContainer.Get(energyBatchParams, qLabelNum), energyBatchParams);
+		// The part of the message candidates that doesn't depend on q's label.
+		Energy messageCandidateBase = pLabelEnergies[pIndex];
+		for (int r = 0; r < NumNeighborEdges; ++r)
+		{
+			if (r != qEdgeInP)
+			{
+				messageCandidateBase += LoadMessage(pLabelInfo.messages[r]);
+			}
+		}
 
-		// Queue energy calculations
+		// A candidate can only replace the current message if its overlap
+		// energy is below this bound, so the energy calculator may stop as
+		// soon as the bound is exceeded.
+		qIndicesCalculated.clear();
 		for (int qIndex = 0; qIndex < qLabelNum; ++qIndex)
 		{
-			const Label& qLabel = neighbor.m_labelInfoSet[qIndex].label;
-			const int qOverlapLeft = qLabel.left + qOverlapLeftOffset;
-			const int qOverlapTop = qLabel.top + qOverlapTopOffset;
+			const Energy bound = messages[qIndex] - messageCandidateBase;
+			const bool isAnswered = isEdgeEnergyCached && (pOwnsEdgeEnergyCache
+				? edgeEnergyCache.Lookup(pIndex, qIndex, bound, qEnergies[qIndex])
+				: edgeEnergyCache.Lookup(qIndex, pIndex, bound, qEnergies[qIndex]));
 
-			const EnergyCalculator::BatchQueued::Handle handle = energyBatch.QueueCalculation(qOverlapLeft, qOverlapTop);
-			ASSERT_ENERGY_BATCH_QUEUED_HANDLE_IS_INDEX(handle, qIndex);
+			if (!isAnswered)
+			{
+				qIndicesCalculated.push_back(qIndex);
+			}
 		}
 
-		energyBatch.ProcessCalculations();
-
-		// Get and use energy calculation results
-		for (int qIndex = 0; qIndex < qLabelNum; ++qIndex)
+		const int calculationNum = qIndicesCalculated.size();
+		if (calculationNum > 0)
 		{
-			Energy messageCandidate = pLabelEnergies[pIndex] + energyBatch.GetResult(EnergyCalculator::BatchQueued::Handle(qIndex));
+			const EnergyCalculator::BatchParams energyBatchParams(calculationNum, overlapWidth, overlapHeight, pOverlapLeft, pOverlapTop, false);
+			EnergyCalculator::BatchQueued energyBatch(m_context->energyCalculatorContainer.Get(energyBatchParams, calculationNum), energyBatchParams);
+
+			// Queue energy calculations
+			for (int i = 0; i < calculationNum; ++i)
+			{
+				const int qIndex = qIndicesCalculated[i];
+				const Label& qLabel = qLabels.GetLabel(qIndex);
+				const int qOverlapLeft = qLabel.left + qOverlapLeftOffset;
+				const int qOverlapTop = qLabel.top + qOverlapTopOffset;
+				const Energy bound = messages[qIndex] - messageCandidateBase;
+
+				const EnergyCalculator::BatchQueued::Handle handle = energyBatch.QueueCalculationBounded(qOverlapLeft, qOverlapTop, bound);
+				ASSERT_ENERGY_BATCH_QUEUED_HANDLE_IS_INDEX(handle, i);
+			}
+
+			energyBatch.ProcessCalculations();
 
-			for (int r = 0; r < NumNeighborEdges; ++r)
+			// Get and cache energy calculation results
+			for (int i = 0; i < calculationNum; ++i)
 			{
-				if (r != qEdgeInP)
+				const int qIndex = qIndicesCalculated[i];
+				const Energy bound = messages[qIndex] - messageCandidateBase;
+				const Energy energy = energyBatch.GetResult(EnergyCalculator::BatchQueued::Handle(i));
+				qEnergies[qIndex] = energy;
+
+				if (isEdgeEnergyCached)
 				{
-					messageCandidate += pLabelInfo.messages[r];
+					if (pOwnsEdgeEnergyCache)
+					{
+						edgeEnergyCache.Store(pIndex, qIndex, bound, energy);
+					}
+					else
+					{
+						edgeEnergyCache.Store(qIndex, pIndex, bound, energy);
+					}
 				}
 			}
+		}
 
+		// Use the energies
+		for (int qIndex = 0; qIndex < qLabelNum; ++qIndex)
+		{
+			const Energy messageCandidate = messageCandidateBase + qEnergies[qIndex];
 			if (messageCandidate < messages[qIndex])
 			{
 				messages[qIndex] = messageCandidate;
@@ -307,31 +487,46 @@ void LfnIc::Node::SendMessages(Node& neighbor) const
 		}
 	}
 
-	// Normalize p->q messages and assign them.
-	for (int qIndex = 0, qn = neighbor.m_labelInfoSet.size(); qIndex < qn; ++qIndex)
+	// Normalize p->q messages and assign them. Until the neighbor has its
+	// own label info set, only the messages of the edges that have sent any
+	// are stored, rather than a copy of the global label set.
+	StoredMessage* globalLabelMessages = NULL;
+	if (neighbor.m_labelInfoSet.empty())
 	{
-		Energy& message = messages[qIndex];
-		wxASSERT(message >= ENERGY_MIN && message < ENERGY_MAX);
-		message -= messagesMin;
-		neighbor.m_labelInfoSet[qIndex].messages[pEdgeInQ] = message;
+		std::vector<StoredMessage>& edgeMessages = neighbor.m_globalLabelMessages[pEdgeInQ];
+		if (edgeMessages.empty())
+		{
+			edgeMessages.resize(qLabelNum, StoreMessage(Energy(0)));
+		}
+
+		wxASSERT(int(edgeMessages.size()) == qLabelNum);
+		globalLabelMessages = &edgeMessages[0];
 	}
-}
 
-namespace LfnIc
-{
-	// TODO: move belief into LabelInfo?
-	struct PruneInfo
+	Energy messageDeltaMax = ENERGY_MIN;
+	for (int qIndex = 0; qIndex < qLabelNum; ++qIndex)
 	{
-		int labelIndex;
-		Belief belief;
-	};
+		Energy& message = messages[qIndex];
+		wxASSERT(message >= ENERGY_MIN && message < ENERGY_MAX);
+		message -= messagesMin;
 
-	// For sorting:
-	bool operator <(const PruneInfo& a, const PruneInfo& b)
-	{
-		// Use > to sort in descending order
-		return (a.belief > b.belief);
+		// The change is measured between the stored values, so that it's 0
+		// once a saturated message stops changing.
+		StoredMessage& neighborMessage = globalLabelMessages
+			? globalLabelMessages[qIndex]
+			: neighbor.m_labelInfoSet[qIndex].messages[pEdgeInQ];
+		const Energy previousMessage = LoadMessage(neighborMessage);
+		neighborMessage = StoreMessage(message);
+		message = LoadMessage(neighborMessage);
+
+		const Energy messageDelta = (message > previousMessage) ? (message - previousMessage) : (previousMessage - message);
+		if (messageDelta > messageDeltaMax)
+		{
+			messageDeltaMax = messageDelta;
+		}
 	}
+
+	return messageDeltaMax;
 }
 
 void LfnIc::Node::PruneLabels()
@@ -339,34 +534,11 @@ void LfnIc::Node::PruneLabels()
 #if PROFILE_MEM
 	TECH_MEM_PROFILE("LfnIc::Node::PruneLabels");
 #endif
+	Scratch& scratch = m_context->GetScratch();
 	ConstNodeLabels labelSet(*this);
 	const int labelNum = labelSet.size();
-	std::vector<PruneInfo> pruneInfos(labelNum);
-
-	{
-		const EnergyCalculator::BatchParams energyBatchParams(labelNum, m_context->settings.patchWidth, m_context->settings.patchHeight, GetLeft(), GetTop(), true);
-		ScopedNodeEnergyBatchQueued energyBatch(*this, m_context->energyCalculatorContainer.Get(energyBatchParams, labelNum), energyBatchParams);
-
-		// Queue energy calculations
-		for (int i = 0; i < labelNum; ++i)
-		{
-			const Label& label = labelSet.GetLabel(i);
-			const EnergyCalculator::BatchQueued::Handle handle = energyBatch.QueueCalculation(label.left, label.top);
-			ASSERT_NODE_ENERGY_BATCH_QUEUED_HANDLE_IS_INDEX(handle, i);
-		}
-
-		energyBatch.ProcessCalculations();
-
-		// Get and use energy calculation results
-		for (int i = 0; i < labelNum; ++i)
-		{
-			pruneInfos[i].labelIndex = i;
-			pruneInfos[i].belief = CalculateBelief(energyBatch.GetResult(EnergyCalculator::BatchQueued::Handle(i)), labelSet.GetMessages(i));
-		}
-	}
-
-	// Sort pruneInfos by belief
-	sort(pruneInfos.begin(), pruneInfos.end());
+	std::vector<Energy>& labelEnergies = scratch.labelEnergies;
+	GetLabelEnergies(labelEnergies);
 
 	// Perform the pruning
 	{
@@ -376,68 +548,161 @@ void LfnIc::Node::PruneLabels()
 		const int pruneBeliefThreshold = m_context->settings.pruneBeliefThreshold;
 		const int postPruneLabelsMin = m_context->settings.postPruneLabelsMin;
 		const int postPruneLabelsMax = m_context->settings.postPruneLabelsMax;
-		LabelInfoSet labelInfoSetKept;
-
-		for (int pruneInfoIdx = 0, postPruneLabelNum = 0; pruneInfoIdx < labelNum && postPruneLabelNum < postPruneLabelsMax; ++pruneInfoIdx)
+		LabelInfoSet& labelInfoSetKept = scratch.labelInfoSetKept;
+		std::vector<Energy>& labelEnergiesKept = scratch.labelEnergiesKept;
+		labelInfoSetKept.clear();
+		labelEnergiesKept.clear();
+
+		// The labels are considered in belief order, but only as far as the
+		// pruning needs, rather than sorting all of them. Each round streams
+		// the labels' beliefs through a bounded heap, to select the best
+		// pruneInfoMax of those after the previous round's. The first round
+		// selects twice as many as can be kept, which is usually enough;
+		// more are only needed when the similarity filter rejects many.
+		std::vector<PruneInfo>& pruneInfos = scratch.pruneInfos;
+		int pruneInfoMax = (postPruneLabelsMax < labelNum / 2) ? postPruneLabelsMax * 2 : labelNum;
+		PruneInfo pruneInfoPreviousLast;
+		Energy messages[NumNeighborEdges];
+
+		// The beliefs don't change between rounds.
+		std::vector<Belief>& beliefs = scratch.beliefs;
+		beliefs.resize(labelNum);
+		for (int i = 0; i < labelNum; ++i)
 		{
-			const int labelIdx = pruneInfos[pruneInfoIdx].labelIndex;
-			const Label& label = labelSet.GetLabel(labelIdx);
+			labelSet.GetMessages(i, messages);
+			beliefs[i] = CalculateBelief(labelEnergies[i], messages);
+		}
 
-			// Attempt to keep this label if the min number of post pruned
-			// labels hasn't been reached, or if the label's belief is above
-			// the pruning threshold.
-			bool keep = false;
-			if (postPruneLabelNum < postPruneLabelsMin || pruneInfos[pruneInfoIdx].belief > pruneBeliefThreshold)
+		for (int labelSelectedNum = 0, postPruneLabelNum = 0; labelSelectedNum < labelNum && postPruneLabelNum < postPruneLabelsMax; )
+		{
+			pruneInfos.clear();
+			for (int i = 0; i < labelNum; ++i)
 			{
-				if (m_hasPrunedOnce)
+				PruneInfo pruneInfo;
+				pruneInfo.labelIndex = i;
+				pruneInfo.belief = beliefs[i];
+
+				if (labelSelectedNum > 0 && !(pruneInfoPreviousLast < pruneInfo))
+				{
+					// Selected by a previous round.
+					continue;
+				}
+
+				// The heap's front is the worst selected label.
+				if (int(pruneInfos.size()) < pruneInfoMax)
 				{
-					// If this node's labels have already been pruned, then
-					// its current labels have passed the similarity filter below.
-					// It is not necessary to perform that filtering twice.
-					keep = true;
+					pruneInfos.push_back(pruneInfo);
+					std::push_heap(pruneInfos.begin(), pruneInfos.end());
 				}
-				else
+				else if (pruneInfo < pruneInfos.front())
 				{
-					// On the first pruning, verify that this label is
-					// dissimilar enough from the labels that have been kept
-					// so far.
-					bool isSimilarToAlreadyKeptLabel = false;
+					std::pop_heap(pruneInfos.begin(), pruneInfos.end());
+					pruneInfos.back() = pruneInfo;
+					std::push_heap(pruneInfos.begin(), pruneInfos.end());
+				}
+			}
 
-					const int keptNum = labelInfoSetKept.size();
-					if (keptNum > 0)
-					{
-						// Use an immediate batch - there shouldn't be too
-						// many calculations, and the upper bound is unknown.
-						// TODO: run some tests to verify this assumption.
-						const EnergyCalculator::BatchParams energyBatchParams(keptNum, patchWidth, patchHeight, label.left, label.top, false);
-						EnergyCalculator::BatchImmediate energyBatch(m_context->energyCalculatorContainer.Get(energyBatchParams, keptNum), energyBatchParams);
+			// Sort pruneInfos by belief
+			std::sort_heap(pruneInfos.begin(), pruneInfos.end());
+			wxASSERT(!pruneInfos.empty());
+			labelSelectedNum += pruneInfos.size();
+			pruneInfoPreviousLast = pruneInfos.back();
+			pruneInfoMax = (pruneInfoMax < labelNum / 2) ? pruneInfoMax * 2 : labelNum;
 
+			for (int pruneInfoIdx = 0, pruneInfoNum = pruneInfos.size(); pruneInfoIdx < pruneInfoNum && postPruneLabelNum < postPruneLabelsMax; ++pruneInfoIdx)
+			{
+				const int labelIdx = pruneInfos[pruneInfoIdx].labelIndex;
+				const Label& label = labelSet.GetLabel(labelIdx);
+
+				// Attempt to keep this label if the min number of post pruned
+				// labels hasn't been reached, or if the label's belief is above
+				// the pruning threshold.
+				bool keep = false;
+				if (postPruneLabelNum < postPruneLabelsMin || pruneInfos[pruneInfoIdx].belief > pruneBeliefThreshold)
+				{
+					if (m_hasPrunedOnce)
+					{
+						// If this node's labels have already been pruned, then
+						// its current labels have passed the similarity filter below.
+						// It is not necessary to perform that filtering twice.
+						keep = true;
+					}
+					else
+					{
+						// On the first pruning, verify that this label is
+						// dissimilar enough from the labels that have been kept
+						// so far. Neighboring nodes tend to keep the same
+						// labels, so the pairs that any node has already
+						// compared are looked up first, and only the rest are
+						// calculated.
+						bool isSimilarToAlreadyKeptLabel = false;
+						LabelPairEnergyCache& labelPairEnergyCache = m_context->labelPairEnergyCache;
+						std::vector<int>& keptIndicesUncached = scratch.keptIndicesUncached;
+						keptIndicesUncached.clear();
+
+						const int keptNum = labelInfoSetKept.size();
 						for (int keptIdx = 0; !isSimilarToAlreadyKeptLabel && keptIdx < keptNum; ++keptIdx)
 						{
-							const Label& alreadyKeptLabel = labelInfoSetKept[keptIdx].label;
-							const Energy e = energyBatch.Calculate(alreadyKeptLabel.left, alreadyKeptLabel.top);
-							isSimilarToAlreadyKeptLabel = (e < pruneEnergySimilarThreshold);
+							Energy e;
+							if (labelPairEnergyCache.Lookup(label, labelInfoSetKept[keptIdx].label, e))
+							{
+								isSimilarToAlreadyKeptLabel = (e < pruneEnergySimilarThreshold);
+							}
+							else
+							{
+								keptIndicesUncached.push_back(keptIdx);
+							}
+						}
+
+						const int uncachedNum = keptIndicesUncached.size();
+						if (!isSimilarToAlreadyKeptLabel && uncachedNum > 0)
+						{
+							// Use an immediate batch - there shouldn't be too
+							// many calculations, and the upper bound is unknown.
+							// TODO: run some tests to verify this assumption.
+							const EnergyCalculator::BatchParams energyBatchParams(uncachedNum, patchWidth, patchHeight, label.left, label.top, false);
+							EnergyCalculator::BatchImmediate energyBatch(m_context->energyCalculatorContainer.Get(energyBatchParams, uncachedNum), energyBatchParams);
+
+							for (int uncachedIdx = 0; !isSimilarToAlreadyKeptLabel && uncachedIdx < uncachedNum; ++uncachedIdx)
+							{
+								const Label& alreadyKeptLabel = labelInfoSetKept[keptIndicesUncached[uncachedIdx]].label;
+
+								// Every pair is bounded by the same threshold, so
+								// the bounded energy is as good as the exact one
+								// for the other nodes' lookups.
+								const Energy e = energyBatch.CalculateBounded(alreadyKeptLabel.left, alreadyKeptLabel.top, pruneEnergySimilarThreshold);
+								labelPairEnergyCache.Store(label, alreadyKeptLabel, e, m_context->cacheBudget);
+								isSimilarToAlreadyKeptLabel = (e < pruneEnergySimilarThreshold);
+							}
 						}
+
+						keep = !isSimilarToAlreadyKeptLabel;
 					}
+				}
 
-					keep = !isSimilarToAlreadyKeptLabel;
+				if (keep)
+				{
+					LabelInfo labelInfo;
+					labelInfo.label = label;
+					labelSet.GetMessages(labelIdx, messages);
+					for (int j = 0; j < NumNeighborEdges; ++j)
+					{
+						const Energy message = messages[j];
+						wxASSERT(message >= ENERGY_MIN && message <= ENERGY_MAX);
+						labelInfo.messages[j] = StoreMessage(message);
+					}
+					labelInfoSetKept.push_back(labelInfo);
+					labelEnergiesKept.push_back(labelEnergies[labelIdx]);
+					++postPruneLabelNum;
 				}
 			}
 
-			if (keep)
+			// The rounds select the labels in belief order, so once the min
+			// number is kept and this round's worst belief doesn't pass the
+			// threshold, no later label can be kept.
+			if (postPruneLabelNum >= postPruneLabelsMin && pruneInfoPreviousLast.belief <= pruneBeliefThreshold)
 			{
-				LabelInfo labelInfo;
-				labelInfo.label = label;
-				memcpy(labelInfo.messages, labelSet.GetMessages(labelIdx), sizeof(labelInfo.messages));
-#ifdef _DEBUG
-				for (int j = 0; j < NumNeighborEdges; ++j)
-				{
-					const Energy message = labelInfo.messages[j];
-					wxASSERT(message >= ENERGY_MIN && message <= ENERGY_MAX);
-				}
-#endif
-				labelInfoSetKept.push_back(labelInfo);
-				++postPruneLabelNum;
+				break;
 			}
 		}
 
@@ -445,37 +710,237 @@ void LfnIc::Node::PruneLabels()
 		printf("PruneLabels, before: %d, after %d\n", labelNum, labelInfoSetKept.size());
 #endif
 
-		m_labelInfoSet.swap(labelInfoSetKept);
+		AssignReusingCapacity(m_labelInfoSet, labelInfoSetKept);
 		m_hasPrunedOnce = true;
+
+		// The kept labels' messages were copied into the label info set.
+		ClearGlobalLabelMessages();
+
+		// The kept labels' energies are already known, so the pruned set can
+		// be cached even if the unpruned one didn't fit in the budget.
+		StoreLabelEnergyCache(labelEnergiesKept);
 	}
 }
 
-LfnIc::Priority LfnIc::Node::CalculatePriority() const
+bool LfnIc::Node::HasOwnLabelSet() const
 {
-	Priority priority = PRIORITY_MIN;
+	return !m_labelInfoSet.empty();
+}
 
-	ConstNodeLabels labelSet(*this);
-	const int labelNum = labelSet.size();
-	std::vector<Belief> beliefs(labelNum);
-	Belief beliefMax = BELIEF_MIN;
+void LfnIc::Node::SetCandidateLabels(const std::vector<Label>& labels)
+{
+	wxASSERT(m_labelInfoSet.empty() && !m_hasPrunedOnce);
+	wxASSERT(!labels.empty());
 
-	const EnergyCalculator::BatchParams energyBatchParams(labelNum, m_context->settings.patchWidth, m_context->settings.patchHeight, GetLeft(), GetTop(), true);
-	ScopedNodeEnergyBatchQueued energyBatch(*this, m_context->energyCalculatorContainer.Get(energyBatchParams, labelNum), energyBatchParams);
+	// The caches and messages are for the global label set.
+	ClearLabelEnergyCache();
+	ClearEdgeEnergyCaches();
+	ClearGlobalLabelMessages();
 
-	// Queue energy calculations
+	const int labelNum = labels.size();
+	m_labelInfoSet.resize(labelNum);
 	for (int i = 0; i < labelNum; ++i)
 	{
-		const Label& label = labelSet.GetLabel(i);
-		const EnergyCalculator::BatchQueued::Handle handle = energyBatch.QueueCalculation(label.left, label.top);
-		ASSERT_NODE_ENERGY_BATCH_QUEUED_HANDLE_IS_INDEX(handle, i);
+		LabelInfo& labelInfo = m_labelInfoSet[i];
+		labelInfo.label = labels[i];
+		for (int j = 0; j < NumNeighborEdges; ++j)
+		{
+			labelInfo.messages[j] = StoreMessage(Energy(0));
+		}
+	}
+}
+
+LfnIc::Energy LfnIc::Node::CalculateCandidateEnergy(const Label& label, const Label* const neighborLabels[NumNeighborEdges], Energy bound) const
+{
+	Energy energy = ENERGY_MIN;
+	if (OverlapsKnownRegion())
+	{
+		const EnergyCalculator::BatchParams energyBatchParams(GetNodeEnergyBatchParams(*this, 1));
+		ScopedNodeEnergyBatchImmediate energyBatch(*this, m_context->energyCalculatorContainer.Get(energyBatchParams, 1), energyBatchParams);
+		energy = energyBatch.CalculateBounded(label.left, label.top, bound);
+	}
+
+	// Same overlap energies as SendMessages().
+	for (int edge = 0; edge < NumNeighborEdges && energy < bound; ++edge)
+	{
+		const Label* neighborLabel = neighborLabels[edge];
+		if (neighborLabel && m_neighbors[edge] != NO_NEIGHBOR)
+		{
+			const EdgeInfo& edgeInfo = m_edges[edge];
+			const EnergyCalculator::BatchParams energyBatchParams(1, edgeInfo.overlapWidth, edgeInfo.overlapHeight, label.left + edgeInfo.overlapLeftOffset, label.top + edgeInfo.overlapTopOffset, false);
+			EnergyCalculator::BatchImmediate energyBatch(m_context->energyCalculatorContainer.Get(energyBatchParams, 1), energyBatchParams);
+			energy += energyBatch.CalculateBounded(neighborLabel->left + edgeInfo.neighborOverlapLeftOffset, neighborLabel->top + edgeInfo.neighborOverlapTopOffset, bound - energy);
+		}
+	}
+
+	return energy;
+}
+
+void LfnIc::Node::WriteCheckpoint(std::ostream& ostream) const
+{
+	// Messages are written as energies, so that the checkpoint doesn't
+	// depend on NODE_COMPACT_MESSAGES.
+	PriorityBpCheckpoint::Write(ostream, m_index);
+	PriorityBpCheckpoint::Write(ostream, GetCurrentResolution().x);
+	PriorityBpCheckpoint::Write(ostream, GetCurrentResolution().y);
+	PriorityBpCheckpoint::Write(ostream, int(m_hasPrunedOnce));
+
+	const int labelInfoNum = m_labelInfoSet.size();
+	PriorityBpCheckpoint::Write(ostream, labelInfoNum);
+	for (int i = 0; i < labelInfoNum; ++i)
+	{
+		const LabelInfo& labelInfo = m_labelInfoSet[i];
+		PriorityBpCheckpoint::Write(ostream, labelInfo.label);
+		for (int j = 0; j < NumNeighborEdges; ++j)
+		{
+			PriorityBpCheckpoint::Write(ostream, LoadMessage(labelInfo.messages[j]));
+		}
 	}
 
-	energyBatch.ProcessCalculations();
+	for (int i = 0; i < NumNeighborEdges; ++i)
+	{
+		const std::vector<StoredMessage>& globalLabelMessages = m_globalLabelMessages[i];
+		const int messageNum = globalLabelMessages.size();
+		PriorityBpCheckpoint::Write(ostream, messageNum);
+		for (int j = 0; j < messageNum; ++j)
+		{
+			PriorityBpCheckpoint::Write(ostream, LoadMessage(globalLabelMessages[j]));
+		}
+	}
+}
+
+bool LfnIc::Node::ReadCheckpoint(std::istream& istream)
+{
+	const LabelSet& globalLabelSet = m_context->labelSet;
+	const int globalLabelNum = globalLabelSet.size();
+
+	int index = 0;
+	short x = 0;
+	short y = 0;
+	int hasPrunedOnce = 0;
+	int labelInfoNum = 0;
+	bool result =
+		PriorityBpCheckpoint::Read(istream, index) &&
+		PriorityBpCheckpoint::Read(istream, x) &&
+		PriorityBpCheckpoint::Read(istream, y) &&
+		PriorityBpCheckpoint::Read(istream, hasPrunedOnce) &&
+		PriorityBpCheckpoint::Read(istream, labelInfoNum) &&
+		index == m_index &&
+		x == GetCurrentResolution().x &&
+		y == GetCurrentResolution().y &&
+		labelInfoNum >= 0 &&
+		labelInfoNum <= globalLabelNum;
+
+	// Read into new containers, so that the node is untouched until the
+	// whole of its state has been read.
+	LabelInfoSet labelInfoSet;
+	std::vector<StoredMessage> globalLabelMessages[NumNeighborEdges];
+
+	if (result)
+	{
+		labelInfoSet.resize(labelInfoNum);
+	}
+
+	Energy message = ENERGY_MIN;
+	for (int i = 0; result && i < labelInfoNum; ++i)
+	{
+		LabelInfo& labelInfo = labelInfoSet[i];
+		result =
+			PriorityBpCheckpoint::Read(istream, labelInfo.label) &&
+			globalLabelSet.Contains(labelInfo.label.left, labelInfo.label.top);
+
+		for (int j = 0; result && j < NumNeighborEdges; ++j)
+		{
+			result = PriorityBpCheckpoint::Read(istream, message) && message >= ENERGY_MIN && message <= ENERGY_MAX;
+			labelInfo.messages[j] = result ? StoreMessage(message) : 0;
+		}
+	}
+
+	for (int i = 0; result && i < NumNeighborEdges; ++i)
+	{
+		// Global label messages are either absent, or one per global label.
+		int messageNum = 0;
+		result =
+			PriorityBpCheckpoint::Read(istream, messageNum) &&
+			(messageNum == 0 || (labelInfoNum == 0 && messageNum == globalLabelNum));
+
+		if (result)
+		{
+			globalLabelMessages[i].resize(messageNum);
+		}
+
+		for (int j = 0; result && j < messageNum; ++j)
+		{
+			result = PriorityBpCheckpoint::Read(istream, message) && message >= ENERGY_MIN && message <= ENERGY_MAX;
+			globalLabelMessages[i][j] = result ? StoreMessage(message) : 0;
+		}
+	}
 
-	// Get and use energy calculation results
+	// The caches are for the labels being replaced, and the neighbors'.
+	ResetLabels();
+
+	if (result)
+	{
+		m_labelInfoSet.swap(labelInfoSet);
+		for (int i = 0; i < NumNeighborEdges; ++i)
+		{
+			m_globalLabelMessages[i].swap(globalLabelMessages[i]);
+		}
+		m_hasPrunedOnce = (hasPrunedOnce != 0);
+	}
+
+	return result;
+}
+
+void LfnIc::Node::ResetLabels()
+{
+	ClearLabelEnergyCache();
+	ClearEdgeEnergyCaches();
+	ClearGlobalLabelMessages();
+	LabelInfoSet().swap(m_labelInfoSet);
+	m_hasPrunedOnce = false;
+}
+
+void LfnIc::Node::PrecomputeLabelEnergies() const
+{
+	if (m_labelEnergyCache.empty())
+	{
+		GetLabelEnergies(m_context->GetScratch().labelEnergies);
+	}
+}
+
+bool LfnIc::Node::HasChosenLabelEnergyCalculator() const
+{
+	bool result = true;
+	if (m_labelEnergyCache.empty() && OverlapsKnownRegion())
+	{
+		const int labelNum = ConstNodeLabels(*this).size();
+		result = m_context->energyCalculatorContainer.HasChosen(GetNodeEnergyBatchParams(*this, labelNum), labelNum);
+	}
+
+	return result;
+}
+
+LfnIc::Priority LfnIc::Node::CalculatePriority() const
+{
+	Priority priority = PRIORITY_MIN;
+
+	Scratch& scratch = m_context->GetScratch();
+	ConstNodeLabels labelSet(*this);
+	const int labelNum = labelSet.size();
+	std::vector<Belief>& beliefs = scratch.beliefs;
+	beliefs.resize(labelNum);
+	Belief beliefMax = BELIEF_MIN;
+
+	// Once the label energies are cached, only the messages are summed here.
+	std::vector<Energy>& labelEnergies = scratch.labelEnergies;
+	GetLabelEnergies(labelEnergies);
+
+	Energy messages[NumNeighborEdges];
 	for (int i = 0; i < labelNum; ++i)
 	{
-		beliefs[i] = CalculateBelief(energyBatch.GetResult(EnergyCalculator::BatchQueued::Handle(i)), labelSet.GetMessages(i));
+		labelSet.GetMessages(i, messages);
+		beliefs[i] = CalculateBelief(labelEnergies[i], messages);
 		if (beliefs[i] > beliefMax)
 		{
 			beliefMax = beliefs[i];
@@ -502,6 +967,44 @@ LfnIc::Priority LfnIc::Node::CalculatePriority() const
 	return priority;
 }
 
+void LfnIc::Node::CalculateBestLabel(Label& outLabel, bool& outIsDominant) const
+{
+	ConstNodeLabels labelSet(*this);
+	const int labelNum = labelSet.size();
+	wxASSERT(labelNum > 0);
+
+	std::vector<Energy>& labelEnergies = m_context->GetScratch().labelEnergies;
+	GetLabelEnergies(labelEnergies);
+
+	Energy messages[NumNeighborEdges];
+	labelSet.GetMessages(0, messages);
+
+	int bestIndex = 0;
+	Belief bestBelief = CalculateBelief(labelEnergies[0], messages);
+	Belief secondBelief = BELIEF_MIN;
+	for (int i = 1; i < labelNum; ++i)
+	{
+		labelSet.GetMessages(i, messages);
+		const Belief belief = CalculateBelief(labelEnergies[i], messages);
+		if (belief > bestBelief)
+		{
+			secondBelief = bestBelief;
+			bestBelief = belief;
+			bestIndex = i;
+		}
+		else if (belief > secondBelief)
+		{
+			secondBelief = belief;
+		}
+	}
+
+	outLabel = labelSet.GetLabel(bestIndex);
+
+	// Same test as CalculatePriority(): the best label is dominant if the
+	// runner-up is outside of the confusion set.
+	outIsDominant = (labelNum == 1) || !(secondBelief - bestBelief > Belief(m_context->settings.confidenceBeliefThreshold));
+}
+
 LfnIc::Belief LfnIc::Node::CalculateBelief(Energy labelEnergy, const Energy messages[NumNeighborEdges]) const
 {
 	Belief belief= Belief(-labelEnergy);
@@ -520,7 +1023,7 @@ LfnIc::Belief LfnIc::Node::CalculateBelief(const Label& label, const Energy mess
 	if (OverlapsKnownRegion())
 	{
 		// Single energy calculation; use an immediate batch.
-		const EnergyCalculator::BatchParams energyBatchParams(1, m_context->settings.patchWidth, m_context->settings.patchHeight, GetLeft(), GetTop(), true);
+		const EnergyCalculator::BatchParams energyBatchParams(GetNodeEnergyBatchParams(*this, 1));
 		ScopedNodeEnergyBatchImmediate energyBatch(*this, m_context->energyCalculatorContainer.Get(energyBatchParams, 1), energyBatchParams);
 
 		e = energyBatch.Calculate(label.left, label.top);
@@ -533,22 +1036,98 @@ LfnIc::Belief LfnIc::Node::CalculateBelief(const Label& label, const Energy mess
 	return CalculateBelief(e, messages);
 }
 
-void LfnIc::Node::PopulateLabelInfoSetIfNeeded()
+void LfnIc::Node::ClearGlobalLabelMessages()
 {
-#if PROFILE_MEM
-	TECH_MEM_PROFILE("LfnIc::Node::PopulateLabelInfoSetIfNeeded");
-#endif
-	if (m_labelInfoSet.size() == 0)
+	for (int i = 0; i < NumNeighborEdges; ++i)
+	{
+		// Swap to actually release the memory.
+		std::vector<StoredMessage>().swap(m_globalLabelMessages[i]);
+	}
+}
+
+void LfnIc::Node::GetLabelEnergies(std::vector<Energy>& outEnergies) const
+{
+	ConstNodeLabels labelSet(*this);
+	const int labelNum = labelSet.size();
+
+	if (!m_labelEnergyCache.empty())
 	{
-		const int labelNum = m_context->labelSet.size();
+		wxASSERT(int(m_labelEnergyCache.size()) == labelNum);
+		outEnergies = m_labelEnergyCache;
+		return;
+	}
 
-		// We'll have exactly with many labels. Resize now and fill in data.
-		m_labelInfoSet.resize(labelNum);
+	outEnergies.resize(labelNum);
+	if (OverlapsKnownRegion())
+	{
+		const EnergyCalculator::BatchParams energyBatchParams(GetNodeEnergyBatchParams(*this, labelNum));
+		ScopedNodeEnergyBatchQueued energyBatch(*this, m_context->energyCalculatorContainer.Get(energyBatchParams, labelNum), energyBatchParams);
 
+		// Queue energy calculations
 		for (int i = 0; i < labelNum; ++i)
 		{
-			m_labelInfoSet[i].SetLabelAndClearMessages(m_context->labelSet[i]);
+			const Label& label = labelSet.GetLabel(i);
+			const EnergyCalculator::BatchQueued::Handle handle = energyBatch.QueueCalculation(label.left, label.top);
+			ASSERT_NODE_ENERGY_BATCH_QUEUED_HANDLE_IS_INDEX(handle, i);
 		}
+
+		energyBatch.ProcessCalculations();
+
+		// Get energy calculation results
+		for (int i = 0; i < labelNum; ++i)
+		{
+			outEnergies[i] = energyBatch.GetResult(EnergyCalculator::BatchQueued::Handle(i));
+		}
+
+		StoreLabelEnergyCache(outEnergies);
+	}
+	else
+	{
+		// Same as ScopedNodeEnergyBatchQueued, and not worth caching.
+		std::fill(outEnergies.begin(), outEnergies.end(), ENERGY_MIN);
+	}
+}
+
+void LfnIc::Node::StoreLabelEnergyCache(const std::vector<Energy>& energies) const
+{
+	// Only the change in size is reserved or released, and the cache's
+	// memory is reused, since pruning usually replaces it with a similarly
+	// sized one.
+	const int64 bytesOld = int64(m_labelEnergyCache.size()) * int64(sizeof(Energy));
+	const int64 bytesNew = int64(energies.size()) * int64(sizeof(Energy));
+	if (OverlapsKnownRegion() && (bytesNew <= bytesOld || m_context->cacheBudget.Reserve(bytesNew - bytesOld)))
+	{
+		if (bytesNew < bytesOld)
+		{
+			m_context->cacheBudget.Release(bytesOld - bytesNew);
+		}
+
+		AssignReusingCapacity(m_labelEnergyCache, energies);
+	}
+	else
+	{
+		ClearLabelEnergyCache();
+	}
+}
+
+void LfnIc::Node::ClearLabelEnergyCache() const
+{
+	m_context->cacheBudget.Release(int64(m_labelEnergyCache.size()) * int64(sizeof(Energy)));
+
+	// Swap to actually release the memory.
+	std::vector<Energy>().swap(m_labelEnergyCache);
+}
+
+bool LfnIc::Node::OwnsEdgeEnergyCache(NeighborEdge edge)
+{
+	return edge == NeighborEdgeRight || edge == NeighborEdgeBottom;
+}
+
+void LfnIc::Node::ClearEdgeEnergyCaches() const
+{
+	for (int i = 0; i < NumNeighborEdges; ++i)
+	{
+		m_edgeEnergyCaches[i].Clear(m_context->cacheBudget);
 	}
 }
 
@@ -567,14 +1146,85 @@ bool LfnIc::Node::OverlapsKnownRegion() const
 	return m_overlapsKnownRegion;
 }
 
+void LfnIc::Node::PrecomputeKnownRegion()
+{
+	const int patchWidth = m_context->settings.patchWidth;
+	const int patchHeight = m_context->settings.patchHeight;
+
+	// The whole patch, unless known pixels are found below.
+	m_knownRegion.leftOffset = 0;
+	m_knownRegion.topOffset = 0;
+	m_knownRegion.width = patchWidth;
+	m_knownRegion.height = patchHeight;
+
+	if (m_overlapsKnownRegion)
+	{
+		const MaskLod::LodData& maskData = m_context->mask.GetLodData(m_context->mask.GetHighestLod());
+		const int left = GetLeft();
+		const int top = GetTop();
+
+		// Only the part of the patch that's within the mask. The energy
+		// calculators clip the rest.
+		const int colStart = std::max(-left, 0);
+		const int rowStart = std::max(-top, 0);
+		const int colEnd = std::min(patchWidth, maskData.width - left);
+		const int rowEnd = std::min(patchHeight, maskData.height - top);
+
+		int knownColMin = colEnd;
+		int knownColMax = -1;
+		int knownRowMin = rowEnd;
+		int knownRowMax = -1;
+		for (int row = rowStart; row < rowEnd; ++row)
+		{
+			const Mask::Value* maskRow = &maskData.buffer[LfnTech::GetRowMajorIndex(maskData.width, 0, top + row)];
+			for (int col = colStart; col < colEnd; ++col)
+			{
+				if (maskRow[left + col] == Mask::KNOWN)
+				{
+					knownColMin = std::min(knownColMin, col);
+					knownColMax = std::max(knownColMax, col);
+					knownRowMin = std::min(knownRowMin, row);
+					knownRowMax = row;
+				}
+			}
+		}
+
+		if (knownRowMax >= 0)
+		{
+			// Round outward to lattice gap multiples, which the fft energy
+			// calculator requires. The patch is a whole number of gaps, so
+			// the result stays within it, and the added pixels aren't known,
+			// so the energies don't change.
+			const int latticeGapX = m_context->settings.latticeGapX;
+			const int latticeGapY = m_context->settings.latticeGapY;
+			const int regionLeft = (knownColMin / latticeGapX) * latticeGapX;
+			const int regionTop = (knownRowMin / latticeGapY) * latticeGapY;
+			const int regionRight = std::min(((knownColMax / latticeGapX) + 1) * latticeGapX, patchWidth);
+			const int regionBottom = std::min(((knownRowMax / latticeGapY) + 1) * latticeGapY, patchHeight);
+
+			m_knownRegion.leftOffset = regionLeft;
+			m_knownRegion.topOffset = regionTop;
+			m_knownRegion.width = regionRight - regionLeft;
+			m_knownRegion.height = regionBottom - regionTop;
+		}
+	}
+}
+
+const LfnIc::Node::KnownRegion& LfnIc::Node::GetKnownRegion() const
+{
+	return m_knownRegion;
+}
+
 void LfnIc::Node::ScaleUp()
 {
 	wxASSERT(m_depth > 0);
 
-	m_resolutions.erase(m_resolutions.begin() + m_resolutions.size() - 1);
-
 	--m_depth;
-	wxASSERT(m_depth == int(m_resolutions.size()) - 1);
+	m_currentResolution = Resolution(m_originalResolution.x / (1 << m_depth), m_originalResolution.y / (1 << m_depth));
+
+	// The labels and image are about to change resolution.
+	ClearLabelEnergyCache();
+	ClearEdgeEnergyCaches();
 
 	// Scale up the label info set.
 	{
@@ -620,31 +1270,26 @@ void LfnIc::Node::ScaleDown()
 {
 	wxASSERT(m_depth >= 0);
 
-	const Resolution& resolutionToScaleDown = GetCurrentResolution();
-	m_resolutions.push_back(Resolution(resolutionToScaleDown.x / 2, resolutionToScaleDown.y / 2));
-
+	// Same as halving the previous resolution, since integer division by 2
+	// repeatedly is integer division by the product.
 	++m_depth;
-	wxASSERT(m_depth == int(m_resolutions.size()) - 1);
+	m_currentResolution = Resolution(m_originalResolution.x / (1 << m_depth), m_originalResolution.y / (1 << m_depth));
+
+	ClearLabelEnergyCache();
+	ClearEdgeEnergyCaches();
 
 	// We don't expect the label set to be populated until running priority-bp
 	// on the most-scaled-down resolution.
 	wxASSERT(m_labelInfoSet.size() == 0);
-}
-
-int LfnIc::Node::GetScaleDepth() const
-{
-	return m_depth;
-}
-
-void LfnIc::Node::LabelInfo::SetLabelAndClearMessages(const Label& label)
-{
-	this->label = label;
-	memset(messages, 0, sizeof(messages));
-
 #ifdef _DEBUG
 	for (int i = 0; i < NumNeighborEdges; ++i)
 	{
-		wxASSERT(messages[i] == Energy(0));
+		wxASSERT(m_globalLabelMessages[i].empty());
 	}
 #endif
 }
+
+int LfnIc::Node::GetScaleDepth() const
+{
+	return m_depth;
+}
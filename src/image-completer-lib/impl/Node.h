@@ -22,11 +22,37 @@
 #ifndef NODE_H
 #define NODE_H
 
+#include "CacheBudget.h"
+#include "LabelPairEnergyCache.h"
+#include "EdgeEnergyCache.h"
 #include "Label.h"
 #include "NeighborEdge.h"
 #include "LfnIcTypes.h"
 #include "Scalable.h"
 
+// If set, LabelInfo stores its messages as 32 bit values, saturated at
+// Node::STORED_MESSAGE_MAX, which packs a LabelInfo into 20 bytes rather
+// than 36. Each edge's messages are normalized so that the smallest is 0,
+// so only the messages of labels that are far too costly to be chosen
+// ever saturate.
+//
+// Can be defined as 0 by the build (the CMake COMPACT_NODE_MESSAGES option)
+// to compare the solution against 64 bit messages; see
+// test-data/elephant-compare-compact-messages.sh.
+#ifndef NODE_COMPACT_MESSAGES
+#define NODE_COMPACT_MESSAGES 1
+#endif
+
+// If set, storing a message that saturates asserts. As long as none do,
+// the compact messages are exact, and the solution is the same as with
+// 64 bit messages.
+#define NODE_COMPACT_MESSAGES_VALIDATION_ENABLED 0
+
+namespace LfnTech
+{
+	class ThreadPool;
+}
+
 namespace LfnIc
 {
 	// Forward declarations
@@ -41,22 +67,70 @@ namespace LfnIc
 	class Node : public Scalable
 	{
 	public:
+		/// The buffers that message sending, pruning and priority calculation
+		/// reuse, rather than allocating on each call. Defined in Node.cpp.
+		struct Scratch;
+
 		/// Consolidates the external references needed by each node.
 		struct Context
 		{
-			Context(const Settings& settings, const LabelSet& labelSet, EnergyCalculatorContainer& energyCalculatorContainer);
+			Context(const Settings& settings, const MaskLod& mask, const LabelSet& labelSet, EnergyCalculatorContainer& energyCalculatorContainer, const LfnTech::ThreadPool& threadPool, std::vector<Node>& nodes);
+			~Context();
+
+			/// Returns the calling thread's scratch buffers.
+			Scratch& GetScratch() const;
 
 			const Settings& settings;
+			const MaskLod& mask;
 			const LabelSet& labelSet;
 			EnergyCalculatorContainer& energyCalculatorContainer;
+			const LfnTech::ThreadPool& threadPool;
+
+			/// All of the nodes, at their Node::GetIndex(). Neighbors are
+			/// addressed by index into this.
+			std::vector<Node>& nodes;
+
+			/// The bytes left for the nodes' label energy and edge energy
+			/// caches, starting at settings.labelEnergyCacheMegabytesMax.
+			CacheBudget cacheBudget;
+
+			/// The energies between label pairs that the first pruning's
+			/// similarity filter has calculated, shared by all of the nodes.
+			/// Cleared whenever the nodes change resolution.
+			LabelPairEnergyCache labelPairEnergyCache;
+
+			/// One per thread pool thread, indexed by
+			/// LfnTech::ThreadPool::GetCurrentThreadIndex(). They're kept for
+			/// the whole run, so once they've grown to the largest label
+			/// sets, the nodes' Priority-BP iterations don't allocate.
+			std::vector<Scratch*> scratches;
+
+		private:
+			// Owns the scratches, so it's not copyable.
+			Context(const Context&);
+			Context& operator=(const Context&);
+		};
+
+		/// The bounding rectangle of the known pixels in the node's patch,
+		/// relative to the patch's left and top, rounded outward to lattice
+		/// gap multiples.
+		struct KnownRegion
+		{
+			short leftOffset;
+			short topOffset;
+			short width;
+			short height;
 		};
 
 		///
 		/// Methods
 		///
-		Node(Context& context, const MaskLod& mask, int x, int y);
+		Node(Context& context, const MaskLod& mask, int index, int x, int y);
 		Node(const Node& other);
 
+		/// Returns the node's stable index within its NodeSet.
+		int GetIndex() const;
+
 		int GetX() const;
 		int GetY() const;
 
@@ -65,15 +139,67 @@ namespace LfnIc
 		Node* GetNeighbor(NeighborEdge edge) const;
 		NeighborEdge GetNeighborEdge(const Node& neighbor) const;
 
+		/// Precomputes the neighbor edges' overlap geometry. Must be called
+		/// once all of the nodes' neighbors are added, and whenever the nodes
+		/// change resolution.
+		void PrecomputeEdges();
+
 		/// Sends all beliefe propagation messages from this node to its
-		/// neighbor.
-		void SendMessages(Node& neighbor) const;
+		/// neighbor at the edge. Returns the largest change to any of the
+		/// neighbor's messages from this node.
+		Energy SendMessages(NeighborEdge edge) const;
 
 		/// Applies label pruning to this node.
 		void PruneLabels();
 
+		/// Returns true once the node has its own label set, rather than the
+		/// global one.
+		bool HasOwnLabelSet() const;
+
+		/// Replaces the global label set with the given candidate labels, with
+		/// no messages, until the first pruning. Must be called before the
+		/// node has its own label set.
+		void SetCandidateLabels(const std::vector<Label>& labels);
+
+		/// Writes the node's labels and messages to a checkpoint. See
+		/// PriorityBpCheckpoint.
+		void WriteCheckpoint(std::ostream& ostream) const;
+
+		/// Replaces the node's labels and messages with those written by
+		/// WriteCheckpoint() at the same resolution. Returns false if they
+		/// couldn't be read, after calling ResetLabels().
+		bool ReadCheckpoint(std::istream& istream);
+
+		/// Returns the node to the global label set, with no messages, as it
+		/// was before its first pruning.
+		void ResetLabels();
+
+		/// Returns the energy of the label at this node against the node's own
+		/// masked patch, plus the overlap energy against each of the
+		/// neighbors' labels that aren't NULL. Like a bounded calculation,
+		/// it's exact if it's less than bound, and otherwise some energy >=
+		/// bound.
+		Energy CalculateCandidateEnergy(const Label& label, const Label* const neighborLabels[NumNeighborEdges], Energy bound) const;
+
+		/// Calculates the energies of the node's labels against its own
+		/// masked patch, and caches them if they fit in the context's budget,
+		/// unless they're already cached. Can be called concurrently for
+		/// different nodes.
+		void PrecomputeLabelEnergies() const;
+
+		/// Returns false if the energy calculator container hasn't yet
+		/// chosen the calculator for the node's label energy batch, and
+		/// would measure it if PrecomputeLabelEnergies() were called outside
+		/// of the thread pool.
+		bool HasChosenLabelEnergyCalculator() const;
+
 		Priority CalculatePriority() const;
 
+		/// Stores the label with the highest belief into outLabel. Sets
+		/// outIsDominant if it's the only label in the confusion set that
+		/// CalculatePriority() counts, i.e., if the node's priority is max.
+		void CalculateBestLabel(Label& outLabel, bool& outIsDominant) const;
+
 		/// Fast belief calculation when the label energy is already known.
 		Belief CalculateBelief(Energy labelEnergy, const Energy messages[NumNeighborEdges]) const;
 
@@ -90,6 +216,18 @@ namespace LfnIc
 		/// calculating the energy of its labels against the image.
 		bool OverlapsKnownRegion() const;
 
+		/// Finds the node's KnownRegion in the context's mask, which must be
+		/// at the node's current resolution. Must be called whenever both
+		/// have changed resolution, before the node's energies are
+		/// calculated.
+		void PrecomputeKnownRegion();
+
+		/// Masked energy batches of the node's patch are cropped to this,
+		/// since the pixels outside of it add nothing to their energies. It's
+		/// the whole patch if the node doesn't overlap the known region at
+		/// the current resolution.
+		const KnownRegion& GetKnownRegion() const;
+
 		/// Scalable interface
 		virtual void ScaleUp();
 		virtual void ScaleDown();
@@ -102,16 +240,41 @@ namespace LfnIc
 
 		friend class ConstNodeLabels;
 
-		// During the first pass, once a node is either pruned or receives
-		// messages, it store its own label set.
+		// The type that messages are stored as. See NODE_COMPACT_MESSAGES.
+#if NODE_COMPACT_MESSAGES
+		typedef uint32 StoredMessage;
+		static const StoredMessage STORED_MESSAGE_MAX = 0xffffffff;
+#else
+		typedef Energy StoredMessage;
+#endif
+
+		static inline StoredMessage StoreMessage(Energy message)
+		{
+			wxASSERT(message >= ENERGY_MIN);
+#if NODE_COMPACT_MESSAGES
+#if NODE_COMPACT_MESSAGES_VALIDATION_ENABLED
+			wxASSERT_MSG(message <= Energy(STORED_MESSAGE_MAX), "LfnIc::Node::StoreMessage - saturated a compact message!");
+#endif
+			return (message < Energy(STORED_MESSAGE_MAX)) ? StoredMessage(message) : STORED_MESSAGE_MAX;
+#else
+			return message;
+#endif
+		}
+
+		static inline Energy LoadMessage(StoredMessage storedMessage)
+		{
+			return Energy(storedMessage);
+		}
+
+		// During the first pass, once a node is pruned, it stores its own
+		// label set. Until then, its labels are the global label set's (see
+		// m_globalLabelMessages).
 		//
 		// The messages order matches the node's own m_neighbors member array.
 		struct LabelInfo
 		{
 			Label label;
-			Energy messages[NumNeighborEdges];
-
-			void SetLabelAndClearMessages(const Label& label);
+			StoredMessage messages[NumNeighborEdges];
 		};
 
 		typedef std::vector<LabelInfo> LabelInfoSet;
@@ -123,30 +286,90 @@ namespace LfnIc
 			short y;
 		};
 
+		// The geometry of the region where this node's and a neighbor's
+		// patches overlap, relative to each patch's left and top.
+		struct EdgeInfo
+		{
+			// This node's edge in the neighbor.
+			NeighborEdge edgeInNeighbor;
+
+			short overlapWidth;
+			short overlapHeight;
+			short overlapLeftOffset;
+			short overlapTopOffset;
+			short neighborOverlapLeftOffset;
+			short neighborOverlapTopOffset;
+		};
+
+		static const int NO_NEIGHBOR = -1;
+
 		//
 		// Internal methods
 		//
 
-		// If this node doesn't have its own label set, the global label set
-		// will be copied into this node.
-		void PopulateLabelInfoSetIfNeeded();
+		// Releases m_globalLabelMessages, once this node has its own label
+		// info set.
+		void ClearGlobalLabelMessages();
+
+		// Stores the energy of each of this node's labels against the node's
+		// own masked patch into outEnergies, in ConstNodeLabels order. The
+		// energies only depend on the image, the mask and the label, so
+		// they're only calculated once per label set and resolution, as long
+		// as the cache fits in the context's budget.
+		void GetLabelEnergies(std::vector<Energy>& outEnergies) const;
+
+		// Replaces the label energy cache with energies, which must be in
+		// ConstNodeLabels order, if they fit in the context's budget. The
+		// cache's memory is reused when possible.
+		void StoreLabelEnergyCache(const std::vector<Energy>& energies) const;
 
-		inline Resolution& GetCurrentResolution() { return m_resolutions[m_depth]; }
-		inline const Resolution& GetCurrentResolution() const { return m_resolutions[m_depth]; }
+		// Empties the label energy cache and returns its bytes to the
+		// context's budget. Must be called whenever the labels change.
+		void ClearLabelEnergyCache() const;
+
+		// Returns true if this node, rather than its neighbor, owns the
+		// cache for the edge. Each edge's energies are symmetric, so they're
+		// only cached once, by the node on its left or top side.
+		static bool OwnsEdgeEnergyCache(NeighborEdge edge);
+
+		// Empties the edge energy caches and returns their bytes to the
+		// context's budget.
+		void ClearEdgeEnergyCaches() const;
+
+		inline const Resolution& GetCurrentResolution() const { return m_currentResolution; }
 
 		//
 		// Data
 		//
 		Context* m_context;
+		int m_index;
 
-		std::vector<Resolution> m_resolutions;
+		// Each scaled down resolution is the original one divided by
+		// 2^m_depth, so it's derived rather than stacked.
+		Resolution m_originalResolution;
+		Resolution m_currentResolution;
 		int m_depth;
 
-		// Size and order matches the NeighborEdge enum:
-		Node* m_neighbors[NumNeighborEdges];
+		// Size and order matches the NeighborEdge enum. Neighbor node
+		// indices, or NO_NEIGHBOR.
+		int m_neighbors[NumNeighborEdges];
+		EdgeInfo m_edges[NumNeighborEdges];
 		LabelInfoSet m_labelInfoSet;
 
+		// While m_labelInfoSet is empty, the messages received at each edge,
+		// in the global label set's order. Empty for the edges that haven't
+		// sent any, whose messages are all 0.
+		std::vector<StoredMessage> m_globalLabelMessages[NumNeighborEdges];
+
+		// Either empty, or the energies of all of this node's current labels,
+		// in ConstNodeLabels order.
+		mutable std::vector<Energy> m_labelEnergyCache;
+
+		// Only the edges for which OwnsEdgeEnergyCache() is true are used.
+		mutable EdgeEnergyCache m_edgeEnergyCaches[NumNeighborEdges];
+
 		bool m_overlapsKnownRegion;
+		KnownRegion m_knownRegion;
 		bool m_hasPrunedOnce;
 	};
 }
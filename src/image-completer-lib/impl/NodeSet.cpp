@@ -27,6 +27,7 @@
 #include "ImageConst.h"
 #include "LfnIcSettings.h"
 #include "MaskLod.h"
+#include "PriorityBpCheckpoint.h"
 
 #include "tech/DbgMem.h"
 
@@ -96,23 +97,34 @@ void LfnIc::Lattice::CreateUnknownRegionNodes()
 
 	m_numCols = nodeSpaceWidth / latticeGapX;
 	m_numRows = nodeSpaceHeight / latticeGapY;
-	m_pointNodeIndices.resize(m_numCols * m_numRows);
+	m_pointNodeIndices.assign(m_numCols * m_numRows, INVALID_INDEX);
 
-	for (int pointIndex = 0, row = 0, y = topMostNodeY; row < m_numRows; ++row, y += latticeGapY)
+	// Create the nodes in the order of a Hilbert curve over the lattice
+	// points, so that neighboring nodes are mostly stored close together.
+	int hilbertSideLength = 1;
+	while (hilbertSideLength < m_numCols || hilbertSideLength < m_numRows)
 	{
+		hilbertSideLength *= 2;
+	}
+
+	for (int d = 0, dn = hilbertSideLength * hilbertSideLength; d < dn; ++d)
+	{
+		int col;
+		int row;
+		LfnTech::GetHilbertCurvePoint(hilbertSideLength, d, col, row);
+		if (col >= m_numCols || row >= m_numRows)
+		{
+			continue;
+		}
+
+		const int x = leftMostNodeX + (col * latticeGapX);
+		const int y = topMostNodeY + (row * latticeGapY);
+		const int neighborhoodLeft = x - patchHalfWidth;
 		const int neighborhoodTop = y - patchHalfHeight;
-		for (int col = 0, x = leftMostNodeX; col < m_numCols; ++pointIndex, ++col, x += latticeGapX)
+		if (m_mask.RegionXywhHasAny(neighborhoodLeft, neighborhoodTop, patchWidth, patchHeight, Mask::UNKNOWN))
 		{
-			const int neighborhoodLeft = x - patchHalfWidth;
-			if (m_mask.RegionXywhHasAny(neighborhoodLeft, neighborhoodTop, patchWidth, patchHeight, Mask::UNKNOWN))
-			{
-				m_pointNodeIndices[pointIndex] = m_nodeStorage.size();
-				m_nodeStorage.push_back(Node(m_nodeContext, m_mask, x, y));
-			}
-			else
-			{
-				m_pointNodeIndices[pointIndex] = INVALID_INDEX;
-			}
+			m_pointNodeIndices[LfnTech::GetRowMajorIndex(m_numCols, col, row)] = m_nodeStorage.size();
+			m_nodeStorage.push_back(Node(m_nodeContext, m_mask, m_nodeStorage.size(), x, y));
 		}
 	}
 }
@@ -184,83 +196,156 @@ LfnIc::NodeSet::NodeSet(
 	const ImageConst& inputImage,
 	const MaskLod& mask,
 	const LabelSet& labelSet,
-	EnergyCalculatorContainer& energyCalculatorContainer) :
-m_nodeContext(settings, labelSet, energyCalculatorContainer),
+	EnergyCalculatorContainer& energyCalculatorContainer,
+	const LfnTech::ThreadPool& threadPool) :
+m_nodeContext(settings, mask, labelSet, energyCalculatorContainer, threadPool, *this),
 m_depth(0)
 {
 	Lattice lattice(inputImage, mask, m_nodeContext, *this);
 	lattice.CreateUnknownRegionNodes();
 	lattice.ConnectNeighboringNodes();
+	PrecomputeNodeEdges();
 
 	m_nodeSetInfo.resize(size());
+
+	// Every node starts out uncommitted, with the same priority, so the
+	// nodes' index order is already a valid heap.
+	m_uncommittedHeap.resize(size());
+	for (int i = 0, n = size(); i < n; ++i)
+	{
+		wxASSERT(operator[](i).GetIndex() == i);
+		m_uncommittedHeap[i] = i;
+		m_nodeSetInfo[i].heapPosition = i;
+	}
 }
 
 void LfnIc::NodeSet::UpdatePriority(const Node& node)
 {
-	for (int i = 0, n = size(); i < n; ++i)
+	SetPriority(node, node.CalculatePriority());
+}
+
+void LfnIc::NodeSet::SetPriority(const Node& node, Priority priority)
+{
+	const int index = node.GetIndex();
+	wxASSERT(&(operator[](index)) == &node);
+
+	NodeInfo& nodeInfo = m_nodeSetInfo[index];
+	const Priority priorityOld = nodeInfo.priority;
+	nodeInfo.priority = priority;
+
+	if (nodeInfo.heapPosition != COMMITTED_HEAP_POSITION)
 	{
-		if (&(operator[](i)) == &node)
+		if (nodeInfo.priority > priorityOld)
 		{
-			m_nodeSetInfo[i].priority = node.CalculatePriority();
-			break;
+			HeapSiftUp(nodeInfo.heapPosition);
+		}
+		else
+		{
+			HeapSiftDown(nodeInfo.heapPosition);
 		}
 	}
 }
 
 LfnIc::Priority LfnIc::NodeSet::GetPriority(const Node& node) const
 {
-	Priority priority = PRIORITY_MIN;
-	for (int i = 0, n = size(); i < n; ++i)
+	wxASSERT(&(operator[](node.GetIndex())) == &node);
+	return m_nodeSetInfo[node.GetIndex()].priority;
+}
+
+void LfnIc::NodeSet::SetCommitted(const Node& node, bool committed)
+{
+	const int index = node.GetIndex();
+	wxASSERT(&(operator[](index)) == &node);
+
+	NodeInfo& nodeInfo = m_nodeSetInfo[index];
+	const bool isCommitted = (nodeInfo.heapPosition == COMMITTED_HEAP_POSITION);
+	if (committed && !isCommitted)
 	{
-		if (&(operator[](i)) == &node)
+		// Move the last node into the removed node's position, and restore
+		// the heap property from there.
+		const int heapPosition = nodeInfo.heapPosition;
+		const int heapPositionLast = m_uncommittedHeap.size() - 1;
+		HeapSwap(heapPosition, heapPositionLast);
+		m_uncommittedHeap.pop_back();
+		nodeInfo.heapPosition = COMMITTED_HEAP_POSITION;
+
+		if (heapPosition < heapPositionLast)
 		{
-			priority = m_nodeSetInfo[i].priority;
-			break;
+			HeapSiftUp(heapPosition);
+			HeapSiftDown(heapPosition);
 		}
 	}
+	else if (!committed && isCommitted)
+	{
+		nodeInfo.heapPosition = m_uncommittedHeap.size();
+		m_uncommittedHeap.push_back(index);
+		HeapSiftUp(nodeInfo.heapPosition);
+	}
+}
 
-	return priority;
+bool LfnIc::NodeSet::IsCommitted(const Node& node) const
+{
+	wxASSERT(&(operator[](node.GetIndex())) == &node);
+	return m_nodeSetInfo[node.GetIndex()].heapPosition == COMMITTED_HEAP_POSITION;
 }
 
-void LfnIc::NodeSet::SetCommitted(const Node& node, bool committed)
+LfnIc::Node* LfnIc::NodeSet::GetHighestPriorityUncommittedNode() const
+{
+	return m_uncommittedHeap.empty()
+		? NULL
+		: const_cast<Node*>(&at(m_uncommittedHeap[0]));
+}
+
+void LfnIc::NodeSet::WriteCheckpoint(std::ostream& ostream) const
 {
+	PriorityBpCheckpoint::Write(ostream, m_depth);
+	PriorityBpCheckpoint::Write(ostream, int(size()));
 	for (int i = 0, n = size(); i < n; ++i)
 	{
-		if (&(operator[](i)) == &node)
-		{
-			m_nodeSetInfo[i].isCommitted = committed;
-			break;
-		}
+		PriorityBpCheckpoint::Write(ostream, m_nodeSetInfo[i].priority);
+		at(i).WriteCheckpoint(ostream);
 	}
 }
 
-bool LfnIc::NodeSet::IsCommitted(const Node& node) const
+bool LfnIc::NodeSet::ReadCheckpoint(std::istream& istream)
 {
-	for (int i = 0, n = size(); i < n; ++i)
+	int depth = 0;
+	int nodeNum = 0;
+	bool result =
+		PriorityBpCheckpoint::Read(istream, depth) &&
+		PriorityBpCheckpoint::Read(istream, nodeNum) &&
+		depth == m_depth &&
+		nodeNum == int(size());
+
+	for (int i = 0, n = size(); result && i < n; ++i)
 	{
-		if (&(operator[](i)) == &node)
+		Node& node = at(i);
+		Priority priority;
+		result =
+			PriorityBpCheckpoint::Read(istream, priority) &&
+			node.ReadCheckpoint(istream);
+
+		if (result)
 		{
-			return m_nodeSetInfo[i].isCommitted;
+			SetPriority(node, priority);
 		}
 	}
 
-	return false;
-}
-
-LfnIc::Node* LfnIc::NodeSet::GetHighestPriorityUncommittedNode() const
-{
-	Node* node = NULL;
-	Priority priorityHighest = PRIORITY_MIN;
-	for (int i = 0, n = size(); i < n; ++i)
+	if (!result)
 	{
-		if (!m_nodeSetInfo[i].isCommitted && m_nodeSetInfo[i].priority > priorityHighest)
+		// Don't leave a mix of restored and unrestored nodes.
+		for (int i = 0, n = size(); i < n; ++i)
 		{
-			node = const_cast<Node*>(&at(i));
-			priorityHighest = m_nodeSetInfo[i].priority;
+			at(i).ResetLabels();
 		}
 	}
 
-	return node;
+	return result;
+}
+
+const LfnIc::LabelPairEnergyCache& LfnIc::NodeSet::GetLabelPairEnergyCache() const
+{
+	return m_nodeContext.labelPairEnergyCache;
 }
 
 void LfnIc::NodeSet::ScaleUp()
@@ -268,11 +353,17 @@ void LfnIc::NodeSet::ScaleUp()
 	wxASSERT(m_depth > 0);
 	--m_depth;
 
+	// The cached label pairs are at the previous resolution.
+	m_nodeContext.labelPairEnergyCache.Clear(m_nodeContext.cacheBudget);
+
 	for (int i = 0, n = size(); i < n; ++i)
 	{
 		Node& node = at(i);
 		node.ScaleUp();
 	}
+
+	PrecomputeNodeEdges();
+	PrecomputeKnownRegions();
 }
 
 void LfnIc::NodeSet::ScaleDown()
@@ -280,11 +371,17 @@ void LfnIc::NodeSet::ScaleDown()
 	wxASSERT(m_depth >= 0);
 	++m_depth;
 
+	// The cached label pairs are at the previous resolution.
+	m_nodeContext.labelPairEnergyCache.Clear(m_nodeContext.cacheBudget);
+
 	for (int i = 0, n = size(); i < n; ++i)
 	{
 		Node& node = at(i);
 		node.ScaleDown();
 	}
+
+	PrecomputeNodeEdges();
+	PrecomputeKnownRegions();
 }
 
 int LfnIc::NodeSet::GetScaleDepth() const
@@ -292,8 +389,84 @@ int LfnIc::NodeSet::GetScaleDepth() const
 	return m_depth;
 }
 
+void LfnIc::NodeSet::PrecomputeNodeEdges()
+{
+	// Every node must be at the new resolution first, since the edges
+	// depend on the neighbors' positions.
+	for (int i = 0, n = size(); i < n; ++i)
+	{
+		at(i).PrecomputeEdges();
+	}
+}
+
+void LfnIc::NodeSet::PrecomputeKnownRegions()
+{
+	for (int i = 0, n = size(); i < n; ++i)
+	{
+		Node& node = at(i);
+		node.PrecomputeKnownRegion();
+	}
+}
+
+bool LfnIc::NodeSet::IsHigherPriority(int a, int b) const
+{
+	const Priority priorityA = m_nodeSetInfo[a].priority;
+	const Priority priorityB = m_nodeSetInfo[b].priority;
+	return (priorityA > priorityB) || (priorityA == priorityB && a < b);
+}
+
+void LfnIc::NodeSet::HeapSiftUp(int heapPosition)
+{
+	while (heapPosition > 0)
+	{
+		const int heapPositionParent = (heapPosition - 1) / 2;
+		if (!IsHigherPriority(m_uncommittedHeap[heapPosition], m_uncommittedHeap[heapPositionParent]))
+		{
+			break;
+		}
+
+		HeapSwap(heapPosition, heapPositionParent);
+		heapPosition = heapPositionParent;
+	}
+}
+
+void LfnIc::NodeSet::HeapSiftDown(int heapPosition)
+{
+	for (int n = m_uncommittedHeap.size(); ; )
+	{
+		const int heapPositionLeft = (heapPosition * 2) + 1;
+		const int heapPositionRight = heapPositionLeft + 1;
+		int heapPositionHighest = heapPosition;
+
+		if (heapPositionLeft < n && IsHigherPriority(m_uncommittedHeap[heapPositionLeft], m_uncommittedHeap[heapPositionHighest]))
+		{
+			heapPositionHighest = heapPositionLeft;
+		}
+
+		if (heapPositionRight < n && IsHigherPriority(m_uncommittedHeap[heapPositionRight], m_uncommittedHeap[heapPositionHighest]))
+		{
+			heapPositionHighest = heapPositionRight;
+		}
+
+		if (heapPositionHighest == heapPosition)
+		{
+			break;
+		}
+
+		HeapSwap(heapPosition, heapPositionHighest);
+		heapPosition = heapPositionHighest;
+	}
+}
+
+void LfnIc::NodeSet::HeapSwap(int heapPositionA, int heapPositionB)
+{
+	std::swap(m_uncommittedHeap[heapPositionA], m_uncommittedHeap[heapPositionB]);
+	m_nodeSetInfo[m_uncommittedHeap[heapPositionA]].heapPosition = heapPositionA;
+	m_nodeSetInfo[m_uncommittedHeap[heapPositionB]].heapPosition = heapPositionB;
+}
+
 LfnIc::NodeSet::NodeInfo::NodeInfo() :
 priority(PRIORITY_MIN),
-isCommitted(false)
+heapPosition(COMMITTED_HEAP_POSITION)
 {
 }
@@ -37,7 +37,12 @@ namespace LfnIc
 
 	///
 	/// Contains the Markov Random Field lattice nodes that intersect with the
-	/// unknown region.
+	/// unknown region, in the order of a Hilbert curve over the lattice,
+	/// which keeps neighbors close in memory. Each node is stored at its
+	/// Node::GetIndex(), and the uncommitted nodes are kept in an indexed
+	/// max-heap by priority, so that node lookups are O(1), and priority
+	/// updates, commitment changes and highest priority selection are
+	/// O(log N).
 	///
 	class NodeSet : private std::vector<Node>, public Scalable
 	{
@@ -47,7 +52,8 @@ namespace LfnIc
 			const ImageConst& inputImage,
 			const MaskLod& mask,
 			const LabelSet& labelSet,
-			EnergyCalculatorContainer& energyCalculatorContainer);
+			EnergyCalculatorContainer& energyCalculatorContainer,
+			const LfnTech::ThreadPool& threadPool);
 
 		/// Elevate select vector methods to public access:
 		typedef std::vector<Node> Super;
@@ -58,6 +64,11 @@ namespace LfnIc
 		/// order.
 		void UpdatePriority(const Node& node);
 
+		/// Stores a priority that was already calculated by the node, and
+		/// updates the node set's priority order. This lets the priorities
+		/// be calculated concurrently, and applied in a fixed order.
+		void SetPriority(const Node& node, Priority priority);
+
 		/// Returns the stored priority for the node.
 		Priority GetPriority(const Node& node) const;
 
@@ -68,9 +79,22 @@ namespace LfnIc
 		bool IsCommitted(const Node& node) const;
 
 		/// Returns the uncommitted node of the highest priority, or NULL if
-		/// none remain.
+		/// none remain. Equal priorities are broken by the lower index.
 		Node* GetHighestPriorityUncommittedNode() const;
 
+		/// Returns the label pair energies shared by the nodes' first pruning
+		/// at the current resolution, for its statistics.
+		const LabelPairEnergyCache& GetLabelPairEnergyCache() const;
+
+		/// Writes the nodes' labels, messages and priorities, at the current
+		/// resolution, to a checkpoint. See PriorityBpCheckpoint.
+		void WriteCheckpoint(std::ostream& ostream) const;
+
+		/// Restores the nodes from a checkpoint written by WriteCheckpoint()
+		/// at the same resolution. Returns false if it couldn't be read, in
+		/// which case every node is reset to the global label set.
+		bool ReadCheckpoint(std::istream& istream);
+
 		/// Scalable interface
 		virtual void ScaleUp();
 		virtual void ScaleDown();
@@ -85,13 +109,46 @@ namespace LfnIc
 			NodeInfo();
 
 			Priority priority;
-			bool isCommitted;
+
+			// The node's position in m_uncommittedHeap, or
+			// COMMITTED_HEAP_POSITION if it's committed.
+			int heapPosition;
 		};
 		typedef std::vector<NodeInfo> NodeSetInfo;
 
+		static const int COMMITTED_HEAP_POSITION = -1;
+
+		//
+		// Internal methods
+		//
+
+		// Calls Node::PrecomputeEdges() on every node.
+		void PrecomputeNodeEdges();
+
+		// Calls Node::PrecomputeKnownRegion() on every node. The mask is
+		// scaled before the node set, so it's already at the nodes' new
+		// resolution.
+		void PrecomputeKnownRegions();
+
+		// Returns true if node index a should be above node index b in the
+		// heap.
+		bool IsHigherPriority(int a, int b) const;
+
+		// Heap maintenance. Both move the node index at heapPosition until the
+		// heap property is restored.
+		void HeapSiftUp(int heapPosition);
+		void HeapSiftDown(int heapPosition);
+		void HeapSwap(int heapPositionA, int heapPositionB);
+
+		//
+		// Data
+		//
 		Node::Context m_nodeContext;
 		NodeSetInfo m_nodeSetInfo;
 
+		// Max-heap of the uncommitted nodes' indices.
+		std::vector<int> m_uncommittedHeap;
+
 		int m_depth;
 	};
 }
@@ -0,0 +1,221 @@
+//
+// Copyright 2010, Darren Lafreniere
+// <http://www.lafarren.com/image-completer/>
+//
+// This file is part of lafarren.com's Image Completer.
+//
+// Image Completer is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Image Completer is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Image Completer, named License.txt. If not, see
+// <http://www.gnu.org/licenses/>.
+//
+
+#include "Pch.h"
+#include "PriorityBpCheckpoint.h"
+
+#include <stdio.h>
+
+#include "LfnIcImage.h"
+#include "LfnIcMask.h"
+#include "LfnIcSettings.h"
+#include "NodeSet.h"
+#include "PriorityBpRunner.h"
+
+#include "tech/DbgMem.h"
+
+namespace LfnIc
+{
+	// Identifies the file format. Bump the version whenever the format, or
+	// the meaning of the saved state, changes.
+	static const char g_checkpointFileTag[] = "lfn-ic-priority-bp-checkpoint";
+	static const int g_checkpointFileVersion = 1;
+
+	static std::string g_checkpointFilePath;
+
+	// 64 bit FNV-1a, for identifying the completion that a checkpoint is
+	// from.
+	static const uint64 HASH_OFFSET_BASIS = 14695981039346656037ULL;
+	static const uint64 HASH_PRIME = 1099511628211ULL;
+
+	static void HashBytes(uint64& hash, const void* bytes, size_t numBytes)
+	{
+		const unsigned char* byte = static_cast<const unsigned char*>(bytes);
+		for (size_t i = 0; i < numBytes; ++i)
+		{
+			hash = (hash ^ byte[i]) * HASH_PRIME;
+		}
+	}
+
+	template<typename T>
+	static void HashValue(uint64& hash, const T& value)
+	{
+		HashBytes(hash, &value, sizeof(T));
+	}
+}
+
+void LfnIc::PriorityBpCheckpoint::SetFilePath(const std::string& filePath)
+{
+	g_checkpointFilePath = filePath;
+}
+
+const std::string& LfnIc::PriorityBpCheckpoint::GetFilePath()
+{
+	return g_checkpointFilePath;
+}
+
+LfnIc::PriorityBpCheckpoint::PriorityBpCheckpoint(const Settings& settings, const Image& inputImage, const Mask& mask) :
+m_completionHash(HASH_OFFSET_BASIS),
+m_canResume(false)
+{
+	memset(&m_resumeHeader, 0, sizeof(m_resumeHeader));
+
+	// The settings that change the solution. The others, like the number
+	// of threads or the cache size, only change how fast it's found. That
+	// includes the parallel schedule, whose waves are a fixed size rather
+	// than one node per thread, but the solution does depend on that size.
+	HashValue(m_completionHash, settings.lowResolutionPassesMax);
+	HashValue(m_completionHash, settings.numIterations);
+	HashValue(m_completionHash, settings.convergenceEnergyThreshold);
+	HashValue(m_completionHash, settings.freezeStableIterations);
+	HashValue(m_completionHash, settings.candidateLabelsPerNode);
+	HashValue(m_completionHash, settings.priorityBpSchedule);
+	if (settings.priorityBpSchedule == PriorityBpScheduleParallel)
+	{
+		const int waveNodesMax = PriorityBpRunner::WAVE_NODES_MAX;
+		HashValue(m_completionHash, waveNodesMax);
+	}
+	HashValue(m_completionHash, settings.latticeGapX);
+	HashValue(m_completionHash, settings.latticeGapY);
+	HashValue(m_completionHash, settings.patchWidth);
+	HashValue(m_completionHash, settings.patchHeight);
+	HashValue(m_completionHash, settings.confidenceBeliefThreshold);
+	HashValue(m_completionHash, settings.pruneBeliefThreshold);
+	HashValue(m_completionHash, settings.pruneEnergySimilarThreshold);
+	HashValue(m_completionHash, settings.postPruneLabelsMin);
+	HashValue(m_completionHash, settings.postPruneLabelsMax);
+
+	const int width = inputImage.GetWidth();
+	const int height = inputImage.GetHeight();
+	HashValue(m_completionHash, width);
+	HashValue(m_completionHash, height);
+	HashBytes(m_completionHash, inputImage.GetData(), sizeof(Image::Pixel) * width * height);
+	for (int y = 0; y < height; ++y)
+	{
+		for (int x = 0; x < width; ++x)
+		{
+			HashValue(m_completionHash, mask.GetValue(x, y));
+		}
+	}
+
+	if (!g_checkpointFilePath.empty())
+	{
+		std::ifstream file(g_checkpointFilePath.c_str(), std::ios::binary);
+		m_canResume = file.is_open() && ReadHeader(file, m_resumeHeader);
+	}
+}
+
+bool LfnIc::PriorityBpCheckpoint::CanResume() const
+{
+	return m_canResume;
+}
+
+int LfnIc::PriorityBpCheckpoint::GetResumeDepth() const
+{
+	return m_resumeHeader.depth;
+}
+
+int LfnIc::PriorityBpCheckpoint::GetResumeIterationsRun() const
+{
+	return m_resumeHeader.iterationsRun;
+}
+
+bool LfnIc::PriorityBpCheckpoint::IsResumeDepthComplete() const
+{
+	return m_resumeHeader.isDepthComplete != 0;
+}
+
+bool LfnIc::PriorityBpCheckpoint::Resume(NodeSet& nodeSet)
+{
+	wxASSERT(m_canResume);
+	wxASSERT(nodeSet.GetScaleDepth() == m_resumeHeader.depth);
+	m_canResume = false;
+
+	std::ifstream file(g_checkpointFilePath.c_str(), std::ios::binary);
+	Header header;
+	bool result =
+		ReadHeader(file, header) &&
+		header.depth == m_resumeHeader.depth &&
+		header.iterationsRun == m_resumeHeader.iterationsRun &&
+		header.isDepthComplete == m_resumeHeader.isDepthComplete;
+
+	// The node set resets its nodes if it fails partway.
+	result = result && nodeSet.ReadCheckpoint(file);
+	return result;
+}
+
+bool LfnIc::PriorityBpCheckpoint::Save(const NodeSet& nodeSet, int iterationsRun, bool isDepthComplete) const
+{
+	wxASSERT(!g_checkpointFilePath.empty());
+
+	Header header;
+	header.completionHash = m_completionHash;
+	header.depth = nodeSet.GetScaleDepth();
+	header.iterationsRun = iterationsRun;
+	header.isDepthComplete = isDepthComplete ? 1 : 0;
+
+	const std::string tempFilePath = g_checkpointFilePath + ".tmp";
+	bool result = false;
+	{
+		std::ofstream file(tempFilePath.c_str(), std::ios::binary);
+		file.write(g_checkpointFileTag, sizeof(g_checkpointFileTag));
+		Write(file, g_checkpointFileVersion);
+		Write(file, header);
+		nodeSet.WriteCheckpoint(file);
+
+		file.close();
+		result = !file.fail();
+	}
+
+	if (result)
+	{
+		// rename() replaces the old checkpoint in one step where it can. On
+		// platforms where it won't replace an existing file, remove it
+		// first.
+		result = (rename(tempFilePath.c_str(), g_checkpointFilePath.c_str()) == 0);
+		if (!result)
+		{
+			remove(g_checkpointFilePath.c_str());
+			result = (rename(tempFilePath.c_str(), g_checkpointFilePath.c_str()) == 0);
+		}
+	}
+	else
+	{
+		remove(tempFilePath.c_str());
+	}
+
+	return result;
+}
+
+bool LfnIc::PriorityBpCheckpoint::ReadHeader(std::istream& istream, Header& outHeader) const
+{
+	char tag[sizeof(g_checkpointFileTag)];
+	int version = 0;
+	return
+		!istream.read(tag, sizeof(tag)).fail() &&
+		memcmp(tag, g_checkpointFileTag, sizeof(tag)) == 0 &&
+		Read(istream, version) &&
+		version == g_checkpointFileVersion &&
+		Read(istream, outHeader) &&
+		outHeader.completionHash == m_completionHash &&
+		outHeader.depth >= 0 &&
+		outHeader.iterationsRun >= 0;
+}
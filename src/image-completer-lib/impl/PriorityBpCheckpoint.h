@@ -0,0 +1,118 @@
+//
+// Copyright 2010, Darren Lafreniere
+// <http://www.lafarren.com/image-completer/>
+//
+// This file is part of lafarren.com's Image Completer.
+//
+// Image Completer is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Image Completer is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Image Completer, named License.txt. If not, see
+// <http://www.gnu.org/licenses/>.
+//
+
+#ifndef PRIORITY_BP_CHECKPOINT_H
+#define PRIORITY_BP_CHECKPOINT_H
+
+#include "tech/Core.h"
+
+namespace LfnIc
+{
+	// Forward declarations
+	class Image;
+	class Mask;
+	class NodeSet;
+	struct Settings;
+
+	///
+	/// Saves the Priority-BP state of the node set to a binary file, so that
+	/// a completion that's interrupted can be resumed from the last
+	/// checkpoint rather than from scratch. A checkpoint stores the current
+	/// resolution depth, and the nodes' labels, messages and priorities. It's
+	/// saved after each low resolution pass, and every
+	/// settings.checkpointIterations iterations.
+	///
+	/// Checkpoints are identified by the input image, mask and the settings
+	/// that decide the solution, so that a completion only resumes its own.
+	/// Resuming skips the resolutions below the checkpoint's, which were
+	/// already solved, restores the nodes at the checkpoint's resolution, and
+	/// continues from there.
+	///
+	class PriorityBpCheckpoint
+	{
+	public:
+		/// Sets the file that checkpoints are saved to and resumed from. An
+		/// empty path, the default, disables checkpoints.
+		static void SetFilePath(const std::string& filePath);
+		static const std::string& GetFilePath();
+
+		/// Reads the header of the checkpoint file, if there is one, to find
+		/// out whether this completion can be resumed from it.
+		PriorityBpCheckpoint(const Settings& settings, const Image& inputImage, const Mask& mask);
+
+		/// Returns true if the checkpoint file is from this completion, and
+		/// hasn't been resumed from yet.
+		bool CanResume() const;
+
+		/// The checkpoint's resolution depth, the number of iterations it
+		/// had run at that depth, and whether they had run to completion.
+		int GetResumeDepth() const;
+		int GetResumeIterationsRun() const;
+		bool IsResumeDepthComplete() const;
+
+		/// Restores the node set, which must be at the resume depth, from the
+		/// checkpoint file. Returns false if it couldn't be read, in which
+		/// case the nodes are left on the global label set, without messages.
+		/// CanResume() is false afterwards either way.
+		bool Resume(NodeSet& nodeSet);
+
+		/// Saves the node set at its current depth, after iterationsRun
+		/// iterations. The checkpoint is written to a temporary file, which
+		/// then replaces the checkpoint file, so that an interrupted save
+		/// leaves the previous checkpoint intact. Returns false if it
+		/// couldn't be saved.
+		bool Save(const NodeSet& nodeSet, int iterationsRun, bool isDepthComplete) const;
+
+		/// Raw binary value reading and writing, for the state that the
+		/// node set and nodes save into the checkpoint.
+		template<typename T>
+		static inline void Write(std::ostream& ostream, const T& value)
+		{
+			ostream.write(reinterpret_cast<const char*>(&value), sizeof(T));
+		}
+
+		template<typename T>
+		static inline bool Read(std::istream& istream, T& outValue)
+		{
+			return !istream.read(reinterpret_cast<char*>(&outValue), sizeof(T)).fail();
+		}
+
+	private:
+		// The checkpoint's header, which follows the file tag and version.
+		struct Header
+		{
+			uint64 completionHash;
+			int depth;
+			int iterationsRun;
+			int isDepthComplete;
+		};
+
+		// Reads the file tag, version and header, and returns false if they
+		// aren't from this version, or this completion.
+		bool ReadHeader(std::istream& istream, Header& outHeader) const;
+
+		uint64 m_completionHash;
+		Header m_resumeHeader;
+		bool m_canResume;
+	};
+}
+
+#endif
@@ -22,18 +22,25 @@
 #include "Pch.h"
 #include "PriorityBpRunner.h"
 
+#include "tech/AllocationCounter.h"
 #include "tech/Profile.h"
+#include "tech/ThreadPool.h"
 
 #include "ConstNodeLabels.h"
 #include "Label.h"
+#include "LabelCandidateSearch.h"
 #include "NodeSet.h"
 #include "LfnIcSettings.h"
+#include "PriorityBpCheckpoint.h"
 
 #include "tech/DbgMem.h"
 
 #define ENABLE_TIME_PROFILING 0
 #define ENABLE_MEM_PROFILING 0
 
+// If set, each iteration's convergence statistics are written to stdout.
+#define ENABLE_CONVERGENCE_LOGGING 0
+
 #if ENABLE_TIME_PROFILING
 #define PRIORITY_BP_TIME_PROFILE(__name__) TECH_TIME_PROFILE_EVERY_SAMPLE(__name__)
 #else
@@ -71,11 +78,121 @@
 //			send all messages mpq(.) from node p to node q
 //			update beliefs bq(.) as well as priority of node q
 //
+// The parallel schedule (PriorityBpScheduleParallel) replaces the single
+// node p of each step with a wave of nodes that are at least 3 lattice
+// edges apart. Their neighbors are all distinct, so each wave node's
+// pruning, message sending and neighbor priority calculations only touch
+// state that's disjoint from the other wave nodes', and can run
+// concurrently. The priorities are applied to the node set in wave order
+// once the wave is done.
+//
+// The K iterations stop early once an iteration has converged (see
+// Settings::convergenceEnergyThreshold). Nodes whose best label has been
+// stable for Settings::freezeStableIterations are frozen, and are skipped
+// by the remaining passes, other than being committed in their turn.
+//
+
+namespace LfnIc
+{
+	// Up to this many candidates per wave node are examined for each wave,
+	// in priority order, before a wave is closed with fewer nodes.
+	const int WAVE_CANDIDATES_PER_NODE = 4;
+
+	// The nodes' label energy batches vary in cost, so the unary energy
+	// precomputation claims a few nodes at a time. Consecutive nodes are
+	// neighbors along the Hilbert curve, so they read the same image region.
+	const int UNARY_ENERGY_NODES_PER_CHUNK = 4;
+}
+
+//
+// PriorityBpRunner::WaveJob implementation
+//
+class LfnIc::PriorityBpRunner::WaveJob : public LfnTech::ThreadPool::Job
+{
+public:
+	WaveJob(PriorityBpRunner& priorityBpRunner, int waveBegin, ProcessNeighborsType type, bool prune) :
+	m_priorityBpRunner(priorityBpRunner),
+		m_waveBegin(waveBegin),
+		m_type(type),
+		m_prune(prune)
+	{
+	}
+
+	virtual void Process(int itemBegin, int itemEnd)
+	{
+		for (int i = itemBegin; i < itemEnd; ++i)
+		{
+			Node* node = m_priorityBpRunner.m_forwardOrder[m_waveBegin + i];
+			wxASSERT(node);
+
+			WaveNeighborPriority* neighborPriorities = &m_priorityBpRunner.m_waveNeighborPriorities[i * NumNeighborEdges];
+			m_priorityBpRunner.ProcessWaveNode(*node, m_type, m_prune, neighborPriorities);
+		}
+	}
+
+private:
+	PriorityBpRunner& m_priorityBpRunner;
+	const int m_waveBegin;
+	const ProcessNeighborsType m_type;
+	const bool m_prune;
+};
+
+//
+// PriorityBpRunner::UnaryEnergyJob implementation
+//
+class LfnIc::PriorityBpRunner::UnaryEnergyJob : public LfnTech::ThreadPool::Job
+{
+public:
+	UnaryEnergyJob(PriorityBpRunner& priorityBpRunner, bool calculatePriorities) :
+	m_priorityBpRunner(priorityBpRunner),
+		m_calculatePriorities(calculatePriorities)
+	{
+	}
+
+	// Items index m_unaryEnergyNodeIndices.
+	virtual void Process(int itemBegin, int itemEnd)
+	{
+		for (int i = itemBegin; i < itemEnd; ++i)
+		{
+			ProcessNode(m_priorityBpRunner.m_unaryEnergyNodeIndices[i]);
+		}
+	}
+
+	void ProcessNode(int nodeIndex)
+	{
+		const Node& node = m_priorityBpRunner.m_nodeSet[nodeIndex];
+		if (m_calculatePriorities)
+		{
+			// Calculating the priority calculates and caches the label
+			// energies.
+			m_priorityBpRunner.m_initialPriorities[nodeIndex] = node.CalculatePriority();
+		}
+		else
+		{
+			node.PrecomputeLabelEnergies();
+		}
+	}
 
-LfnIc::PriorityBpRunner::PriorityBpRunner(const Settings& settings, NodeSet& nodeSet) :
+private:
+	PriorityBpRunner& m_priorityBpRunner;
+	const bool m_calculatePriorities;
+};
+
+//
+// PriorityBpRunner implementation
+//
+LfnIc::PriorityBpRunner::PriorityBpRunner(const Settings& settings, const LabelSet& labelSet, NodeSet& nodeSet, LfnTech::ThreadPool& threadPool) :
 m_settings(settings),
+m_labelSet(labelSet),
 m_nodeSet(nodeSet),
-m_forwardOrder(nodeSet.size())
+m_threadPool(threadPool),
+m_forwardOrder(nodeSet.size()),
+m_waveStamp(0),
+m_messageDeltaMax(ENERGY_MIN),
+m_iterationsRun(0),
+m_frozenNodeNum(0),
+m_checkpoint(NULL),
+m_resumeIterationsRun(NOT_RESUMING)
 {
   std::cout << "There are " << nodeSet.size() << " nodes." << std::endl;
 }
@@ -100,30 +217,143 @@ void LfnIc::PriorityBpRunner::Run()
 	}
 #endif
 
-	// Assign node priorities and declare them uncommitted
-	{
-		PRIORITY_BP_TIME_PROFILE("LfnIc::PriorityBpRunner::Run - initial priorities");
-		PRIORITY_BP_MEM_PROFILE("LfnIc::PriorityBpRunner::Run - initial priorities");
+	// A resumed run's labels, messages and priorities were restored from a
+	// checkpoint.
+	const bool isResuming = (m_resumeIterationsRun != NOT_RESUMING);
 
-		for (int i = 0, n = m_nodeSet.size(); i < n; ++i)
-		{
-			Node& node = m_nodeSet[i];
-			m_nodeSet.UpdatePriority(node);
-			m_nodeSet.SetCommitted(node, false);
-		}
-
-		wxASSERT(m_forwardOrder.size() == m_nodeSet.size());
+	// Before the first run, narrow each node's labels down to candidates, so
+	// that the initial priorities and first pruning don't score every label.
+	if (!isResuming && m_settings.candidateLabelsPerNode != Settings::CANDIDATE_LABELS_PER_NODE_DISABLED)
+	{
+		LabelCandidateSearch labelCandidateSearch(m_settings, m_labelSet, m_nodeSet);
+		labelCandidateSearch.Run();
 	}
 
+	// Assign node priorities and declare them uncommitted
+	PrecomputeUnaryEnergies(!isResuming);
+
+	// Nodes that were frozen before the checkpoint aren't known, so a
+	// resumed run starts with none frozen. At least one iteration is run, so
+	// that m_forwardOrder is populated.
 	wxASSERT(m_settings.numIterations >= 1);
-	for (int i = 0; i < m_settings.numIterations; ++i)
+	m_nodeConvergence.assign(m_nodeSet.size(), NodeConvergence());
+	m_iterationsRun = isResuming ? std::min(m_resumeIterationsRun, m_settings.numIterations - 1) : 0;
+	m_resumeIterationsRun = NOT_RESUMING;
+	m_frozenNodeNum = 0;
+
+	const bool isCheckpointing = m_checkpoint && m_settings.checkpointIterations != Settings::CHECKPOINT_ITERATIONS_DISABLED;
+	for (int i = m_iterationsRun; i < m_settings.numIterations; ++i)
 	{
 		PRIORITY_BP_TIME_PROFILE("LfnIc::PriorityBpRunner::Run - iteration");
 		PRIORITY_BP_MEM_PROFILE(Str::Format("LfnIc::PriorityBpRunner::Run - iteration %d", i));
 
+#if TECH_ALLOCATION_COUNTER_ENABLED
+		const long allocationCountStart = LfnTech::GetAllocationCount();
+#endif
+
+		m_messageDeltaMax = ENERGY_MIN;
 		ForwardPass();
 		BackwardPass();
+		++m_iterationsRun;
+
+		const bool hasConverged = UpdateConvergence();
+
+#if TECH_ALLOCATION_COUNTER_ENABLED
+		// The first iterations prune the label sets and grow the nodes'
+		// scratch buffers. After that, an iteration is expected to make no
+		// heap allocations, unless the energy calculator container measures
+		// a new batch size.
+		std::cout << "Priority-BP iteration " << i << " made " << (LfnTech::GetAllocationCount() - allocationCountStart) << " heap allocations." << std::endl;
+#endif
+
+		if (hasConverged)
+		{
+			break;
+		}
+
+		// The last iteration's state is saved by the caller, if at all, once
+		// the resolution is complete.
+		if (isCheckpointing && m_iterationsRun % m_settings.checkpointIterations == 0 && m_iterationsRun < m_settings.numIterations)
+		{
+			if (!m_checkpoint->Save(m_nodeSet, m_iterationsRun, false))
+			{
+				std::cout << "Couldn't save the Priority-BP checkpoint to " << PriorityBpCheckpoint::GetFilePath() << "." << std::endl;
+			}
+		}
 	}
+
+	std::cout << "Ran " << m_iterationsRun << " of " << m_settings.numIterations << " Priority-BP iterations, with " << m_frozenNodeNum << " frozen nodes." << std::endl;
+
+	const LabelPairEnergyCache& labelPairEnergyCache = m_nodeSet.GetLabelPairEnergyCache();
+	const int64 labelPairLookupNum = labelPairEnergyCache.GetLookupNum();
+	if (labelPairLookupNum > 0)
+	{
+		const int64 labelPairHitNum = labelPairEnergyCache.GetHitNum();
+		std::cout << "Label pair energy cache: " << labelPairHitNum << " of " << labelPairLookupNum << " lookups hit ("
+			<< (100.0 * double(labelPairHitNum) / double(labelPairLookupNum)) << "%)." << std::endl;
+	}
+}
+
+int LfnIc::PriorityBpRunner::GetIterationsRun() const
+{
+	return m_iterationsRun;
+}
+
+void LfnIc::PriorityBpRunner::SetCheckpoint(const PriorityBpCheckpoint* checkpoint)
+{
+	m_checkpoint = checkpoint;
+}
+
+void LfnIc::PriorityBpRunner::ResumeNextRun(int iterationsRun)
+{
+	wxASSERT(iterationsRun >= 0);
+	m_resumeIterationsRun = iterationsRun;
+}
+
+void LfnIc::PriorityBpRunner::PrecomputeUnaryEnergies(bool calculatePriorities)
+{
+	PRIORITY_BP_TIME_PROFILE("LfnIc::PriorityBpRunner::PrecomputeUnaryEnergies");
+	PRIORITY_BP_MEM_PROFILE("LfnIc::PriorityBpRunner::PrecomputeUnaryEnergies");
+
+	const int nodeNum = m_nodeSet.size();
+	if (calculatePriorities)
+	{
+		m_initialPriorities.resize(nodeNum);
+	}
+
+	// The pool's threads can't measure batch sizes, and would fall back to
+	// the per-pixel calculator for those that the energy calculator
+	// container hasn't chosen a calculator for yet. Those nodes are run
+	// serially first, so that the container measures them. Measuring takes
+	// two batches per batch size, so only a few nodes are run serially.
+	UnaryEnergyJob job(*this, calculatePriorities);
+	m_unaryEnergyNodeIndices.clear();
+	m_unaryEnergyNodeIndices.reserve(nodeNum);
+	for (int i = 0; i < nodeNum; ++i)
+	{
+		if (m_nodeSet[i].HasChosenLabelEnergyCalculator())
+		{
+			m_unaryEnergyNodeIndices.push_back(i);
+		}
+		else
+		{
+			job.ProcessNode(i);
+		}
+	}
+
+	m_threadPool.Run(job, m_unaryEnergyNodeIndices.size(), UNARY_ENERGY_NODES_PER_CHUNK);
+
+	for (int i = 0; i < nodeNum; ++i)
+	{
+		Node& node = m_nodeSet[i];
+		if (calculatePriorities)
+		{
+			m_nodeSet.SetPriority(node, m_initialPriorities[i]);
+		}
+		m_nodeSet.SetCommitted(node, false);
+	}
+
+	wxASSERT(m_forwardOrder.size() == m_nodeSet.size());
 }
 
 void LfnIc::PriorityBpRunner::ForwardPass()
@@ -131,12 +361,22 @@ void LfnIc::PriorityBpRunner::ForwardPass()
 	PRIORITY_BP_TIME_PROFILE("LfnIc::PriorityBpRunner::ForwardPass");
 	PRIORITY_BP_MEM_PROFILE("LfnIc::PriorityBpRunner::ForwardPass");
 
+	if (m_settings.priorityBpSchedule == PriorityBpScheduleParallel)
+	{
+		ForwardPassParallel();
+		return;
+	}
+
 	for (int i = 0, n = m_nodeSet.size(); i < n; ++i)
 	{
 		Node* node = m_nodeSet.GetHighestPriorityUncommittedNode();
 		wxASSERT(node);
 
-		node->PruneLabels();
+		if (!IsFrozen(*node))
+		{
+			node->PruneLabels();
+		}
+
 		m_forwardOrder[i] = node;
 
 		m_nodeSet.SetCommitted(*node, true);
@@ -149,6 +389,12 @@ void LfnIc::PriorityBpRunner::BackwardPass()
 	PRIORITY_BP_TIME_PROFILE("LfnIc::PriorityBpRunner::BackwardPass");
 	PRIORITY_BP_MEM_PROFILE("LfnIc::PriorityBpRunner::BackwardPass");
 
+	if (m_settings.priorityBpSchedule == PriorityBpScheduleParallel)
+	{
+		BackwardPassParallel();
+		return;
+	}
+
 	for (int i = m_nodeSet.size(); --i >= 0; )
 	{
 		Node* node = m_forwardOrder[i];
@@ -161,22 +407,246 @@ void LfnIc::PriorityBpRunner::BackwardPass()
 
 void LfnIc::PriorityBpRunner::ProcessNeighbors(Node& node, ProcessNeighborsType type)
 {
+	if (IsFrozen(node))
+	{
+		return;
+	}
+
 	for (int i = 0; i < NumNeighborEdges; ++i)
 	{
 		NeighborEdge edge = NeighborEdge(i);
 		Node* neighbor = node.GetNeighbor(edge);
-		if (neighbor)
+		if (neighbor && !IsFrozen(*neighbor))
 		{
 			const bool desiredCommitment = (type == CommittedNeighbors);
 			if (m_nodeSet.IsCommitted(*neighbor) == desiredCommitment)
 			{
-				node.SendMessages(*neighbor);
+				const Energy messageDelta = node.SendMessages(edge);
+				if (messageDelta > m_messageDeltaMax)
+				{
+					m_messageDeltaMax = messageDelta;
+				}
+
 				m_nodeSet.UpdatePriority(*neighbor);
 			}
 		}
 	}
 }
 
+bool LfnIc::PriorityBpRunner::IsFrozen(const Node& node) const
+{
+	return m_nodeConvergence[node.GetIndex()].isFrozen;
+}
+
+bool LfnIc::PriorityBpRunner::UpdateConvergence()
+{
+	const bool isEarlyStopEnabled = (m_settings.convergenceEnergyThreshold != Settings::CONVERGENCE_ENERGY_THRESHOLD_DISABLED);
+	const bool isFreezingEnabled = (m_settings.freezeStableIterations != Settings::FREEZE_STABLE_ITERATIONS_DISABLED);
+	if (!isEarlyStopEnabled && !isFreezingEnabled)
+	{
+		return false;
+	}
+
+	int labelsPrunedNodeNum = 0;
+	int bestLabelChangedNodeNum = 0;
+	for (int i = 0, n = m_nodeSet.size(); i < n; ++i)
+	{
+		const Node& node = m_nodeSet[i];
+		NodeConvergence& nodeConvergence = m_nodeConvergence[node.GetIndex()];
+		if (nodeConvergence.isFrozen)
+		{
+			continue;
+		}
+
+		const int labelNum = ConstNodeLabels(node).size();
+		if (labelNum != nodeConvergence.labelNum)
+		{
+			nodeConvergence.labelNum = labelNum;
+			++labelsPrunedNodeNum;
+		}
+
+		Label bestLabel;
+		bool isDominant;
+		node.CalculateBestLabel(bestLabel, isDominant);
+
+		if (nodeConvergence.hasBestLabel && bestLabel == nodeConvergence.bestLabel)
+		{
+			nodeConvergence.stableIterations = isDominant ? (nodeConvergence.stableIterations + 1) : 0;
+		}
+		else
+		{
+			nodeConvergence.bestLabel = bestLabel;
+			nodeConvergence.hasBestLabel = true;
+			nodeConvergence.stableIterations = 0;
+			++bestLabelChangedNodeNum;
+		}
+
+		if (isFreezingEnabled && nodeConvergence.stableIterations >= m_settings.freezeStableIterations)
+		{
+			nodeConvergence.isFrozen = true;
+			++m_frozenNodeNum;
+		}
+	}
+
+#if ENABLE_CONVERGENCE_LOGGING
+	std::cout << "Iteration " << m_iterationsRun << ": max message delta " << m_messageDeltaMax << ", " << bestLabelChangedNodeNum << " best labels changed, " << labelsPrunedNodeNum << " nodes pruned, " << m_frozenNodeNum << " nodes frozen." << std::endl;
+#endif
+
+	return isEarlyStopEnabled
+		&& labelsPrunedNodeNum == 0
+		&& bestLabelChangedNodeNum == 0
+		&& m_messageDeltaMax <= m_settings.convergenceEnergyThreshold;
+}
+
+void LfnIc::PriorityBpRunner::ForwardPassParallel()
+{
+	const int nodeNum = m_nodeSet.size();
+	m_waveEnds.clear();
+	m_waveReservations.resize(nodeNum, 0);
+	m_waveNeighborPriorities.resize(WAVE_NODES_MAX * NumNeighborEdges);
+
+	for (int waveBegin = 0; waveBegin < nodeNum; )
+	{
+		const int waveEnd = SelectWave(waveBegin);
+		wxASSERT(waveEnd > waveBegin);
+
+		ProcessWave(waveBegin, waveEnd, UncommittedNeighbors, true);
+		m_waveEnds.push_back(waveEnd);
+		waveBegin = waveEnd;
+	}
+}
+
+void LfnIc::PriorityBpRunner::BackwardPassParallel()
+{
+	for (int wave = m_waveEnds.size(); --wave >= 0; )
+	{
+		const int waveBegin = (wave > 0) ? m_waveEnds[wave - 1] : 0;
+		const int waveEnd = m_waveEnds[wave];
+
+		// None of the wave's nodes are neighbors, so uncommitting all of them
+		// first doesn't change which neighbors each of them sends to.
+		for (int i = waveBegin; i < waveEnd; ++i)
+		{
+			m_nodeSet.SetCommitted(*m_forwardOrder[i], false);
+		}
+
+		ProcessWave(waveBegin, waveEnd, CommittedNeighbors, false);
+	}
+}
+
+int LfnIc::PriorityBpRunner::SelectWave(int waveBegin)
+{
+	// A new stamp releases all of the previous wave's reservations.
+	++m_waveStamp;
+
+	const int waveNodeMax = WAVE_NODES_MAX;
+	const int candidateMax = waveNodeMax * WAVE_CANDIDATES_PER_NODE;
+
+	// Candidates are committed as they're examined, so that the next one
+	// surfaces, and the skipped ones are uncommitted again afterwards. Ties
+	// in priority are broken by node index, so the selection only depends
+	// on the priorities.
+	m_waveSkippedNodes.clear();
+	int waveEnd = waveBegin;
+	for (int candidate = 0; candidate < candidateMax && waveEnd - waveBegin < waveNodeMax; ++candidate)
+	{
+		Node* node = m_nodeSet.GetHighestPriorityUncommittedNode();
+		if (!node)
+		{
+			break;
+		}
+
+		m_nodeSet.SetCommitted(*node, true);
+		if (m_waveReservations[node->GetIndex()] == m_waveStamp)
+		{
+			m_waveSkippedNodes.push_back(node);
+		}
+		else
+		{
+			ReserveWaveNeighborhood(*node);
+			m_forwardOrder[waveEnd++] = node;
+		}
+	}
+
+	for (int i = 0, n = m_waveSkippedNodes.size(); i < n; ++i)
+	{
+		m_nodeSet.SetCommitted(*m_waveSkippedNodes[i], false);
+	}
+
+	return waveEnd;
+}
+
+void LfnIc::PriorityBpRunner::ReserveWaveNeighborhood(const Node& node)
+{
+	m_waveReservations[node.GetIndex()] = m_waveStamp;
+	for (int i = 0; i < NumNeighborEdges; ++i)
+	{
+		const Node* neighbor = node.GetNeighbor(NeighborEdge(i));
+		if (neighbor)
+		{
+			m_waveReservations[neighbor->GetIndex()] = m_waveStamp;
+			for (int j = 0; j < NumNeighborEdges; ++j)
+			{
+				const Node* neighborsNeighbor = neighbor->GetNeighbor(NeighborEdge(j));
+				if (neighborsNeighbor)
+				{
+					m_waveReservations[neighborsNeighbor->GetIndex()] = m_waveStamp;
+				}
+			}
+		}
+	}
+}
+
+void LfnIc::PriorityBpRunner::ProcessWave(int waveBegin, int waveEnd, ProcessNeighborsType type, bool prune)
+{
+	const int waveNodeNum = waveEnd - waveBegin;
+	wxASSERT(waveNodeNum * NumNeighborEdges <= int(m_waveNeighborPriorities.size()));
+
+	WaveJob job(*this, waveBegin, type, prune);
+	m_threadPool.Run(job, waveNodeNum, 1);
+
+	for (int i = 0, n = waveNodeNum * NumNeighborEdges; i < n; ++i)
+	{
+		const WaveNeighborPriority& neighborPriority = m_waveNeighborPriorities[i];
+		if (neighborPriority.neighbor)
+		{
+			m_nodeSet.SetPriority(*neighborPriority.neighbor, neighborPriority.priority);
+			if (neighborPriority.messageDelta > m_messageDeltaMax)
+			{
+				m_messageDeltaMax = neighborPriority.messageDelta;
+			}
+		}
+	}
+}
+
+void LfnIc::PriorityBpRunner::ProcessWaveNode(Node& node, ProcessNeighborsType type, bool prune, WaveNeighborPriority neighborPriorities[NumNeighborEdges]) const
+{
+	const bool isFrozen = IsFrozen(node);
+	if (prune && !isFrozen)
+	{
+		node.PruneLabels();
+	}
+
+	for (int i = 0; i < NumNeighborEdges; ++i)
+	{
+		NeighborEdge edge = NeighborEdge(i);
+		WaveNeighborPriority& neighborPriority = neighborPriorities[i];
+		neighborPriority.neighbor = NULL;
+
+		Node* neighbor = isFrozen ? NULL : node.GetNeighbor(edge);
+		if (neighbor && !IsFrozen(*neighbor))
+		{
+			const bool desiredCommitment = (type == CommittedNeighbors);
+			if (m_nodeSet.IsCommitted(*neighbor) == desiredCommitment)
+			{
+				neighborPriority.messageDelta = node.SendMessages(edge);
+				neighborPriority.neighbor = neighbor;
+				neighborPriority.priority = neighbor->CalculatePriority();
+			}
+		}
+	}
+}
+
 // Sort the patches in ascending order of priority, so that the more
 // confident patches are laid atop the less confidence patches.
 struct SortPatchesByPriority
@@ -220,3 +690,11 @@ LfnIc::PriorityBpRunner::ForwardOrder::ForwardOrder(int nodeNum) :
 Super(nodeNum)
 {
 }
+
+LfnIc::PriorityBpRunner::NodeConvergence::NodeConvergence() :
+hasBestLabel(false),
+labelNum(0),
+stableIterations(0),
+isFrozen(false)
+{
+}
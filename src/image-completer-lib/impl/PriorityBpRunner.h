@@ -22,12 +22,20 @@
 #ifndef PRIORITY_BP_RUNNER_H
 #define PRIORITY_BP_RUNNER_H
 
+#include "Label.h"
 #include "Patch.h"
 
+namespace LfnTech
+{
+	class ThreadPool;
+}
+
 namespace LfnIc
 {
+	class LabelSet;
 	class Node;
 	class NodeSet;
+	class PriorityBpCheckpoint;
 	struct Settings;
 
 	///
@@ -37,11 +45,24 @@ namespace LfnIc
 	class PriorityBpRunner
 	{
 	public:
+		//
+		// Definitions
+		//
+
+		/// The parallel schedule's waves hold at most this many nodes. It's
+		/// fixed, rather than the number of threads, so that the solution
+		/// doesn't depend on the machine.
+		static const int WAVE_NODES_MAX = 16;
+
 		//
 		// Methods
 		//
 
-		PriorityBpRunner(const Settings& settings, NodeSet& nodeSet);
+		/// The thread pool is used by the parallel schedule (see
+		/// PriorityBpSchedule), and to precompute the nodes' label energies
+		/// and initial priorities. The label set is only used by the label
+		/// candidate search (see Settings::candidateLabelsPerNode).
+		PriorityBpRunner(const Settings& settings, const LabelSet& labelSet, NodeSet& nodeSet, LfnTech::ThreadPool& threadPool);
 
 		/// Executes the Priority-BP to completion, and populates the outPatches
 		/// object based on the solution. The patches are sorted by a
@@ -54,6 +75,20 @@ namespace LfnIc
 		/// the label set from each node.
 		void Run();
 
+		/// Returns the number of iterations that the last Run() used, which
+		/// is less than settings.numIterations if it converged early.
+		int GetIterationsRun() const;
+
+		/// If set, Run() saves a checkpoint every settings.checkpointIterations
+		/// iterations. NULL, the default, disables them.
+		void SetCheckpoint(const PriorityBpCheckpoint* checkpoint);
+
+		/// Makes the next Run() continue a run whose node set was restored
+		/// from a checkpoint after iterationsRun iterations. It skips the
+		/// label candidate search and the initial priority calculations, and
+		/// only runs the remaining iterations, or at least one.
+		void ResumeNextRun(int iterationsRun);
+
 	private:
 		//
 		// Internal definitions
@@ -75,12 +110,95 @@ namespace LfnIc
 			CommittedNeighbors,
 		};
 
+		// A neighbor's priority, calculated by a wave's job once the wave
+		// node has sent it messages, and applied to the node set afterwards.
+		// Also the largest change to those messages.
+		struct WaveNeighborPriority
+		{
+			Node* neighbor;
+			Priority priority;
+			Energy messageDelta;
+		};
+
+		// A node's state across the iterations, for detecting convergence.
+		struct NodeConvergence
+		{
+			NodeConvergence();
+
+			// The best label as of the last iteration, if hasBestLabel.
+			Label bestLabel;
+			bool hasBestLabel;
+
+			// The number of labels as of the last iteration. Labels are only
+			// pruned away during a resolution's iterations, so any change
+			// means some were.
+			int labelNum;
+
+			// The number of consecutive iterations after which bestLabel was
+			// unchanged and dominant.
+			int stableIterations;
+
+			// Frozen nodes neither prune their labels, nor send or receive
+			// messages.
+			bool isFrozen;
+		};
+
+		class WaveJob;
+		friend class WaveJob;
+
+		class UnaryEnergyJob;
+		friend class UnaryEnergyJob;
+
+		static const int NOT_RESUMING = -1;
+
 		//
 		// Internal methods
 		//
+		// Before a run's first forward pass, concurrently calculates every
+		// node's label energies, which the nodes cache for the passes, and,
+		// unless the run is resumed with restored priorities, their initial
+		// priorities. Then declares the nodes uncommitted.
+		void PrecomputeUnaryEnergies(bool calculatePriorities);
+
 		void ForwardPass();
 		void BackwardPass();
 		void ProcessNeighbors(Node& node, ProcessNeighborsType type);
+
+		bool IsFrozen(const Node& node) const;
+
+		// Called after each iteration. Updates m_nodeConvergence, and freezes
+		// the nodes that have been stable for settings.freezeStableIterations.
+		// Returns true if the iteration converged, according to
+		// settings.convergenceEnergyThreshold.
+		bool UpdateConvergence();
+
+		// The parallel schedule's passes. The forward pass records the end of
+		// each wave in m_waveEnds, and the backward pass replays them in
+		// reverse.
+		void ForwardPassParallel();
+		void BackwardPassParallel();
+
+		// Commits the highest priority uncommitted nodes that are at least 3
+		// lattice edges apart, so that no two of them share a neighbor, and
+		// stores them in m_forwardOrder from waveBegin. Returns the end of
+		// the wave, which is always past waveBegin if any nodes are
+		// uncommitted.
+		int SelectWave(int waveBegin);
+
+		// Marks the nodes within 2 lattice edges of node as unavailable to the
+		// current wave.
+		void ReserveWaveNeighborhood(const Node& node);
+
+		// Concurrently prunes the labels of the m_forwardOrder nodes in
+		// [waveBegin, waveEnd), if prune is true, and sends their messages to
+		// their neighbors of the given type. The neighbors' priorities are
+		// then applied in a fixed order, so the result doesn't depend on the
+		// threads' timing.
+		void ProcessWave(int waveBegin, int waveEnd, ProcessNeighborsType type, bool prune);
+
+		// A WaveJob's work for a single wave node.
+		void ProcessWaveNode(Node& node, ProcessNeighborsType type, bool prune, WaveNeighborPriority neighborPriorities[NumNeighborEdges]) const;
+
 		void PopulatePatches(std::vector<Patch>& outPatches) const;
 
 		//
@@ -88,8 +206,47 @@ namespace LfnIc
 		//
 
 		const Settings& m_settings;
+		const LabelSet& m_labelSet;
 		NodeSet& m_nodeSet;
+		LfnTech::ThreadPool& m_threadPool;
 		ForwardOrder m_forwardOrder;
+
+		// Parallel schedule only. The end of each of the last forward pass's
+		// waves within m_forwardOrder.
+		std::vector<int> m_waveEnds;
+
+		// Parallel schedule only. Indexed by Node::GetIndex(), the wave
+		// stamp of the last wave that reserved the node's neighborhood.
+		std::vector<int> m_waveReservations;
+		int m_waveStamp;
+
+		// Parallel schedule only. The candidates that SelectWave() skipped,
+		// kept as a member so that its memory is reused.
+		std::vector<Node*> m_waveSkippedNodes;
+
+		// Parallel schedule only. NumNeighborEdges entries per wave node.
+		std::vector<WaveNeighborPriority> m_waveNeighborPriorities;
+
+		// Indexed by Node::GetIndex().
+		std::vector<NodeConvergence> m_nodeConvergence;
+
+		// Indexed by Node::GetIndex(). The initial priorities calculated by
+		// PrecomputeUnaryEnergies(), applied in node order afterwards.
+		std::vector<Priority> m_initialPriorities;
+
+		// The nodes that PrecomputeUnaryEnergies() runs on the thread pool.
+		std::vector<int> m_unaryEnergyNodeIndices;
+
+		// The largest change to any message during the current iteration.
+		Energy m_messageDeltaMax;
+
+		int m_iterationsRun;
+		int m_frozenNodeNum;
+
+		const PriorityBpCheckpoint* m_checkpoint;
+
+		// The iterations that the next Run() resumes after, or NOT_RESUMING.
+		int m_resumeIterationsRun;
 	};
 };
 
@@ -29,11 +29,20 @@ namespace LfnIc
 	// Forward declarations
 	class Node;
 
+	///
+	/// Returns the parameters of a masked batch of the node's patch against
+	/// up to maxCalculations blocks, cropped to Node::GetKnownRegion(). The
+	/// ScopedNodeEnergyBatch classes offset each block B to match, so their
+	/// callers pass the labels' positions as usual.
+	///
+	inline EnergyCalculator::BatchParams GetNodeEnergyBatchParams(const Node& node, int maxCalculations);
+
 	///
 	/// Based on EnergyCalculator::BatchImmediate, this class assumes that
-	/// block A is masked. If the node does not overlap the known region, this
-	/// class will skip performing the energy calculation and will return
-	/// ENERGY_MIN for all Calculate calls.
+	/// block A is masked, with the parameters from GetNodeEnergyBatchParams().
+	/// If the node does not overlap the known region, this class will skip
+	/// performing the energy calculation and will return ENERGY_MIN for all
+	/// Calculate calls.
 	///
 	class ScopedNodeEnergyBatchImmediate
 	{
@@ -46,39 +55,31 @@ namespace LfnIc
 		inline ~ScopedNodeEnergyBatchImmediate();
 
 		inline Energy Calculate(int bLeft, int bTop) const;
+		inline Energy CalculateBounded(int bLeft, int bTop, Energy bound) const;
 
 	private:
-		class Delegate
+		// Constructed in m_batchStorage if the node overlaps the known
+		// region, otherwise NULL. Stored in place, so that opening a batch
+		// never allocates.
+		EnergyCalculator::BatchImmediate* m_batch;
+
+		// Added to each block B, since block A is cropped to the node's
+		// known region.
+		int m_bLeftOffset;
+		int m_bTopOffset;
+		union
 		{
-		public:
-			virtual ~Delegate() {}
-			virtual Energy Calculate(int bLeft, int bTop) const = 0;
+			void* m_batchAlignment;
+			char m_batchStorage[sizeof(EnergyCalculator::BatchImmediate)];
 		};
-
-		class DelegateOverlap : public Delegate
-		{
-		public:
-			inline DelegateOverlap(EnergyCalculator& energyCalculator, const EnergyCalculator::BatchParams& params);
-			virtual Energy Calculate(int bLeft, int bTop) const;
-
-		private:
-			EnergyCalculator::BatchImmediate m_batchImmediate;
-		};
-
-		class DelegateNoOverlap : public Delegate
-		{
-		public:
-			virtual Energy Calculate(int bLeft, int bTop) const;
-		};
-
-		Delegate* m_delegate;
 	};
 
 	//
 	// Based on EnergyCalculator::BatchQueued, this class assumes that block A
-	// is masked. If the node does not overlap the known region, this class
-	// will skip performing the energy calculation and will return ENERGY_MIN
-	// for all Calculate calls.
+	// is masked, with the parameters from GetNodeEnergyBatchParams(). If the
+	// node does not overlap the known region, this class will skip
+	// performing the energy calculation and will return ENERGY_MIN for all
+	// Calculate calls.
 	//
 	class ScopedNodeEnergyBatchQueued
 	{
@@ -97,36 +98,17 @@ namespace LfnIc
 		inline Energy GetResult(Handle handle) const;
 
 	private:
-		class Delegate
-		{
-		public:
-			virtual ~Delegate() {}
-			virtual Handle QueueCalculation(int bLeft, int bTop) = 0;
-			virtual void ProcessCalculations() = 0;
-			virtual Energy GetResult(Handle handle) const = 0;
-		};
+		// See ScopedNodeEnergyBatchImmediate::m_batch.
+		EnergyCalculator::BatchQueued* m_batch;
 
-		class DelegateOverlap : public Delegate
+		// See ScopedNodeEnergyBatchImmediate::m_bLeftOffset.
+		int m_bLeftOffset;
+		int m_bTopOffset;
+		union
 		{
-		public:
-			inline DelegateOverlap(EnergyCalculator& energyCalculator, const EnergyCalculator::BatchParams& params);
-			virtual Handle QueueCalculation(int bLeft, int bTop);
-			virtual void ProcessCalculations();
-			virtual Energy GetResult(Handle handle) const;
-
-		private:
-			EnergyCalculator::BatchQueued m_batchQueued;
+			void* m_batchAlignment;
+			char m_batchStorage[sizeof(EnergyCalculator::BatchQueued)];
 		};
-
-		class DelegateNoOverlap : public Delegate
-		{
-		public:
-			virtual Handle QueueCalculation(int bLeft, int bTop);
-			virtual void ProcessCalculations();
-			virtual Energy GetResult(Handle handle) const;
-		};
-
-		Delegate* m_delegate;
 	};
 }
 
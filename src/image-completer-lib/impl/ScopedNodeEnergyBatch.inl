@@ -33,6 +33,16 @@
 
 namespace LfnIc
 {
+	inline EnergyCalculator::BatchParams GetNodeEnergyBatchParams(const Node& node, int maxCalculations)
+	{
+		const Node::KnownRegion& knownRegion = node.GetKnownRegion();
+		return EnergyCalculator::BatchParams(
+			maxCalculations,
+			knownRegion.width, knownRegion.height,
+			node.GetLeft() + knownRegion.leftOffset, node.GetTop() + knownRegion.topOffset,
+			true);
+	}
+
 	//
 	// ScopedNodeEnergyBatchImmediate implementation
 	//
@@ -42,34 +52,31 @@ namespace LfnIc
 		const EnergyCalculator::BatchParams& params)
 	{
 		wxASSERT(params.aMasked);
-		m_delegate = node.OverlapsKnownRegion()
-			? static_cast<Delegate*>(new DelegateOverlap(energyCalculator, params))
-			: new DelegateNoOverlap();
+		m_bLeftOffset = node.GetKnownRegion().leftOffset;
+		m_bTopOffset = node.GetKnownRegion().topOffset;
+		wxASSERT(params.aLeft == node.GetLeft() + m_bLeftOffset && params.aTop == node.GetTop() + m_bTopOffset);
+
+		m_batch = node.OverlapsKnownRegion()
+			? new(m_batchStorage) EnergyCalculator::BatchImmediate(energyCalculator, params)
+			: NULL;
 	}
 
 	inline ScopedNodeEnergyBatchImmediate::~ScopedNodeEnergyBatchImmediate()
 	{
-		delete m_delegate;
+		if (m_batch)
+		{
+			m_batch->~BatchImmediate();
+		}
 	}
 
 	inline Energy ScopedNodeEnergyBatchImmediate::Calculate(int bLeft, int bTop) const
 	{
-		return m_delegate->Calculate(bLeft, bTop);
-	}
-
-	inline ScopedNodeEnergyBatchImmediate::DelegateOverlap::DelegateOverlap(EnergyCalculator& energyCalculator, const EnergyCalculator::BatchParams& params)
-		: m_batchImmediate(energyCalculator, params)
-	{
-	}
-
-	Energy ScopedNodeEnergyBatchImmediate::DelegateOverlap::Calculate(int bLeft, int bTop) const
-	{
-		return m_batchImmediate.Calculate(bLeft, bTop);
+		return m_batch ? m_batch->Calculate(bLeft + m_bLeftOffset, bTop + m_bTopOffset) : ENERGY_MIN;
 	}
 
-	Energy ScopedNodeEnergyBatchImmediate::DelegateNoOverlap::Calculate(int bLeft, int bTop) const
+	inline Energy ScopedNodeEnergyBatchImmediate::CalculateBounded(int bLeft, int bTop, Energy bound) const
 	{
-		return ENERGY_MIN;
+		return m_batch ? m_batch->CalculateBounded(bLeft + m_bLeftOffset, bTop + m_bTopOffset, bound) : ENERGY_MIN;
 	}
 
 	//
@@ -81,63 +88,39 @@ namespace LfnIc
 		const EnergyCalculator::BatchParams& params)
 	{
 		wxASSERT(params.aMasked);
-		m_delegate = node.OverlapsKnownRegion()
-			? static_cast<Delegate*>(new DelegateOverlap(energyCalculator, params))
-			: new DelegateNoOverlap();
+		m_bLeftOffset = node.GetKnownRegion().leftOffset;
+		m_bTopOffset = node.GetKnownRegion().topOffset;
+		wxASSERT(params.aLeft == node.GetLeft() + m_bLeftOffset && params.aTop == node.GetTop() + m_bTopOffset);
+
+		m_batch = node.OverlapsKnownRegion()
+			? new(m_batchStorage) EnergyCalculator::BatchQueued(energyCalculator, params)
+			: NULL;
 	}
 
 	inline ScopedNodeEnergyBatchQueued::~ScopedNodeEnergyBatchQueued()
 	{
-		delete m_delegate;
+		if (m_batch)
+		{
+			m_batch->~BatchQueued();
+		}
 	}
 
 	inline ScopedNodeEnergyBatchQueued::Handle ScopedNodeEnergyBatchQueued::QueueCalculation(int bLeft, int bTop)
 	{
-		return m_delegate->QueueCalculation(bLeft, bTop);
+		return m_batch ? m_batch->QueueCalculation(bLeft + m_bLeftOffset, bTop + m_bTopOffset) : EnergyCalculator::BatchQueued::INVALID_HANDLE;
 	}
 
 	inline void ScopedNodeEnergyBatchQueued::ProcessCalculations()
 	{
-		return m_delegate->ProcessCalculations();
+		if (m_batch)
+		{
+			m_batch->ProcessCalculations();
+		}
 	}
 
 	inline Energy ScopedNodeEnergyBatchQueued::GetResult(Handle handle) const
 	{
-		return m_delegate->GetResult(handle);
-	}
-
-	inline ScopedNodeEnergyBatchQueued::DelegateOverlap::DelegateOverlap(EnergyCalculator& energyCalculator, const EnergyCalculator::BatchParams& params)
-		: m_batchQueued(energyCalculator, params)
-	{
-	}
-
-	EnergyCalculator::BatchQueued::Handle ScopedNodeEnergyBatchQueued::DelegateOverlap::QueueCalculation(int bLeft, int bTop)
-	{
-		return m_batchQueued.QueueCalculation(bLeft, bTop);
-	}
-
-	void ScopedNodeEnergyBatchQueued::DelegateOverlap::ProcessCalculations()
-	{
-		return m_batchQueued.ProcessCalculations();
-	}
-
-	Energy ScopedNodeEnergyBatchQueued::DelegateOverlap::GetResult(Handle handle) const
-	{
-		return m_batchQueued.GetResult(handle);
-	}
-
-	EnergyCalculator::BatchQueued::Handle ScopedNodeEnergyBatchQueued::DelegateNoOverlap::QueueCalculation(int bLeft, int bTop)
-	{
-		return EnergyCalculator::BatchQueued::INVALID_HANDLE;
-	}
-
-	void ScopedNodeEnergyBatchQueued::DelegateNoOverlap::ProcessCalculations()
-	{
-	}
-
-	Energy ScopedNodeEnergyBatchQueued::DelegateNoOverlap::GetResult(EnergyCalculator::BatchQueued::Handle handle) const
-	{
-		return ENERGY_MIN;
+		return m_batch ? m_batch->GetResult(handle) : ENERGY_MIN;
 	}
 }
 
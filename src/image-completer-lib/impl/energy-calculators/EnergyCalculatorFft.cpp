@@ -31,6 +31,7 @@
 #endif
 #include "EnergyCalculatorUtils.h"
 #include "ImageConst.h"
+#include "ImageWorkingCopy.h"
 #include "LfnIcSettings.h"
 #include "MaskLod.h"
 
@@ -76,24 +77,50 @@ namespace LfnIc
 		return FftReal((maskValue == Mask::KNOWN) ? 1 : 0);
 	}
 
+	// Fill policies are positioned on an input image row by OnRow(), then
+	// sampled by GetReal() at columns of that row.
 	class FillPolicyChannel
 	{
 	public:
 		FillPolicyChannel(const ImageConst& inputImage, int channel) :
-		  m_imagePixel(inputImage.GetData()),
-			  m_channel(channel)
+		  m_workingCopy(inputImage.GetWorkingCopy()),
+			  m_channel(channel),
+			  m_planarRow(NULL)
 		  {
 		  }
 
-		  // rowMajorIndex length is based on EnergyCalculatorFft::m_inputWidth
-		  inline FftReal GetReal(int rowMajorIndex) const
+		  // Reads the channel's plane, which is contiguous for each row.
+		  inline void OnRow(int y)
 		  {
-			  return m_imagePixel[rowMajorIndex].channel[m_channel];
+			  m_planarRow = m_workingCopy.GetPlanarRow(m_channel, y);
+		  }
+
+		  inline FftReal GetReal(int x) const
+		  {
+			  return m_planarRow[x];
 		  }
 
 	protected:
-		const Image::Pixel* m_imagePixel;
+		const ImageWorkingCopy& m_workingCopy;
 		const int m_channel;
+		const ImageWorkingCopy::ChannelType* m_planarRow;
+	};
+
+	class FillPolicyChannelSquared : public FillPolicyChannel
+	{
+	public:
+		typedef FillPolicyChannel Super;
+
+		FillPolicyChannelSquared(const ImageConst& inputImage, int channel) :
+		Super(inputImage, channel)
+		{
+		}
+
+		inline FftReal GetReal(int x) const
+		{
+			const FftReal value = Super::GetReal(x);
+			return value * value;
+		}
 	};
 
 	class FillPolicyChannelScaled : public FillPolicyChannel
@@ -107,10 +134,9 @@ namespace LfnIc
 		{
 		}
 
-		// rowMajorIndex length is based on EnergyCalculatorFft::m_inputWidth
-		inline FftReal GetReal(int rowMajorIndex) const
+		inline FftReal GetReal(int x) const
 		{
-			return m_scalar * Super::GetReal(rowMajorIndex);
+			return m_scalar * Super::GetReal(x);
 		}
 
 	protected:
@@ -124,77 +150,204 @@ namespace LfnIc
 
 		FillPolicyChannelMaskedScaled(const ImageConst& inputImage, const MaskLod& mask, int channel, FftReal scalar) :
 		Super(inputImage, channel, scalar),
-			m_maskBuffer(mask.GetLodBuffer(mask.GetHighestLod()))
+			m_maskBuffer(mask.GetLodBuffer(mask.GetHighestLod())),
+			m_maskRow(NULL)
+		{
+		}
+
+		inline void OnRow(int y)
 		{
+			Super::OnRow(y);
+			m_maskRow = m_maskBuffer + LfnTech::GetRowMajorIndex(m_workingCopy.GetWidth(), 0, y);
 		}
 
-		// rowMajorIndex length is based on EnergyCalculatorFft::m_inputWidth
-		inline FftReal GetReal(int rowMajorIndex) const
+		inline FftReal GetReal(int x) const
 		{
-			return MaskValueToFftReal(m_maskBuffer[rowMajorIndex]) * Super::GetReal(rowMajorIndex);
+			return MaskValueToFftReal(m_maskRow[x]) * Super::GetReal(x);
 		}
 
 	protected:
 		const Mask::Value* m_maskBuffer;
+		const Mask::Value* m_maskRow;
 	};
 
 	class FillPolicyMask
 	{
 	public:
-		FillPolicyMask(const MaskLod& mask) :
-		  m_maskBuffer(mask.GetLodBuffer(mask.GetHighestLod()))
+		FillPolicyMask(const ImageConst& inputImage, const MaskLod& mask) :
+		  m_maskBuffer(mask.GetLodBuffer(mask.GetHighestLod())),
+			  m_maskWidth(inputImage.GetWidth()),
+			  m_maskRow(NULL)
 		  {
 		  }
 
-		  // rowMajorIndex length is based on EnergyCalculatorFft::m_inputWidth
-		  inline FftReal GetReal(int rowMajorIndex) const
+		  inline void OnRow(int y)
 		  {
-			  return MaskValueToFftReal(m_maskBuffer[rowMajorIndex]);
+			  m_maskRow = m_maskBuffer + LfnTech::GetRowMajorIndex(m_maskWidth, 0, y);
+		  }
+
+		  inline FftReal GetReal(int x) const
+		  {
+			  return MaskValueToFftReal(m_maskRow[x]);
 		  }
 
 	protected:
 		const Mask::Value* m_maskBuffer;
+		const int m_maskWidth;
+		const Mask::Value* m_maskRow;
 	};
 }
 
-//
-// Energy operator for use with the ApplyFftRealTo2ndAnd3rdTerm template function.
-//
 namespace LfnIc
 {
-	class EnergyOperatorAssignNegative
+	// The fftw wisdom file, and whether it has been imported since the path
+	// was set. fftw's wisdom and planner are process-wide, and are only used
+	// from the thread that completes the image.
+	static std::string g_fftwWisdomFilePath;
+	static bool g_isFftwWisdomLoaded = false;
+
+	// Limits fftw's subsequent plans to numThreads. fftw's threading is
+	// initialized once per process, and is never cleaned up, because
+	// fftw_cleanup_threads() must not be called while other plans (e.g.,
+	// another resolution's) still exist.
+	static void SetFftwNumThreads(int numThreads)
 	{
-	public:
-		void Execute(Energy& a, const Energy& b) const
+#ifdef USE_THREADS
+		static bool isInitialized = false;
+		if (!isInitialized)
 		{
-			a = -b;
+			const int fftwInitThreadsResult = FFTW_PREFIX(init_threads)();
+			wxASSERT(fftwInitThreadsResult != 0);
+			isInitialized = true;
 		}
-	};
 
-	class EnergyOperatorDecrement
+		wxASSERT(numThreads >= 1);
+		FFTW_PREFIX(plan_with_nthreads)(numThreads);
+#endif
+	}
+}
+
+void LfnIc::EnergyCalculatorFft::SetWisdomFilePath(const std::string& filePath)
+{
+	g_fftwWisdomFilePath = filePath;
+	g_isFftwWisdomLoaded = false;
+}
+
+bool LfnIc::EnergyCalculatorFft::PrePlan(int numThreads, int inputWidth, int inputHeight, int patchWidth, int patchHeight)
+{
+	const int fftWidth = EnergyCalculatorFftUtils::GetFftFriendlySize(inputWidth + patchWidth - 1);
+	const int fftHeight = EnergyCalculatorFftUtils::GetFftFriendlySize(inputHeight + patchHeight - 1);
+
+	SetFftwNumThreads(numThreads);
+
+	FftwInPlaceBuffer batchBuffer;
+	batchBuffer.generic = FFTW_PREFIX(malloc)(BATCH_BUFFERS_NUM * GetInPlaceBufferNumBytes(fftWidth, fftHeight));
+
+	FftPlans plans;
+	const bool result = CreatePlans(fftWidth, fftHeight, batchBuffer, plans);
+
+	DestroyPlans(plans);
+	FFTW_PREFIX(free)(batchBuffer.generic);
+
+	return result && !g_fftwWisdomFilePath.empty();
+}
+
+int LfnIc::EnergyCalculatorFft::GetInPlaceBufferNumBytes(int fftWidth, int fftHeight)
+{
+	// http://www.fftw.org/fftw3_doc/Multi_002dDimensional-DFTs-of-Real-Data.html#Multi_002dDimensional-DFTs-of-Real-Data
+	const int BUFFER_ALIGNMENT = 64;
+	const int numBytes = sizeof(FftReal) * 2 * (fftWidth / 2 + 1) * fftHeight;
+	return (numBytes + BUFFER_ALIGNMENT - 1) & ~(BUFFER_ALIGNMENT - 1);
+}
+
+bool LfnIc::EnergyCalculatorFft::CreatePlans(int fftWidth, int fftHeight, FftwInPlaceBuffer batchBuffer, FftPlans& outPlans)
+{
+	const bool hasWisdomFile = !g_fftwWisdomFilePath.empty();
+	if (hasWisdomFile && !g_isFftwWisdomLoaded)
 	{
-	public:
-		void Execute(Energy& a, const Energy& b) const
-		{
-			a -= b;
-		}
-	};
+		// A missing file is expected the first time; the wisdom will be
+		// measured and saved below.
+		FFTW_PREFIX(import_wisdom_from_filename)(g_fftwWisdomFilePath.c_str());
+		g_isFftwWisdomLoaded = true;
+	}
 
-	class EnergyOperatorIncrement
+	// Try the accumulated wisdom first, which doesn't touch the buffer, and
+	// only measure if it doesn't cover these plans.
+	bool wasMeasured = false;
+	if (!CreatePlans(fftWidth, fftHeight, batchBuffer, FFTW_MEASURE | FFTW_WISDOM_ONLY, outPlans))
 	{
-	public:
-		void Execute(Energy& a, const Energy& b) const
+		const bool wereCreated = CreatePlans(fftWidth, fftHeight, batchBuffer, FFTW_MEASURE, outPlans);
+		wxASSERT(wereCreated);
+		wasMeasured = true;
+	}
+
+	bool result = true;
+	if (hasWisdomFile && wasMeasured)
+	{
+		result = (FFTW_PREFIX(export_wisdom_to_filename)(g_fftwWisdomFilePath.c_str()) != 0);
+		wxASSERT_MSG(result, "LfnIc::EnergyCalculatorFft - couldn't save the fftw wisdom file.");
+	}
+
+	return result;
+}
+
+bool LfnIc::EnergyCalculatorFft::CreatePlans(int fftWidth, int fftHeight, FftwInPlaceBuffer batchBuffer, unsigned int flags, FftPlans& outPlans)
+{
+	// Dimensions must be in row-major order, so swap width and height. Each
+	// real row is padded to hold its complex output.
+	// http://www.fftw.org/fftw3_doc/Advanced-Real_002ddata-DFTs.html
+	const int bufferNumBytes = GetInPlaceBufferNumBytes(fftWidth, fftHeight);
+	const int dimensions[2] = { fftHeight, fftWidth };
+	const int realEmbed[2] = { fftHeight, 2 * (fftWidth / 2 + 1) };
+	const int complexEmbed[2] = { fftHeight, fftWidth / 2 + 1 };
+	const int realDistance = bufferNumBytes / sizeof(FftReal);
+	const int complexDistance = bufferNumBytes / sizeof(FftComplex);
+
+	outPlans.realToComplexChannels = FFTW_PREFIX(plan_many_dft_r2c)(
+		2, dimensions, CHANNELS_NUM,
+		batchBuffer.real, realEmbed, 1, realDistance,
+		batchBuffer.complex, complexEmbed, 1, complexDistance,
+		flags);
+
+	outPlans.realToComplexChannelsAndMask = FFTW_PREFIX(plan_many_dft_r2c)(
+		2, dimensions, BATCH_BUFFERS_NUM,
+		batchBuffer.real, realEmbed, 1, realDistance,
+		batchBuffer.complex, complexEmbed, 1, complexDistance,
+		flags);
+
+	outPlans.complexToReal = FFTW_PREFIX(plan_dft_c2r_2d)(fftHeight, fftWidth, batchBuffer.complex, batchBuffer.real, flags);
+
+	if (!outPlans.realToComplexChannels || !outPlans.realToComplexChannelsAndMask || !outPlans.complexToReal)
+	{
+		DestroyPlans(outPlans);
+		return false;
+	}
+
+	return true;
+}
+
+void LfnIc::EnergyCalculatorFft::DestroyPlans(FftPlans& plans)
+{
+	FftPlan* const planPtrs[] = { &plans.realToComplexChannels, &plans.realToComplexChannelsAndMask, &plans.complexToReal };
+	for (int i = 0; i < int(sizeof(planPtrs) / sizeof(planPtrs[0])); ++i)
+	{
+		if (*planPtrs[i])
 		{
-			a += b;
+			FFTW_PREFIX(destroy_plan)(*planPtrs[i]);
+			*planPtrs[i] = NULL;
 		}
-	};
+	}
+}
+
+LfnIc::EnergyCalculatorFft::Shared::Shared(const Settings& settings, const ImageConst& inputImage, const MaskLod& mask) :
+wsst(inputImage, settings.latticeGapX, settings.latticeGapY),
+	wsstMasked(inputImage, mask, settings.latticeGapX, settings.latticeGapY)
+{
 }
 
-//
-// EnergyCalculatorFft implementation
-//
 LfnIc::EnergyCalculatorFft::EnergyCalculatorFft(
 	const Settings& settings,
+	int numThreads,
 	const ImageConst& inputImage,
 	const MaskLod& mask
 #if FFT_VALIDATION_ENABLED
@@ -209,89 +362,126 @@ m_settings(settings),
 #endif
 	m_inputWidth(m_inputImage.GetWidth()),
 	m_inputHeight(m_inputImage.GetHeight()),
-	m_fftWidth(m_inputWidth + m_settings.patchWidth - 1),
-	m_fftHeight(m_inputHeight + m_settings.patchHeight - 1),
+	// fftw is fastest for sizes whose factors are small primes, and the
+	// linear convolution only requires at least this much zero padding.
+	m_fftWidth(EnergyCalculatorFftUtils::GetFftFriendlySize(m_inputWidth + m_settings.patchWidth - 1)),
+	m_fftHeight(EnergyCalculatorFftUtils::GetFftFriendlySize(m_inputHeight + m_settings.patchHeight - 1)),
 	// http://www.fftw.org/fftw3_doc/Multi_002dDimensional-DFTs-of-Real-Data.html#Multi_002dDimensional-DFTs-of-Real-Data
 	m_fftInPlaceBufferStride(sizeof(FftReal) * 2 * (m_fftWidth / 2 + 1)),
-	m_fftInPlaceBufferNumBytes(m_fftInPlaceBufferStride * m_fftHeight),
-	m_wsst(inputImage, settings.latticeGapX, settings.latticeGapY),
-	m_wsstMasked(inputImage, mask, settings.latticeGapX, settings.latticeGapY),
+	m_fftInPlaceBufferNumBytes(GetInPlaceBufferNumBytes(m_fftWidth, m_fftHeight)),
+	m_shared(new Shared(settings, inputImage, mask)),
+	m_ownsShared(true),
+	m_fftPlans(&m_shared->fftPlans),
 	m_batchEnergy1stTerm(ENERGY_MIN),
-	m_batchEnergy2ndAnd3rdTerm(new Energy[m_inputWidth * m_inputHeight]),
 	m_isBatchOpen(false),
 	m_isBatchProcessed(false)
 {
-#ifdef USE_THREADS
-	const int fftwInitThreadsResult = FFTW_PREFIX(init_threads)();
-	wxASSERT(fftwInitThreadsResult != 0);
-
-	const int cpuCount = wxThread::GetCPUCount();
-	wxASSERT(cpuCount >= 1);
-	FFTW_PREFIX(plan_with_nthreads)(cpuCount);
-#endif
-
-	m_fftPlanBuffer = FftwInPlaceBufferAlloc();
-
-	// Dimensions must be in row-major order, so swap width and height
-	// http://www.fftw.org/fftw3_doc/Multi_002dDimensional-DFTs-of-Real-Data.html#Multi_002dDimensional-DFTs-of-Real-Data
-	m_fftPlanRealToComplex = FFTW_PREFIX(plan_dft_r2c_2d)(m_fftHeight, m_fftWidth, m_fftPlanBuffer.real, m_fftPlanBuffer.complex, FFTW_MEASURE);
-	m_fftPlanComplexToReal = FFTW_PREFIX(plan_dft_c2r_2d)(m_fftHeight, m_fftWidth, m_fftPlanBuffer.complex, m_fftPlanBuffer.real, FFTW_MEASURE);
+	m_fftBatchBuffer = FftwInPlaceBufferAlloc(BATCH_BUFFERS_NUM);
+
+	// Share the process-wide thread budget with the thread pool. Either its
+	// workers are parked while fftw executes, or each of them has its own
+	// batch context, which executes the single threaded plans.
+	SetFftwNumThreads(numThreads);
+	CreatePlans(m_fftWidth, m_fftHeight, m_fftBatchBuffer, m_shared->fftPlans);
+	if (numThreads > 1)
+	{
+		SetFftwNumThreads(1);
+		CreatePlans(m_fftWidth, m_fftHeight, m_fftBatchBuffer, m_shared->fftPlansSingleThreaded);
+	}
+	else
+	{
+		m_shared->fftPlansSingleThreaded = m_shared->fftPlans;
+	}
 
-	// For each channel of m_fftImage and m_fftImageSquared, fill the real data,
-	// execute the real-to-complex plan, and copy the results into the channel
-	// buffer.
-	for (int channel = 0; channel < CHANNELS_NUM; ++channel)
+	// Fill each channel's real data into its batch buffer, transform them all
+	// at once, and keep the results.
 	{
+		for (int channel = 0; channel < CHANNELS_NUM; ++channel)
 		{
-			m_fftComplexImage[channel] = FftwInPlaceBufferAlloc();
-
 			FillPolicyChannel fillPolicy(m_inputImage, channel);
-			FillRealBuffer(fillPolicy, m_fftPlanBuffer.real, 0, 0, m_inputWidth, m_inputHeight);
-
-			FFTW_PREFIX(execute)(m_fftPlanRealToComplex);
-			memcpy(m_fftComplexImage[channel].generic, m_fftPlanBuffer.generic, m_fftInPlaceBufferNumBytes);
+			FillRealBuffer(fillPolicy, GetBuffer(m_fftBatchBuffer, channel).real, 0, 0, m_inputWidth, m_inputHeight);
 		}
 
+		ExecuteRealToComplex(m_fftPlans->realToComplexChannels);
+
+		m_shared->fftComplexImage = FftwInPlaceBufferAlloc(CHANNELS_NUM);
+		memcpy(m_shared->fftComplexImage.generic, m_fftBatchBuffer.generic, CHANNELS_NUM * m_fftInPlaceBufferNumBytes);
+	}
+
+	// Same for the squared channels. The third term is summed over the
+	// channels, so only the sum of their transforms is kept.
+	{
+		for (int channel = 0; channel < CHANNELS_NUM; ++channel)
 		{
-			m_fftComplexImageSquared[channel] = FftwInPlaceBufferAlloc();
+			FillPolicyChannelSquared fillPolicy(m_inputImage, channel);
+			FillRealBuffer(fillPolicy, GetBuffer(m_fftBatchBuffer, channel).real, 0, 0, m_inputWidth, m_inputHeight);
+		}
 
-			FillPolicyChannel fillPolicy(m_inputImage, channel);
-			FillRealBuffer(fillPolicy, m_fftPlanBuffer.real, 0, 0, m_inputWidth, m_inputHeight);
+		ExecuteRealToComplex(m_fftPlans->realToComplexChannels);
 
-			for (int y = 0; y < m_inputHeight; ++y)
+		m_shared->fftComplexImageSquaredSum = FftwInPlaceBufferAlloc();
+		const int complexNum = GetComplexNum();
+		FftComplex* sum = m_shared->fftComplexImageSquaredSum.complex;
+		memcpy(sum, m_fftBatchBuffer.generic, m_fftInPlaceBufferNumBytes);
+		for (int channel = 1; channel < CHANNELS_NUM; ++channel)
+		{
+			const FftComplex* channelComplex = GetBuffer(m_fftBatchBuffer, channel).complex;
+			for (int i = 0; i < complexNum; ++i)
 			{
-				FftReal* real = GetRow(m_fftPlanBuffer.real, y);
-				for (int x = 0; x < m_inputWidth; ++x, ++real)
-				{
-					FFT_ASSERT_BOUNDS(m_fftPlanBuffer.real, real);
-					const FftReal value = *real;
-					*real = value * value;
-				}
+				sum[i][REAL] += channelComplex[i][REAL];
+				sum[i][IMAG] += channelComplex[i][IMAG];
 			}
-
-			FFTW_PREFIX(execute)(m_fftPlanRealToComplex);
-			memcpy(m_fftComplexImageSquared[channel].generic, m_fftPlanBuffer.generic, m_fftInPlaceBufferNumBytes);
 		}
 	}
 }
 
+LfnIc::EnergyCalculatorFft::EnergyCalculatorFft(const EnergyCalculatorFft& owner, const FftPlans& fftPlans) :
+m_settings(owner.m_settings),
+	m_inputImage(owner.m_inputImage),
+	m_mask(owner.m_mask),
+#if FFT_VALIDATION_ENABLED
+	m_energyCalculatorPerPixel(owner.m_energyCalculatorPerPixel),
+#endif
+	m_inputWidth(owner.m_inputWidth),
+	m_inputHeight(owner.m_inputHeight),
+	m_fftWidth(owner.m_fftWidth),
+	m_fftHeight(owner.m_fftHeight),
+	m_fftInPlaceBufferStride(owner.m_fftInPlaceBufferStride),
+	m_fftInPlaceBufferNumBytes(owner.m_fftInPlaceBufferNumBytes),
+	m_shared(owner.m_shared),
+	m_ownsShared(false),
+	m_fftPlans(&fftPlans),
+	m_batchEnergy1stTerm(ENERGY_MIN),
+	m_isBatchOpen(false),
+	m_isBatchProcessed(false)
+{
+	// fftw_malloc() aligns every buffer alike, which new-array execution of
+	// the shared plans requires.
+	m_fftBatchBuffer = FftwInPlaceBufferAlloc(BATCH_BUFFERS_NUM);
+}
+
 LfnIc::EnergyCalculatorFft::~EnergyCalculatorFft()
 {
-	for (int channel = 0; channel < CHANNELS_NUM; ++channel)
+	if (m_ownsShared)
 	{
-		FFTW_PREFIX(free)(m_fftComplexImage[channel].generic);
-		FFTW_PREFIX(free)(m_fftComplexImageSquared[channel].generic);
-	}
+		FFTW_PREFIX(free)(m_shared->fftComplexImageSquaredSum.generic);
+		FFTW_PREFIX(free)(m_shared->fftComplexImage.generic);
 
-	FFTW_PREFIX(destroy_plan)(m_fftPlanComplexToReal);
-	FFTW_PREFIX(destroy_plan)(m_fftPlanRealToComplex);
-	FFTW_PREFIX(free)(m_fftPlanBuffer.generic);
+		if (m_shared->fftPlansSingleThreaded.complexToReal != m_shared->fftPlans.complexToReal)
+		{
+			DestroyPlans(m_shared->fftPlansSingleThreaded);
+		}
 
-	delete [] m_batchEnergy2ndAnd3rdTerm;
+		DestroyPlans(m_shared->fftPlans);
+		delete m_shared;
+	}
 
-#ifdef USE_THREADS
-	FFTW_PREFIX(cleanup_threads)();
-#endif
+	FFTW_PREFIX(free)(m_fftBatchBuffer.generic);
+}
+
+LfnIc::EnergyCalculatorFft* LfnIc::EnergyCalculatorFft::CreateBatchContext() const
+{
+	return new EnergyCalculatorFft(*this, m_shared->fftPlansSingleThreaded);
 }
 
 void LfnIc::EnergyCalculatorFft::BatchOpen(const BatchParams& params)
@@ -315,60 +505,60 @@ void LfnIc::EnergyCalculatorFft::BatchOpen(const BatchParams& params)
 
 	// Store first term in m_batchEnergy1stTerm:
 	{
-		const EnergyWsst& wsst = m_batchParams.aMasked ? m_wsstMasked : m_wsst;
+		const EnergyWsst& wsst = m_batchParams.aMasked ? m_shared->wsstMasked : m_shared->wsst;
 		m_batchEnergy1stTerm = wsst.Calculate(m_batchParams.aLeft, m_batchParams.aTop, m_batchParams.width, m_batchParams.height);
 	}
 
-	// Calculate second term into m_batchEnergy2ndAnd3rdTerm
+	// Calculate the second term, and the third term if aMasked is true, into
+	// m_fftBatchBuffer. Otherwise, Calculate will look up the third
+	// term for b from the unmasked wsst.
+	//
+	// Both are correlations over the channels, so all of a's transforms are
+	// batched together, the channels are summed in the frequency domain, and
+	// a single inverse transform yields the combined terms.
 	{
+		// Calculate fft(2 * <Ma> * Ia) for each channel, and fft(Ma) if aMasked,
+		// into m_fftBatchBuffer.
 		for (int channel = 0; channel < CHANNELS_NUM; ++channel)
 		{
-			// Calculate fft(-2 * <Ma?> * Ia) into m_fftPlanBuffer.
-			{
-				if (m_batchParams.aMasked)
-				{
-					FillPolicyChannelMaskedScaled fillPolicy(m_inputImage, m_mask, channel, FftReal(2));
-					ReverseFillRealBuffer(fillPolicy, m_fftPlanBuffer.real, m_batchParams.aLeft, m_batchParams.aTop, m_batchParams.width, m_batchParams.height);
-				}
-				else
-				{
-					FillPolicyChannelScaled fillPolicy(m_inputImage, channel, FftReal(2));
-					ReverseFillRealBuffer(fillPolicy, m_fftPlanBuffer.real, m_batchParams.aLeft, m_batchParams.aTop, m_batchParams.width, m_batchParams.height);
-				}
-
-				FFTW_PREFIX(execute)(m_fftPlanRealToComplex);
-			}
-
-			// fft(Ib) is already in m_fftComplexImage. Multiply
-			// m_fftComplexImage into m_fftPlanBuffer.
-			MultiplyEquals(m_fftPlanBuffer.complex, m_fftComplexImage[channel].complex);
-
-			// Inverse transform m_fftPlanBuffer, then normalize it
-			FFTW_PREFIX(execute)(m_fftPlanComplexToReal);
-			MultiplyEquals(m_fftPlanBuffer.real, FftReal(1) / FftReal(m_fftWidth * m_fftHeight));
-
-			// Apply the results from m_fftPlanBuffer into
-			// m_batchEnergy2ndAnd3rdTerm
-			if (channel == 0)
+			FftReal* real = GetBuffer(m_fftBatchBuffer, channel).real;
+			if (m_batchParams.aMasked)
 			{
-				EnergyOperatorAssignNegative energyOperator;
-				ApplyFftRealTo2ndAnd3rdTerm(energyOperator);
+				FillPolicyChannelMaskedScaled fillPolicy(m_inputImage, m_mask, channel, FftReal(2));
+				ReverseFillRealBuffer(fillPolicy, real, m_batchParams.aLeft, m_batchParams.aTop, m_batchParams.width, m_batchParams.height);
 			}
 			else
 			{
-				EnergyOperatorDecrement energyOperator;
-				ApplyFftRealTo2ndAnd3rdTerm(energyOperator);
+				FillPolicyChannelScaled fillPolicy(m_inputImage, channel, FftReal(2));
+				ReverseFillRealBuffer(fillPolicy, real, m_batchParams.aLeft, m_batchParams.aTop, m_batchParams.width, m_batchParams.height);
 			}
 		}
 
+		if (m_batchParams.aMasked)
+		{
+			FillPolicyMask fillPolicy(m_inputImage, m_mask);
+			ReverseFillRealBuffer(fillPolicy, GetBuffer(m_fftBatchBuffer, BATCH_BUFFER_MASK).real, m_batchParams.aLeft, m_batchParams.aTop, m_batchParams.width, m_batchParams.height);
+			ExecuteRealToComplex(m_fftPlans->realToComplexChannelsAndMask);
+			AccumulateBatchSpectrum<true>();
+		}
+		else
+		{
+			ExecuteRealToComplex(m_fftPlans->realToComplexChannels);
+			AccumulateBatchSpectrum<false>();
+		}
+
+		// Inverse transform the accumulated spectrum. The results stay in
+		// m_fftBatchBuffer, and are only extracted for the blocks that are
+		// calculated.
+		ExecuteComplexToReal(m_fftPlans->complexToReal);
+
 #if FFT_VALIDATION_ENABLED
 		for (int y = 0; y < m_inputHeight; ++y)
 		{
-			Energy* batchEnergy2ndAnd3rdTermCurrent = m_batchEnergy2ndAnd3rdTerm + LfnTech::GetRowMajorIndex(m_inputWidth, 0, y);
-			for (int x = 0; x < m_inputWidth; ++x, ++batchEnergy2ndAnd3rdTermCurrent)
+			for (int x = 0; x < m_inputWidth; ++x)
 			{
-				const Energy e = *batchEnergy2ndAnd3rdTermCurrent;
-				const Energy eBruteForce = EnergyCalculatorFftUtils::BruteForceCalculate2ndTerm(
+				const Energy e = GetBatchEnergy2ndAnd3rdTerm(x, y);
+				Energy eBruteForce = EnergyCalculatorFftUtils::BruteForceCalculate2ndTerm(
 					m_inputImage,
 					m_inputWidth,
 					m_inputHeight,
@@ -377,38 +567,23 @@ void LfnIc::EnergyCalculatorFft::BatchOpen(const BatchParams& params)
 					m_batchParams.aMasked ? &m_mask : NULL,
 					x,
 					y);
+				if (m_batchParams.aMasked)
+				{
+					eBruteForce += EnergyCalculatorFftUtils::BruteForceCalculate3rdTerm(
+						m_inputImage,
+						m_batchParams.width,
+						m_batchParams.height,
+						m_batchParams.aLeft,
+						m_batchParams.aTop,
+						&m_mask,
+						x,
+						y);
+				}
 				wxASSERT(abs(e - eBruteForce) < 10);
 			}
 		}
 #endif
 	}
-
-	// If a is masked, calculate and add third term into m_batchEnergy2ndAnd3rdTerm
-	// here. Otherwise, Calculate will look up the third term for b from m_wsst.
-	if (m_batchParams.aMasked)
-	{
-		for (int channel = 0; channel < CHANNELS_NUM; ++channel)
-		{
-			// Calculate fft(<Ma>) into m_fftPlanBuffer.
-			{
-				FillPolicyMask fillPolicy(m_mask);
-				ReverseFillRealBuffer(fillPolicy, m_fftPlanBuffer.real, m_batchParams.aLeft, m_batchParams.aTop, m_batchParams.width, m_batchParams.height);
-				FFTW_PREFIX(execute)(m_fftPlanRealToComplex);
-			}
-
-			// fft(Ib^2) is already in m_fftComplexImageSquared. Multiply
-			// m_fftComplexImageSquared into m_fftPlanBuffer.
-			MultiplyEquals(m_fftPlanBuffer.complex, m_fftComplexImageSquared[channel].complex);
-
-			// Inverse transform m_fftPlanBuffer, then normalize it
-			FFTW_PREFIX(execute)(m_fftPlanComplexToReal);
-			MultiplyEquals(m_fftPlanBuffer.real, FftReal(1) / FftReal(m_fftWidth * m_fftHeight));
-
-			// Add the results from m_fftPlanBuffer into m_batchEnergy2ndAnd3rdTerm
-			EnergyOperatorIncrement energyOperator;
-			ApplyFftRealTo2ndAnd3rdTerm(energyOperator);
-		}
-	}
 }
 
 void LfnIc::EnergyCalculatorFft::BatchOpenImmediate(const BatchParams& params)
@@ -451,12 +626,12 @@ LfnIc::Energy LfnIc::EnergyCalculatorFft::Calculate(int bLeft, int bTop) const
 
 	// Second term, and possibly third term if aMasked was true, calculated
 	// in BatchOpen:
-	e += m_batchEnergy2ndAnd3rdTerm[LfnTech::GetRowMajorIndex(m_inputImage.GetWidth(), bLeft, bTop)];
+	e += GetBatchEnergy2ndAnd3rdTerm(bLeft, bTop);
 
 	// Third term if aMasked was false:
 	if (!m_batchParams.aMasked)
 	{
-		e += m_wsst.Calculate(bLeft, bTop, m_batchParams.width, m_batchParams.height);
+		e += m_shared->wsst.Calculate(bLeft, bTop, m_batchParams.width, m_batchParams.height);
 	}
 
 #if FFT_VALIDATION_ENABLED
@@ -494,13 +669,36 @@ LfnIc::Energy LfnIc::EnergyCalculatorFft::GetResult(BatchQueued::Handle handle)
 	return m_queuedEnergyResults[handle];
 }
 
-LfnIc::EnergyCalculatorFft::FftwInPlaceBuffer LfnIc::EnergyCalculatorFft::FftwInPlaceBufferAlloc() const
+void LfnIc::EnergyCalculatorFft::ExecuteRealToComplex(FftPlan plan)
+{
+	FFTW_PREFIX(execute_dft_r2c)(plan, m_fftBatchBuffer.real, m_fftBatchBuffer.complex);
+}
+
+void LfnIc::EnergyCalculatorFft::ExecuteComplexToReal(FftPlan plan)
+{
+	FFTW_PREFIX(execute_dft_c2r)(plan, m_fftBatchBuffer.complex, m_fftBatchBuffer.real);
+}
+
+LfnIc::EnergyCalculatorFft::FftwInPlaceBuffer LfnIc::EnergyCalculatorFft::FftwInPlaceBufferAlloc(int numBuffers) const
 {
 	wxASSERT(!m_isBatchProcessed);
-	FftwInPlaceBuffer result = { FFTW_PREFIX(malloc)(m_fftInPlaceBufferNumBytes) };
+	wxASSERT(numBuffers >= 1);
+	FftwInPlaceBuffer result = { FFTW_PREFIX(malloc)(numBuffers * m_fftInPlaceBufferNumBytes) };
+	return result;
+}
+
+LfnIc::EnergyCalculatorFft::FftwInPlaceBuffer LfnIc::EnergyCalculatorFft::GetBuffer(FftwInPlaceBuffer buffers, int index) const
+{
+	FftwInPlaceBuffer result = { (unsigned char*)buffers.generic + (index * m_fftInPlaceBufferNumBytes) };
 	return result;
 }
 
+int LfnIc::EnergyCalculatorFft::GetComplexNum() const
+{
+	// The padded real rows hold exactly fftWidth / 2 + 1 complex values.
+	return (m_fftInPlaceBufferStride / sizeof(FftComplex)) * m_fftHeight;
+}
+
 template<typename T>
 T* LfnIc::EnergyCalculatorFft::GetRow(T* real, int y) const
 {
@@ -508,7 +706,7 @@ T* LfnIc::EnergyCalculatorFft::GetRow(T* real, int y) const
 }
 
 template<typename POLICY>
-void LfnIc::EnergyCalculatorFft::FillRealBuffer(const POLICY& policy, FftReal* real, int left, int top, int width, int height) const
+void LfnIc::EnergyCalculatorFft::FillRealBuffer(POLICY& policy, FftReal* real, int left, int top, int width, int height) const
 {
 	// Clamp dimensions to fit within the fft dimensions
 	width = std::min(width, m_fftWidth);
@@ -531,18 +729,18 @@ void LfnIc::EnergyCalculatorFft::FillRealBuffer(const POLICY& policy, FftReal* r
 	top += topPadding;
 	for (int y = 0; y < heightToCopy; ++y)
 	{
-		int inRowMajorIdx = LfnTech::GetRowMajorIndex(m_inputWidth, left, top + y);
+		policy.OnRow(top + y);
 		FftReal* out = GetRow(real, topPadding + y) + leftPadding;
-		for (int x = 0; x < widthToCopy; ++x, ++inRowMajorIdx, ++out)
+		for (int x = 0, inX = left; x < widthToCopy; ++x, ++inX, ++out)
 		{
 			FFT_ASSERT_BOUNDS(real, out);
-			*out = policy.GetReal(inRowMajorIdx);
+			*out = policy.GetReal(inX);
 		}
 	}
 }
 
 template<typename POLICY>
-void LfnIc::EnergyCalculatorFft::ReverseFillRealBuffer(const POLICY& policy, FftReal* real, int left, int top, int width, int height) const
+void LfnIc::EnergyCalculatorFft::ReverseFillRealBuffer(POLICY& policy, FftReal* real, int left, int top, int width, int height) const
 {
 	// Clamp dimensions to fit within the fft buffers
 	width = std::min(width, m_fftWidth);
@@ -569,12 +767,12 @@ void LfnIc::EnergyCalculatorFft::ReverseFillRealBuffer(const POLICY& policy, Fft
 	bottom -= topPadding;
 	for (int y = 0; y < heightToCopy; ++y)
 	{
-		int inRowMajorIdx = LfnTech::GetRowMajorIndex(m_inputWidth, right, bottom - y);
+		policy.OnRow(bottom - y);
 		FftReal* out = GetRow(real, topPadding + y) + leftPadding;
-		for (int x = 0; x < widthToCopy; ++x, --inRowMajorIdx, ++out)
+		for (int x = 0, inX = right; x < widthToCopy; ++x, --inX, ++out)
 		{
 			FFT_ASSERT_BOUNDS(real, out);
-			*out = policy.GetReal(inRowMajorIdx);
+			*out = policy.GetReal(inX);
 		}
 	}
 }
@@ -644,60 +842,65 @@ void LfnIc::EnergyCalculatorFft::PadRealBuffer(FftReal* real, int leftPad, int t
 	}
 }
 
-void LfnIc::EnergyCalculatorFft::MultiplyEquals(FftComplex* aComplex, const FftComplex* bComplex) const
+template<bool A_MASKED>
+void LfnIc::EnergyCalculatorFft::AccumulateBatchSpectrum()
 {
-	const int complexNum = m_fftInPlaceBufferNumBytes / sizeof(FftComplex);
-	FftComplex* aCurrent = aComplex;
-	const FftComplex* bCurrent = bComplex;
-	for (int i = 0; i < complexNum; ++i, ++aCurrent, ++bCurrent)
+	// For each frequency f, with A the transformed batch buffers, B the
+	// transformed image channels, M the transformed mask and S the summed
+	// transformed squared channels:
+	//
+	//		out[f] = (-sum(Ac[f] * Bc[f]) + <M[f] * S[f]>) / (fftWidth * fftHeight)
+	//
+	// The result is written over the first batch buffer, which is read before
+	// it's overwritten, ready for the inverse transform. The multiplications
+	// and normalization are fused into one straight pass so that the compiler
+	// can vectorize it.
+	const int complexNum = GetComplexNum();
+	const FftReal normalization = FftReal(1) / FftReal(m_fftWidth * m_fftHeight);
+
+	const FftComplex* a[CHANNELS_NUM];
+	const FftComplex* b[CHANNELS_NUM];
+	for (int channel = 0; channel < CHANNELS_NUM; ++channel)
 	{
-		FFT_ASSERT_BOUNDS(aComplex, aCurrent);
-		FFT_ASSERT_BOUNDS(bComplex, bCurrent);
-
-		// a = a * b
-		//
-		//		ar[f] = ar[f]br[f] - ai[f]bi[f]
-		//		ai[f] = ar[f]bi[f] + ai[f]br[f]
-		FftComplex& a = *aCurrent;
-		const FftComplex& b = *bCurrent;
-
-		const FftReal ar = a[REAL]; // Save this before it's overwritten
-		a[REAL] = (ar * b[REAL]) - (a[IMAG] * b[IMAG]);
-		a[IMAG] = (ar * b[IMAG]) + (a[IMAG] * b[REAL]);
+		a[channel] = GetBuffer(m_fftBatchBuffer, channel).complex;
+		b[channel] = GetBuffer(m_shared->fftComplexImage, channel).complex;
 	}
-}
 
-void LfnIc::EnergyCalculatorFft::MultiplyEquals(FftReal* aReal, FftReal bScalar) const
-{
-	for (int y = 0; y < m_fftHeight; ++y)
+	const FftComplex* m = GetBuffer(m_fftBatchBuffer, BATCH_BUFFER_MASK).complex;
+	const FftComplex* s = m_shared->fftComplexImageSquaredSum.complex;
+	FftComplex* out = m_fftBatchBuffer.complex;
+
+	for (int i = 0; i < complexNum; ++i)
 	{
-		FftReal* aCurrent = GetRow(aReal, y);
-		for (int x = 0; x < m_fftWidth; ++x, ++aCurrent)
+		FftReal real = FftReal(0);
+		FftReal imag = FftReal(0);
+
+		// (ar + i*ai)(br + i*bi) = (ar*br - ai*bi) + i*(ar*bi + ai*br)
+		for (int channel = 0; channel < CHANNELS_NUM; ++channel)
 		{
-			FFT_ASSERT_BOUNDS(aReal, aCurrent);
+			const FftComplex& ac = a[channel][i];
+			const FftComplex& bc = b[channel][i];
+			real -= (ac[REAL] * bc[REAL]) - (ac[IMAG] * bc[IMAG]);
+			imag -= (ac[REAL] * bc[IMAG]) + (ac[IMAG] * bc[REAL]);
+		}
 
-			*aCurrent *= bScalar;
+		if (A_MASKED)
+		{
+			real += (m[i][REAL] * s[i][REAL]) - (m[i][IMAG] * s[i][IMAG]);
+			imag += (m[i][REAL] * s[i][IMAG]) + (m[i][IMAG] * s[i][REAL]);
 		}
+
+		out[i][REAL] = real * normalization;
+		out[i][IMAG] = imag * normalization;
 	}
 }
 
-template<typename ENERGY_OPERATOR>
-void LfnIc::EnergyCalculatorFft::ApplyFftRealTo2ndAnd3rdTerm(const ENERGY_OPERATOR& energyOperator)
+LfnIc::Energy LfnIc::EnergyCalculatorFft::GetBatchEnergy2ndAnd3rdTerm(int bLeft, int bTop) const
 {
 	// The results are shifted by the batch dimensions - 1
-	const int resultsLeft = m_batchParams.width - 1;
-	const int resultsTop = m_batchParams.height - 1;
-	for (int y = 0; y < m_inputHeight; ++y)
-	{
-		Energy* batchEnergy2ndAnd3rdTermCurrent = m_batchEnergy2ndAnd3rdTerm + LfnTech::GetRowMajorIndex(m_inputWidth, 0, y);
-		const FftReal* fftCurrent = GetRow(m_fftPlanBuffer.real, resultsTop + y) + resultsLeft;
-
-		for (int x = 0; x < m_inputWidth; ++x, ++batchEnergy2ndAnd3rdTermCurrent, ++fftCurrent)
-		{
-			FFT_ASSERT_BOUNDS(m_fftPlanBuffer.real, fftCurrent);
-			energyOperator.Execute(*batchEnergy2ndAnd3rdTermCurrent, Energy(*fftCurrent));
-		}
-	}
+	const FftReal* fftCurrent = GetRow(m_fftBatchBuffer.real, m_batchParams.height - 1 + bTop) + (m_batchParams.width - 1 + bLeft);
+	FFT_ASSERT_BOUNDS(m_fftBatchBuffer.real, fftCurrent);
+	return Energy(*fftCurrent);
 }
 
 #endif // ENABLE_ENERGY_CALCULATOR_FFT
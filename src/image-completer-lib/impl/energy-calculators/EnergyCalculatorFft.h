@@ -48,7 +48,14 @@ namespace LfnIc
 	/// http://citeseerx.ist.psu.edu/viewdoc/summary?doi=10.1.1.7.2795
 	///
 	/// Internally, the RGB color channel data is stored in a separate buffer
-	/// per channel.
+	/// per channel. Each batch transforms all of the channels (and the mask)
+	/// with a single batched fftw plan, and sums the channels' products in
+	/// the frequency domain, so that only one inverse transform is needed.
+	///
+	/// The image transforms, windowed sum squared tables and plans are
+	/// immutable once constructed, and are shared with the lightweight batch
+	/// contexts returned by CreateBatchContext(), which only own the buffers
+	/// and state of a batch.
 	class EnergyCalculatorFft : public EnergyCalculator
 	{
 	public:
@@ -74,8 +81,12 @@ namespace LfnIc
 		///
 		/// Methods
 		///
+		/// fftw's plans are limited to numThreads. This is the thread pool's
+		/// number of threads when they're idle while the fft calculations
+		/// run, and 1 when each of the pool's threads has its own instance.
 		EnergyCalculatorFft(
 			const Settings& settings,
+			int numThreads,
 			const ImageConst& inputImage,
 			const MaskLod& mask
 #if FFT_VALIDATION_ENABLED
@@ -84,6 +95,23 @@ namespace LfnIc
 			);
 		~EnergyCalculatorFft();
 
+		/// Creates a batch context that shares this instance's precomputation,
+		/// so that batches can be open on several contexts at once, from
+		/// different threads. Contexts execute single threaded fftw plans,
+		/// and must be deleted before this instance.
+		EnergyCalculatorFft* CreateBatchContext() const;
+
+		/// Sets the file that fftw wisdom is imported from before the next
+		/// plan is created, and exported to whenever new plans have been
+		/// measured. An empty path disables the wisdom file.
+		static void SetWisdomFilePath(const std::string& filePath);
+
+		/// Measures the plans that an instance would use for an input image
+		/// and patch of the given dimensions, with numThreads fftw threads,
+		/// so that they're added to the wisdom file. Returns false if there's
+		/// no wisdom file, or it couldn't be saved.
+		static bool PrePlan(int numThreads, int inputWidth, int inputHeight, int patchWidth, int patchHeight);
+
 	protected:
 		// Common batch opening method.
 		void BatchOpen(const BatchParams& params);
@@ -111,12 +139,78 @@ namespace LfnIc
 			FftComplex* complex;
 		};
 
+		// The batch buffer holds consecutive in-place buffers: one per
+		// channel, followed by one for the mask.
+		static const int BATCH_BUFFER_MASK = CHANNELS_NUM;
+		static const int BATCH_BUFFERS_NUM = CHANNELS_NUM + 1;
+
+		struct FftPlans
+		{
+			// Transform the first CHANNELS_NUM, or all BATCH_BUFFERS_NUM,
+			// buffers of the batch buffer in one execution.
+			FftPlan realToComplexChannels;
+			FftPlan realToComplexChannelsAndMask;
+
+			// Transforms the first buffer of the batch buffer.
+			FftPlan complexToReal;
+		};
+
+		// The precomputation for the input image and mask, which is shared by
+		// an instance and its batch contexts.
+		struct Shared
+		{
+			Shared(const Settings& settings, const ImageConst& inputImage, const MaskLod& mask);
+
+			const EnergyWsst wsst;
+			const EnergyWsst wsstMasked;
+
+			// Plans limited to the constructing instance's number of threads,
+			// and single threaded plans for the batch contexts. These are
+			// the same plans if the instance is single threaded. Each instance
+			// executes them on its own batch buffer, using fftw's thread safe
+			// new-array execution.
+			FftPlans fftPlans;
+			FftPlans fftPlansSingleThreaded;
+
+			// The complex output of the fft of each image channel
+			// (CHANNELS_NUM consecutive buffers), and of the sum of the
+			// squared image channels.
+			FftwInPlaceBuffer fftComplexImage;
+			FftwInPlaceBuffer fftComplexImageSquaredSum;
+		};
+
 		//
 		// Internal methods
 		//
 
-		// Allocates and returns an appropriately sized fftw in-place buffer
-		FftwInPlaceBuffer FftwInPlaceBufferAlloc() const;
+		// Batch context constructor; see CreateBatchContext().
+		EnergyCalculatorFft(const EnergyCalculatorFft& owner, const FftPlans& fftPlans);
+
+		// Execute one of m_fftPlans on this instance's batch buffer.
+		void ExecuteRealToComplex(FftPlan plan);
+		void ExecuteComplexToReal(FftPlan plan);
+
+		// Allocates and returns numBuffers consecutive, appropriately sized
+		// fftw in-place buffers.
+		FftwInPlaceBuffer FftwInPlaceBufferAlloc(int numBuffers = 1) const;
+
+		// Returns the number of bytes of an in-place buffer for an fft of the
+		// given dimensions. Rounded up so that consecutive buffers stay as
+		// aligned as the first.
+		static int GetInPlaceBufferNumBytes(int fftWidth, int fftHeight);
+
+		// Returns the index'th of a set of consecutive in-place buffers.
+		FftwInPlaceBuffer GetBuffer(FftwInPlaceBuffer buffers, int index) const;
+
+		// Returns the number of complex values in an in-place buffer.
+		int GetComplexNum() const;
+
+		// Creates the plans for an fft of the given dimensions, operating on
+		// batchBuffer, using the wisdom file when possible. Returns false if
+		// newly measured wisdom couldn't be saved.
+		static bool CreatePlans(int fftWidth, int fftHeight, FftwInPlaceBuffer batchBuffer, FftPlans& outPlans);
+		static bool CreatePlans(int fftWidth, int fftHeight, FftwInPlaceBuffer batchBuffer, unsigned int flags, FftPlans& outPlans);
+		static void DestroyPlans(FftPlans& plans);
 
 		// Given a FftwInPlaceBuffer pointer type and a y coordinate, this
 		// returns a pointer to the data for that row.
@@ -126,30 +220,32 @@ namespace LfnIc
 		// Policy-driven templates for generic fills and reverse fills. Policy
 		// class must define:
 		//
-		//		inline FftReal GetReal(int rowMajorIndex) const;
+		//		inline void OnRow(int y);
+		//		inline FftReal GetReal(int x) const;
 		//
 		template<typename POLICY>
-		void FillRealBuffer(const POLICY& policy, FftReal* real, int left, int top, int width, int height) const;
+		void FillRealBuffer(POLICY& policy, FftReal* real, int left, int top, int width, int height) const;
 
 		template<typename POLICY>
-		void ReverseFillRealBuffer(const POLICY& policy, FftReal* real, int left, int top, int width, int height) const;
+		void ReverseFillRealBuffer(POLICY& policy, FftReal* real, int left, int top, int width, int height) const;
 
 		// Zero-fills the real buffer according to the specified padding.
 		void PadRealBuffer(FftReal* real, int leftPad, int topPad, int rightPad, int bottomPad) const;
 
-		// a *= b
-		void MultiplyEquals(FftComplex* aComplex, const FftComplex* bComplex) const;
-		void MultiplyEquals(FftReal* aReal, FftReal bScalar) const;
-
-		// Applies m_fftPlanBuffer.real to m_batchEnergy2ndAnd3rdTerm using
-		// the energy operator policy class. The policy class must define:
-		//
-		//		inline void Execute(Energy& a, const Energy& b) const;
+		// Fused frequency domain pass. Into the first buffer of the batch
+		// buffer, stores the normalized sum over the channels of
+		// -fft(2*<Ma>*Ia)*fft(Ib), plus fft(Ma)*fft(sum of Ib^2) if aMasked.
 		//
 		// Made this a template to avoid putting conditional behavior in its
 		// inner loop.
-		template<typename ENERGY_OPERATOR>
-		void ApplyFftRealTo2ndAnd3rdTerm(const ENERGY_OPERATOR& energyOperator);
+		template<bool A_MASKED>
+		void AccumulateBatchSpectrum();
+
+		// Returns the second term, and the third term if aMasked, of block b
+		// against block a. Read directly from the first buffer of the batch
+		// buffer, once inverse transformed, so that only the positions that
+		// are actually calculated are ever extracted.
+		Energy GetBatchEnergy2ndAnd3rdTerm(int bLeft, int bTop) const;
 
 		//
 		// Data
@@ -172,23 +268,22 @@ namespace LfnIc
 		const int m_fftInPlaceBufferStride;
 		const int m_fftInPlaceBufferNumBytes;
 
-		const EnergyWsst m_wsst;
-		const EnergyWsst m_wsstMasked;
+		// Owned by the instance constructed from the image, and immutable
+		// once it's constructed.
+		Shared* m_shared;
+		const bool m_ownsShared;
 
-		FftwInPlaceBuffer m_fftPlanBuffer;
-		FftPlan m_fftPlanRealToComplex;
-		FftPlan m_fftPlanComplexToReal;
+		// The m_shared plans that this instance executes.
+		const FftPlans* m_fftPlans;
 
-		// These two buffers are initialized at construction to store the
-		// complex output of the fft of the image, and the image squared.
-		FftwInPlaceBuffer m_fftComplexImage[CHANNELS_NUM];
-		FftwInPlaceBuffer m_fftComplexImageSquared[CHANNELS_NUM];
+		// BATCH_BUFFERS_NUM consecutive in-place buffers that the plans
+		// operate on. Each instance has its own.
+		FftwInPlaceBuffer m_fftBatchBuffer;
 
-		// Terms calculated by EnergyCalculatorFft::BatchOpen()
-		// m_batchEnergy2ndAnd3rdTerm is a row-major buffer of the image
-		// dimensions.
+		// First term calculated by EnergyCalculatorFft::BatchOpen(). The
+		// second and third terms are left in m_fftBatchBuffer until the
+		// batch is closed.
 		Energy m_batchEnergy1stTerm;
-		Energy* m_batchEnergy2ndAnd3rdTerm;
 
 		bool m_isBatchOpen;
 		bool m_isBatchProcessed;
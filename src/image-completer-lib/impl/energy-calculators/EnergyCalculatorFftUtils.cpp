@@ -31,6 +31,23 @@
 
 #include "tech/DbgMem.h"
 
+int LfnIc::EnergyCalculatorFftUtils::GetFftFriendlySize(int minSize)
+{
+	wxASSERT(minSize >= 1);
+	for (int size = minSize; ; ++size)
+	{
+		int remainder = size;
+		while (remainder % 2 == 0) remainder /= 2;
+		while (remainder % 3 == 0) remainder /= 3;
+		while (remainder % 5 == 0) remainder /= 5;
+		while (remainder % 7 == 0) remainder /= 7;
+		if (remainder == 1)
+		{
+			return size;
+		}
+	}
+}
+
 #if FFT_VALIDATION_ENABLED
 LfnIc::Energy LfnIc::EnergyCalculatorFftUtils::BruteForceCalculate1stTerm(const ImageConst& image, int width, int height, int aLeft, int aTop, const MaskLod* aMask)
 {
@@ -108,6 +125,38 @@ LfnIc::Energy LfnIc::EnergyCalculatorFftUtils::BruteForceCalculate2ndTerm(const
 LfnIc::Energy LfnIc::EnergyCalculatorFftUtils::BruteForceCalculate3rdTerm(const ImageConst& image, int width, int height, int aLeft, int aTop, const MaskLod* aMask, int bLeft, int bTop)
 {
 	Energy e = Energy(0);
+
+	const int imageWidth = image.GetWidth();
+	const int imageHeight = image.GetHeight();
+	const Mask::Value* maskBuffer = aMask ? aMask->GetLodBuffer(aMask->GetHighestLod()) : NULL;
+	const Image::Pixel* imagePixel = image.GetData();
+
+	for (int j = 0; j < height; ++j)
+	{
+		const int ay = aTop + j;
+		const int by = bTop + j;
+		if (ay >= 0 && by >= 0 && ay < imageHeight && by < imageHeight)
+		{
+			for (int i = 0; i < width; ++i)
+			{
+				const int ax = aLeft + i;
+				const int bx = bLeft + i;
+				if (ax >= 0 && bx >= 0 && ax < imageWidth && bx < imageWidth)
+				{
+					const int aIdx = LfnTech::GetRowMajorIndex(imageWidth, ax, ay);
+					if (!aMask || maskBuffer[aIdx] == Mask::KNOWN)
+					{
+						const Image::Pixel& bPixel = imagePixel[LfnTech::GetRowMajorIndex(imageWidth, bx, by)];
+						for (int c = 0; c < Image::Pixel::NUM_CHANNELS; ++c)
+						{
+							e += Energy(bPixel.channel[c] * bPixel.channel[c]);
+						}
+					}
+				}
+			}
+		}
+	}
+
 	return e;
 }
 #endif //FFT_VALIDATION_ENABLED
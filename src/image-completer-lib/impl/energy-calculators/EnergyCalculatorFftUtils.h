@@ -39,6 +39,11 @@ namespace LfnIc
 	class EnergyCalculatorFftUtils
 	{
 	public:
+		/// Returns the smallest size >= minSize whose only prime factors are
+		/// 2, 3, 5 and 7. fftw is fastest for such sizes, and can be much
+		/// slower for sizes with large prime factors.
+		static int GetFftFriendlySize(int minSize);
+
 #if FFT_VALIDATION_ENABLED
 		/// Brute force energy evaluations for validating the fft computations.
 		/// Should not be used for anything other than testing. There are two
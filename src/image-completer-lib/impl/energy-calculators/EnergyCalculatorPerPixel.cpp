@@ -22,17 +22,23 @@
 #include "Pch.h"
 #include "EnergyCalculatorPerPixel.h"
 
-#include "tech/Atomic.h"
 #include "tech/Core.h"
 #include "tech/MathUtils.h"
+#include "tech/ThreadPool.h"
 
+#include "EnergyCalculatorPerPixelSimd.h"
 #include "EnergyCalculatorUtils.h"
 #include "ImageConst.h"
+#include "ImageWorkingCopy.h"
 #include "LfnIcSettings.h"
 #include "MaskLod.h"
 
 #include "tech/DbgMem.h"
 
+// Debugging flag. If enabled, verifies every multi-candidate energy result
+// against the single candidate calculation.
+#define MULTI_CANDIDATE_VALIDATION_ENABLED 0
+
 namespace LfnIc
 {
 	// If the batch has maxCalculations has >= this value and there are worker
@@ -43,22 +49,68 @@ namespace LfnIc
 	// NOTE: value is arbitrary. Do some tests to find the sweet spot.
 	const int MIN_CALCULATIONS_FOR_ASYNC_BATCH = 30;
 
+	// Queued calculations are sorted by their block B's top and left, and
+	// calculated this many at a time by the policies' multi-candidate
+	// methods. Each row of block A is then read once for the whole group,
+	// while it's in the L1 cache, and neighboring blocks B share cache lines.
+	const int MULTI_CANDIDATES_NUM = 4;
+
+	// Asynchronous batches are divided into chunks of this many queued
+	// calculations, which is the granularity at which threads steal work
+	// from each other. A few whole groups of MULTI_CANDIDATES_NUM, so that
+	// claiming a chunk's atomic increment isn't paid for every group.
+	const int QUEUED_CALCULATIONS_PER_CHUNK = MULTI_CANDIDATES_NUM * 4;
+
+	//
+	// PolicyPixelsPacked - base class that reads the A and B rows straight
+	// from the input image's packed pixels.
+	//
+	class PolicyPixelsPacked
+	{
+	public:
+		inline void OnPreLoop(const ImageConst& inputImage, const MaskLod* mask)
+		{
+			m_pixels = inputImage.GetData();
+			m_imageWidth = inputImage.GetWidth();
+		}
+
+		inline void OnARow(int aLeft, int aTop)
+		{
+			m_aRow = m_pixels + LfnTech::GetRowMajorIndex(m_imageWidth, aLeft, aTop);
+		}
+
+		inline void OnBRow(int bLeft, int bTop)
+		{
+			m_bRow = m_pixels + LfnTech::GetRowMajorIndex(m_imageWidth, bLeft, bTop);
+		}
+
+		inline void OnBRowMulti(int candidate, int bLeft, int bTop)
+		{
+			m_bRows[candidate] = m_pixels + LfnTech::GetRowMajorIndex(m_imageWidth, bLeft, bTop);
+		}
+
+	protected:
+		const Image::Pixel* m_pixels;
+		int m_imageWidth;
+		const Image::Pixel* m_aRow;
+		const Image::Pixel* m_bRow;
+
+		// The multi-candidate B rows.
+		const Image::Pixel* m_bRows[MULTI_CANDIDATES_NUM];
+	};
+
 	//
 	// PolicyNoMask - handles straight pixel SSD calculations without any masking.
 	// This policy, along with the non-specialized CalculateEnergy function, provide
 	// an extremely efficient implementation for pixels with exactly 3 unsigned char channels.
 	//
-	class PolicyNoMask_24BitRgb
+	class PolicyNoMask_24BitRgb : public PolicyPixelsPacked
 	{
 	public:
 		static const bool HAS_MASK = false;
 		typedef uint32 ResultType;
 
-		inline void OnPreLoop(const Mask* mask) {}
-		inline void OnARow(int aSrcIndex) {}
-		inline void OnBRow(int bSrcIndex) {}
-
-		inline int GetMaxPixelsPerBunch() const
+		static inline int GetMaxPixelsPerBunch()
 		{
 			// MaxPixelsForUint32Energy is how many pixels a uint32 energy variable
 			// can safely capture without overflowing, assuming the worst case of
@@ -74,10 +126,10 @@ namespace LfnIc
 			return MAX_PIXELS_PER_RESULT;
 		}
 
-		FORCE_INLINE ResultType CalculateSquaredDifference(const Image::Pixel* aSrcRow, const Image::Pixel* bSrcRow, int x)
+		FORCE_INLINE ResultType CalculateSquaredDifference(int x)
 		{
-			const Image::Pixel& a = aSrcRow[x];
-			const Image::Pixel& b = bSrcRow[x];
+			const Image::Pixel& a = m_aRow[x];
+			const Image::Pixel& b = m_bRow[x];
 
 			// d[x] = channel delta
 			// e = dr^2 + dg^2 + db^2
@@ -86,18 +138,51 @@ namespace LfnIc
 			const ResultType db = a.channel[2] - b.channel[2];
 			return (dr * dr) + (dg * dg) + (db * db);
 		}
+
+		FORCE_INLINE ResultType CalculateSquaredDifferences(int x, int numPixels)
+		{
+			ResultType squaredDifferences = ResultType(0);
+			for (const int xEnd = x + numPixels; x < xEnd; ++x)
+			{
+				squaredDifferences += CalculateSquaredDifference(x);
+			}
+
+			return squaredDifferences;
+		}
+
+		// Adds the squared difference of pixel x against each multi-candidate
+		// B row. The A pixel's channels are loaded once for all of them.
+		FORCE_INLINE void AddSquaredDifferenceMulti(int x, ResultType* ioSquaredDifferences)
+		{
+			const Image::Pixel& a = m_aRow[x];
+			const ResultType ar = a.channel[0];
+			const ResultType ag = a.channel[1];
+			const ResultType ab = a.channel[2];
+			for (int i = 0; i < MULTI_CANDIDATES_NUM; ++i)
+			{
+				const Image::Pixel& b = m_bRows[i][x];
+				const ResultType dr = ar - b.channel[0];
+				const ResultType dg = ag - b.channel[1];
+				const ResultType db = ab - b.channel[2];
+				ioSquaredDifferences[i] += (dr * dr) + (dg * dg) + (db * db);
+			}
+		}
+
+		FORCE_INLINE void AddSquaredDifferencesMulti(int x, int numPixels, ResultType* ioSquaredDifferences)
+		{
+			for (const int xEnd = x + numPixels; x < xEnd; ++x)
+			{
+				AddSquaredDifferenceMulti(x, ioSquaredDifferences);
+			}
+		}
 	};
 
-	class PolicyNoMask_General
+	class PolicyNoMask_General : public PolicyPixelsPacked
 	{
 	public:
 		static const bool HAS_MASK = false;
 		typedef float ResultType;
 
-		inline void OnPreLoop(const Mask* mask) {}
-		inline void OnARow(int aSrcIndex) {}
-		inline void OnBRow(int bSrcIndex) {}
-
 		inline int GetMaxPixelsPerBunch() const
 		{
 			// It's difficult to get a hard limit for how much a floating
@@ -108,10 +193,10 @@ namespace LfnIc
 			return 32 * 32;
 		}
 
-		FORCE_INLINE ResultType CalculateSquaredDifference(const Image::Pixel* aSrcRow, const Image::Pixel* bSrcRow, int x)
+		FORCE_INLINE ResultType CalculateSquaredDifference(int x)
 		{
-			const Image::Pixel& a = aSrcRow[x];
-			const Image::Pixel& b = bSrcRow[x];
+			const Image::Pixel& a = m_aRow[x];
+			const Image::Pixel& b = m_bRow[x];
 
 			ResultType squaredDifference = ResultType(0);
 
@@ -122,6 +207,38 @@ namespace LfnIc
 
 			return squaredDifference;
 		}
+
+		FORCE_INLINE ResultType CalculateSquaredDifferences(int x, int numPixels)
+		{
+			ResultType squaredDifferences = ResultType(0);
+			for (const int xEnd = x + numPixels; x < xEnd; ++x)
+			{
+				squaredDifferences += CalculateSquaredDifference(x);
+			}
+
+			return squaredDifferences;
+		}
+
+		FORCE_INLINE void AddSquaredDifferenceMulti(int x, ResultType* ioSquaredDifferences)
+		{
+			const Image::Pixel& a = m_aRow[x];
+			for (int i = 0; i < MULTI_CANDIDATES_NUM; ++i)
+			{
+				const Image::Pixel& b = m_bRows[i][x];
+				for (int c = 0; c < Image::Pixel::NUM_CHANNELS; ++c)
+				{
+					ioSquaredDifferences[i] += (a.channel[c] - b.channel[c]) * (a.channel[c] - b.channel[c]);
+				}
+			}
+		}
+
+		FORCE_INLINE void AddSquaredDifferencesMulti(int x, int numPixels, ResultType* ioSquaredDifferences)
+		{
+			for (const int xEnd = x + numPixels; x < xEnd; ++x)
+			{
+				AddSquaredDifferenceMulti(x, ioSquaredDifferences);
+			}
+		}
 	};
 
 	//
@@ -135,18 +252,42 @@ namespace LfnIc
 		typedef POLICY_NO_MASK Super;
 		typedef typename Super::ResultType ResultType;
 
-		inline void OnPreLoop(const MaskLod* mask)
+		inline void OnPreLoop(const ImageConst& inputImage, const MaskLod* mask)
 		{
+			Super::OnPreLoop(inputImage, mask);
 			m_lodBuffer = mask ? mask->GetLodBuffer(mask->GetHighestLod()) : NULL;
 		}
 
-		inline ResultType CalculateSquaredDifference(const Image::Pixel* aSrcRow, const Image::Pixel* bSrcRow, int x)
+		inline ResultType CalculateSquaredDifference(int x)
 		{
 			return (!m_lodRow || m_lodRow[x] == Mask::KNOWN)
-				? Super::CalculateSquaredDifference(aSrcRow, bSrcRow, x)
+				? Super::CalculateSquaredDifference(x)
 				: ResultType(0);
 		}
 
+		inline ResultType CalculateSquaredDifferences(int x, int numPixels)
+		{
+			ResultType squaredDifferences = ResultType(0);
+			for (const int xEnd = x + numPixels; x < xEnd; ++x)
+			{
+				squaredDifferences += CalculateSquaredDifference(x);
+			}
+
+			return squaredDifferences;
+		}
+
+		// The mask is tested once per pixel for all of the candidates.
+		inline void AddSquaredDifferencesMulti(int x, int numPixels, ResultType* ioSquaredDifferences)
+		{
+			for (const int xEnd = x + numPixels; x < xEnd; ++x)
+			{
+				if (!m_lodRow || m_lodRow[x] == Mask::KNOWN)
+				{
+					Super::AddSquaredDifferenceMulti(x, ioSquaredDifferences);
+				}
+			}
+		}
+
 	protected:
 		const Mask::Value* m_lodBuffer;
 		const Mask::Value* m_lodRow;
@@ -161,26 +302,172 @@ namespace LfnIc
 	public:
 		typedef PolicyMask<POLICY_NO_MASK> Super;
 
-		inline void OnARow(int aSrcIndex)
+		inline void OnARow(int aLeft, int aTop)
 		{
-			Super::m_lodRow = Super::m_lodBuffer ? (Super::m_lodBuffer + aSrcIndex) : NULL;
+			Super::OnARow(aLeft, aTop);
+			Super::m_lodRow = Super::m_lodBuffer ? (Super::m_lodBuffer + LfnTech::GetRowMajorIndex(Super::m_imageWidth, aLeft, aTop)) : NULL;
 		}
 	};
 
 	typedef PolicyMaskA<PolicyNoMask_24BitRgb> PolicyMaskA_24BitRgb;
 	typedef PolicyMaskA<PolicyNoMask_General> PolicyMaskA_General;
 
+#if ENABLE_ENERGY_CALCULATOR_SIMD
+	//
+	// PolicySimdNoMask_24BitRgb - calculates whole row strips with the
+	// vectorized kernels selected for the host cpu, reading the input image's
+	// padded RGBX working copy. The scalar 24 bit rgb policy remains the
+	// reference implementation and the fallback.
+	//
+	class PolicySimdNoMask_24BitRgb
+	{
+	public:
+		static const bool HAS_MASK = false;
+		typedef uint32 ResultType;
+
+		inline PolicySimdNoMask_24BitRgb()
+			: m_kernels(*EnergyCalculatorPerPixelSimd::GetBestKernels())
+		{
+		}
+
+		inline void OnPreLoop(const ImageConst& inputImage, const MaskLod* mask)
+		{
+			m_workingCopy = &inputImage.GetWorkingCopy();
+		}
+
+		inline void OnARow(int aLeft, int aTop)
+		{
+			m_aRow = m_workingCopy->GetPaddedRow(aTop) + aLeft;
+		}
+
+		inline void OnBRow(int bLeft, int bTop)
+		{
+			m_bRow = m_workingCopy->GetPaddedRow(bTop) + bLeft;
+		}
+
+		inline void OnBRowMulti(int candidate, int bLeft, int bTop)
+		{
+			m_bRows[candidate] = m_workingCopy->GetPaddedRow(bTop) + bLeft;
+		}
+
+		static inline int GetMaxPixelsPerBunch()
+		{
+			// The X channel is always zero, so the limit is the same as the
+			// scalar policy's.
+			return PolicyNoMask_24BitRgb::GetMaxPixelsPerBunch();
+		}
+
+		FORCE_INLINE ResultType CalculateSquaredDifferences(int x, int numPixels)
+		{
+			return m_kernels.ssd(m_aRow + x, m_bRow + x, numPixels);
+		}
+
+		FORCE_INLINE void AddSquaredDifferencesMulti(int x, int numPixels, ResultType* ioSquaredDifferences)
+		{
+			const ImageWorkingCopy::PaddedPixel* bRows[MULTI_CANDIDATES_NUM];
+			ResultType squaredDifferences[MULTI_CANDIDATES_NUM];
+			GetBRowsMulti(x, bRows);
+			m_kernels.ssdMulti(m_aRow + x, bRows, numPixels, squaredDifferences);
+			AddMulti(squaredDifferences, ioSquaredDifferences);
+		}
+
+	protected:
+		inline void GetBRowsMulti(int x, const ImageWorkingCopy::PaddedPixel** outBRows) const
+		{
+			for (int i = 0; i < MULTI_CANDIDATES_NUM; ++i)
+			{
+				outBRows[i] = m_bRows[i] + x;
+			}
+		}
+
+		static inline void AddMulti(const ResultType* squaredDifferences, ResultType* ioSquaredDifferences)
+		{
+			for (int i = 0; i < MULTI_CANDIDATES_NUM; ++i)
+			{
+				ioSquaredDifferences[i] += squaredDifferences[i];
+			}
+		}
+
+		const EnergyCalculatorPerPixelSimd::Kernels& m_kernels;
+		const ImageWorkingCopy* m_workingCopy;
+		const ImageWorkingCopy::PaddedPixel* m_aRow;
+		const ImageWorkingCopy::PaddedPixel* m_bRow;
+
+		// The multi-candidate B rows.
+		const ImageWorkingCopy::PaddedPixel* m_bRows[MULTI_CANDIDATES_NUM];
+	};
+
+	wxCOMPILE_TIME_ASSERT(EnergyCalculatorPerPixelSimd::SSD_MULTI_NUM == MULTI_CANDIDATES_NUM, SimdMultiKernelsMustMatchMultiCandidates);
+
+	//
+	// PolicySimdMaskA_24BitRgb - vectorized version of PolicyMaskA_24BitRgb.
+	//
+	class PolicySimdMaskA_24BitRgb : public PolicySimdNoMask_24BitRgb
+	{
+	public:
+		static const bool HAS_MASK = true;
+		typedef PolicySimdNoMask_24BitRgb Super;
+
+		inline void OnPreLoop(const ImageConst& inputImage, const MaskLod* mask)
+		{
+			Super::OnPreLoop(inputImage, mask);
+			m_lodBuffer = mask ? mask->GetLodBuffer(mask->GetHighestLod()) : NULL;
+		}
+
+		inline void OnARow(int aLeft, int aTop)
+		{
+			Super::OnARow(aLeft, aTop);
+			m_lodRow = m_lodBuffer ? (m_lodBuffer + LfnTech::GetRowMajorIndex(m_workingCopy->GetWidth(), aLeft, aTop)) : NULL;
+		}
+
+		FORCE_INLINE ResultType CalculateSquaredDifferences(int x, int numPixels)
+		{
+			return m_lodRow
+				? m_kernels.ssdMasked(m_aRow + x, m_bRow + x, m_lodRow + x, numPixels)
+				: m_kernels.ssd(m_aRow + x, m_bRow + x, numPixels);
+		}
+
+		FORCE_INLINE void AddSquaredDifferencesMulti(int x, int numPixels, ResultType* ioSquaredDifferences)
+		{
+			const ImageWorkingCopy::PaddedPixel* bRows[MULTI_CANDIDATES_NUM];
+			ResultType squaredDifferences[MULTI_CANDIDATES_NUM];
+			GetBRowsMulti(x, bRows);
+			if (m_lodRow)
+			{
+				m_kernels.ssdMaskedMulti(m_aRow + x, bRows, m_lodRow + x, numPixels, squaredDifferences);
+			}
+			else
+			{
+				m_kernels.ssdMulti(m_aRow + x, bRows, numPixels, squaredDifferences);
+			}
+
+			AddMulti(squaredDifferences, ioSquaredDifferences);
+		}
+
+	private:
+		const Mask::Value* m_lodBuffer;
+		const Mask::Value* m_lodRow;
+	};
+#endif // ENABLE_ENERGY_CALCULATOR_SIMD
+
 	//
 	// General purpose energy calculation template. Performs masking via a policy
 	// template parameter. Because the policy is resolved at compile time, the
-	// mask testing is compiled out when it's not needed.
+	// mask testing is compiled out when it's not needed. Policies read their own
+	// rows and calculate whole row strips at a time, which allows the vectorized
+	// policies to read the padded working copy and process several pixels per
+	// instruction.
+	//
+	// Once a row brings the energy to bound or more, the remaining rows are
+	// skipped and the partial energy, which is also >= bound, is returned.
 	//
 	template<typename POLICY>
 	static inline Energy CalculateEnergy(
 		const ImageConst& inputImage, const MaskLod* mask,
 		int width, int height,
 		int aLeft, int aTop,
-		int bLeft, int bTop)
+		int bLeft, int bTop,
+		Energy bound)
 	{
 		Energy energy64Bit = Energy(0);
 
@@ -195,55 +482,47 @@ namespace LfnIc
 		if (width > 0 && height > 0)
 		{
 			POLICY policy;
-			policy.OnPreLoop(mask);
+			policy.OnPreLoop(inputImage, mask);
 
 			typename POLICY::ResultType energyBunch = 0;
+			const int maxPixelsPerBunch = policy.GetMaxPixelsPerBunch();
+			const bool canFitInSingleBunch = (width * height) <= maxPixelsPerBunch;
 			int numPixelsInBunch = 0;
-			const bool canFitInSingleBunch = (width * height) <= policy.GetMaxPixelsPerBunch();
 
-			const Image::Pixel* inputImageRgb = inputImage.GetData();
-			int aRowIndex = LfnTech::GetRowMajorIndex(imageWidth, aLeft, aTop);
-			int bRowIndex = LfnTech::GetRowMajorIndex(imageWidth, bLeft, bTop);
-			for (int y = 0; y < height; ++y, aRowIndex += imageWidth, bRowIndex += imageWidth)
+			for (int y = 0; y < height; ++y)
 			{
-				const Image::Pixel* aRow = inputImageRgb + aRowIndex;
-				const Image::Pixel* bRow = inputImageRgb + bRowIndex;
-				policy.OnARow(aRowIndex);
-				policy.OnBRow(bRowIndex);
+				policy.OnARow(aLeft, aTop + y);
+				policy.OnBRow(bLeft, bTop + y);
 
 				if (canFitInSingleBunch)
 				{
-					for (int x = 0; x < width; ++x)
-					{
-						energyBunch += policy.CalculateSquaredDifference(aRow, bRow, x++);
-					}
+					energyBunch += policy.CalculateSquaredDifferences(0, width);
 				}
 				else
 				{
-					int x = 0;
-					do
+					// Split the row into strips that fill the bunch, and dump
+					// the bunch into the 64-bit result whenever it's full.
+					for (int x = 0; x < width;)
 					{
-						const int remainingPixelsInRow = width - x;
-						const bool shouldDumpBunchAfterStrip = (remainingPixelsInRow > policy.GetMaxPixelsPerBunch());
-						const int stripWidth = shouldDumpBunchAfterStrip ? policy.GetMaxPixelsPerBunch() : remainingPixelsInRow;
+						const int stripWidth = std::min(width - x, maxPixelsPerBunch - numPixelsInBunch);
+						energyBunch += policy.CalculateSquaredDifferences(x, stripWidth);
+						x += stripWidth;
+						numPixelsInBunch += stripWidth;
 
-						while (x < stripWidth)
-						{
-							energyBunch += policy.CalculateSquaredDifference(aRow, bRow, x++);
-						}
-
-						if (shouldDumpBunchAfterStrip)
+						if (numPixelsInBunch == maxPixelsPerBunch)
 						{
 							energy64Bit += energyBunch;
 							energyBunch = 0;
 							numPixelsInBunch = 0;
 						}
-						else
-						{
-							numPixelsInBunch += stripWidth;
-						}
 					}
-					while (x < width);
+				}
+
+				// Squared differences only accumulate, so the partial energy
+				// can only grow from here.
+				if (energy64Bit + Energy(energyBunch) >= bound)
+				{
+					break;
 				}
 			}
 
@@ -254,43 +533,176 @@ namespace LfnIc
 		wxASSERT(energy64Bit >= ENERGY_MIN && energy64Bit <= ENERGY_MAX);
 		return energy64Bit;
 	}
+
+	//
+	// Multi-candidate version of CalculateEnergy. Calculates block A against
+	// MULTI_CANDIDATES_NUM blocks B, row by row, so that each row of A is
+	// read once for all of them. Block A is clipped to the image as usual,
+	// and the blocks B are offset to match, but must then be entirely
+	// within the image, so that the clipping is the same for all of them.
+	//
+	// The rows stop once every candidate's energy has reached its bound.
+	// Until then, the candidates that already have continue to accumulate,
+	// which still satisfies their bounds.
+	//
+	template<typename POLICY>
+	static inline void CalculateEnergiesMulti(
+		const ImageConst& inputImage, const MaskLod* mask,
+		int width, int height,
+		int aLeft, int aTop,
+		const int* bLefts, const int* bTops,
+		const Energy* bounds,
+		Energy* outEnergies)
+	{
+		Energy energies64Bit[MULTI_CANDIDATES_NUM];
+		typename POLICY::ResultType energyBunches[MULTI_CANDIDATES_NUM];
+		for (int i = 0; i < MULTI_CANDIDATES_NUM; ++i)
+		{
+			energies64Bit[i] = Energy(0);
+			energyBunches[i] = 0;
+		}
+
+		const int aLeftUnclipped = aLeft;
+		const int aTopUnclipped = aTop;
+		EnergyCalculatorUtils::ClampToMinBoundary(aLeft, width, 0);
+		EnergyCalculatorUtils::ClampToMinBoundary(aTop, height, 0);
+		EnergyCalculatorUtils::ClampToMaxBoundary(aLeft, width, inputImage.GetWidth());
+		EnergyCalculatorUtils::ClampToMaxBoundary(aTop, height, inputImage.GetHeight());
+		const int bLeftOffset = aLeft - aLeftUnclipped;
+		const int bTopOffset = aTop - aTopUnclipped;
+
+		if (width > 0 && height > 0)
+		{
+			POLICY policy;
+			policy.OnPreLoop(inputImage, mask);
+
+			const int maxPixelsPerBunch = policy.GetMaxPixelsPerBunch();
+			const bool canFitInSingleBunch = (width * height) <= maxPixelsPerBunch;
+			int numPixelsInBunch = 0;
+
+			for (int y = 0; y < height; ++y)
+			{
+				policy.OnARow(aLeft, aTop + y);
+				for (int i = 0; i < MULTI_CANDIDATES_NUM; ++i)
+				{
+					wxASSERT(bLefts[i] + bLeftOffset >= 0 && bLefts[i] + bLeftOffset + width <= inputImage.GetWidth());
+					wxASSERT(bTops[i] + bTopOffset >= 0 && bTops[i] + bTopOffset + height <= inputImage.GetHeight());
+					policy.OnBRowMulti(i, bLefts[i] + bLeftOffset, bTops[i] + bTopOffset + y);
+				}
+
+				if (canFitInSingleBunch)
+				{
+					policy.AddSquaredDifferencesMulti(0, width, energyBunches);
+				}
+				else
+				{
+					// The candidates' bunches fill at the same rate, so they're
+					// dumped together.
+					for (int x = 0; x < width;)
+					{
+						const int stripWidth = std::min(width - x, maxPixelsPerBunch - numPixelsInBunch);
+						policy.AddSquaredDifferencesMulti(x, stripWidth, energyBunches);
+						x += stripWidth;
+						numPixelsInBunch += stripWidth;
+
+						if (numPixelsInBunch == maxPixelsPerBunch)
+						{
+							for (int i = 0; i < MULTI_CANDIDATES_NUM; ++i)
+							{
+								energies64Bit[i] += energyBunches[i];
+								energyBunches[i] = 0;
+							}
+
+							numPixelsInBunch = 0;
+						}
+					}
+				}
+
+				bool areAllBounded = true;
+				for (int i = 0; i < MULTI_CANDIDATES_NUM && areAllBounded; ++i)
+				{
+					areAllBounded = (energies64Bit[i] + Energy(energyBunches[i]) >= bounds[i]);
+				}
+
+				if (areAllBounded)
+				{
+					break;
+				}
+			}
+		}
+
+		for (int i = 0; i < MULTI_CANDIDATES_NUM; ++i)
+		{
+			outEnergies[i] = energies64Bit[i] + Energy(energyBunches[i]);
+			wxASSERT(outEnergies[i] >= ENERGY_MIN && outEnergies[i] <= ENERGY_MAX);
+		}
+	}
 }
 
+//
+// EnergyCalculatorPerPixel::QueuedCalculationsJob implementation
+//
+class LfnIc::EnergyCalculatorPerPixel::QueuedCalculationsJob : public LfnTech::ThreadPool::Job
+{
+public:
+	QueuedCalculationsJob(EnergyCalculatorPerPixel& energyCalculatorPerPixel) :
+	m_energyCalculatorPerPixel(energyCalculatorPerPixel)
+	{
+	}
+
+	virtual void Process(int itemBegin, int itemEnd)
+	{
+		m_energyCalculatorPerPixel.ProcessQueuedCalculations(itemBegin, itemEnd);
+	}
+
+private:
+	EnergyCalculatorPerPixel& m_energyCalculatorPerPixel;
+};
+
+//
+// EnergyCalculatorPerPixel::QueuedCalculationLess implementation
+//
+class LfnIc::EnergyCalculatorPerPixel::QueuedCalculationLess
+{
+public:
+	QueuedCalculationLess(const std::vector<QueuedCalculationAndResult>& queuedCalculationsAndResults) :
+	m_queuedCalculationsAndResults(queuedCalculationsAndResults)
+	{
+	}
+
+	inline bool operator()(int a, int b) const
+	{
+		const QueuedCalculationAndResult& queuedA = m_queuedCalculationsAndResults[a];
+		const QueuedCalculationAndResult& queuedB = m_queuedCalculationsAndResults[b];
+		return (queuedA.bTop != queuedB.bTop)
+			? (queuedA.bTop < queuedB.bTop)
+			: (queuedA.bLeft < queuedB.bLeft);
+	}
+
+private:
+	const std::vector<QueuedCalculationAndResult>& m_queuedCalculationsAndResults;
+};
+
 //
 // EnergyCalculatorPerPixel implementation
 //
-LfnIc::EnergyCalculatorPerPixel::EnergyCalculatorPerPixel(const ImageConst& inputImage, const MaskLod& mask) :
+LfnIc::EnergyCalculatorPerPixel::EnergyCalculatorPerPixel(const ImageConst& inputImage, const MaskLod& mask, LfnTech::ThreadPool& threadPool) :
 m_inputImage(inputImage),
 	m_mask(mask),
 	m_batchState(BatchStateClosed),
 	m_isAsyncBatch(false),
-	m_queuedCalculationAndResultIndexBuffer(*this),
-	m_targetThreadIndex(0)
+	m_threadPool(threadPool),
+	m_useSimdKernels(false)
 {
-#ifdef USE_THREADS
-	const int cpuCount = wxThread::GetCPUCount();
-	if (cpuCount > 1)
-	{
-		const int numWorkerThreads = cpuCount - 1;
-		for (int i = 0; i < numWorkerThreads; ++i)
-		{
-			WorkerThread* workerThread = new WorkerThread(*this);
-			m_workerThreads.push_back(workerThread);
-
-			wxASSERT(workerThread->IsPaused());
-		}
-	}
+#if ENABLE_ENERGY_CALCULATOR_SIMD
+	// Selects the kernels for the host cpu before any calculations run on
+	// the pool's threads.
+	m_useSimdKernels = LfnIc::Image::PixelInfo::IS_24_BIT_RGB && EnergyCalculatorPerPixelSimd::GetBestKernels() != NULL;
 #endif
 }
 
 LfnIc::EnergyCalculatorPerPixel::~EnergyCalculatorPerPixel()
 {
-	for (int i = 0, n = m_workerThreads.size(); i < n; ++i)
-	{
-		WorkerThread* workerThread = m_workerThreads[i];
-		workerThread->ResumeAndQuit();
-		delete workerThread;
-	}
 }
 
 void LfnIc::EnergyCalculatorPerPixel::BatchOpenImmediate(const BatchParams& params)
@@ -310,10 +722,12 @@ void LfnIc::EnergyCalculatorPerPixel::BatchOpenQueued(const BatchParams& params)
 	{
 		m_queuedCalculationsAndResults.clear();
 		m_queuedCalculationsAndResults.reserve(m_batchParams.maxCalculations);
+		m_queuedCalculationOrder.clear();
+		m_queuedCalculationOrder.reserve(m_batchParams.maxCalculations);
 	}
 
 	{
-		m_isAsyncBatch = (m_workerThreads.size() > 0 && m_batchParams.maxCalculations >= MIN_CALCULATIONS_FOR_ASYNC_BATCH);
+		m_isAsyncBatch = (m_threadPool.GetNumThreads() > 1 && m_batchParams.maxCalculations >= MIN_CALCULATIONS_FOR_ASYNC_BATCH);
 	}
 }
 
@@ -325,34 +739,62 @@ void LfnIc::EnergyCalculatorPerPixel::BatchClose()
 }
 
 LfnIc::Energy LfnIc::EnergyCalculatorPerPixel::Calculate(int bLeft, int bTop) const
+{
+	return CalculateBounded(bLeft, bTop, ENERGY_MAX);
+}
+
+LfnIc::Energy LfnIc::EnergyCalculatorPerPixel::CalculateBounded(int bLeft, int bTop, Energy bound) const
 {
 	wxASSERT(m_batchState != BatchStateClosed);
 
 	if (LfnIc::Image::PixelInfo::IS_24_BIT_RGB)
 	{
+#if ENABLE_ENERGY_CALCULATOR_SIMD
+		if (m_useSimdKernels)
+		{
+			const Energy energy = m_batchParams.aMasked
+				? CalculateMaskA<PolicySimdMaskA_24BitRgb>(bLeft, bTop, bound)
+				: CalculateNoMask<PolicySimdNoMask_24BitRgb>(bLeft, bTop, bound);
+
+#if SIMD_VALIDATION_ENABLED
+			const Energy energyScalar = m_batchParams.aMasked
+				? CalculateMaskA<PolicyMaskA_24BitRgb>(bLeft, bTop, bound)
+				: CalculateNoMask<PolicyNoMask_24BitRgb>(bLeft, bTop, bound);
+			wxASSERT_MSG(energy == energyScalar, "The vectorized energy doesn't match the scalar reference energy.");
+#endif
+
+			return energy;
+		}
+#endif // ENABLE_ENERGY_CALCULATOR_SIMD
+
 		if (m_batchParams.aMasked)
 		{
-			return CalculateMaskA<PolicyMaskA_24BitRgb>(bLeft, bTop);
+			return CalculateMaskA<PolicyMaskA_24BitRgb>(bLeft, bTop, bound);
 		}
 		else
 		{
-			return CalculateNoMask<PolicyNoMask_24BitRgb>(bLeft, bTop);
+			return CalculateNoMask<PolicyNoMask_24BitRgb>(bLeft, bTop, bound);
 		}
 	}
 	else
 	{
 		if (m_batchParams.aMasked)
 		{
-			return CalculateMaskA<PolicyMaskA_General>(bLeft, bTop);
+			return CalculateMaskA<PolicyMaskA_General>(bLeft, bTop, bound);
 		}
 		else
 		{
-			return CalculateNoMask<PolicyNoMask_General>(bLeft, bTop);
+			return CalculateNoMask<PolicyNoMask_General>(bLeft, bTop, bound);
 		}
 	}
-} // end Calculate
+} // end CalculateBounded
 
 LfnIc::EnergyCalculator::BatchQueued::Handle LfnIc::EnergyCalculatorPerPixel::QueueCalculation(int bLeft, int bTop)
+{
+	return QueueCalculationBounded(bLeft, bTop, ENERGY_MAX);
+}
+
+LfnIc::EnergyCalculator::BatchQueued::Handle LfnIc::EnergyCalculatorPerPixel::QueueCalculationBounded(int bLeft, int bTop, Energy bound)
 {
 	wxASSERT(m_batchState != BatchStateClosed);
 
@@ -364,50 +806,40 @@ LfnIc::EnergyCalculator::BatchQueued::Handle LfnIc::EnergyCalculatorPerPixel::Qu
 		QueuedCalculationAndResult queuedCalculationAndResult;
 		queuedCalculationAndResult.bLeft = bLeft;
 		queuedCalculationAndResult.bTop = bTop;
+		queuedCalculationAndResult.bound = bound;
 		m_queuedCalculationsAndResults.push_back(queuedCalculationAndResult);
 	}
 
-	// Give index of new QueuedCalculationAndResult to the next target thread.
-	{
-		// See comments above m_targetThreadIndex member.
-		QueuedCalculationAndResultIndexBuffer& queuedCalculationAndResultIndexBuffer = (!m_isAsyncBatch || static_cast<unsigned int>(m_targetThreadIndex) == m_workerThreads.size())
-			? m_queuedCalculationAndResultIndexBuffer                                           // main thread
-			: m_workerThreads[m_targetThreadIndex]->GetQueuedCalculationAndResultIndexBuffer(); // worker thread
-
-		queuedCalculationAndResultIndexBuffer.push_back(queuedCalculationAndResultIndex);
-
-		// Cycle to the next thread index.
-		m_targetThreadIndex = (m_targetThreadIndex + 1) % (m_workerThreads.size() + 1);
-	}
-
 	return BatchQueued::Handle(queuedCalculationAndResultIndex);
 }
 
 void LfnIc::EnergyCalculatorPerPixel::ProcessCalculations()
 {
-	// Resume the worker threads and have them process their calculations.
-	if (m_isAsyncBatch)
+	const int numQueuedCalculations = m_queuedCalculationsAndResults.size();
+
+	// Sorting by block B's top and left puts blocks B that share rows into
+	// the same multi-candidate group.
+	m_queuedCalculationOrder.resize(numQueuedCalculations);
+	for (int i = 0; i < numQueuedCalculations; ++i)
 	{
-		for (int i = 0, n = m_workerThreads.size(); i < n; ++i)
-		{
-			wxASSERT(m_workerThreads[i]->IsPaused());
-			m_workerThreads[i]->ResumeAndStartProcessingCalculations();
-			wxASSERT(!m_workerThreads[i]->IsPaused());
-		}
+		m_queuedCalculationOrder[i] = i;
 	}
 
-	// Process the main thread's calculations.
-	m_queuedCalculationAndResultIndexBuffer.ProcessCalculationsAndClear();
+	if (numQueuedCalculations > MULTI_CANDIDATES_NUM)
+	{
+		std::sort(m_queuedCalculationOrder.begin(), m_queuedCalculationOrder.end(), QueuedCalculationLess(m_queuedCalculationsAndResults));
+	}
 
-	// Wait for all worker threads to finish.
 	if (m_isAsyncBatch)
 	{
-		for (int i = 0, n = m_workerThreads.size(); i < n; ++i)
-		{
-			wxASSERT(!m_workerThreads[i]->IsPaused());
-			m_workerThreads[i]->FinishProcessingCalculationsAndPause();
-			wxASSERT(m_workerThreads[i]->IsPaused());
-		}
+		// The pool's threads each start on a contiguous range of chunks, and
+		// steal from the others' ranges once theirs run out.
+		QueuedCalculationsJob job(*this);
+		m_threadPool.Run(job, numQueuedCalculations, QUEUED_CALCULATIONS_PER_CHUNK);
+	}
+	else
+	{
+		ProcessQueuedCalculations(0, numQueuedCalculations);
 	}
 
 	m_batchState = BatchStateOpenQueuedAndProcessed;
@@ -420,150 +852,164 @@ LfnIc::Energy LfnIc::EnergyCalculatorPerPixel::GetResult(BatchQueued::Handle han
 }
 
 template <typename POLICY>
-LfnIc::Energy LfnIc::EnergyCalculatorPerPixel::CalculateNoMask(int bLeft, int bTop) const
+LfnIc::Energy LfnIc::EnergyCalculatorPerPixel::CalculateNoMask(int bLeft, int bTop, Energy bound) const
 {
 	wxCOMPILE_TIME_ASSERT(!POLICY::HAS_MASK, CalculateNoMask_IsCalledWithAMaskPolicy);
 	return CalculateEnergy<POLICY>(
 		m_inputImage, NULL,
 		m_batchParams.width, m_batchParams.height,
 		m_batchParams.aLeft, m_batchParams.aTop,
-		bLeft, bTop);
+		bLeft, bTop,
+		bound);
 }
 
 template<typename POLICY>
-LfnIc::Energy LfnIc::EnergyCalculatorPerPixel::CalculateMaskA(int bLeft, int bTop) const
+LfnIc::Energy LfnIc::EnergyCalculatorPerPixel::CalculateMaskA(int bLeft, int bTop, Energy bound) const
 {
 	wxCOMPILE_TIME_ASSERT(POLICY::HAS_MASK, CalculateMaskA_IsCalledWithANoMaskPolicy);
 	return CalculateEnergy<POLICY>(
 		m_inputImage, &m_mask,
 		m_batchParams.width, m_batchParams.height,
 		m_batchParams.aLeft, m_batchParams.aTop,
-		bLeft, bTop);
-}
-
-LfnIc::EnergyCalculatorPerPixel::QueuedCalculationAndResultIndexBuffer::QueuedCalculationAndResultIndexBuffer(EnergyCalculatorPerPixel& energyCalculatorPerPixel) :
-m_energyCalculatorPerPixel(energyCalculatorPerPixel)
-{
+		bLeft, bTop,
+		bound);
 }
 
-void LfnIc::EnergyCalculatorPerPixel::QueuedCalculationAndResultIndexBuffer::ProcessCalculationsAndClear()
+void LfnIc::EnergyCalculatorPerPixel::CalculateBoundedMulti(QueuedCalculationAndResult* const* queued) const
 {
-	for (int i = 0, n = size(); i < n; ++i)
-	{
-		QueuedCalculationAndResult& queuedCalculationAndResult = m_energyCalculatorPerPixel.m_queuedCalculationsAndResults[at(i)];
-		queuedCalculationAndResult.result = m_energyCalculatorPerPixel.Calculate(queuedCalculationAndResult.bLeft, queuedCalculationAndResult.bTop);
-	}
-
-	clear();
-}
-
-LfnIc::EnergyCalculatorPerPixel::WorkerThread::WorkerThread(EnergyCalculatorPerPixel& energyCalculatorPerPixel) :
-wxThread(wxTHREAD_JOINABLE),
-	m_energyCalculatorPerPixel(energyCalculatorPerPixel),
-	m_queuedCalculationAndResultIndexBuffer(energyCalculatorPerPixel),
-	m_state(Active)
-{
-	Create();
-	Run();
-	FinishProcessingCalculationsAndPause();
-}
+	wxASSERT(m_batchState != BatchStateClosed);
 
-wxThread::ExitCode LfnIc::EnergyCalculatorPerPixel::WorkerThread::Entry()
-{
-	State state = Active;
-	while (state != Quitting)
+	if (LfnIc::Image::PixelInfo::IS_24_BIT_RGB)
 	{
-		m_queuedCalculationAndResultIndexBuffer.ProcessCalculationsAndClear();
-
-		// Just query the state; it's never expected to be invalid, the
-		// exchange and comparand are dummies.
-		state = AtomicGetState();
-
-		// If the main thread wants us to pause, safely loop in here till it
-		// wants to resume.
-		if (state == Pausing)
+#if ENABLE_ENERGY_CALCULATOR_SIMD
+		if (m_useSimdKernels)
 		{
-			// Set the paused state, and verify that the main thread's sync
-			// loop did its job by waiting.
+			if (m_batchParams.aMasked)
 			{
-				const State previousState = State(LfnTech::Atomic<>::CompareExchange(&m_state, Paused, Pausing));
-				wxASSERT(previousState == Pausing);
+				CalculateMulti<PolicySimdMaskA_24BitRgb>(queued, &m_mask);
 			}
-
-			// Loop until the resuming state is set.
-			while ((state = AtomicGetState()) == Paused)
+			else
 			{
-				wxThread::Yield();
+				CalculateMulti<PolicySimdNoMask_24BitRgb>(queued, NULL);
 			}
 
-			// If we're resuming, set the active state, and verify that the
-			// main thread's sync loop did its job by waiting.
-			if (state == Resuming)
-			{
-				const State previousState = State(LfnTech::Atomic<>::CompareExchange(&m_state, Active, Resuming));
-				wxASSERT(previousState == Resuming);
-			}
+			return;
 		}
-	}
-
-	return 0;
-}
-
-bool LfnIc::EnergyCalculatorPerPixel::WorkerThread::IsPaused() const
-{
-	return wxThread::IsPaused();
-}
-
-void LfnIc::EnergyCalculatorPerPixel::WorkerThread::ResumeAndStartProcessingCalculations()
-{
-	wxASSERT(IsPaused());
-
-	const State previousState = State(LfnTech::Atomic<>::CompareExchange(&m_state, Resuming, Paused));
-	wxASSERT(previousState == Paused);
+#endif // ENABLE_ENERGY_CALCULATOR_SIMD
 
-	wxThread::Resume();
-
-	// No need to wait until thread sets state to active;
-	// FinishProcessingCalculationsAndPause() handles all synchronization.
+		if (m_batchParams.aMasked)
+		{
+			CalculateMulti<PolicyMaskA_24BitRgb>(queued, &m_mask);
+		}
+		else
+		{
+			CalculateMulti<PolicyNoMask_24BitRgb>(queued, NULL);
+		}
+	}
+	else
+	{
+		if (m_batchParams.aMasked)
+		{
+			CalculateMulti<PolicyMaskA_General>(queued, &m_mask);
+		}
+		else
+		{
+			CalculateMulti<PolicyNoMask_General>(queued, NULL);
+		}
+	}
 }
 
-void LfnIc::EnergyCalculatorPerPixel::WorkerThread::FinishProcessingCalculationsAndPause()
+template<typename POLICY>
+void LfnIc::EnergyCalculatorPerPixel::CalculateMulti(QueuedCalculationAndResult* const* queued, const MaskLod* mask) const
 {
-	wxASSERT(!IsPaused());
+	wxCOMPILE_TIME_ASSERT(POLICY::HAS_MASK == true || POLICY::HAS_MASK == false, CalculateMulti_PolicyMustDefineHasMask);
 
-	// Sync: loop until state is Active, which is required to set the Pausing
-	// state. This is done in case ResumeAndStartProcessingCalculations()
-	// was just called and the thread hasn't had a chance to wake up.
-	while (LfnTech::Atomic<>::CompareExchange(&m_state, Pausing, Active) != Active)
+	int bLefts[MULTI_CANDIDATES_NUM];
+	int bTops[MULTI_CANDIDATES_NUM];
+	Energy bounds[MULTI_CANDIDATES_NUM];
+	Energy energies[MULTI_CANDIDATES_NUM];
+	for (int i = 0; i < MULTI_CANDIDATES_NUM; ++i)
 	{
-		wxThread::Yield();
+		bLefts[i] = queued[i]->bLeft;
+		bTops[i] = queued[i]->bTop;
+		bounds[i] = queued[i]->bound;
 	}
 
-	// Sync: loop until state is Paused, which won't happen until the thread
-	// has finished processing.
-	while (AtomicGetState() != Paused)
+	CalculateEnergiesMulti<POLICY>(
+		m_inputImage, mask,
+		m_batchParams.width, m_batchParams.height,
+		m_batchParams.aLeft, m_batchParams.aTop,
+		bLefts, bTops,
+		bounds,
+		energies);
+
+	for (int i = 0; i < MULTI_CANDIDATES_NUM; ++i)
 	{
-		wxThread::Yield();
+#if MULTI_CANDIDATE_VALIDATION_ENABLED
+		const Energy energySingle = CalculateBounded(bLefts[i], bTops[i], bounds[i]);
+		wxASSERT_MSG(energies[i] == energySingle || (energies[i] >= bounds[i] && energySingle >= bounds[i]), "The multi-candidate energy doesn't match the single candidate energy.");
+#endif
+		queued[i]->result = energies[i];
 	}
-
-	wxThread::Pause();
 }
 
-void LfnIc::EnergyCalculatorPerPixel::WorkerThread::ResumeAndQuit()
+void LfnIc::EnergyCalculatorPerPixel::ProcessQueuedCalculations(int begin, int end)
 {
-	wxASSERT(IsPaused());
-
-	const State previousState = State(LfnTech::Atomic<>::CompareExchange(&m_state, Quitting, Paused));
-	wxASSERT(previousState == Paused);
+	// Block A clipped to the image, as CalculateEnergy() clips it. The
+	// blocks B that are entirely within the image once they're offset the
+	// same way are calculated in multi-candidate groups, in sorted order.
+	// The others are clipped differently, so they're calculated one by one.
+	int aLeft = m_batchParams.aLeft;
+	int aTop = m_batchParams.aTop;
+	int width = m_batchParams.width;
+	int height = m_batchParams.height;
+	EnergyCalculatorUtils::ClampToMinBoundary(aLeft, width, 0);
+	EnergyCalculatorUtils::ClampToMinBoundary(aTop, height, 0);
+	EnergyCalculatorUtils::ClampToMaxBoundary(aLeft, width, m_inputImage.GetWidth());
+	EnergyCalculatorUtils::ClampToMaxBoundary(aTop, height, m_inputImage.GetHeight());
+	const int bLeftOffset = aLeft - m_batchParams.aLeft;
+	const int bTopOffset = aTop - m_batchParams.aTop;
+	const int bLeftMax = m_inputImage.GetWidth() - width - bLeftOffset;
+	const int bTopMax = m_inputImage.GetHeight() - height - bTopOffset;
+
+	QueuedCalculationAndResult* group[MULTI_CANDIDATES_NUM];
+	int groupNum = 0;
+	for (int i = begin; i < end; ++i)
+	{
+		QueuedCalculationAndResult& queuedCalculationAndResult = m_queuedCalculationsAndResults[m_queuedCalculationOrder[i]];
+		const bool isMultiCandidate =
+			width > 0 && height > 0 &&
+			queuedCalculationAndResult.bLeft >= -bLeftOffset && queuedCalculationAndResult.bLeft <= bLeftMax &&
+			queuedCalculationAndResult.bTop >= -bTopOffset && queuedCalculationAndResult.bTop <= bTopMax;
 
-	wxThread::Resume();
+		if (isMultiCandidate)
+		{
+			group[groupNum++] = &queuedCalculationAndResult;
+			if (groupNum == MULTI_CANDIDATES_NUM)
+			{
+				CalculateBoundedMulti(group);
+				groupNum = 0;
+			}
+		}
+		else
+		{
+			queuedCalculationAndResult.result = CalculateBounded(queuedCalculationAndResult.bLeft, queuedCalculationAndResult.bTop, queuedCalculationAndResult.bound);
+		}
+	}
 
-	// Joinable thread, wait for it to join.
-	Wait();
-}
+	// Fill out the last partial group by repeating its last calculation,
+	// which just stores the same result again.
+	if (groupNum == 1)
+	{
+		group[0]->result = CalculateBounded(group[0]->bLeft, group[0]->bTop, group[0]->bound);
+	}
+	else if (groupNum > 1)
+	{
+		for (int i = groupNum; i < MULTI_CANDIDATES_NUM; ++i)
+		{
+			group[i] = group[groupNum - 1];
+		}
 
-LfnIc::EnergyCalculatorPerPixel::WorkerThread::State LfnIc::EnergyCalculatorPerPixel::WorkerThread::AtomicGetState() const
-{
-	// The exchange and comparand are dummies.
-	return State(LfnTech::Atomic<>::CompareExchange(&m_state, Invalid, Invalid));
+		CalculateBoundedMulti(group);
+	}
 }
@@ -24,6 +24,11 @@
 
 #include "EnergyCalculator.h"
 
+namespace LfnTech
+{
+	class ThreadPool;
+}
+
 namespace LfnIc
 {
 	// Forward declarations
@@ -31,11 +36,12 @@ namespace LfnIc
 	class MaskLod;
 
 	/// Calculates the energy between two regions of the input image by doing
-	/// straight per-pixel calculations on the CPU.
+	/// straight per-pixel calculations on the CPU. Large queued batches are
+	/// processed in parallel by threadPool.
 	class EnergyCalculatorPerPixel : public EnergyCalculator
 	{
 	public:
-		EnergyCalculatorPerPixel(const ImageConst& inputImage, const MaskLod& mask);
+		EnergyCalculatorPerPixel(const ImageConst& inputImage, const MaskLod& mask, LfnTech::ThreadPool& threadPool);
 		virtual ~EnergyCalculatorPerPixel();
 
 	private:
@@ -57,71 +63,19 @@ namespace LfnIc
 		{
 			int bLeft;
 			int bTop;
+			Energy bound;
 			Energy result;
 		};
 
-		// An index buffer into the m_queuedCalculationsAndResults member.
-		// Stores the indices that a given thread is responsible for
-		// processing.
-		class QueuedCalculationAndResultIndexBuffer : private std::vector<uint>
-		{
-		public:
-			typedef std::vector<uint> Super;
-
-			QueuedCalculationAndResultIndexBuffer(EnergyCalculatorPerPixel& energyCalculatorPerPixel);
-
-			using Super::push_back;
-			void ProcessCalculationsAndClear();
-
-		private:
-			EnergyCalculatorPerPixel& m_energyCalculatorPerPixel;
-		};
-
-		// Worker thread for parallel calculation processing. New instances
-		// automatically initialize themselves in a paused state.
-		class WorkerThread : private wxThread
-		{
-		public:
-			WorkerThread(EnergyCalculatorPerPixel& energyCalculatorPerPixel);
-			virtual ExitCode Entry();
-
-			inline QueuedCalculationAndResultIndexBuffer& GetQueuedCalculationAndResultIndexBuffer() { return m_queuedCalculationAndResultIndexBuffer; }
-
-			bool IsPaused() const;
-
-			// Resumes the thread and starts processing its calculations.
-			void ResumeAndStartProcessingCalculations();
+		// Processes ranges of m_queuedCalculationsAndResults on the thread
+		// pool's threads.
+		class QueuedCalculationsJob;
+		friend class QueuedCalculationsJob;
 
-			// Finishes processing this's thread's calculations, and pauses
-			// the thread.
-			void FinishProcessingCalculationsAndPause();
-
-			// Causes the worker thread to gracefully quit altogether.
-			void ResumeAndQuit();
-
-		private:
-			enum State
-			{
-				Invalid = -1,
-				Quitting,
-				Paused,
-				Pausing,
-				Resuming,
-				Active,
-			};
-
-			// Returns the current state using an atomic operation.
-			inline State AtomicGetState() const;
-
-			EnergyCalculatorPerPixel& m_energyCalculatorPerPixel;
-
-			// This thread's index buffer into m_energyCalculatorPerPixel.m_queuedCalculationsAndResults.
-			QueuedCalculationAndResultIndexBuffer m_queuedCalculationAndResultIndexBuffer;
-
-			mutable long volatile m_state;
-		};
-
-		friend class WorkerThread;
+		// Orders indices of m_queuedCalculationsAndResults by block B's top,
+		// then left.
+		class QueuedCalculationLess;
+		friend class QueuedCalculationLess;
 
 		//
 		// Internal methods
@@ -135,12 +89,30 @@ namespace LfnIc
 		virtual BatchQueued::Handle QueueCalculation(int bLeft, int bTop);
 		virtual void ProcessCalculations();
 		virtual Energy GetResult(BatchQueued::Handle handle) const;
+		virtual Energy CalculateBounded(int bLeft, int bTop, Energy bound) const;
+		virtual BatchQueued::Handle QueueCalculationBounded(int bLeft, int bTop, Energy bound);
+
+		// Calculates and stores the results of the queued calculations in
+		// [begin, end) of m_queuedCalculationOrder, several candidates at a
+		// time where possible. Safe to call concurrently for disjoint ranges.
+		void ProcessQueuedCalculations(int begin, int end);
+
+		// Calculates and stores the results of a group of
+		// MULTI_CANDIDATES_NUM queued calculations (see the .cpp), reading
+		// block A once for all of them. Once offset by block A's clipping,
+		// their blocks B must be within the image.
+		void CalculateBoundedMulti(QueuedCalculationAndResult* const* queued) const;
+
+		template<typename POLICY>
+		void CalculateMulti(QueuedCalculationAndResult* const* queued, const MaskLod* mask) const;
 
+		// The calculation stops at the end of the first row that brings the
+		// energy to bound or more. Pass ENERGY_MAX for the exact energy.
 		template<typename POLICY>
-		Energy CalculateNoMask(int bLeft, int bTop) const;
+		Energy CalculateNoMask(int bLeft, int bTop, Energy bound) const;
 
 		template<typename POLICY>
-		Energy CalculateMaskA(int bLeft, int bTop) const;
+		Energy CalculateMaskA(int bLeft, int bTop, Energy bound) const;
 
 		//
 		// Data
@@ -151,18 +123,20 @@ namespace LfnIc
 		BatchParams m_batchParams;
 		bool m_isAsyncBatch;
 
-		std::vector<WorkerThread*> m_workerThreads;
+		LfnTech::ThreadPool& m_threadPool;
 
 		// All queued calculations and results.
 		std::vector<QueuedCalculationAndResult> m_queuedCalculationsAndResults;
 
-		// Main thread's index buffer into m_queuedCalculationsAndResults.
-		QueuedCalculationAndResultIndexBuffer m_queuedCalculationAndResultIndexBuffer;
+		// Indices of m_queuedCalculationsAndResults, sorted by
+		// ProcessCalculations() so that neighboring blocks B are calculated
+		// together.
+		std::vector<int> m_queuedCalculationOrder;
 
-		// Cycles through the thread indices, and is the target for the next
-		// queued calculation (index == m_workerThreads.size() indicates the
-		// main thread).
-		int m_targetThreadIndex;
+		// True if the host supports one of the vectorized SSD kernels in
+		// EnergyCalculatorPerPixelSimd, which are then used instead of the
+		// scalar policies.
+		bool m_useSimdKernels;
 	};
 }
 
@@ -0,0 +1,618 @@
+//
+// Copyright 2010, Darren Lafreniere
+// <http://www.lafarren.com/image-completer/>
+//
+// This file is part of lafarren.com's Image Completer.
+//
+// Image Completer is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Image Completer is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Image Completer, named License.txt. If not, see
+// <http://www.gnu.org/licenses/>.
+//
+
+
+#include "Pch.h"
+#include "EnergyCalculatorPerPixelSimd.h"
+
+#if ENABLE_ENERGY_CALCULATOR_SIMD
+
+#include <immintrin.h>
+
+#include "tech/DbgMem.h"
+
+// gcc and clang only allow intrinsics of instruction sets that are enabled
+// for the enclosing function. Enable them per function, so that the rest of
+// the library continues to target the baseline cpu. msvc doesn't need this.
+#if defined(__GNUC__)
+#define SIMD_TARGET(instructionSets) __attribute__((target(instructionSets)))
+#else
+#define SIMD_TARGET(instructionSets)
+#endif
+
+namespace LfnIc
+{
+	typedef ImageWorkingCopy::PaddedPixel PaddedPixel;
+
+	// The kernels treat a row of RGBX pixels as a flat array of channel
+	// bytes, since the SSD doesn't care which channel a byte belongs to, and
+	// the X channel is zero in every pixel.
+	const int BYTES_PER_PIXEL = 4;
+	wxCOMPILE_TIME_ASSERT(!Image::PixelInfo::IS_24_BIT_RGB || sizeof(PaddedPixel) == BYTES_PER_PIXEL, PaddedPixelIsNotRgbx);
+
+	// Converts a row of pixels into its channel bytes.
+	static FORCE_INLINE const uint8* ToBytes(const PaddedPixel* pixels)
+	{
+		return reinterpret_cast<const uint8*>(pixels);
+	}
+
+	// Scalar SSD over the remaining pixels that don't fill a vector.
+	static FORCE_INLINE uint32 SsdTailPixels(const uint8* a, const uint8* b, int numPixels)
+	{
+		uint32 ssd = 0;
+		for (int i = 0, n = numPixels * BYTES_PER_PIXEL; i < n; ++i)
+		{
+			const int d = int(a[i]) - int(b[i]);
+			ssd += d * d;
+		}
+
+		return ssd;
+	}
+
+	// Masked version of SsdTailPixels.
+	static FORCE_INLINE uint32 SsdTailPixelsMasked(const uint8* a, const uint8* b, const Mask::Value* mask, int numPixels)
+	{
+		uint32 ssd = 0;
+		for (int i = 0; i < numPixels; ++i, a += BYTES_PER_PIXEL, b += BYTES_PER_PIXEL)
+		{
+			if (mask[i] == Mask::KNOWN)
+			{
+				ssd += SsdTailPixels(a, b, 1);
+			}
+		}
+
+		return ssd;
+	}
+
+	const int SSD_MULTI_NUM = EnergyCalculatorPerPixelSimd::SSD_MULTI_NUM;
+
+	//
+	// SSE2
+	//
+
+	// Returns four 32 bit lanes that sum to the SSD of the 16 bytes in a and b.
+	static SIMD_TARGET("sse2") inline __m128i SquaredDifferencesSse2(__m128i a, __m128i b)
+	{
+		const __m128i zero = _mm_setzero_si128();
+		const __m128i dLo = _mm_sub_epi16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero));
+		const __m128i dHi = _mm_sub_epi16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero));
+		return _mm_add_epi32(_mm_madd_epi16(dLo, dLo), _mm_madd_epi16(dHi, dHi));
+	}
+
+	// The lanes are summed as unsigned values. The callers guarantee that the
+	// total fits in a uint32, so any intermediate wraparound cancels out.
+	static SIMD_TARGET("sse2") inline uint32 HorizontalSumSse2(__m128i v)
+	{
+		v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2)));
+		v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1)));
+		return uint32(_mm_cvtsi128_si32(v));
+	}
+
+	static SIMD_TARGET("sse2") uint32 SsdSse2(const PaddedPixel* aPixels, const PaddedPixel* bPixels, int numPixels)
+	{
+		static const int PIXELS_PER_VECTOR = 16 / BYTES_PER_PIXEL;
+		const uint8* a = ToBytes(aPixels);
+		const uint8* b = ToBytes(bPixels);
+
+		__m128i sum = _mm_setzero_si128();
+		int p = 0;
+		for (; p + PIXELS_PER_VECTOR <= numPixels; p += PIXELS_PER_VECTOR, a += 16, b += 16)
+		{
+			const __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a));
+			const __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b));
+			sum = _mm_add_epi32(sum, SquaredDifferencesSse2(va, vb));
+		}
+
+		return HorizontalSumSse2(sum) + SsdTailPixels(a, b, numPixels - p);
+	}
+
+	static SIMD_TARGET("sse2") uint32 SsdMaskedSse2(const PaddedPixel* aPixels, const PaddedPixel* bPixels, const Mask::Value* mask, int numPixels)
+	{
+		static const int PIXELS_PER_VECTOR = 16 / BYTES_PER_PIXEL;
+		const uint8* a = ToBytes(aPixels);
+		const uint8* b = ToBytes(bPixels);
+		const __m128i known = _mm_set1_epi8(Mask::KNOWN);
+
+		__m128i sum = _mm_setzero_si128();
+		int p = 0;
+		for (; p + PIXELS_PER_VECTOR <= numPixels; p += PIXELS_PER_VECTOR, a += 16, b += 16)
+		{
+			// Replicate each of the four pixels' known flags over the pixel's
+			// four bytes, and zero the bytes of the unknown pixels in both a
+			// and b.
+			int maskValues;
+			memcpy(&maskValues, mask + p, sizeof(maskValues));
+			__m128i m = _mm_cmpeq_epi8(_mm_cvtsi32_si128(maskValues), known);
+			m = _mm_unpacklo_epi8(m, m);
+			m = _mm_unpacklo_epi16(m, m);
+
+			const __m128i va = _mm_and_si128(m, _mm_loadu_si128(reinterpret_cast<const __m128i*>(a)));
+			const __m128i vb = _mm_and_si128(m, _mm_loadu_si128(reinterpret_cast<const __m128i*>(b)));
+			sum = _mm_add_epi32(sum, SquaredDifferencesSse2(va, vb));
+		}
+
+		return HorizontalSumSse2(sum) + SsdTailPixelsMasked(a, b, mask + p, numPixels - p);
+	}
+
+	// Same as SquaredDifferencesSse2(), with a already unpacked to 16 bits,
+	// so that it's unpacked once for all of the multi kernels' b rows.
+	static SIMD_TARGET("sse2") inline __m128i SquaredDifferencesUnpackedSse2(__m128i aLo, __m128i aHi, __m128i b)
+	{
+		const __m128i zero = _mm_setzero_si128();
+		const __m128i dLo = _mm_sub_epi16(aLo, _mm_unpacklo_epi8(b, zero));
+		const __m128i dHi = _mm_sub_epi16(aHi, _mm_unpackhi_epi8(b, zero));
+		return _mm_add_epi32(_mm_madd_epi16(dLo, dLo), _mm_madd_epi16(dHi, dHi));
+	}
+
+	static SIMD_TARGET("sse2") void SsdMultiSse2(const PaddedPixel* aPixels, const PaddedPixel* const* bPixels, int numPixels, uint32* outSsds)
+	{
+		static const int PIXELS_PER_VECTOR = 16 / BYTES_PER_PIXEL;
+		const uint8* a = ToBytes(aPixels);
+		const __m128i zero = _mm_setzero_si128();
+
+		__m128i sums[SSD_MULTI_NUM];
+		for (int i = 0; i < SSD_MULTI_NUM; ++i)
+		{
+			sums[i] = _mm_setzero_si128();
+		}
+
+		int p = 0;
+		int offset = 0;
+		for (; p + PIXELS_PER_VECTOR <= numPixels; p += PIXELS_PER_VECTOR, offset += 16)
+		{
+			const __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + offset));
+			const __m128i aLo = _mm_unpacklo_epi8(va, zero);
+			const __m128i aHi = _mm_unpackhi_epi8(va, zero);
+			for (int i = 0; i < SSD_MULTI_NUM; ++i)
+			{
+				const __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(ToBytes(bPixels[i]) + offset));
+				sums[i] = _mm_add_epi32(sums[i], SquaredDifferencesUnpackedSse2(aLo, aHi, vb));
+			}
+		}
+
+		for (int i = 0; i < SSD_MULTI_NUM; ++i)
+		{
+			outSsds[i] = HorizontalSumSse2(sums[i]) + SsdTailPixels(a + offset, ToBytes(bPixels[i]) + offset, numPixels - p);
+		}
+	}
+
+	static SIMD_TARGET("sse2") void SsdMaskedMultiSse2(const PaddedPixel* aPixels, const PaddedPixel* const* bPixels, const Mask::Value* mask, int numPixels, uint32* outSsds)
+	{
+		static const int PIXELS_PER_VECTOR = 16 / BYTES_PER_PIXEL;
+		const uint8* a = ToBytes(aPixels);
+		const __m128i zero = _mm_setzero_si128();
+		const __m128i known = _mm_set1_epi8(Mask::KNOWN);
+
+		__m128i sums[SSD_MULTI_NUM];
+		for (int i = 0; i < SSD_MULTI_NUM; ++i)
+		{
+			sums[i] = _mm_setzero_si128();
+		}
+
+		int p = 0;
+		int offset = 0;
+		for (; p + PIXELS_PER_VECTOR <= numPixels; p += PIXELS_PER_VECTOR, offset += 16)
+		{
+			// Same known flags as SsdMaskedSse2(), built once for all of the
+			// b rows.
+			int maskValues;
+			memcpy(&maskValues, mask + p, sizeof(maskValues));
+			__m128i m = _mm_cmpeq_epi8(_mm_cvtsi32_si128(maskValues), known);
+			m = _mm_unpacklo_epi8(m, m);
+			m = _mm_unpacklo_epi16(m, m);
+
+			const __m128i va = _mm_and_si128(m, _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + offset)));
+			const __m128i aLo = _mm_unpacklo_epi8(va, zero);
+			const __m128i aHi = _mm_unpackhi_epi8(va, zero);
+			for (int i = 0; i < SSD_MULTI_NUM; ++i)
+			{
+				const __m128i vb = _mm_and_si128(m, _mm_loadu_si128(reinterpret_cast<const __m128i*>(ToBytes(bPixels[i]) + offset)));
+				sums[i] = _mm_add_epi32(sums[i], SquaredDifferencesUnpackedSse2(aLo, aHi, vb));
+			}
+		}
+
+		for (int i = 0; i < SSD_MULTI_NUM; ++i)
+		{
+			outSsds[i] = HorizontalSumSse2(sums[i]) + SsdTailPixelsMasked(a + offset, ToBytes(bPixels[i]) + offset, mask + p, numPixels - p);
+		}
+	}
+
+	//
+	// AVX2
+	//
+
+	// Returns eight 32 bit lanes that sum to the SSD of the 32 bytes in a and b.
+	static SIMD_TARGET("avx2") inline __m256i SquaredDifferencesAvx2(__m256i a, __m256i b)
+	{
+		const __m256i dLo = _mm256_sub_epi16(
+			_mm256_cvtepu8_epi16(_mm256_castsi256_si128(a)),
+			_mm256_cvtepu8_epi16(_mm256_castsi256_si128(b)));
+		const __m256i dHi = _mm256_sub_epi16(
+			_mm256_cvtepu8_epi16(_mm256_extracti128_si256(a, 1)),
+			_mm256_cvtepu8_epi16(_mm256_extracti128_si256(b, 1)));
+		return _mm256_add_epi32(_mm256_madd_epi16(dLo, dLo), _mm256_madd_epi16(dHi, dHi));
+	}
+
+	static SIMD_TARGET("avx2") inline uint32 HorizontalSumAvx2(__m256i v)
+	{
+		__m128i v128 = _mm_add_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+		v128 = _mm_add_epi32(v128, _mm_shuffle_epi32(v128, _MM_SHUFFLE(1, 0, 3, 2)));
+		v128 = _mm_add_epi32(v128, _mm_shuffle_epi32(v128, _MM_SHUFFLE(2, 3, 0, 1)));
+		return uint32(_mm_cvtsi128_si32(v128));
+	}
+
+	static SIMD_TARGET("avx2") uint32 SsdAvx2(const PaddedPixel* aPixels, const PaddedPixel* bPixels, int numPixels)
+	{
+		static const int PIXELS_PER_VECTOR = 32 / BYTES_PER_PIXEL;
+		const uint8* a = ToBytes(aPixels);
+		const uint8* b = ToBytes(bPixels);
+
+		__m256i sum = _mm256_setzero_si256();
+		int p = 0;
+		for (; p + PIXELS_PER_VECTOR <= numPixels; p += PIXELS_PER_VECTOR, a += 32, b += 32)
+		{
+			const __m256i va = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a));
+			const __m256i vb = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b));
+			sum = _mm256_add_epi32(sum, SquaredDifferencesAvx2(va, vb));
+		}
+
+		return HorizontalSumAvx2(sum) + SsdTailPixels(a, b, numPixels - p);
+	}
+
+	static SIMD_TARGET("avx2") uint32 SsdMaskedAvx2(const PaddedPixel* aPixels, const PaddedPixel* bPixels, const Mask::Value* mask, int numPixels)
+	{
+		static const int PIXELS_PER_VECTOR = 32 / BYTES_PER_PIXEL;
+		const uint8* a = ToBytes(aPixels);
+		const uint8* b = ToBytes(bPixels);
+		const __m128i known = _mm_set1_epi8(Mask::KNOWN);
+
+		__m256i sum = _mm256_setzero_si256();
+		int p = 0;
+		for (; p + PIXELS_PER_VECTOR <= numPixels; p += PIXELS_PER_VECTOR, a += 32, b += 32)
+		{
+			// Sign extending the eight pixels' 0x00 or 0xff known flags to 32
+			// bits gives a mask over each pixel's four bytes.
+			const __m128i isKnown = _mm_cmpeq_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(mask + p)), known);
+			const __m256i m = _mm256_cvtepi8_epi32(isKnown);
+
+			const __m256i va = _mm256_and_si256(m, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a)));
+			const __m256i vb = _mm256_and_si256(m, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b)));
+			sum = _mm256_add_epi32(sum, SquaredDifferencesAvx2(va, vb));
+		}
+
+		return HorizontalSumAvx2(sum) + SsdTailPixelsMasked(a, b, mask + p, numPixels - p);
+	}
+
+	// Same as SquaredDifferencesAvx2(), with a already widened to 16 bits.
+	static SIMD_TARGET("avx2") inline __m256i SquaredDifferencesUnpackedAvx2(__m256i aLo, __m256i aHi, __m256i b)
+	{
+		const __m256i dLo = _mm256_sub_epi16(aLo, _mm256_cvtepu8_epi16(_mm256_castsi256_si128(b)));
+		const __m256i dHi = _mm256_sub_epi16(aHi, _mm256_cvtepu8_epi16(_mm256_extracti128_si256(b, 1)));
+		return _mm256_add_epi32(_mm256_madd_epi16(dLo, dLo), _mm256_madd_epi16(dHi, dHi));
+	}
+
+	static SIMD_TARGET("avx2") void SsdMultiAvx2(const PaddedPixel* aPixels, const PaddedPixel* const* bPixels, int numPixels, uint32* outSsds)
+	{
+		static const int PIXELS_PER_VECTOR = 32 / BYTES_PER_PIXEL;
+		const uint8* a = ToBytes(aPixels);
+
+		__m256i sums[SSD_MULTI_NUM];
+		for (int i = 0; i < SSD_MULTI_NUM; ++i)
+		{
+			sums[i] = _mm256_setzero_si256();
+		}
+
+		int p = 0;
+		int offset = 0;
+		for (; p + PIXELS_PER_VECTOR <= numPixels; p += PIXELS_PER_VECTOR, offset += 32)
+		{
+			const __m256i va = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + offset));
+			const __m256i aLo = _mm256_cvtepu8_epi16(_mm256_castsi256_si128(va));
+			const __m256i aHi = _mm256_cvtepu8_epi16(_mm256_extracti128_si256(va, 1));
+			for (int i = 0; i < SSD_MULTI_NUM; ++i)
+			{
+				const __m256i vb = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(ToBytes(bPixels[i]) + offset));
+				sums[i] = _mm256_add_epi32(sums[i], SquaredDifferencesUnpackedAvx2(aLo, aHi, vb));
+			}
+		}
+
+		for (int i = 0; i < SSD_MULTI_NUM; ++i)
+		{
+			outSsds[i] = HorizontalSumAvx2(sums[i]) + SsdTailPixels(a + offset, ToBytes(bPixels[i]) + offset, numPixels - p);
+		}
+	}
+
+	static SIMD_TARGET("avx2") void SsdMaskedMultiAvx2(const PaddedPixel* aPixels, const PaddedPixel* const* bPixels, const Mask::Value* mask, int numPixels, uint32* outSsds)
+	{
+		static const int PIXELS_PER_VECTOR = 32 / BYTES_PER_PIXEL;
+		const uint8* a = ToBytes(aPixels);
+		const __m128i known = _mm_set1_epi8(Mask::KNOWN);
+
+		__m256i sums[SSD_MULTI_NUM];
+		for (int i = 0; i < SSD_MULTI_NUM; ++i)
+		{
+			sums[i] = _mm256_setzero_si256();
+		}
+
+		int p = 0;
+		int offset = 0;
+		for (; p + PIXELS_PER_VECTOR <= numPixels; p += PIXELS_PER_VECTOR, offset += 32)
+		{
+			const __m128i isKnown = _mm_cmpeq_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(mask + p)), known);
+			const __m256i m = _mm256_cvtepi8_epi32(isKnown);
+
+			const __m256i va = _mm256_and_si256(m, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + offset)));
+			const __m256i aLo = _mm256_cvtepu8_epi16(_mm256_castsi256_si128(va));
+			const __m256i aHi = _mm256_cvtepu8_epi16(_mm256_extracti128_si256(va, 1));
+			for (int i = 0; i < SSD_MULTI_NUM; ++i)
+			{
+				const __m256i vb = _mm256_and_si256(m, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(ToBytes(bPixels[i]) + offset)));
+				sums[i] = _mm256_add_epi32(sums[i], SquaredDifferencesUnpackedAvx2(aLo, aHi, vb));
+			}
+		}
+
+		for (int i = 0; i < SSD_MULTI_NUM; ++i)
+		{
+			outSsds[i] = HorizontalSumAvx2(sums[i]) + SsdTailPixelsMasked(a + offset, ToBytes(bPixels[i]) + offset, mask + p, numPixels - p);
+		}
+	}
+
+	//
+	// AVX-512
+	//
+
+	// Returns sixteen 32 bit lanes that sum to the SSD of the 64 bytes in a
+	// and b.
+	static SIMD_TARGET("avx512f,avx512bw") inline __m512i SquaredDifferencesAvx512(__m512i a, __m512i b)
+	{
+		const __m512i dLo = _mm512_sub_epi16(
+			_mm512_cvtepu8_epi16(_mm512_castsi512_si256(a)),
+			_mm512_cvtepu8_epi16(_mm512_castsi512_si256(b)));
+		const __m512i dHi = _mm512_sub_epi16(
+			_mm512_cvtepu8_epi16(_mm512_extracti64x4_epi64(a, 1)),
+			_mm512_cvtepu8_epi16(_mm512_extracti64x4_epi64(b, 1)));
+		return _mm512_add_epi32(_mm512_madd_epi16(dLo, dLo), _mm512_madd_epi16(dHi, dHi));
+	}
+
+	// Returns a mask with the lowest n of 16 bits set, for 0 <= n <= 16.
+	static FORCE_INLINE __mmask16 LowBitsMask16(int n)
+	{
+		return __mmask16((1u << n) - 1);
+	}
+
+	static SIMD_TARGET("avx512f,avx512bw") uint32 SsdAvx512(const PaddedPixel* aPixels, const PaddedPixel* bPixels, int numPixels)
+	{
+		static const int PIXELS_PER_VECTOR = 64 / BYTES_PER_PIXEL;
+		const uint8* a = ToBytes(aPixels);
+		const uint8* b = ToBytes(bPixels);
+
+		__m512i sum = _mm512_setzero_si512();
+		int p = 0;
+		for (; p + PIXELS_PER_VECTOR <= numPixels; p += PIXELS_PER_VECTOR, a += 64, b += 64)
+		{
+			sum = _mm512_add_epi32(sum, SquaredDifferencesAvx512(_mm512_loadu_si512(a), _mm512_loadu_si512(b)));
+		}
+
+		// A pixel granular masked load handles the tail without touching
+		// memory past the row.
+		if (p < numPixels)
+		{
+			const __mmask16 tail = LowBitsMask16(numPixels - p);
+			sum = _mm512_add_epi32(sum, SquaredDifferencesAvx512(
+				_mm512_maskz_loadu_epi32(tail, a),
+				_mm512_maskz_loadu_epi32(tail, b)));
+		}
+
+		return uint32(_mm512_reduce_add_epi32(sum));
+	}
+
+	static SIMD_TARGET("avx512f,avx512bw") uint32 SsdMaskedAvx512(const PaddedPixel* aPixels, const PaddedPixel* bPixels, const Mask::Value* mask, int numPixels)
+	{
+		static const int PIXELS_PER_VECTOR = 64 / BYTES_PER_PIXEL;
+		const uint8* a = ToBytes(aPixels);
+		const uint8* b = ToBytes(bPixels);
+		const __m128i known = _mm_set1_epi8(Mask::KNOWN);
+
+		// The known flags of each group of 16 pixels become the load mask,
+		// so the unknown pixels, and the pixels past the tail, read as zero
+		// in both a and b.
+		__m512i sum = _mm512_setzero_si512();
+		for (int p = 0; p < numPixels; p += PIXELS_PER_VECTOR, a += 64, b += 64)
+		{
+			const int numVectorPixels = std::min(numPixels - p, PIXELS_PER_VECTOR);
+
+			__m128i maskValues;
+			if (numVectorPixels == PIXELS_PER_VECTOR)
+			{
+				maskValues = _mm_loadu_si128(reinterpret_cast<const __m128i*>(mask + p));
+			}
+			else
+			{
+				Mask::Value tailMaskValues[PIXELS_PER_VECTOR] = { 0 };
+				memcpy(tailMaskValues, mask + p, numVectorPixels * sizeof(Mask::Value));
+				maskValues = _mm_loadu_si128(reinterpret_cast<const __m128i*>(tailMaskValues));
+			}
+
+			const __mmask16 isKnown = __mmask16(_mm_movemask_epi8(_mm_cmpeq_epi8(maskValues, known))) & LowBitsMask16(numVectorPixels);
+			sum = _mm512_add_epi32(sum, SquaredDifferencesAvx512(
+				_mm512_maskz_loadu_epi32(isKnown, a),
+				_mm512_maskz_loadu_epi32(isKnown, b)));
+		}
+
+		return uint32(_mm512_reduce_add_epi32(sum));
+	}
+
+	// Same as SquaredDifferencesAvx512(), with a already widened to 16 bits.
+	static SIMD_TARGET("avx512f,avx512bw") inline __m512i SquaredDifferencesUnpackedAvx512(__m512i aLo, __m512i aHi, __m512i b)
+	{
+		const __m512i dLo = _mm512_sub_epi16(aLo, _mm512_cvtepu8_epi16(_mm512_castsi512_si256(b)));
+		const __m512i dHi = _mm512_sub_epi16(aHi, _mm512_cvtepu8_epi16(_mm512_extracti64x4_epi64(b, 1)));
+		return _mm512_add_epi32(_mm512_madd_epi16(dLo, dLo), _mm512_madd_epi16(dHi, dHi));
+	}
+
+	// Accumulates the squared differences of a's vector, loaded under the
+	// pixel granular load mask, against each of the b rows at offset.
+	static SIMD_TARGET("avx512f,avx512bw") inline void AccumulateMultiAvx512(const uint8* a, const PaddedPixel* const* bPixels, int offset, __mmask16 loadMask, __m512i* sums)
+	{
+		const __m512i va = _mm512_maskz_loadu_epi32(loadMask, a + offset);
+		const __m512i aLo = _mm512_cvtepu8_epi16(_mm512_castsi512_si256(va));
+		const __m512i aHi = _mm512_cvtepu8_epi16(_mm512_extracti64x4_epi64(va, 1));
+		for (int i = 0; i < SSD_MULTI_NUM; ++i)
+		{
+			const __m512i vb = _mm512_maskz_loadu_epi32(loadMask, ToBytes(bPixels[i]) + offset);
+			sums[i] = _mm512_add_epi32(sums[i], SquaredDifferencesUnpackedAvx512(aLo, aHi, vb));
+		}
+	}
+
+	static SIMD_TARGET("avx512f,avx512bw") void SsdMultiAvx512(const PaddedPixel* aPixels, const PaddedPixel* const* bPixels, int numPixels, uint32* outSsds)
+	{
+		static const int PIXELS_PER_VECTOR = 64 / BYTES_PER_PIXEL;
+		const uint8* a = ToBytes(aPixels);
+
+		__m512i sums[SSD_MULTI_NUM];
+		for (int i = 0; i < SSD_MULTI_NUM; ++i)
+		{
+			sums[i] = _mm512_setzero_si512();
+		}
+
+		// The tail is a masked load, as in SsdAvx512().
+		for (int p = 0, offset = 0; p < numPixels; p += PIXELS_PER_VECTOR, offset += 64)
+		{
+			AccumulateMultiAvx512(a, bPixels, offset, LowBitsMask16(std::min(numPixels - p, PIXELS_PER_VECTOR)), sums);
+		}
+
+		for (int i = 0; i < SSD_MULTI_NUM; ++i)
+		{
+			outSsds[i] = uint32(_mm512_reduce_add_epi32(sums[i]));
+		}
+	}
+
+	static SIMD_TARGET("avx512f,avx512bw") void SsdMaskedMultiAvx512(const PaddedPixel* aPixels, const PaddedPixel* const* bPixels, const Mask::Value* mask, int numPixels, uint32* outSsds)
+	{
+		static const int PIXELS_PER_VECTOR = 64 / BYTES_PER_PIXEL;
+		const uint8* a = ToBytes(aPixels);
+		const __m128i known = _mm_set1_epi8(Mask::KNOWN);
+
+		__m512i sums[SSD_MULTI_NUM];
+		for (int i = 0; i < SSD_MULTI_NUM; ++i)
+		{
+			sums[i] = _mm512_setzero_si512();
+		}
+
+		// Same load masks as SsdMaskedAvx512().
+		for (int p = 0, offset = 0; p < numPixels; p += PIXELS_PER_VECTOR, offset += 64)
+		{
+			const int numVectorPixels = std::min(numPixels - p, PIXELS_PER_VECTOR);
+
+			__m128i maskValues;
+			if (numVectorPixels == PIXELS_PER_VECTOR)
+			{
+				maskValues = _mm_loadu_si128(reinterpret_cast<const __m128i*>(mask + p));
+			}
+			else
+			{
+				Mask::Value tailMaskValues[PIXELS_PER_VECTOR] = { 0 };
+				memcpy(tailMaskValues, mask + p, numVectorPixels * sizeof(Mask::Value));
+				maskValues = _mm_loadu_si128(reinterpret_cast<const __m128i*>(tailMaskValues));
+			}
+
+			const __mmask16 isKnown = __mmask16(_mm_movemask_epi8(_mm_cmpeq_epi8(maskValues, known))) & LowBitsMask16(numVectorPixels);
+			AccumulateMultiAvx512(a, bPixels, offset, isKnown, sums);
+		}
+
+		for (int i = 0; i < SSD_MULTI_NUM; ++i)
+		{
+			outSsds[i] = uint32(_mm512_reduce_add_epi32(sums[i]));
+		}
+	}
+
+	// Returns true if the host supports the instruction set's kernels.
+	static bool IsSupported(EnergyCalculatorPerPixelSimd::InstructionSet instructionSet)
+	{
+		const LfnTech::CpuFeatures& cpuFeatures = LfnTech::GetCpuFeatures();
+		switch (instructionSet)
+		{
+		case EnergyCalculatorPerPixelSimd::InstructionSetSse2:
+			return cpuFeatures.sse2;
+		case EnergyCalculatorPerPixelSimd::InstructionSetAvx2:
+			return cpuFeatures.avx2;
+		case EnergyCalculatorPerPixelSimd::InstructionSetAvx512:
+			return cpuFeatures.avx512bw;
+		default:
+			return false;
+		}
+	}
+
+	// Indexed by InstructionSet.
+	static const EnergyCalculatorPerPixelSimd::Kernels KERNELS[EnergyCalculatorPerPixelSimd::NumInstructionSets] =
+	{
+		{ EnergyCalculatorPerPixelSimd::InstructionSetNone, NULL, NULL, NULL, NULL },
+		{ EnergyCalculatorPerPixelSimd::InstructionSetSse2, SsdSse2, SsdMaskedSse2, SsdMultiSse2, SsdMaskedMultiSse2 },
+		{ EnergyCalculatorPerPixelSimd::InstructionSetAvx2, SsdAvx2, SsdMaskedAvx2, SsdMultiAvx2, SsdMaskedMultiAvx2 },
+		{ EnergyCalculatorPerPixelSimd::InstructionSetAvx512, SsdAvx512, SsdMaskedAvx512, SsdMultiAvx512, SsdMaskedMultiAvx512 },
+	};
+
+	static const EnergyCalculatorPerPixelSimd::Kernels* SelectBestKernels()
+	{
+		for (int i = EnergyCalculatorPerPixelSimd::NumInstructionSets - 1; i > EnergyCalculatorPerPixelSimd::InstructionSetNone; --i)
+		{
+			const EnergyCalculatorPerPixelSimd::InstructionSet instructionSet = EnergyCalculatorPerPixelSimd::InstructionSet(i);
+			if (IsSupported(instructionSet))
+			{
+				return &KERNELS[instructionSet];
+			}
+		}
+
+		return NULL;
+	}
+}
+
+const LfnIc::EnergyCalculatorPerPixelSimd::Kernels* LfnIc::EnergyCalculatorPerPixelSimd::GetBestKernels()
+{
+	static const Kernels* kernels = SelectBestKernels();
+	return kernels;
+}
+
+const LfnIc::EnergyCalculatorPerPixelSimd::Kernels* LfnIc::EnergyCalculatorPerPixelSimd::GetKernels(InstructionSet instructionSet)
+{
+	wxASSERT(instructionSet >= InstructionSetNone && instructionSet < NumInstructionSets);
+	return IsSupported(instructionSet) ? &KERNELS[instructionSet] : NULL;
+}
+
+const char* LfnIc::EnergyCalculatorPerPixelSimd::GetInstructionSetName(InstructionSet instructionSet)
+{
+	switch (instructionSet)
+	{
+	case InstructionSetNone:
+		return "none";
+	case InstructionSetSse2:
+		return "SSE2";
+	case InstructionSetAvx2:
+		return "AVX2";
+	case InstructionSetAvx512:
+		return "AVX-512";
+	default:
+		wxFAIL_MSG("Unknown instruction set.");
+		return "unknown";
+	}
+}
+
+#endif // ENABLE_ENERGY_CALCULATOR_SIMD
@@ -0,0 +1,109 @@
+//
+// Copyright 2010, Darren Lafreniere
+// <http://www.lafarren.com/image-completer/>
+//
+// This file is part of lafarren.com's Image Completer.
+//
+// Image Completer is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Image Completer is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Image Completer, named License.txt. If not, see
+// <http://www.gnu.org/licenses/>.
+//
+
+
+#ifndef ENERGY_CALCULATOR_PER_PIXEL_SIMD_H
+#define ENERGY_CALCULATOR_PER_PIXEL_SIMD_H
+
+#include "tech/Core.h"
+#include "tech/CpuFeatures.h"
+
+#include "ImageWorkingCopy.h"
+#include "LfnIcMask.h"
+
+// The vectorized kernels are only implemented for x86 cpus. Everything else,
+// including non 24 bit rgb images, uses the scalar per-pixel policies.
+#define ENABLE_ENERGY_CALCULATOR_SIMD (TECH_CPU_X86 && 1)
+
+// Debugging flag. If enabled, verifies every vectorized energy result against
+// the scalar per-pixel policies, which remain the reference implementation.
+#define SIMD_VALIDATION_ENABLED (ENABLE_ENERGY_CALCULATOR_SIMD && 0)
+
+#if ENABLE_ENERGY_CALCULATOR_SIMD
+
+namespace LfnIc
+{
+	///
+	/// Vectorized sum of squared differences (SSD) kernels for rows of 24 bit
+	/// rgb pixels, as stored in ImageWorkingCopy's padded RGBX form. A kernel
+	/// is implemented for each supported instruction set, and the fastest one
+	/// that the host supports is selected at runtime.
+	///
+	class EnergyCalculatorPerPixelSimd
+	{
+	public:
+		enum InstructionSet
+		{
+			InstructionSetNone,
+			InstructionSetSse2,
+			InstructionSetAvx2,
+			InstructionSetAvx512,
+
+			NumInstructionSets
+		};
+
+		/// Returns the sum of the squared channel differences between
+		/// numPixels consecutive pixels at a and b. The caller must ensure
+		/// that numPixels is small enough for the result to fit in a uint32.
+		typedef uint32 (*SsdFunction)(const ImageWorkingCopy::PaddedPixel* a, const ImageWorkingCopy::PaddedPixel* b, int numPixels);
+
+		/// Like SsdFunction, but only the pixels whose corresponding mask
+		/// value is Mask::KNOWN contribute to the result.
+		typedef uint32 (*SsdMaskedFunction)(const ImageWorkingCopy::PaddedPixel* a, const ImageWorkingCopy::PaddedPixel* b, const Mask::Value* mask, int numPixels);
+
+		/// The number of b rows that the multi kernels compare a against.
+		static const int SSD_MULTI_NUM = 4;
+
+		/// Like SsdFunction, for SSD_MULTI_NUM rows b at once, with each
+		/// row's result stored in outSsds. Each vector of a is loaded and
+		/// unpacked once, and kept in registers for all of the b rows.
+		typedef void (*SsdMultiFunction)(const ImageWorkingCopy::PaddedPixel* a, const ImageWorkingCopy::PaddedPixel* const* b, int numPixels, uint32* outSsds);
+
+		/// Like SsdMultiFunction, but only the pixels whose corresponding
+		/// mask value is Mask::KNOWN contribute to the results.
+		typedef void (*SsdMaskedMultiFunction)(const ImageWorkingCopy::PaddedPixel* a, const ImageWorkingCopy::PaddedPixel* const* b, const Mask::Value* mask, int numPixels, uint32* outSsds);
+
+		struct Kernels
+		{
+			InstructionSet instructionSet;
+			SsdFunction ssd;
+			SsdMaskedFunction ssdMasked;
+			SsdMultiFunction ssdMulti;
+			SsdMaskedMultiFunction ssdMaskedMulti;
+		};
+
+		/// Returns the kernels for the fastest instruction set supported by
+		/// the host, or NULL if the host doesn't support any of them. The
+		/// selection is performed on the first call, which must not race
+		/// with any other call.
+		static const Kernels* GetBestKernels();
+
+		/// Returns the kernels for the specified instruction set, or NULL if
+		/// the host doesn't support it.
+		static const Kernels* GetKernels(InstructionSet instructionSet);
+
+		/// Returns a human readable name for the instruction set.
+		static const char* GetInstructionSetName(InstructionSet instructionSet);
+	};
+}
+
+#endif // ENABLE_ENERGY_CALCULATOR_SIMD
+#endif // ENERGY_CALCULATOR_PER_PIXEL_SIMD_H
@@ -30,6 +30,7 @@
 
 #include "EnergyCalculatorFftUtils.h"
 #include "ImageConst.h"
+#include "ImageWorkingCopy.h"
 #include "MaskLod.h"
 
 #include "tech/DbgMem.h"
@@ -115,7 +116,7 @@ void LfnIc::EnergyWsst::Construct(const ImageConst& inputImage, const MaskLod* m
 {
 	const int imageWidth = inputImage.GetWidth();
 	const int imageHeight = inputImage.GetHeight();
-	const Image::Pixel* imagePixel = inputImage.GetData();
+	const ImageWorkingCopy& workingCopy = inputImage.GetWorkingCopy();
 	const Mask::Value* maskBuffer = mask ? mask->GetLodBuffer(mask->GetHighestLod()) : NULL;
 
 	m_table = new Energy[m_tableWidth * m_tableHeight];
@@ -150,7 +151,7 @@ void LfnIc::EnergyWsst::Construct(const ImageConst& inputImage, const MaskLod* m
 		}
 
 		// x and y are in image space
-		FORCE_INLINE Energy Get(const Image::Pixel* imagePixel, const Mask::Value* maskBuffer, int x, int y) const
+		FORCE_INLINE Energy Get(const ImageWorkingCopy& workingCopy, const Mask::Value* maskBuffer, int x, int y) const
 		{
 			Energy e(0);
 
@@ -159,7 +160,7 @@ void LfnIc::EnergyWsst::Construct(const ImageConst& inputImage, const MaskLod* m
 				const int imageIdx = LfnTech::GetRowMajorIndex(m_imageWidth, x, y);
 				if (!maskBuffer || maskBuffer[imageIdx] == Mask::KNOWN)
 				{
-					const Image::Pixel& pixel = imagePixel[imageIdx];
+					const ImageWorkingCopy::PaddedPixel& pixel = workingCopy.GetPaddedRow(y)[x];
 					for (int c = 0; c < Image::Pixel::NUM_CHANNELS; ++c)
 					{
 						e += Energy(pixel.channel[c] * pixel.channel[c]);
@@ -209,7 +210,7 @@ void LfnIc::EnergyWsst::Construct(const ImageConst& inputImage, const MaskLod* m
 							const int tableY = imageY + m_blockHeight;
 
 							Energy& e = data2d.Get(sstTable, tableX, tableY);
-							e = data2d.Get(imagePixel, maskBuffer, imageX, imageY);
+							e = data2d.Get(workingCopy, maskBuffer, imageX, imageY);
 
 							if (i < blockRight)
 							{
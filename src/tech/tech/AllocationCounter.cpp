@@ -0,0 +1,92 @@
+//
+// Copyright 2010, Darren Lafreniere
+// <http://www.lafarren.com/image-completer/>
+//
+// This file is part of lafarren.com's Image Completer.
+//
+// Image Completer is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Image Completer is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Image Completer, named License.txt. If not, see
+// <http://www.gnu.org/licenses/>.
+//
+
+#include "Pch.h"
+#include "tech/AllocationCounter.h"
+
+#include "tech/Atomic.h"
+
+#if TECH_ALLOCATION_COUNTER_ENABLED
+#include <cstdlib>
+#include <new>
+
+// The replacement operators can't go through DEBUG_NEW, so DbgMem.h isn't
+// included here. Allocations made through DEBUG_NEW's placement form, in
+// _DEBUG builds with msvc, aren't counted.
+
+#if __cplusplus >= 201103L
+#define TECH_ALLOCATION_COUNTER_NOTHROW noexcept
+#else
+#define TECH_ALLOCATION_COUNTER_NOTHROW throw()
+#endif
+
+namespace LfnTech
+{
+	AtomicNativeType volatile g_allocationCount = 0;
+
+	void* CountedAllocate(size_t size)
+	{
+		Atomic<>::Increment(&g_allocationCount);
+
+		// Each allocation must return a unique pointer, even if it's 0 bytes.
+		void* const p = malloc((size > 0) ? size : 1);
+		if (!p)
+		{
+			throw std::bad_alloc();
+		}
+
+		return p;
+	}
+}
+
+void* operator new(size_t size)
+{
+	return LfnTech::CountedAllocate(size);
+}
+
+void* operator new[](size_t size)
+{
+	return LfnTech::CountedAllocate(size);
+}
+
+void operator delete(void* p) TECH_ALLOCATION_COUNTER_NOTHROW
+{
+	free(p);
+}
+
+void operator delete[](void* p) TECH_ALLOCATION_COUNTER_NOTHROW
+{
+	free(p);
+}
+
+long LfnTech::GetAllocationCount()
+{
+	return Atomic<>::ExchangeAdd(&g_allocationCount, 0);
+}
+
+#else
+
+long LfnTech::GetAllocationCount()
+{
+	return 0;
+}
+
+#endif // TECH_ALLOCATION_COUNTER_ENABLED
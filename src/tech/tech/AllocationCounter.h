@@ -0,0 +1,44 @@
+//
+// Copyright 2010, Darren Lafreniere
+// <http://www.lafarren.com/image-completer/>
+//
+// This file is part of lafarren.com's Image Completer.
+//
+// Image Completer is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Image Completer is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Image Completer, named License.txt. If not, see
+// <http://www.gnu.org/licenses/>.
+//
+
+//
+// Counts the heap allocations made through the global operator new, so that
+// code that's expected to reuse its memory can verify that it doesn't
+// allocate.
+//
+#ifndef TECH_ALLOCATION_COUNTER_H
+#define TECH_ALLOCATION_COUNTER_H
+
+// If set, the global operator new and delete (and their array forms) are
+// replaced with versions that count each allocation before deferring to
+// malloc and free. Disabled by default, since it adds an atomic increment
+// to every allocation.
+#define TECH_ALLOCATION_COUNTER_ENABLED 0
+
+namespace LfnTech
+{
+	/// Returns the number of global operator new calls made by all threads
+	/// since the process started. Always 0 if
+	/// TECH_ALLOCATION_COUNTER_ENABLED isn't set.
+	long GetAllocationCount();
+}
+
+#endif
@@ -0,0 +1,115 @@
+//
+// Copyright 2010, Darren Lafreniere
+// <http://www.lafarren.com/image-completer/>
+//
+// This file is part of lafarren.com's Image Completer.
+//
+// Image Completer is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Image Completer is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Image Completer, named License.txt. If not, see
+// <http://www.gnu.org/licenses/>.
+//
+
+
+#include "Pch.h"
+#include "tech/CpuFeatures.h"
+
+#if TECH_CPU_X86 && defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+#include "tech/DbgMem.h"
+
+namespace LfnTech
+{
+#if TECH_CPU_X86 && defined(_MSC_VER)
+	// Bits of the cpuid leaf 1 and leaf 7 registers, and of the XCR0
+	// register. See Intel's Software Developer's Manual, volume 2A.
+	enum
+	{
+		CPUID_1_EDX_SSE2 = 1 << 26,
+		CPUID_1_ECX_SSSE3 = 1 << 9,
+		CPUID_1_ECX_OSXSAVE = 1 << 27,
+		CPUID_1_ECX_AVX = 1 << 28,
+		CPUID_7_EBX_AVX2 = 1 << 5,
+		CPUID_7_EBX_AVX512F = 1 << 16,
+		CPUID_7_EBX_AVX512BW = 1 << 30,
+		XCR0_SSE_AVX_STATE = 0x06,
+		XCR0_AVX512_STATE = 0xe0,
+	};
+
+	static CpuFeatures DetectCpuFeatures()
+	{
+		CpuFeatures features = { false, false, false, false };
+
+		int regs[4]; // eax, ebx, ecx, edx
+		__cpuid(regs, 0);
+		const int maxLeaf = regs[0];
+
+		__cpuid(regs, 1);
+		const int ecx1 = regs[2];
+		const int edx1 = regs[3];
+		features.sse2 = (edx1 & CPUID_1_EDX_SSE2) != 0;
+		features.ssse3 = (ecx1 & CPUID_1_ECX_SSSE3) != 0;
+
+		// The os must save the ymm (and for avx-512, the zmm and opmask)
+		// registers on a context switch before those extensions can be used.
+		unsigned __int64 xcr0 = 0;
+		if ((ecx1 & CPUID_1_ECX_OSXSAVE) && (ecx1 & CPUID_1_ECX_AVX))
+		{
+			xcr0 = _xgetbv(0);
+		}
+
+		const bool osSavesAvxState = (xcr0 & XCR0_SSE_AVX_STATE) == XCR0_SSE_AVX_STATE;
+		const bool osSavesAvx512State = osSavesAvxState && (xcr0 & XCR0_AVX512_STATE) == XCR0_AVX512_STATE;
+
+		if (maxLeaf >= 7)
+		{
+			__cpuidex(regs, 7, 0);
+			const int ebx7 = regs[1];
+			features.avx2 = osSavesAvxState && (ebx7 & CPUID_7_EBX_AVX2) != 0;
+			features.avx512bw = osSavesAvx512State
+				&& (ebx7 & CPUID_7_EBX_AVX512F) != 0
+				&& (ebx7 & CPUID_7_EBX_AVX512BW) != 0;
+		}
+
+		return features;
+	}
+#elif TECH_CPU_X86 && defined(__GNUC__)
+	static CpuFeatures DetectCpuFeatures()
+	{
+		// The gcc builtins test the os register state as well as the cpuid
+		// bits for the avx extensions.
+		__builtin_cpu_init();
+
+		CpuFeatures features;
+		features.sse2 = __builtin_cpu_supports("sse2") != 0;
+		features.ssse3 = __builtin_cpu_supports("ssse3") != 0;
+		features.avx2 = __builtin_cpu_supports("avx2") != 0;
+		features.avx512bw = __builtin_cpu_supports("avx512f") != 0 && __builtin_cpu_supports("avx512bw") != 0;
+		return features;
+	}
+#else
+#pragma message("Non-critical warning: LfnTech::GetCpuFeatures() is not implemented for this platform. Vectorized code paths are disabled.")
+	static CpuFeatures DetectCpuFeatures()
+	{
+		const CpuFeatures features = { false, false, false, false };
+		return features;
+	}
+#endif
+
+	const CpuFeatures& GetCpuFeatures()
+	{
+		static const CpuFeatures features = DetectCpuFeatures();
+		return features;
+	}
+}
@@ -0,0 +1,56 @@
+//
+// Copyright 2010, Darren Lafreniere
+// <http://www.lafarren.com/image-completer/>
+//
+// This file is part of lafarren.com's Image Completer.
+//
+// Image Completer is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Image Completer is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Image Completer, named License.txt. If not, see
+// <http://www.gnu.org/licenses/>.
+//
+
+
+//
+// Runtime detection of the instruction set extensions supported by the host
+// cpu and operating system.
+//
+#ifndef TECH_CPU_FEATURES_H
+#define TECH_CPU_FEATURES_H
+
+#if defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__)
+#define TECH_CPU_X86 1
+#else
+#define TECH_CPU_X86 0
+#endif
+
+namespace LfnTech
+{
+	///
+	/// Instruction set extensions that are usable by this process. A
+	/// feature is only reported if both the cpu supports it and the
+	/// operating system saves the associated register state.
+	///
+	struct CpuFeatures
+	{
+		bool sse2;
+		bool ssse3;
+		bool avx2;
+		bool avx512bw;
+	};
+
+	/// Returns the features detected on the host cpu. Detection is performed
+	/// once, on the first call.
+	const CpuFeatures& GetCpuFeatures();
+}
+
+#endif
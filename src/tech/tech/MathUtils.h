@@ -60,6 +60,14 @@ namespace LfnTech
 	/// Returns the log base 2 of n.
 	inline unsigned int LogBase2(unsigned int n);
 
+	///
+	/// Returns the d'th point along a Hilbert curve that fills a
+	/// sideLength * sideLength square. sideLength must be a power of 2.
+	/// Consecutive points are adjacent, so walking a grid in this order keeps
+	/// neighboring cells close together.
+	///
+	inline void GetHilbertCurvePoint(int sideLength, int d, int& outX, int& outY);
+
 	/// Not a math function, move this someday.
 	template<typename T>
 	inline void Swap(T& a, T& b);
@@ -79,6 +79,37 @@ namespace LfnTech
 		return l;
 	}
 
+	inline void GetHilbertCurvePoint(int sideLength, int d, int& outX, int& outY)
+	{
+		int x = 0;
+		int y = 0;
+		for (int s = 1, t = d; s < sideLength; s *= 2, t /= 4)
+		{
+			const int rx = 1 & (t / 2);
+			const int ry = 1 & (t ^ rx);
+
+			// Rotate the quadrant
+			if (ry == 0)
+			{
+				if (rx == 1)
+				{
+					x = s - 1 - x;
+					y = s - 1 - y;
+				}
+
+				const int swap = x;
+				x = y;
+				y = swap;
+			}
+
+			x += s * rx;
+			y += s * ry;
+		}
+
+		outX = x;
+		outY = y;
+	}
+
 	template<typename T>
 	inline void Swap(T& a, T& b)
 	{
@@ -0,0 +1,233 @@
+//
+// Copyright 2010, Darren Lafreniere
+// <http://www.lafarren.com/image-completer/>
+//
+// This file is part of lafarren.com's Image Completer.
+//
+// Image Completer is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Image Completer is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Image Completer, named License.txt. If not, see
+// <http://www.gnu.org/licenses/>.
+//
+
+#include "Pch.h"
+#include "tech/ThreadPool.h"
+
+#include "tech/Atomic.h"
+#include "tech/Core.h"
+
+#include "tech/DbgMem.h"
+
+//
+// LfnTech::ThreadPool::Worker
+//
+class LfnTech::ThreadPool::Worker : public wxThread
+{
+public:
+	Worker(ThreadPool& threadPool, int shareIndex) :
+	wxThread(wxTHREAD_JOINABLE),
+		m_threadPool(threadPool),
+		m_shareIndex(shareIndex)
+	{
+	}
+
+	virtual ExitCode Entry()
+	{
+		ThreadPool& pool = m_threadPool;
+		int generation = 0;
+		for (;;)
+		{
+			// Park until the next run is published, or the pool is quitting.
+			{
+				wxMutexLocker lock(pool.m_mutex);
+				while (pool.m_generation == generation && !pool.m_quit)
+				{
+					pool.m_wakeCondition.Wait();
+				}
+
+				if (pool.m_quit)
+				{
+					break;
+				}
+
+				generation = pool.m_generation;
+			}
+
+			pool.ProcessChunks(m_shareIndex);
+
+			{
+				wxMutexLocker lock(pool.m_mutex);
+				wxASSERT(pool.m_numWorkersBusy > 0);
+				if (--pool.m_numWorkersBusy == 0)
+				{
+					pool.m_doneCondition.Signal();
+				}
+			}
+		}
+
+		return 0;
+	}
+
+private:
+	ThreadPool& m_threadPool;
+	const int m_shareIndex;
+};
+
+//
+// LfnTech::ThreadPool implementation
+//
+int LfnTech::ThreadPool::ResolveNumThreads(int numThreadsRequested)
+{
+	if (numThreadsRequested > NUM_THREADS_AUTO)
+	{
+		return numThreadsRequested;
+	}
+
+	// GetCPUCount() returns -1 if the count couldn't be determined.
+	return std::max(wxThread::GetCPUCount(), 1);
+}
+
+LfnTech::ThreadPool::ThreadPool(int numThreads) :
+m_wakeCondition(m_mutex),
+	m_doneCondition(m_mutex),
+	m_generation(0),
+	m_quit(false),
+	m_numWorkersBusy(0),
+	m_isRunning(0),
+	m_job(NULL),
+	m_numItems(0),
+	m_itemsPerChunk(0)
+{
+	wxASSERT(numThreads >= 1);
+
+	// Share 0 belongs to the thread calling Run(), the rest to the workers.
+	for (int i = 1; i < numThreads; ++i)
+	{
+		Worker* worker = new Worker(*this, i);
+		if (worker->Create() != wxTHREAD_NO_ERROR || worker->Run() != wxTHREAD_NO_ERROR)
+		{
+			wxFAIL_MSG("LfnTech::ThreadPool - couldn't start a worker thread, continuing with fewer threads.");
+			delete worker;
+			break;
+		}
+
+		m_workers.push_back(worker);
+	}
+
+	m_shares.resize(m_workers.size() + 1);
+}
+
+LfnTech::ThreadPool::~ThreadPool()
+{
+	wxASSERT(m_isRunning == 0);
+
+	{
+		wxMutexLocker lock(m_mutex);
+		m_quit = true;
+		m_wakeCondition.Broadcast();
+	}
+
+	for (int i = 0, n = m_workers.size(); i < n; ++i)
+	{
+		// Joinable threads, wait for them to join.
+		m_workers[i]->Wait();
+		delete m_workers[i];
+	}
+}
+
+int LfnTech::ThreadPool::GetCurrentThreadIndex() const
+{
+	const wxThread* const thread = wxThread::This();
+	for (int i = 0, n = m_workers.size(); i < n; ++i)
+	{
+		if (m_workers[i] == thread)
+		{
+			return i + 1;
+		}
+	}
+
+	return 0;
+}
+
+void LfnTech::ThreadPool::Run(Job& job, int numItems, int itemsPerChunk)
+{
+	wxASSERT(itemsPerChunk >= 1);
+	if (numItems <= 0)
+	{
+		return;
+	}
+
+	const int numChunks = (numItems + itemsPerChunk - 1) / itemsPerChunk;
+	if (m_workers.empty() || numChunks == 1 || Atomic<>::CompareExchange(&m_isRunning, 1, 0) != 0)
+	{
+		job.Process(0, numItems);
+		return;
+	}
+
+	// Deal each thread a contiguous share of the chunks.
+	const int numShares = m_shares.size();
+	for (int i = 0; i < numShares; ++i)
+	{
+		Share& share = m_shares[i];
+		share.next = long((int64(numChunks) * i) / numShares);
+		share.end = long((int64(numChunks) * (i + 1)) / numShares);
+	}
+
+	m_job = &job;
+	m_numItems = numItems;
+	m_itemsPerChunk = itemsPerChunk;
+
+	// Publish the run and wake the workers.
+	{
+		wxMutexLocker lock(m_mutex);
+		++m_generation;
+		m_numWorkersBusy = m_workers.size();
+		m_wakeCondition.Broadcast();
+	}
+
+	ProcessChunks(0);
+
+	// Wait for the workers to finish their last chunks.
+	{
+		wxMutexLocker lock(m_mutex);
+		while (m_numWorkersBusy > 0)
+		{
+			m_doneCondition.Wait();
+		}
+	}
+
+	m_job = NULL;
+	Atomic<>::CompareExchange(&m_isRunning, 0, 1);
+}
+
+void LfnTech::ThreadPool::ProcessChunks(int shareIndex)
+{
+	const int numShares = m_shares.size();
+	for (int i = 0; i < numShares; ++i)
+	{
+		Share& share = m_shares[(shareIndex + i) % numShares];
+		for (;;)
+		{
+			// Increment() returns the incremented value. Over-incrementing
+			// past the end is harmless; every claimer sees the end.
+			const long chunk = Atomic<>::Increment(&share.next) - 1;
+			if (chunk >= share.end)
+			{
+				break;
+			}
+
+			const int itemBegin = chunk * m_itemsPerChunk;
+			const int itemEnd = std::min(itemBegin + m_itemsPerChunk, m_numItems);
+			m_job->Process(itemBegin, itemEnd);
+		}
+	}
+}
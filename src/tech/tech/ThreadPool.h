@@ -0,0 +1,146 @@
+//
+// Copyright 2010, Darren Lafreniere
+// <http://www.lafarren.com/image-completer/>
+//
+// This file is part of lafarren.com's Image Completer.
+//
+// Image Completer is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Image Completer is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Image Completer, named License.txt. If not, see
+// <http://www.gnu.org/licenses/>.
+//
+
+//
+// A process-wide pool of persistent worker threads that help the calling
+// thread process a range of independent work items.
+//
+#ifndef TECH_THREAD_POOL_H
+#define TECH_THREAD_POOL_H
+
+#include <vector>
+#include <wx/thread.h>
+
+namespace LfnTech
+{
+	///
+	/// Persistent worker threads that, together with the calling thread,
+	/// process a range of independent items. The range is split into chunks,
+	/// and each participating thread starts on its own contiguous share of
+	/// those chunks. Once a thread's share is exhausted, it steals the
+	/// remaining chunks of the other shares. Between runs, the workers are
+	/// parked on a condition variable rather than spinning.
+	///
+	/// A single instance should exist per process, sized to the thread
+	/// budget, and other threaded libraries (e.g., fftw) should be limited
+	/// to GetNumThreads() so that they don't oversubscribe the cores.
+	///
+	class ThreadPool
+	{
+	public:
+		/// Passed as the requested number of threads to use one thread per
+		/// cpu.
+		static const int NUM_THREADS_AUTO = 0;
+
+		///
+		/// Implemented by the client to process a subrange of items. Process()
+		/// is called concurrently from multiple threads, with disjoint
+		/// subranges.
+		///
+		class Job
+		{
+		public:
+			virtual ~Job() {}
+			virtual void Process(int itemBegin, int itemEnd) = 0;
+		};
+
+		/// Returns the number of threads that numThreadsRequested resolves
+		/// to. NUM_THREADS_AUTO resolves to the cpu count. The result is
+		/// always >= 1.
+		static int ResolveNumThreads(int numThreadsRequested);
+
+		/// numThreads is the total number of threads that process items,
+		/// including the thread calling Run(), so numThreads - 1 workers are
+		/// created.
+		ThreadPool(int numThreads);
+		~ThreadPool();
+
+		/// Returns the total number of threads that process items, including
+		/// the thread calling Run().
+		inline int GetNumThreads() const { return int(m_workers.size()) + 1; }
+
+		/// Returns true while Run() is processing a job on more than one
+		/// thread. Jobs can use this to decide whether state that's shared
+		/// between threads needs to be partitioned per thread.
+		inline bool IsRunning() const { return m_isRunning != 0; }
+
+		/// Returns the index of the calling thread within the pool: 0 for any
+		/// thread that isn't one of the pool's workers, including the thread
+		/// calling Run(), and [1, GetNumThreads()) for the workers.
+		int GetCurrentThreadIndex() const;
+
+		/// Processes items [0, numItems) in chunks of itemsPerChunk, and
+		/// returns once they've all been processed. If the pool is already
+		/// running a job (e.g., Run() was called from within a Job), the
+		/// items are processed by the calling thread alone.
+		void Run(Job& job, int numItems, int itemsPerChunk);
+
+	private:
+		//
+		// Internal definitions
+		//
+		class Worker;
+		friend class Worker;
+
+		// A participating thread's contiguous share of the chunks. Chunks are
+		// claimed by atomically incrementing next, both by the owner and by
+		// stealers. Padded to keep each share on its own cache line.
+		struct Share
+		{
+			long volatile next;
+			long end;
+			char padding[64 - 2 * sizeof(long)];
+		};
+
+		//
+		// Internal methods
+		//
+
+		// Claims and processes chunks, starting with shareIndex's share and
+		// then stealing from the others, until no chunks remain.
+		void ProcessChunks(int shareIndex);
+
+		//
+		// Data
+		//
+		std::vector<Worker*> m_workers;
+
+		// Guards m_generation, m_quit and m_numWorkersBusy.
+		wxMutex m_mutex;
+		wxCondition m_wakeCondition;
+		wxCondition m_doneCondition;
+		int m_generation;
+		bool m_quit;
+		int m_numWorkersBusy;
+
+		// Nonzero while Run() is in progress.
+		long volatile m_isRunning;
+
+		// The current run's job, which is published to the workers by
+		// incrementing m_generation under m_mutex.
+		Job* m_job;
+		int m_numItems;
+		int m_itemsPerChunk;
+		std::vector<Share> m_shares;
+	};
+}
+
+#endif
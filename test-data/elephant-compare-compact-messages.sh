@@ -0,0 +1,33 @@
+#!/bin/sh
+#
+# Checks that storing Priority-BP messages as saturated 32 bit values
+# (NODE_COMPACT_MESSAGES) chooses the same patches as 64 bit messages.
+#
+# Usage: elephant-compare-compact-messages.sh COMPACT_IMAGE_COMPLETER INT64_IMAGE_COMPLETER
+#
+# The second executable is built with the CMake COMPACT_NODE_MESSAGES option
+# set to OFF. Both runs share an energy calculator table and fft wisdom file,
+# and run single threaded, so that the only difference between them is the
+# messages' storage.
+
+if [ $# -ne 2 ]; then
+	echo "Usage: $0 COMPACT_IMAGE_COMPLETER INT64_IMAGE_COMPLETER"
+	exit 2
+fi
+
+TMP_DIR=`mktemp -d` || exit 2
+trap 'rm -rf "$TMP_DIR"' EXIT
+
+COMMON="-ii elephant-input.png -im elephant-mask.png -sp auto -st 1 -et $TMP_DIR/table.txt -fw $TMP_DIR/wisdom.txt"
+
+"$1" $COMMON -ec || exit 2
+"$1" $COMMON -io "$TMP_DIR/compact-output.png" -po "$TMP_DIR/compact-patches.txt" || exit 2
+"$2" $COMMON -io "$TMP_DIR/int64-output.png" -po "$TMP_DIR/int64-patches.txt" || exit 2
+
+if cmp -s "$TMP_DIR/compact-patches.txt" "$TMP_DIR/int64-patches.txt"; then
+	echo "Compact and 64 bit messages chose the same patches."
+else
+	echo "Compact and 64 bit messages chose different patches:"
+	diff "$TMP_DIR/compact-patches.txt" "$TMP_DIR/int64-patches.txt" | head -20
+	exit 1
+fi